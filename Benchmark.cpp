@@ -0,0 +1,257 @@
+// Regression benchmark: draws fixed, repeatable scenes with no window and compares CPU frame time, submits,
+// allocations and a checksum of the final image against a stored baseline. Headless presents need only
+// VK_EXT_headless_surface, so this runs on GPU-less CI with lavapipe, e.g.
+//
+//   VK_DRIVER_FILES=/usr/share/vulkan/icd.d/lvp_icd.x86_64.json benchmark --baseline benchmark_baseline.txt
+//
+//   --baseline FILE     results to compare against (default benchmark_baseline.txt)
+//   --update            write this run's results as the new baseline instead of comparing
+//   --tolerance PCT     how much slower, or how many more host allocations per frame, still passes (default 25)
+//   --frames N          measured frames per scene (default 300)
+//   --scene NAME        run just this scene
+//   --app PATH          run the scenes in that app binary instead, without comparing (PGO training)
+//   --gpu NAME          passed to the app, e.g. --gpu llvmpipe where a machine has other devices too
+//
+// Exits non-zero on a regression, and when comparing against a baseline that is missing or lacks a row for a
+// scene that ran - a gate that can't compare doesn't pass. Checksums depend on the driver's rasterization, so a
+// baseline belongs to one driver build - regenerate it with --update when CI's changes.
+
+#define GAMELOOP_NO_MAIN
+#include "GameLoop.cpp"
+
+#include <new>
+
+// Count every heap allocation, so per-frame allocations show up in the results
+void* operator new(size_t size)
+{
+    runtime_counters.host_allocations++;
+    if (void* p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+
+// A scene is the app's command line for it, so the same scenes can drive the app binary itself (--app)
+struct BenchScene
+{
+    const char* name;
+    bool        repeatable_image;   // false if the final image isn't a function of the frame number alone
+    std::vector<std::string> args;
+};
+
+// One row of the baseline file
+struct BenchResult
+{
+    std::string name;
+    double      cpu_ms_avg          = 0.0;
+    double      cpu_ms_p99          = 0.0;
+    double      submits_per_frame   = 0.0;
+    uint64_t    device_allocations  = 0;    // during the measured frames; a function of the scene, so compared exactly
+    double      host_allocations_per_frame = 0.0;
+    uint64_t    checksum            = 0;    // 0 when the image isn't repeatable
+};
+
+const std::vector<BenchScene>& benchScenes()
+{
+    static const std::vector<BenchScene> scenes = {
+        { "static-quad",    true,   { "--fixed-step", "0" } },                          // nothing moves
+        { "10k-instances",  true,   { "--lod-scene", "100" } },                         // 100 x 100 tiles, one draw each
+        { "10k-pulled",     true,   { "--lod-scene", "100", "--vertex-pulling" } },     // the same, vertices fetched in the shader
+        { "texture-heavy",  true,   { "--stream-rate", "1048576", "--msaa", "4" } },    // whole chain resident within the warm-up
+        // Streaming is driven by the frame number under --fixed-step, and waits on the timeline rather than racing
+        // it, so residency at the last frame is repeatable. The one outside input is the VK_EXT_memory_budget heap
+        // budget, which only lowers the 64 MB here on a heap that is nearly full.
+        { "upload-heavy",   true,   { "--texture-budget", "64", "--stream-rate", "64" } },  // still streaming mips throughout
+    };
+    return scenes;
+}
+
+// Warm-up covers pipeline compiles and pools and caches growing. Scene arguments come last, so override these.
+std::vector<std::string> sceneArgs(const BenchScene& scene, uint32_t frames, const std::string& gpu)
+{
+    std::vector<std::string> args = { "--headless", "--frames", std::to_string(frames), "--warmup", "60",
+                                      "--fixed-step", "0.0166667", "--present", "fifo" };
+    if (scene.repeatable_image) args.push_back("--checksum");
+    if (!gpu.empty()) args.insert(args.end(), { "--gpu", gpu });
+    args.insert(args.end(), scene.args.begin(), scene.args.end());
+    return args;
+}
+
+BenchResult runScene(const BenchScene& scene, uint32_t frames, const std::string& gpu)
+{
+    std::vector<std::string> args = sceneArgs(scene, frames, gpu);
+    std::vector<char*> argv = { const_cast<char*>("benchmark") };
+    for (auto& arg : args) argv.push_back(arg.data());
+
+    HelloTriangleApplication app(AppConfig::parse(static_cast<int>(argv.size()), argv.data()));
+    app.run();
+
+    const RunStats& stats = app.runStats();
+    if (0 == stats.frames) throw std::runtime_error(std::string("Scene ") + scene.name + " drew no measured frames");
+
+    BenchResult result;
+    result.name = scene.name;
+    result.cpu_ms_avg = stats.cpu_frame_ms.avg();
+    result.cpu_ms_p99 = stats.cpu_frame_ms.percentile(0.99);
+    result.submits_per_frame = static_cast<double>(stats.submits) / stats.frames;
+    result.device_allocations = stats.device_allocations;
+    result.host_allocations_per_frame = static_cast<double>(stats.host_allocations) / stats.frames;
+    result.checksum = stats.checksum.value_or(0);
+    return result;
+}
+
+// Run a scene in another build of the app, e.g. the instrumented one for PGO training. It reports for itself.
+void runSceneInApp(const BenchScene& scene, uint32_t frames, const std::string& gpu, const std::string& app_path)
+{
+    std::string command = "\"" + app_path + "\"";
+    for (const auto& arg : sceneArgs(scene, frames, gpu)) command += " \"" + arg + "\"";
+    if (0 != std::system(command.c_str())) throw std::runtime_error(std::string("Scene ") + scene.name + " failed in " + app_path);
+}
+
+// A baseline that's required but can't be read is an error; --update starts a new one from nothing
+std::vector<BenchResult> readBaseline(const std::string& path, bool required)
+{
+    std::vector<BenchResult> results;
+    std::ifstream file(path);
+    if (!file)
+    {
+        if (required) throw std::runtime_error("Can't read baseline " + path + ", run with --update to create it");
+        return results;
+    }
+    std::string line;
+    while (std::getline(file, line))
+    {
+        if (line.empty() || '#' == line[0]) continue;
+        std::istringstream row(line);
+        BenchResult r;
+        row >> r.name >> r.cpu_ms_avg >> r.cpu_ms_p99 >> r.submits_per_frame >> r.device_allocations
+            >> r.host_allocations_per_frame >> std::hex >> r.checksum;
+        if (!row) throw std::runtime_error("Malformed baseline line: " + line);
+        results.push_back(r);
+    }
+    return results;
+}
+
+void writeBaseline(const std::string& path, const std::vector<BenchResult>& results)
+{
+    std::ofstream file(path);
+    if (!file) throw std::runtime_error("Can't write baseline " + path);
+    file << "# scene cpu_ms_avg cpu_ms_p99 submits_per_frame device_allocations host_allocations_per_frame checksum" << std::endl;
+    for (const auto& r : results)
+    {
+        file << r.name << ' ' << r.cpu_ms_avg << ' ' << r.cpu_ms_p99 << ' ' << r.submits_per_frame << ' '
+             << r.device_allocations << ' ' << r.host_allocations_per_frame << ' ' << std::hex << r.checksum << std::dec << std::endl;
+    }
+}
+
+// Times and host allocations get the tolerance. Submits, device allocations and the image are exact: any
+// change there is a behavior change, not noise.
+std::vector<std::string> compare(const BenchResult& now, const BenchResult& base, double tolerance)
+{
+    std::vector<std::string> failures;
+    auto over = [&](double value, double limit) { return value > limit * (1.0 + tolerance); };
+    if (over(now.cpu_ms_avg, base.cpu_ms_avg)) failures.push_back("CPU frame time avg");
+    if (over(now.cpu_ms_p99, base.cpu_ms_p99)) failures.push_back("CPU frame time p99");
+    if (std::abs(now.submits_per_frame - base.submits_per_frame) > 0.001) failures.push_back("submits per frame");   // the file rounds
+    if (now.device_allocations != base.device_allocations) failures.push_back("device allocations");
+    if (over(now.host_allocations_per_frame, base.host_allocations_per_frame)) failures.push_back("host allocations per frame");
+    if (now.checksum != base.checksum) failures.push_back("image checksum");
+    return failures;
+}
+
+int main(int argc, char** argv)
+{
+    std::string baseline_path = "benchmark_baseline.txt";
+    std::string only_scene;
+    std::string app_path;
+    std::string gpu;
+    bool update = false;
+    double tolerance = 0.25;
+    uint32_t frames = 300;
+
+    try
+    {
+        for (int i = 1; i < argc; i++)
+        {
+            std::string arg = argv[i];
+            auto value = [&]() -> std::string
+            {
+                if (i + 1 >= argc) throw std::invalid_argument("Missing value for " + arg);
+                return argv[++i];
+            };
+
+            if ("--baseline" == arg)        baseline_path = value();
+            else if ("--update" == arg)     update = true;
+            else if ("--tolerance" == arg)  tolerance = std::stod(value()) / 100.0;
+            else if ("--frames" == arg)     frames = static_cast<uint32_t>(std::stoul(value()));
+            else if ("--scene" == arg)      only_scene = value();
+            else if ("--app" == arg)        app_path = value();
+            else if ("--gpu" == arg)        gpu = value();
+            else throw std::invalid_argument("Unknown option: " + arg);
+        }
+
+        std::vector<BenchResult> results;
+        for (const auto& scene : benchScenes())
+        {
+            if (!only_scene.empty() && only_scene != scene.name) continue;
+            std::cout << std::endl << "=== " << scene.name << std::endl;
+            if (app_path.empty()) results.push_back(runScene(scene, frames, gpu));
+            else runSceneInApp(scene, frames, gpu, app_path);
+        }
+        if (!app_path.empty()) return EXIT_SUCCESS;
+        if (results.empty()) throw std::invalid_argument("Unknown scene: " + only_scene);
+
+        if (update)
+        {
+            // Keep the rows of scenes that weren't run
+            std::vector<BenchResult> merged = results;
+            for (const auto& old : readBaseline(baseline_path, false))
+            {
+                auto it = std::find_if(results.begin(), results.end(), [&](const BenchResult& r) { return r.name == old.name; });
+                if (it == results.end()) merged.push_back(old);
+            }
+            writeBaseline(baseline_path, merged);
+            std::cout << std::endl << "Baseline written to " << baseline_path << std::endl;
+            return EXIT_SUCCESS;
+        }
+
+        std::vector<BenchResult> baseline = readBaseline(baseline_path, true);
+        int regressions = 0;
+        std::cout << std::endl << "Results against " << baseline_path << " (tolerance " << tolerance * 100.0 << "%)" << std::endl;
+        for (const auto& r : results)
+        {
+            std::cout << '\t' << r.name << ": CPU avg " << r.cpu_ms_avg << " ms, p99 " << r.cpu_ms_p99 << " ms, "
+                      << r.submits_per_frame << " submits/frame, " << r.device_allocations << " device allocations, "
+                      << r.host_allocations_per_frame << " host allocations/frame, checksum " << std::hex << r.checksum << std::dec;
+
+            auto base = std::find_if(baseline.begin(), baseline.end(), [&](const BenchResult& b) { return b.name == r.name; });
+            if (base == baseline.end())
+            {
+                regressions++;
+                std::cout << " - FAILED: no baseline row, run with --update" << std::endl;
+                continue;
+            }
+
+            auto failures = compare(r, *base, tolerance);
+            if (failures.empty())
+            {
+                std::cout << " - ok" << std::endl;
+                continue;
+            }
+            regressions++;
+            std::cout << " - REGRESSED:";
+            for (const auto& f : failures) std::cout << ' ' << f << ';';
+            std::cout << std::endl << "\t\tbaseline: CPU avg " << base->cpu_ms_avg << " ms, p99 " << base->cpu_ms_p99 << " ms, "
+                      << base->submits_per_frame << " submits/frame, " << base->device_allocations << " device allocations, "
+                      << base->host_allocations_per_frame << " host allocations/frame, checksum " << std::hex << base->checksum << std::dec
+                      << std::endl;
+        }
+        return regressions ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << std::endl << "EXCEPTION: " << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+}
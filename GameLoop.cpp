@@ -1,41 +1,77 @@
 // Complete through https://vulkan-tutorial.com/en/Texture_mapping/Images
 
-//#include <vulkan/vulkan.h>
-#define VK_USE_PLATFORM_WIN32_KHR
+// GLFW includes vulkan.h and picks the platform's surface extension, so no platform defines here
 #define GLFW_INCLUDE_VULKAN
 #include <GLFW/glfw3.h>
-#define GLFW_EXPOSE_NATIVE_WIN32
-#include <GLFW/glfw3native.h>
 
 #define GLM_FORCE_RADIANS
+#define GLM_FORCE_DEPTH_ZERO_TO_ONE     // Vulkan clip space depth is 0..1
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/constants.hpp>
+#include <glm/gtc/packing.hpp>
 
 #define STB_IMAGE_IMPLEMENTATION
 #include <stb_image.h>
 
+#include <shaderc/shaderc.hpp>
+
+#include "shader_interface.h"
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
 #include <iostream>
 #include <stdexcept>
 #include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <cfloat>
+#include <cctype>
 
 #include <algorithm>
 #include <array>
 #include <chrono>
+#include <deque>
+#include <filesystem>
 #include <fstream>
+#include <iterator>
+#include <sstream>
 #include <vector>
 #include <set>
+#include <map>
 #include <optional>
+#include <unordered_map>
+#include <string>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <exception>
 
 #ifdef _DEBUG
 #define VERBOSE_ON
 #define VALIDATION_ON
+#define HOT_RELOAD_ON
 #endif
 
-const uint32_t MAX_FRAMES_IN_FLIGHT = 4;
+// CPU zone instrumentation is cheap enough for release builds - define CPU_PROFILE_OFF to compile it out
+#ifndef CPU_PROFILE_OFF
+#define CPU_PROFILE_ON
+#endif
+
+// Frames the CPU may record ahead of the GPU - each one adds a frame of latency. Independent of the swapchain
+// image count: frame slots are indexed by frame number, per-image resources by the acquired image.
+const uint32_t MAX_FRAMES_IN_FLIGHT = 2;
 
 struct Vertex
 {
-    glm::vec2 pos;
+    glm::vec3 pos;
     glm::vec3 color;
     glm::vec2 texcoord;
 
@@ -53,7 +89,7 @@ struct Vertex
         std::array<VkVertexInputAttributeDescription, 3> attrib_desc{};
         attrib_desc[0].binding = 0;     // Matches binding index 0 above
         attrib_desc[0].location = 0;    // Input location in shader (position attribute)
-        attrib_desc[0].format = VK_FORMAT_R32G32_SFLOAT;    // 2 32-bit floats    
+        attrib_desc[0].format = VK_FORMAT_R32G32B32_SFLOAT; // 3 32-bit floats    
         attrib_desc[0].offset = offsetof(Vertex, pos);      // 1st element
 
         attrib_desc[1].binding = 0;     // Matches binding index 0 above
@@ -70,28 +106,4980 @@ struct Vertex
     }
 };
 
-struct mvp_ubo
+// The vertex pulling path's layout, 20 bytes to Vertex's 32 (matches vert_pull.glsl). With no vertex input state
+// the shader unpacks it, so it needn't be made of formats fixed-function vertex input understands.
+struct PackedVertex
+{
+    float       pos[3];
+    uint32_t    color;          // unorm8 RGBA
+    uint32_t    texcoord;       // 2 halfs
+
+    static PackedVertex pack(const Vertex& v)
+    {
+        return { { v.pos.x, v.pos.y, v.pos.z }, glm::packUnorm4x8(glm::vec4(v.color, 1.0f)), glm::packHalf2x16(v.texcoord) };
+    }
+};
+static_assert(sizeof(PackedVertex) == PACKED_VERTEX_WORDS * sizeof(uint32_t), "PackedVertex must match vert_pull.glsl");
+
+// Vertex pulling's push constants (matches PullConstants in vert_pull.glsl)
+struct PullConstants
+{
+    VkDeviceAddress vertices;   // PackedVertex array
+    VkDeviceAddress objects;    // this frame's ObjectData array
+};
+
+struct mvp_ubo
+{
+    // Default C++ alignments don't match Vulkan spec: https://www.khronos.org/registry/vulkan/specs/1.3-extensions/html/chap15.html#interfaces-resources-layout
+    // i.e. without explicit alignments, the foo vec2 will break this struct
+    glm::vec2 foo;
+    alignas(16) glm::mat4 model;
+    alignas(16) glm::mat4 view;
+    alignas(16) glm::mat4 projection;
+};
+
+const std::vector<Vertex> vertices = { {{-0.5, -0.5, 0.0}, {1.0, 0.0, 0.0}, {1.0f, 0.0f}},
+                                       {{ 0.5, -0.5, 0.0}, {0.0, 1.0, 0.0}, {0.0f, 0.0f}},
+                                       {{ 0.5,  0.5, 0.0}, {0.0, 0.0, 1.0}, {0.0f, 1.0f}},
+                                       {{-0.5,  0.5, 0.0}, {1.0, 1.0, 1.0}, {1.0f, 1.0f}} };
+
+const std::vector<uint16_t> indices = { 0, 1, 2, 0, 2, 3 };
+
+// A scene object's placement. Uploaded each frame, in draw order, as ObjectData.
+struct SceneObject
+{
+    glm::mat4 model;
+};
+
+// Per-object data the vertex shader reads by instance index (matches ObjectData in vert.glsl and cluster_cull.glsl)
+struct ObjectData
+{
+    glm::mat4   model;
+    uint32_t    first_meshlet;      // of the LOD being drawn, for cluster culling
+    uint32_t    meshlet_count;
+    float       radius;             // object space bounding sphere about the origin, for occlusion culling
+    uint32_t    pad;
+};
+
+// Cluster culling parameters, a per-frame uniform buffer (matches CullParams in cluster_cull.glsl, std140)
+struct CullParams
+{
+    glm::vec4   planes[6];
+    glm::vec4   camera;
+    glm::mat4   hiz_view_proj;
+    uint32_t    object_count;
+    uint32_t    max_draws;
+    uint32_t    flags;
+    uint32_t    pad;
+    int32_t     hiz_extent[2];
+    int32_t     hiz_size;
+    int32_t     hiz_levels;
+};
+
+// Cluster culling results (matches Counts in cluster_cull.glsl). draw_count doubles as the indirect draw count.
+struct ClusterCounts
+{
+    uint32_t    draw_count;
+    uint32_t    frustum_culled;
+    uint32_t    backface_culled;
+    uint32_t    occluded;
+    uint32_t    occluded_objects;
+    uint32_t    pad[3];
+};
+
+// Push constants for the depth pyramid build (matches HizConstants in hiz_build.glsl)
+struct HizConstants
+{
+    int32_t extent[2];      // depth pixels rendered
+    int32_t size;           // of level 0's square in the atlas
+    int32_t levels;
+};
+
+// Which mesh a scene object draws, and the LOD it was last drawn at
+struct SceneInstance
+{
+    uint32_t mesh;      // GeometryPool::MeshId
+    uint32_t lod;
+};
+
+// Push constants shared by the compute post-processing shaders (matches PostConstants in post_*.glsl)
+struct PostConstants
+{
+    int32_t extent[2];      // region of the images to process
+    int32_t direction;      // blur: 0 horizontal, 1 vertical
+    float   strength;       // per-stage amount
+};
+
+const char* const post_blur_shader = "post_blur.glsl";
+const char* const post_tonemap_shader = "post_tonemap.glsl";
+const char* const post_grade_shader = "post_grade.glsl";
+const char* const cluster_cull_shader = "cluster_cull.glsl";
+const char* const hiz_build_shader = "hiz_build.glsl";
+
+// Boost-style hash combine, shared by the hash-keyed caches below
+inline void hashCombine(size_t& seed, size_t value)
+{
+    seed ^= value + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+}
+
+template <typename T>
+inline void hashCombine(size_t& seed, const T& value)
+{
+    hashCombine(seed, std::hash<T>{}(value));
+}
+
+/////////////////////////////////////////////////////////////
+// Profiling
+/////////////////////////////////////////////////////////////
+
+// Shared time base for exported CPU and GPU traces
+inline std::chrono::steady_clock::time_point traceEpoch()
+{
+    static const auto epoch = std::chrono::steady_clock::now();
+    return epoch;
+}
+
+inline double traceNowUs()
+{
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - traceEpoch()).count();
+}
+
+// Min / avg / p99 over the last `window` samples
+class RollingStats
+{
+public:
+    explicit RollingStats(size_t window = 256) : capacity(window) { samples.reserve(window); }  // add() never allocates
+
+    void add(double value)
+    {
+        if (samples.size() < capacity) samples.push_back(value);
+        else samples[next] = value;
+        next = (next + 1) % capacity;
+    }
+
+    bool   empty() const { return samples.empty(); }
+    double last() const { return samples.empty() ? 0.0 : samples[(next + samples.size() - 1) % samples.size()]; }
+    double min() const { return samples.empty() ? 0.0 : *std::min_element(samples.begin(), samples.end()); }
+    double avg() const
+    {
+        double sum = 0.0;
+        for (double s : samples) sum += s;
+        return samples.empty() ? 0.0 : sum / samples.size();
+    }
+    double percentile(double p) const
+    {
+        if (samples.empty()) return 0.0;
+        std::vector<double> sorted(samples);
+        size_t idx = std::min(sorted.size() - 1, static_cast<size_t>(p * sorted.size()));
+        std::nth_element(sorted.begin(), sorted.begin() + idx, sorted.end());
+        return sorted[idx];
+    }
+
+private:
+    std::vector<double> samples;
+    size_t capacity;
+    size_t next = 0;
+};
+
+// Process-wide counts for regression tracking. Host allocations are only counted where operator new is
+// replaced to do it (the benchmark).
+struct RuntimeCounters
+{
+    std::atomic<uint64_t> submits{ 0 };
+    std::atomic<uint64_t> device_allocations{ 0 };
+    std::atomic<uint64_t> host_allocations{ 0 };
+};
+
+inline RuntimeCounters runtime_counters;
+
+// GPU timing from timestamp queries. Each frame slot owns a range of the query pool; a slot's results are
+// read back (without waiting) the next time that slot comes around, by which point its fence has signaled.
+// Timings are kept as rolling per-region stats, and the last few frames can be exported as a Chrome trace.
+// Optionally also counts fragment shader invocations per slot with a pipeline statistics query.
+class GpuProfiler
+{
+public:
+    struct TraceEvent
+    {
+        std::string name;
+        std::string track;
+        double      start_us;
+        double      duration_us;
+    };
+
+    void init(VkDevice dev, VkPhysicalDevice phys, uint32_t queue_family, uint32_t frame_slots,
+              bool pipeline_statistics = false, uint32_t regions_per_slot = 32)
+    {
+        device = dev;
+        max_regions = regions_per_slot;
+
+        // One extra slot for the immediate (one-off command buffer) uploads
+        slots.resize(frame_slots + 1);
+        for (auto& slot : slots) slot.names.resize(max_regions);
+
+        // Requires the pipelineStatisticsQuery device feature
+        if (pipeline_statistics)
+        {
+            VkQueryPoolCreateInfo ci = { VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO, nullptr };
+            ci.queryType = VK_QUERY_TYPE_PIPELINE_STATISTICS;
+            ci.queryCount = static_cast<uint32_t>(slots.size());
+            ci.pipelineStatistics = VK_QUERY_PIPELINE_STATISTIC_FRAGMENT_SHADER_INVOCATIONS_BIT;
+            if (VK_SUCCESS != vkCreateQueryPool(device, &ci, nullptr, &stats_pool))
+            {
+                throw std::runtime_error("Failed to create pipeline statistics query pool");
+            }
+            stats_enabled = true;
+        }
+
+        VkPhysicalDeviceProperties props;
+        vkGetPhysicalDeviceProperties(phys, &props);
+        timestamp_period_ns = props.limits.timestampPeriod;
+
+        uint32_t fam_count = 0;
+        vkGetPhysicalDeviceQueueFamilyProperties(phys, &fam_count, nullptr);
+        std::vector<VkQueueFamilyProperties> fam_props(fam_count);
+        vkGetPhysicalDeviceQueueFamilyProperties(phys, &fam_count, fam_props.data());
+        uint32_t valid_bits = fam_props[queue_family].timestampValidBits;
+        if (0 == valid_bits || 0.0f == timestamp_period_ns) return;     // no timestamp support - profiler stays disabled
+        timestamp_mask = (valid_bits >= 64) ? ~0ull : ((1ull << valid_bits) - 1);
+
+        VkQueryPoolCreateInfo ci = { VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO, nullptr };
+        ci.queryType = VK_QUERY_TYPE_TIMESTAMP;
+        ci.queryCount = static_cast<uint32_t>(slots.size()) * max_regions * 2;
+        if (VK_SUCCESS != vkCreateQueryPool(device, &ci, nullptr, &query_pool))
+        {
+            throw std::runtime_error("Failed to create timestamp query pool");
+        }
+        enabled = true;
+    }
+
+    void cleanup()
+    {
+        if (VK_NULL_HANDLE != query_pool) vkDestroyQueryPool(device, query_pool, nullptr);
+        if (VK_NULL_HANDLE != stats_pool) vkDestroyQueryPool(device, stats_pool, nullptr);
+        query_pool = VK_NULL_HANDLE;
+        stats_pool = VK_NULL_HANDLE;
+        enabled = false;
+        stats_enabled = false;
+    }
+
+    bool isEnabled() const { return enabled; }
+    bool hasStatistics() const { return stats_enabled; }
+    uint32_t uploadSlot() const { return static_cast<uint32_t>(slots.size()) - 1; }
+
+    // Start recording a slot: harvest whatever it measured last time around, then reset its queries.
+    // Must be called outside a render pass.
+    void beginSlot(VkCommandBuffer cb, uint32_t slot)
+    {
+        if (!enabled && !stats_enabled) return;
+        resolveSlot(slot);
+
+        Slot& s = slots[slot];
+        s.cpu_begin_us = traceNowUs();
+        if (enabled)
+        {
+            s.region_count = 0;
+            s.pending = true;
+            vkCmdResetQueryPool(cb, query_pool, slot * max_regions * 2, max_regions * 2);
+        }
+        if (stats_enabled)
+        {
+            s.stats_pending = false;
+            vkCmdResetQueryPool(cb, stats_pool, slot, 1);
+        }
+    }
+
+    // Count fragment shader invocations between these calls. At most once per slot, and both calls
+    // must be in the same subpass.
+    void beginStatistics(VkCommandBuffer cb, uint32_t slot)
+    {
+        if (!stats_enabled) return;
+        vkCmdBeginQuery(cb, stats_pool, slot, 0);
+        slots[slot].stats_pending = true;
+    }
+
+    void endStatistics(VkCommandBuffer cb, uint32_t slot)
+    {
+        if (!stats_enabled || !slots[slot].stats_pending) return;
+        vkCmdEndQuery(cb, stats_pool, slot);
+    }
+
+    uint32_t beginRegion(VkCommandBuffer cb, uint32_t slot, const char* name)
+    {
+        if (!enabled) return UINT32_MAX;
+        Slot& s = slots[slot];
+        if (s.region_count >= max_regions) return UINT32_MAX;
+
+        uint32_t region = s.region_count++;
+        s.names[region] = name;
+        vkCmdWriteTimestamp(cb, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, query_pool, queryIndex(slot, region), 0);
+        return region;
+    }
+
+    void endRegion(VkCommandBuffer cb, uint32_t slot, uint32_t region)
+    {
+        if (!enabled || UINT32_MAX == region) return;
+        vkCmdWriteTimestamp(cb, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, query_pool, queryIndex(slot, region) + 1, 0);
+    }
+
+    // Non-blocking read of a slot's results. If the GPU hasn't got there yet the slot is left pending.
+    void resolveSlot(uint32_t slot)
+    {
+        Slot& s = slots[slot];
+        if (stats_enabled && s.stats_pending) resolveStatistics(slot);
+        if (!enabled || !s.pending || 0 == s.region_count) return;
+
+        // Pairs of (value, availability)
+        std::vector<uint64_t> results(s.region_count * 2 * 2);
+        VkResult res = vkGetQueryPoolResults(device, query_pool, queryIndex(slot, 0), s.region_count * 2,
+                                             results.size() * sizeof(uint64_t), results.data(), 2 * sizeof(uint64_t),
+                                             VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WITH_AVAILABILITY_BIT);
+        if (VK_SUCCESS != res && VK_NOT_READY != res) return;
+        for (uint32_t q = 0; q < s.region_count * 2; q++)
+        {
+            if (0 == results[q * 2 + 1]) return;    // not available yet, try again later
+        }
+
+        // GPU time is placed on the CPU timeline relative to when the slot was recorded - good enough
+        // to line the two up by eye in a trace viewer
+        uint64_t gpu_origin = results[0];
+        for (uint32_t r = 0; r < s.region_count; r++)
+        {
+            uint64_t begin = results[(r * 2) * 2];
+            uint64_t end = results[(r * 2 + 1) * 2];
+            double duration_ms = ((end - begin) & timestamp_mask) * timestamp_period_ns * 1e-6;
+            double offset_us = ((begin - gpu_origin) & timestamp_mask) * timestamp_period_ns * 1e-3;
+
+            auto it = region_stats.find(s.names[r]);
+            if (it == region_stats.end()) it = region_stats.emplace(s.names[r], RollingStats()).first;
+            it->second.add(duration_ms);
+
+            recent_events.push_back({ s.names[r], "GPU", s.cpu_begin_us + offset_us, duration_ms * 1000.0 });
+        }
+        while (recent_events.size() > max_trace_events) recent_events.pop_front();
+        s.pending = false;
+    }
+
+    void printReport()
+    {
+        char line[128];
+        if (stats_enabled)
+        {
+            snprintf(line, sizeof(line), "Fragment shader invocations per frame: min %.0f, avg %.0f, p99 %.0f",
+                     fragment_invocations.min(), fragment_invocations.avg(), fragment_invocations.percentile(0.99));
+            std::cout << std::endl << line << std::endl;
+        }
+
+        if (!enabled)
+        {
+            std::cout << std::endl << "GPU profiler: timestamps not supported on this queue" << std::endl;
+            return;
+        }
+
+        std::cout << std::endl << "GPU timings (ms)          min       avg       p99" << std::endl;
+        for (const auto& entry : region_stats)
+        {
+            snprintf(line, sizeof(line), "\t%-20s %8.3f  %8.3f  %8.3f", entry.first.c_str(),
+                     entry.second.min(), entry.second.avg(), entry.second.percentile(0.99));
+            std::cout << line << std::endl;
+        }
+    }
+
+    double averageMs(const std::string& region) const
+    {
+        auto it = region_stats.find(region);
+        return (it != region_stats.end()) ? it->second.avg() : 0.0;
+    }
+
+    // Most recent resolved timing - a couple of frames behind the one being recorded
+    double latestMs(const std::string& region) const
+    {
+        auto it = region_stats.find(region);
+        return (it != region_stats.end()) ? it->second.last() : 0.0;
+    }
+
+    const std::deque<TraceEvent>& events() const { return recent_events; }
+
+    // Chrome trace JSON (chrome://tracing, ui.perfetto.dev) of the most recent frames
+    void writeChromeTrace(const std::string& path) const
+    {
+        std::ofstream file(path);
+        file << "{\"traceEvents\":[";
+        bool first = true;
+        for (const auto& ev : recent_events)
+        {
+            file << (first ? "" : ",") << "\n{\"name\":\"" << ev.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":\"" << ev.track
+                 << "\",\"ts\":" << ev.start_us << ",\"dur\":" << ev.duration_us << "}";
+            first = false;
+        }
+        file << "\n]}" << std::endl;
+    }
+
+private:
+    struct Slot
+    {
+        std::vector<const char*> names;
+        uint32_t    region_count = 0;
+        bool        pending = false;
+        bool        stats_pending = false;
+        double      cpu_begin_us = 0.0;
+    };
+
+    uint32_t queryIndex(uint32_t slot, uint32_t region) const { return (slot * max_regions + region) * 2; }
+
+    void resolveStatistics(uint32_t slot)
+    {
+        uint64_t result[2] = {};    // (value, availability)
+        VkResult res = vkGetQueryPoolResults(device, stats_pool, slot, 1, sizeof(result), result, sizeof(result),
+                                             VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WITH_AVAILABILITY_BIT);
+        if ((VK_SUCCESS != res && VK_NOT_READY != res) || 0 == result[1]) return;
+        fragment_invocations.add(static_cast<double>(result[0]));
+        slots[slot].stats_pending = false;
+    }
+
+    VkDevice            device = VK_NULL_HANDLE;
+    VkQueryPool         query_pool = VK_NULL_HANDLE;
+    VkQueryPool         stats_pool = VK_NULL_HANDLE;
+    bool                enabled = false;
+    bool                stats_enabled = false;
+    float               timestamp_period_ns = 0.0f;
+    uint64_t            timestamp_mask = ~0ull;
+    uint32_t            max_regions = 32;
+    std::vector<Slot>   slots;
+    std::unordered_map<std::string, RollingStats> region_stats;
+    RollingStats        fragment_invocations;
+    std::deque<TraceEvent> recent_events;
+    const size_t        max_trace_events = 4096;
+};
+
+// Scoped CPU zones. Each thread appends begin/end times to its own fixed-size ring buffer (single producer,
+// no locks on the hot path); a dump snapshots every thread's ring into a Chrome trace. With CPU_PROFILE_ON
+// undefined the macros expand to nothing.
+struct CpuEvent
+{
+    const char* name;   // must outlive the profiler - string literals or __func__
+    int64_t     start_ns;
+    int64_t     end_ns;
+};
+
+class CpuProfiler
+{
+public:
+    static constexpr size_t ring_size = 1 << 14;    // events kept per thread
+
+    static int64_t now()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - traceEpoch()).count();
+    }
+
+    static void record(const char* name, int64_t start_ns, int64_t end_ns)
+    {
+        ThreadRing* ring = threadRing();
+        uint64_t head = ring->head.load(std::memory_order_relaxed);
+        ring->events[head % ring_size] = { name, start_ns, end_ns };
+        ring->head.store(head + 1, std::memory_order_release);
+    }
+
+    static void setThreadName(const std::string& name)
+    {
+        std::lock_guard<std::mutex> lock(registryMutex());
+        threadRing()->name = name;
+    }
+
+    // Chrome trace / Perfetto JSON of everything still in the rings, optionally merged with GPU timings
+    static void writeChromeTrace(const std::string& path, const GpuProfiler* gpu = nullptr)
+    {
+        std::ofstream file(path);
+        file << "{\"traceEvents\":[";
+        bool first = true;
+        auto sep = [&]() -> const char* { const char* s = first ? "\n" : ",\n"; first = false; return s; };
+
+        std::lock_guard<std::mutex> lock(registryMutex());
+        for (const auto& ring : registry())
+        {
+            file << sep() << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << ring->id
+                 << ",\"args\":{\"name\":\"" << ring->name << "\"}}";
+
+            // Snapshot without stopping the producer: anything it may have overwritten while we
+            // copied is dropped
+            uint64_t end = ring->head.load(std::memory_order_acquire);
+            uint64_t begin = (end > ring_size) ? end - ring_size : 0;
+            std::vector<CpuEvent> snapshot;
+            for (uint64_t i = begin; i < end; i++) snapshot.push_back(ring->events[i % ring_size]);
+            uint64_t after = ring->head.load(std::memory_order_acquire);
+            uint64_t valid_from = (after > ring_size) ? after - ring_size : 0;
+
+            for (uint64_t i = std::max(begin, valid_from); i < end; i++)
+            {
+                const CpuEvent& ev = snapshot[i - begin];
+                file << sep() << "{\"name\":\"" << ev.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << ring->id
+                     << ",\"ts\":" << ev.start_ns / 1000.0 << ",\"dur\":" << (ev.end_ns - ev.start_ns) / 1000.0 << "}";
+            }
+        }
+
+        if (gpu)
+        {
+            file << sep() << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":\"GPU\",\"args\":{\"name\":\"GPU\"}}";
+            for (const auto& ev : gpu->events())
+            {
+                file << sep() << "{\"name\":\"" << ev.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":\"" << ev.track
+                     << "\",\"ts\":" << ev.start_us << ",\"dur\":" << ev.duration_us << "}";
+            }
+        }
+        file << "\n]}" << std::endl;
+    }
+
+private:
+    struct ThreadRing
+    {
+        std::array<CpuEvent, ring_size> events;
+        std::atomic<uint64_t>           head{ 0 };
+        uint32_t                        id = 0;
+        std::string                     name;
+    };
+
+    static std::mutex& registryMutex()
+    {
+        static std::mutex mutex;
+        return mutex;
+    }
+
+    // Rings live for the whole process, so a dump can still see threads that have exited
+    static std::vector<std::unique_ptr<ThreadRing>>& registry()
+    {
+        static std::vector<std::unique_ptr<ThreadRing>> rings;
+        return rings;
+    }
+
+    static ThreadRing* threadRing()
+    {
+        thread_local ThreadRing* ring = nullptr;
+        if (!ring)
+        {
+            auto fresh = std::make_unique<ThreadRing>();
+            std::lock_guard<std::mutex> lock(registryMutex());
+            fresh->id = static_cast<uint32_t>(registry().size());
+            fresh->name = (0 == fresh->id) ? "main" : "thread " + std::to_string(fresh->id);
+            ring = fresh.get();
+            registry().push_back(std::move(fresh));
+        }
+        return ring;
+    }
+};
+
+class CpuZone
+{
+public:
+    explicit CpuZone(const char* zone_name) : name(zone_name), start(CpuProfiler::now()) {}
+    ~CpuZone() { CpuProfiler::record(name, start, CpuProfiler::now()); }
+
+private:
+    const char* name;
+    int64_t     start;
+};
+
+#ifdef CPU_PROFILE_ON
+#define PROFILE_CONCAT_INNER(a, b)  a##b
+#define PROFILE_CONCAT(a, b)        PROFILE_CONCAT_INNER(a, b)
+#define PROFILE_ZONE(name)          CpuZone PROFILE_CONCAT(cpu_zone_, __LINE__)(name)
+#define PROFILE_FUNCTION()          PROFILE_ZONE(__func__)
+#define PROFILE_THREAD_NAME(name)   CpuProfiler::setThreadName(name)
+#else
+#define PROFILE_ZONE(name)
+#define PROFILE_FUNCTION()
+#define PROFILE_THREAD_NAME(name)
+#endif
+
+/////////////////////////////////////////////////////////////
+// Device features
+/////////////////////////////////////////////////////////////
+
+inline std::string apiVersionString(uint32_t version)
+{
+    return std::to_string(VK_API_VERSION_MAJOR(version)) + "." + std::to_string(VK_API_VERSION_MINOR(version));
+}
+
+// What the device was created with. Rendering paths branch on these rather than querying the device.
+struct DeviceCapabilities
+{
+    uint32_t api_version            = VK_API_VERSION_1_0;   // the lowest of instance, device and the renderer's target
+    bool dynamic_rendering          = false;    // else render pass objects only
+    bool descriptor_indexing        = false;    // runtime, partially bound, update-after-bind sampled image arrays
+    bool buffer_device_address      = false;
+    bool draw_parameters            = false;    // gl_DrawID and gl_BaseInstance in shaders
+    bool cluster_culling            = false;    // multiDrawIndirect and drawIndirectFirstInstance
+    bool draw_indirect_count        = false;
+    bool pipeline_statistics        = false;
+    bool memory_budget              = false;    // VK_EXT_memory_budget
+};
+
+// Feature negotiation. The renderer needs Vulkan 1.3 with timeline semaphores and synchronization2 (both core
+// there); devices without them are rejected before device creation, with the reason. Every optional fast path
+// the device has is enabled, and the ones it lacks are reported rather than silently dropped.
+// Owns the feature chain vkCreateDevice reads, so it has to outlive that call.
+class DeviceFeatures
+{
+public:
+    static constexpr uint32_t target_api_version = VK_API_VERSION_1_3;
+
+    DeviceFeatures() = default;
+    DeviceFeatures(const DeviceFeatures&) = delete;
+    DeviceFeatures& operator=(const DeviceFeatures&) = delete;
+
+    // Why phys can't run the renderer, or empty if it can. instance_version is what the instance was created for.
+    static std::string missingRequirements(VkPhysicalDevice phys, uint32_t instance_version)
+    {
+        VkPhysicalDeviceProperties props;
+        vkGetPhysicalDeviceProperties(phys, &props);
+        uint32_t version = std::min(props.apiVersion, instance_version);
+        if (version < target_api_version) return "Vulkan " + apiVersionString(version) + ", needs " + apiVersionString(target_api_version);
+
+        // Only chain the 1.1+ structures once the version says the device knows them
+        FeatureChain supported;
+        vkGetPhysicalDeviceFeatures2(phys, &supported.core);
+        if (!supported.core.features.samplerAnisotropy) return "no samplerAnisotropy";
+        if (!supported.v12.timelineSemaphore) return "no timelineSemaphore";
+        if (!supported.v13.synchronization2) return "no synchronization2";
+        return {};
+    }
+
+    // Pick what to enable on phys, which must have passed missingRequirements
+    void negotiate(VkPhysicalDevice phys, uint32_t instance_version)
+    {
+        VkPhysicalDeviceProperties props;
+        vkGetPhysicalDeviceProperties(phys, &props);
+        capabilities.api_version = std::min({ props.apiVersion, instance_version, target_api_version });
+
+        FeatureChain supported;
+        vkGetPhysicalDeviceFeatures2(phys, &supported.core);
+
+        enabled.core.features.samplerAnisotropy = VK_TRUE;
+        enabled.v12.timelineSemaphore = VK_TRUE;
+        enabled.v13.synchronization2 = VK_TRUE;
+
+        capabilities.dynamic_rendering = offer("dynamic rendering", supported.v13.dynamicRendering);
+        enabled.v13.dynamicRendering = capabilities.dynamic_rendering;
+
+        const VkPhysicalDeviceVulkan12Features& s12 = supported.v12;
+        capabilities.descriptor_indexing = offer("descriptor indexing",
+            s12.descriptorIndexing && s12.runtimeDescriptorArray && s12.descriptorBindingPartiallyBound &&
+            s12.descriptorBindingVariableDescriptorCount && s12.shaderSampledImageArrayNonUniformIndexing &&
+            s12.descriptorBindingSampledImageUpdateAfterBind);
+        if (capabilities.descriptor_indexing)
+        {
+            enabled.v12.descriptorIndexing = VK_TRUE;
+            enabled.v12.runtimeDescriptorArray = VK_TRUE;
+            enabled.v12.descriptorBindingPartiallyBound = VK_TRUE;
+            enabled.v12.descriptorBindingVariableDescriptorCount = VK_TRUE;
+            enabled.v12.shaderSampledImageArrayNonUniformIndexing = VK_TRUE;
+            enabled.v12.descriptorBindingSampledImageUpdateAfterBind = VK_TRUE;
+        }
+
+        capabilities.buffer_device_address = offer("buffer device address", s12.bufferDeviceAddress);
+        enabled.v12.bufferDeviceAddress = capabilities.buffer_device_address;
+
+        capabilities.draw_parameters = offer("shader draw parameters", supported.v11.shaderDrawParameters);
+        enabled.v11.shaderDrawParameters = capabilities.draw_parameters;
+
+        capabilities.cluster_culling = offer("multi-draw indirect",
+            supported.core.features.multiDrawIndirect && supported.core.features.drawIndirectFirstInstance);
+        enabled.core.features.multiDrawIndirect = capabilities.cluster_culling;
+        enabled.core.features.drawIndirectFirstInstance = capabilities.cluster_culling;
+
+        capabilities.draw_indirect_count = offer("draw indirect count", s12.drawIndirectCount);
+        enabled.v12.drawIndirectCount = capabilities.draw_indirect_count;
+
+        capabilities.pipeline_statistics = offer("pipeline statistics", supported.core.features.pipelineStatisticsQuery);
+        enabled.core.features.pipelineStatisticsQuery = capabilities.pipeline_statistics;
+
+        uint32_t ext_count = 0;
+        vkEnumerateDeviceExtensionProperties(phys, nullptr, &ext_count, nullptr);
+        std::vector<VkExtensionProperties> ext_props(ext_count);
+        vkEnumerateDeviceExtensionProperties(phys, nullptr, &ext_count, ext_props.data());
+        auto has_extension = [&](const char* name)
+        {
+            return ext_props.end() != std::find_if(ext_props.begin(), ext_props.end(),
+                                                   [&](const VkExtensionProperties& ext) { return 0 == strcmp(ext.extensionName, name); });
+        };
+        capabilities.memory_budget = offer("memory budget", has_extension(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME));
+        if (capabilities.memory_budget) optional_extensions.push_back(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+    }
+
+    const DeviceCapabilities& caps() const { return capabilities; }
+    const VkPhysicalDeviceFeatures2* chain() const { return &enabled.core; }    // for VkDeviceCreateInfo::pNext
+    const std::vector<const char*>& extensions() const { return optional_extensions; }
+
+    void report() const
+    {
+        std::cout << std::endl << "Vulkan " << apiVersionString(capabilities.api_version) << ", enabled:";
+        for (const char* name : available) std::cout << ' ' << name << ';';
+        std::cout << std::endl;
+        if (!unavailable.empty())
+        {
+            std::cout << "Not supported, slower paths in use:";
+            for (const char* name : unavailable) std::cout << ' ' << name << ';';
+            std::cout << std::endl;
+        }
+    }
+
+private:
+    // Features2 with the 1.1 - 1.3 structures chained behind it. Points into itself, so can't be copied.
+    struct FeatureChain
+    {
+        VkPhysicalDeviceFeatures2           core    = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2, &v11 };
+        VkPhysicalDeviceVulkan11Features    v11     = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_1_FEATURES, &v12 };
+        VkPhysicalDeviceVulkan12Features    v12     = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES, &v13 };
+        VkPhysicalDeviceVulkan13Features    v13     = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_3_FEATURES, nullptr };
+
+        FeatureChain() = default;
+        FeatureChain(const FeatureChain&) = delete;
+        FeatureChain& operator=(const FeatureChain&) = delete;
+    };
+
+    bool offer(const char* name, bool supported)
+    {
+        (supported ? available : unavailable).push_back(name);
+        return supported;
+    }
+
+    FeatureChain                enabled;
+    DeviceCapabilities          capabilities;
+    std::vector<const char*>    optional_extensions;
+    std::vector<const char*>    available;
+    std::vector<const char*>    unavailable;
+};
+
+/////////////////////////////////////////////////////////////
+// Synchronization
+/////////////////////////////////////////////////////////////
+
+// GPU progress as a single counter (a timeline semaphore). Every queue submission signals the next value,
+// so "is the GPU done with X" becomes "has the counter reached the value X was last submitted with".
+// Submissions must take their value and submit in the same order, i.e. while holding the queue.
+class GpuTimeline
+{
+public:
+    void init(VkDevice dev)
+    {
+        device = dev;
+
+        VkSemaphoreTypeCreateInfo type_ci = { VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO, nullptr };
+        type_ci.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+        type_ci.initialValue = 0;
+
+        VkSemaphoreCreateInfo ci = { VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO, &type_ci };
+        if (VK_SUCCESS != vkCreateSemaphore(device, &ci, nullptr, &timeline))
+        {
+            throw std::runtime_error("Failed to create timeline semaphore");
+        }
+    }
+
+    void cleanup()
+    {
+        vkDestroySemaphore(device, timeline, nullptr);
+        timeline = VK_NULL_HANDLE;
+    }
+
+    VkSemaphore semaphore() const { return timeline; }
+
+    // Value for the next submission to signal
+    uint64_t nextValue() { return ++last_submitted; }
+    uint64_t lastSubmitted() const { return last_submitted; }
+
+    uint64_t completed()
+    {
+        uint64_t value = 0;
+        vkGetSemaphoreCounterValue(device, timeline, &value);
+        known_completed = std::max(known_completed.load(), value);
+        return value;
+    }
+
+    void wait(uint64_t value)
+    {
+        if (value <= known_completed) return;
+
+        VkSemaphoreWaitInfo wi = { VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO, nullptr };
+        wi.semaphoreCount = 1;
+        wi.pSemaphores = &timeline;
+        wi.pValues = &value;
+        if (VK_SUCCESS != vkWaitSemaphores(device, &wi, UINT64_MAX))
+        {
+            throw std::runtime_error("Error waiting on timeline semaphore");
+        }
+        known_completed = std::max(known_completed.load(), value);
+    }
+
+private:
+    VkDevice                device = VK_NULL_HANDLE;
+    VkSemaphore             timeline = VK_NULL_HANDLE;
+    std::atomic<uint64_t>   last_submitted{ 0 };
+    std::atomic<uint64_t>   known_completed{ 0 };
+};
+
+// Destruction deferred until the GPU has passed a timeline value. Resources that in-flight frames may still
+// be using are pushed here rather than destroyed behind a vkDeviceWaitIdle.
+class DeletionQueue
+{
+public:
+    void push(uint64_t retire_value, std::function<void()> destroy)
+    {
+        entries.push_back({ retire_value, std::move(destroy) });
+    }
+
+    // Destroy everything the GPU has finished with
+    void collect(uint64_t completed_value)
+    {
+        for (auto it = entries.begin(); it != entries.end(); )
+        {
+            if (it->first <= completed_value)
+            {
+                it->second();
+                it = entries.erase(it);
+            }
+            else ++it;
+        }
+    }
+
+    // Destroy everything. Only once the device is idle.
+    void flush()
+    {
+        for (auto& entry : entries) entry.second();
+        entries.clear();
+    }
+
+    size_t size() const { return entries.size(); }
+
+private:
+    std::deque<std::pair<uint64_t, std::function<void()>>> entries;
+};
+
+/////////////////////////////////////////////////////////////
+// Descriptors
+/////////////////////////////////////////////////////////////
+
+// Hands out descriptor sets from a growing list of pools. Pools are never freed individually - reset() recycles
+// all of them at once, so it must only be called once the GPU has finished with every set allocated since the last reset.
+class DescriptorAllocator
+{
+public:
+    void init(VkDevice dev, uint32_t sets_per_pool = 64)
+    {
+        device = dev;
+        pool_set_count = sets_per_pool;
+    }
+
+    void cleanup()
+    {
+        for (auto pool : free_pools) vkDestroyDescriptorPool(device, pool, nullptr);
+        for (auto pool : used_pools) vkDestroyDescriptorPool(device, pool, nullptr);
+        free_pools.clear();
+        used_pools.clear();
+        current_pool = VK_NULL_HANDLE;
+    }
+
+    VkDescriptorSet allocate(VkDescriptorSetLayout layout)
+    {
+        if (VK_NULL_HANDLE == current_pool)
+        {
+            current_pool = grabPool();
+            used_pools.push_back(current_pool);
+        }
+
+        VkDescriptorSet set = VK_NULL_HANDLE;
+        VkDescriptorSetAllocateInfo ds_ai = { VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO, nullptr };
+        ds_ai.descriptorPool = current_pool;
+        ds_ai.descriptorSetCount = 1;
+        ds_ai.pSetLayouts = &layout;
+
+        VkResult res = vkAllocateDescriptorSets(device, &ds_ai, &set);
+        if (VK_ERROR_FRAGMENTED_POOL == res || VK_ERROR_OUT_OF_POOL_MEMORY == res)
+        {
+            // Current pool is full - move on to a fresh one and try again
+            current_pool = grabPool();
+            used_pools.push_back(current_pool);
+            ds_ai.descriptorPool = current_pool;
+            res = vkAllocateDescriptorSets(device, &ds_ai, &set);
+        }
+        if (VK_SUCCESS != res) throw std::runtime_error("Error allocating descriptor set");
+
+        allocated_sets++;
+        return set;
+    }
+
+    // Return every pool to the free list. Sets allocated from them become invalid.
+    void reset()
+    {
+        for (auto pool : used_pools)
+        {
+            vkResetDescriptorPool(device, pool, 0);
+            free_pools.push_back(pool);
+        }
+        used_pools.clear();
+        current_pool = VK_NULL_HANDLE;
+    }
+
+    VkDevice getDevice() const { return device; }
+    uint32_t poolCount() const { return static_cast<uint32_t>(used_pools.size() + free_pools.size()); }
+    uint64_t allocatedSets() const { return allocated_sets; }
+
+private:
+    VkDescriptorPool grabPool()
+    {
+        if (!free_pools.empty())
+        {
+            VkDescriptorPool pool = free_pools.back();
+            free_pools.pop_back();
+            return pool;
+        }
+
+        // Descriptors per set, by type. Generous enough that pool exhaustion is driven by set count.
+        const std::array<std::pair<VkDescriptorType, float>, 5> ratios = { {
+            { VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,         2.0f },
+            { VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, 1.0f },
+            { VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,         2.0f },
+            { VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 4.0f },
+            { VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,          1.0f } } };
+
+        std::array<VkDescriptorPoolSize, 5> pool_sizes{};
+        for (size_t i = 0; i < ratios.size(); i++)
+        {
+            pool_sizes[i].type = ratios[i].first;
+            pool_sizes[i].descriptorCount = static_cast<uint32_t>(ratios[i].second * pool_set_count);
+        }
+
+        VkDescriptorPoolCreateInfo dp_ci = { VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO, nullptr };
+        dp_ci.flags = 0;    // No individual frees, pools are only ever reset as a whole
+        dp_ci.poolSizeCount = static_cast<uint32_t>(pool_sizes.size());
+        dp_ci.pPoolSizes = pool_sizes.data();
+        dp_ci.maxSets = pool_set_count;
+
+        VkDescriptorPool pool;
+        if (VK_SUCCESS != vkCreateDescriptorPool(device, &dp_ci, nullptr, &pool))
+        {
+            throw std::runtime_error("Error creating descriptor pool");
+        }
+        return pool;
+    }
+
+    VkDevice                        device = VK_NULL_HANDLE;
+    uint32_t                        pool_set_count = 64;
+    VkDescriptorPool                current_pool = VK_NULL_HANDLE;
+    std::vector<VkDescriptorPool>   used_pools;
+    std::vector<VkDescriptorPool>   free_pools;
+    uint64_t                        allocated_sets = 0;
+};
+
+// Creates each distinct VkDescriptorSetLayout once, keyed by its bindings
+class DescriptorLayoutCache
+{
+public:
+    void init(VkDevice dev) { device = dev; }
+
+    void cleanup()
+    {
+        for (auto& entry : layouts) vkDestroyDescriptorSetLayout(device, entry.second, nullptr);
+        layouts.clear();
+    }
+
+    VkDescriptorSetLayout getLayout(std::vector<VkDescriptorSetLayoutBinding> bindings)
+    {
+        // Sort so that binding order doesn't affect the key
+        std::sort(bindings.begin(), bindings.end(),
+                  [](const auto& a, const auto& b) { return a.binding < b.binding; });
+
+        LayoutKey key{ bindings };
+        auto it = layouts.find(key);
+        if (it != layouts.end()) return it->second;
+
+        VkDescriptorSetLayoutCreateInfo ds_ci = { VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO, nullptr };
+        ds_ci.bindingCount = static_cast<uint32_t>(bindings.size());
+        ds_ci.pBindings = bindings.data();
+
+        VkDescriptorSetLayout layout;
+        if (VK_SUCCESS != vkCreateDescriptorSetLayout(device, &ds_ci, nullptr, &layout))
+        {
+            throw std::runtime_error("Failed to create descriptor set layout");
+        }
+        layouts[key] = layout;
+        return layout;
+    }
+
+    VkDevice getDevice() const { return device; }
+
+private:
+    // Immutable samplers aren't used, so they're not part of the key
+    struct LayoutKey
+    {
+        std::vector<VkDescriptorSetLayoutBinding> bindings;
+
+        bool operator==(const LayoutKey& other) const
+        {
+            if (bindings.size() != other.bindings.size()) return false;
+            for (size_t i = 0; i < bindings.size(); i++)
+            {
+                const auto& a = bindings[i];
+                const auto& b = other.bindings[i];
+                if (a.binding != b.binding || a.descriptorType != b.descriptorType ||
+                    a.descriptorCount != b.descriptorCount || a.stageFlags != b.stageFlags) return false;
+            }
+            return true;
+        }
+    };
+
+    struct LayoutKeyHash
+    {
+        size_t operator()(const LayoutKey& key) const
+        {
+            size_t seed = key.bindings.size();
+            for (const auto& b : key.bindings)
+            {
+                hashCombine(seed, b.binding);
+                hashCombine(seed, static_cast<uint32_t>(b.descriptorType));
+                hashCombine(seed, b.descriptorCount);
+                hashCombine(seed, b.stageFlags);
+            }
+            return seed;
+        }
+    };
+
+    VkDevice device = VK_NULL_HANDLE;
+    std::unordered_map<LayoutKey, VkDescriptorSetLayout, LayoutKeyHash> layouts;
+};
+
+// One resource bound to one binding of a set
+struct DescriptorWrite
+{
+    uint32_t                binding;
+    VkDescriptorType        type;
+    VkShaderStageFlags      stages;
+    VkDescriptorBufferInfo  buffer_info;    // valid for buffer types
+    VkDescriptorImageInfo   image_info;     // valid for image/sampler types
+
+    bool isImage() const
+    {
+        return (VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER == type || VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE == type ||
+                VK_DESCRIPTOR_TYPE_STORAGE_IMAGE == type || VK_DESCRIPTOR_TYPE_SAMPLER == type);
+    }
+
+    bool operator==(const DescriptorWrite& o) const
+    {
+        if (binding != o.binding || type != o.type || stages != o.stages) return false;
+        if (isImage())
+        {
+            return image_info.sampler == o.image_info.sampler && image_info.imageView == o.image_info.imageView &&
+                   image_info.imageLayout == o.image_info.imageLayout;
+        }
+        return buffer_info.buffer == o.buffer_info.buffer && buffer_info.offset == o.buffer_info.offset &&
+               buffer_info.range == o.buffer_info.range;
+    }
+};
+
+// Deduplicates descriptor sets by content. A set built with the same layout and resources as an earlier one
+// is returned as-is, with no allocation or vkUpdateDescriptorSets. Sets must come from a long-lived allocator.
+class DescriptorSetCache
+{
+public:
+    void clear()
+    {
+        sets.clear();
+        spare.clear();
+    }
+
+    VkDescriptorSet find(VkDescriptorSetLayout layout, const std::vector<DescriptorWrite>& writes)
+    {
+        auto it = sets.find(SetKey{ layout, writes });
+        if (it == sets.end())
+        {
+            misses++;
+            return VK_NULL_HANDLE;
+        }
+        hits++;
+        return it->second;
+    }
+
+    void insert(VkDescriptorSetLayout layout, const std::vector<DescriptorWrite>& writes, VkDescriptorSet set)
+    {
+        sets[SetKey{ layout, writes }] = set;
+    }
+
+    // Forgets every set that references `view`, which is about to be destroyed - a later view can get the same
+    // handle and must not hit them. The sets are handed out again by reuse() once retire_value has completed.
+    void evict(VkImageView view, DeletionQueue& deferred, uint64_t retire_value)
+    {
+        for (auto it = sets.begin(); it != sets.end(); )
+        {
+            bool uses_view = std::any_of(it->first.writes.begin(), it->first.writes.end(),
+                                         [view](const DescriptorWrite& w) { return w.isImage() && w.image_info.imageView == view; });
+            if (!uses_view)
+            {
+                ++it;
+                continue;
+            }
+            VkDescriptorSetLayout layout = it->first.layout;
+            VkDescriptorSet set = it->second;
+            deferred.push(retire_value, [this, layout, set]() { spare[layout].push_back(set); });
+            it = sets.erase(it);
+            evictions++;
+        }
+    }
+
+    // An evicted set the GPU is done with, to rewrite instead of allocating another
+    VkDescriptorSet reuse(VkDescriptorSetLayout layout)
+    {
+        auto it = spare.find(layout);
+        if (it == spare.end() || it->second.empty()) return VK_NULL_HANDLE;
+        VkDescriptorSet set = it->second.back();
+        it->second.pop_back();
+        return set;
+    }
+
+    uint64_t hitCount() const { return hits; }
+    uint64_t missCount() const { return misses; }
+    uint64_t evictionCount() const { return evictions; }
+    size_t   size() const { return sets.size(); }
+
+private:
+    struct SetKey
+    {
+        VkDescriptorSetLayout           layout;
+        std::vector<DescriptorWrite>    writes;
+
+        bool operator==(const SetKey& other) const { return layout == other.layout && writes == other.writes; }
+    };
+
+    struct SetKeyHash
+    {
+        size_t operator()(const SetKey& key) const
+        {
+            size_t seed = std::hash<uint64_t>{}((uint64_t)key.layout);
+            for (const auto& w : key.writes)
+            {
+                hashCombine(seed, w.binding);
+                hashCombine(seed, static_cast<uint32_t>(w.type));
+                if (w.isImage())
+                {
+                    hashCombine(seed, (uint64_t)w.image_info.imageView);
+                    hashCombine(seed, (uint64_t)w.image_info.sampler);
+                    hashCombine(seed, static_cast<uint32_t>(w.image_info.imageLayout));
+                }
+                else
+                {
+                    hashCombine(seed, (uint64_t)w.buffer_info.buffer);
+                    hashCombine(seed, w.buffer_info.offset);
+                    hashCombine(seed, w.buffer_info.range);
+                }
+            }
+            return seed;
+        }
+    };
+
+    std::unordered_map<SetKey, VkDescriptorSet, SetKeyHash> sets;
+    std::unordered_map<VkDescriptorSetLayout, std::vector<VkDescriptorSet>> spare;     // evicted and retired
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+};
+
+// Fluent helper: describe the bindings of a set, get back its (cached) layout and a populated set
+class DescriptorBuilder
+{
+public:
+    DescriptorBuilder(DescriptorLayoutCache& layouts, DescriptorAllocator& allocator)
+        : layout_cache(layouts), alloc(allocator) {}
+
+    DescriptorBuilder& bindBuffer(uint32_t binding, const VkDescriptorBufferInfo& info, VkDescriptorType type, VkShaderStageFlags stages)
+    {
+        DescriptorWrite w{ binding, type, stages };
+        w.buffer_info = info;
+        writes.push_back(w);
+        return *this;
+    }
+
+    DescriptorBuilder& bindImage(uint32_t binding, const VkDescriptorImageInfo& info, VkDescriptorType type, VkShaderStageFlags stages)
+    {
+        DescriptorWrite w{ binding, type, stages };
+        w.image_info = info;
+        writes.push_back(w);
+        return *this;
+    }
+
+    VkDescriptorSetLayout buildLayout()
+    {
+        std::vector<VkDescriptorSetLayoutBinding> bindings;
+        for (const auto& w : writes)
+        {
+            VkDescriptorSetLayoutBinding b{};
+            b.binding = w.binding;
+            b.descriptorType = w.type;
+            b.descriptorCount = 1;
+            b.stageFlags = w.stages;
+            b.pImmutableSamplers = nullptr;
+            bindings.push_back(b);
+        }
+        return layout_cache.getLayout(bindings);
+    }
+
+    // With a set cache, identical content returns the previously built set and skips the writes entirely
+    VkDescriptorSet build(DescriptorSetCache* set_cache = nullptr)
+    {
+        VkDescriptorSetLayout layout = buildLayout();
+        std::sort(writes.begin(), writes.end(), [](const auto& a, const auto& b) { return a.binding < b.binding; });
+
+        if (set_cache)
+        {
+            VkDescriptorSet cached = set_cache->find(layout, writes);
+            if (VK_NULL_HANDLE != cached) return cached;
+        }
+
+        VkDescriptorSet set = set_cache ? set_cache->reuse(layout) : VK_NULL_HANDLE;
+        if (VK_NULL_HANDLE == set) set = alloc.allocate(layout);
+
+        std::vector<VkWriteDescriptorSet> write_info(writes.size());
+        for (size_t i = 0; i < writes.size(); i++)
+        {
+            auto& wi = write_info[i];
+            wi = { VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET, nullptr };
+            wi.dstSet = set;
+            wi.dstBinding = writes[i].binding;
+            wi.dstArrayElement = 0;
+            wi.descriptorCount = 1;
+            wi.descriptorType = writes[i].type;
+            if (writes[i].isImage()) wi.pImageInfo = &writes[i].image_info;
+            else                     wi.pBufferInfo = &writes[i].buffer_info;
+        }
+        vkUpdateDescriptorSets(layout_cache.getDevice(), static_cast<uint32_t>(write_info.size()), write_info.data(), 0, nullptr);
+
+        if (set_cache) set_cache->insert(layout, writes, set);
+        return set;
+    }
+
+private:
+    DescriptorLayoutCache&          layout_cache;
+    DescriptorAllocator&            alloc;
+    std::vector<DescriptorWrite>    writes;
+};
+
+/////////////////////////////////////////////////////////////
+// Shaders
+/////////////////////////////////////////////////////////////
+
+// 64-bit FNV-1a. Stable across runs and compilers, unlike std::hash, so it can key on-disk caches.
+inline uint64_t fnv1a64(const void* data, size_t size, uint64_t seed = 0xcbf29ce484222325ull)
+{
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    uint64_t hash = seed;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+inline uint64_t fnv1a64(const std::string& str, uint64_t seed = 0xcbf29ce484222325ull)
+{
+    return fnv1a64(str.data(), str.size(), seed);
+}
+
+inline std::string readTextFile(const std::string& filename)
+{
+    std::ifstream file(filename, std::ios::binary);
+    if (!file.is_open()) throw std::runtime_error(std::string("Failed to open file: " + filename));
+    return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+// Compiles GLSL to SPIR-V in-process with shaderc. Results are cached on disk under a hash of the
+// source, stage and defines, so unchanged shaders skip the compiler entirely on later runs.
+// Safe to call from multiple threads.
+class ShaderCompiler
+{
+public:
+    using Defines = std::vector<std::pair<std::string, std::string>>;
+
+    struct Stats
+    {
+        uint64_t disk_hits = 0;
+        uint64_t compiles = 0;
+        double   total_compile_ms = 0.0;
+    };
+
+    void init(const std::string& cache_directory = "shader_cache")
+    {
+        cache_dir = cache_directory;
+        std::error_code ec;
+        std::filesystem::create_directories(cache_dir, ec);   // no cache dir just means no disk caching
+    }
+
+    // Load SPIR-V for a shader. Precompiled .spv files are read as-is, anything else is treated as GLSL source.
+    std::vector<uint32_t> load(const std::string& path, VkShaderStageFlagBits stage, const Defines& defines = {})
+    {
+        if (std::filesystem::path(path).extension() == ".spv") return readSPIRV(path);
+
+        std::string source = readTextFile(path);
+
+        // Key on everything that affects the output, including the contents of #included files
+        std::set<std::string> includes;
+        gatherIncludes(path, source, includes);
+
+        uint64_t key = fnv1a64(source);
+        for (const auto& include : includes) key = fnv1a64(readTextFile(include), key);
+        key = fnv1a64(&stage, sizeof(stage), key);
+        for (const auto& define : defines)
+        {
+            key = fnv1a64(define.first, key);
+            key = fnv1a64(define.second, key);
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            dependencies[normalize(path)] = includes;
+        }
+
+        char name[32];
+        snprintf(name, sizeof(name), "%016llx.spv", static_cast<unsigned long long>(key));
+        std::filesystem::path cache_file = std::filesystem::path(cache_dir) / name;
+
+        std::error_code ec;
+        if (std::filesystem::exists(cache_file, ec))
+        {
+            auto spirv = readSPIRV(cache_file.string());
+            std::lock_guard<std::mutex> lock(mutex);
+            stats.disk_hits++;
+            return spirv;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        auto spirv = compile(path, source, stage, defines);
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        // Write via a temp file + rename so a concurrent reader never sees a partial file
+        std::filesystem::path tmp_file = cache_file;
+        tmp_file += "." + std::to_string(std::hash<std::thread::id>{}(std::this_thread::get_id())) + ".tmp";
+        {
+            std::ofstream file(tmp_file, std::ios::binary);
+            file.write(reinterpret_cast<const char*>(spirv.data()), spirv.size() * sizeof(uint32_t));
+        }
+        std::filesystem::rename(tmp_file, cache_file, ec);
+        if (ec) std::filesystem::remove(tmp_file, ec);
+
+#ifdef VERBOSE_ON
+        std::cout << std::endl << "Compiled " << path << " in " << ms << " ms, " << spirv.size() * sizeof(uint32_t) << " bytes." << std::endl;
+#endif
+
+        std::lock_guard<std::mutex> lock(mutex);
+        stats.compiles++;
+        stats.total_compile_ms += ms;
+        return spirv;
+    }
+
+    // Shaders affected by a change to `file`: the file itself, plus every shader that #includes it
+    std::vector<std::string> dependents(const std::string& file)
+    {
+        std::string changed = normalize(file);
+        std::vector<std::string> result;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const auto& entry : dependencies)
+        {
+            if (entry.first == changed || entry.second.count(changed)) result.push_back(entry.first);
+        }
+        return result;
+    }
+
+    // Every file a shader pulls in, for the file watcher
+    std::set<std::string> includesOf(const std::string& file)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = dependencies.find(normalize(file));
+        return (it != dependencies.end()) ? it->second : std::set<std::string>{};
+    }
+
+    Stats getStats()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return stats;
+    }
+
+private:
+    static std::string normalize(const std::string& path)
+    {
+        return std::filesystem::path(path).lexically_normal().generic_string();
+    }
+
+    // Quoted includes resolve relative to the including file
+    static std::string resolveInclude(const std::string& requesting_file, const std::string& requested)
+    {
+        return normalize((std::filesystem::path(requesting_file).parent_path() / requested).string());
+    }
+
+    // Recursively collect the files named by #include "..." directives
+    static void gatherIncludes(const std::string& path, const std::string& source, std::set<std::string>& includes)
+    {
+        std::istringstream lines(source);
+        std::string line;
+        while (std::getline(lines, line))
+        {
+            size_t pos = line.find_first_not_of(" \t");
+            if (std::string::npos == pos || 0 != line.compare(pos, 8, "#include")) continue;
+
+            size_t open = line.find('"', pos);
+            size_t close = (std::string::npos == open) ? std::string::npos : line.find('"', open + 1);
+            if (std::string::npos == close) continue;
+
+            std::string include = resolveInclude(path, line.substr(open + 1, close - open - 1));
+            if (includes.insert(include).second) gatherIncludes(include, readTextFile(include), includes);
+        }
+    }
+
+    // Feeds #include "..." requests to shaderc from disk
+    class FileIncluder : public shaderc::CompileOptions::IncluderInterface
+    {
+        struct IncludeData
+        {
+            std::string name;
+            std::string content;
+        };
+
+        shaderc_include_result* GetInclude(const char* requested_source, shaderc_include_type /*type*/,
+                                           const char* requesting_source, size_t /*include_depth*/) override
+        {
+            auto* data = new IncludeData;
+            try
+            {
+                data->name = resolveInclude(requesting_source, requested_source);
+                data->content = readTextFile(data->name);
+            }
+            catch (const std::exception& e)
+            {
+                data->name.clear();     // empty name tells shaderc the content is an error message
+                data->content = e.what();
+            }
+
+            auto* result = new shaderc_include_result;
+            result->source_name = data->name.c_str();
+            result->source_name_length = data->name.size();
+            result->content = data->content.c_str();
+            result->content_length = data->content.size();
+            result->user_data = data;
+            return result;
+        }
+
+        void ReleaseInclude(shaderc_include_result* result) override
+        {
+            delete static_cast<IncludeData*>(result->user_data);
+            delete result;
+        }
+    };
+
+    static std::vector<uint32_t> readSPIRV(const std::string& filename)
+    {
+        std::ifstream file(filename, std::ios::ate | std::ios::binary);
+        if (!file.is_open()) throw std::runtime_error(std::string("Failed to open shader file: " + filename));
+
+        size_t file_size = (size_t)file.tellg();
+        if (0 != file_size % sizeof(uint32_t)) throw std::runtime_error(std::string("Malformed SPIR-V file: " + filename));
+
+        std::vector<uint32_t> buffer(file_size / sizeof(uint32_t));
+        file.seekg(0);
+        file.read(reinterpret_cast<char*>(buffer.data()), file_size);
+
+#ifdef VERBOSE_ON
+        std::cout << std::endl << "Read SPIR-V shader file " << filename << ", size  = " << file_size << " bytes." << std::endl;
+#endif
+
+        file.close();
+        return buffer;
+    }
+
+    std::vector<uint32_t> compile(const std::string& path, const std::string& source, VkShaderStageFlagBits stage, const Defines& defines)
+    {
+        PROFILE_ZONE("compile shader");
+        shaderc_shader_kind kind;
+        switch (stage)
+        {
+        case VK_SHADER_STAGE_VERTEX_BIT:    kind = shaderc_vertex_shader;   break;
+        case VK_SHADER_STAGE_FRAGMENT_BIT:  kind = shaderc_fragment_shader; break;
+        case VK_SHADER_STAGE_COMPUTE_BIT:   kind = shaderc_compute_shader;  break;
+        default: throw std::invalid_argument("Unsupported shader stage for " + path);
+        }
+
+        shaderc::CompileOptions options;
+        for (const auto& define : defines) options.AddMacroDefinition(define.first, define.second);
+        options.SetIncluder(std::make_unique<FileIncluder>());
+        options.SetOptimizationLevel(shaderc_optimization_level_performance);
+
+        shaderc::SpvCompilationResult result = compiler.CompileGlslToSpv(source, kind, path.c_str(), options);
+        if (shaderc_compilation_status_success != result.GetCompilationStatus())
+        {
+            throw std::runtime_error("Shader compilation failed: " + result.GetErrorMessage());
+        }
+        return std::vector<uint32_t>(result.cbegin(), result.cend());
+    }
+
+    shaderc::Compiler   compiler;   // thread-safe per the shaderc docs
+    std::string         cache_dir;
+    std::mutex          mutex;
+    std::unordered_map<std::string, std::set<std::string>> dependencies;   // shader -> files it includes
+    Stats               stats;
+};
+
+// Reports files that have been modified since the last poll. Uses inotify on Linux, and falls back
+// to polling modification times elsewhere. Directories are watched rather than files, since most
+// editors save by writing a new file and renaming it over the old one.
+class FileWatcher
+{
+public:
+    ~FileWatcher()
+    {
+#ifdef __linux__
+        if (inotify_fd >= 0) close(inotify_fd);
+#endif
+    }
+
+    void watch(const std::string& path)
+    {
+        std::string file = normalize(path);
+        std::error_code ec;
+        files[file] = std::filesystem::last_write_time(file, ec);
+
+#ifdef __linux__
+        if (inotify_fd < 0) inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (inotify_fd < 0) return;
+
+        std::string dir = std::filesystem::path(file).parent_path().generic_string();
+        if (dir.empty()) dir = ".";
+        for (const auto& w : dir_watches) if (w.second == dir) return;
+
+        int wd = inotify_add_watch(inotify_fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE);
+        if (wd >= 0) dir_watches[wd] = dir;
+#endif
+    }
+
+    std::vector<std::string> pollChanges()
+    {
+        std::set<std::string> changed;
+
+#ifdef __linux__
+        if (inotify_fd >= 0)
+        {
+            alignas(inotify_event) char buf[4096];
+            ssize_t len;
+            while ((len = read(inotify_fd, buf, sizeof(buf))) > 0)
+            {
+                for (char* ptr = buf; ptr < buf + len; ptr += sizeof(inotify_event) + reinterpret_cast<inotify_event*>(ptr)->len)
+                {
+                    const inotify_event* ev = reinterpret_cast<const inotify_event*>(ptr);
+                    if (0 == ev->len || !dir_watches.count(ev->wd)) continue;
+
+                    const std::string& dir = dir_watches[ev->wd];
+                    std::string file = normalize((dir == ".") ? std::string(ev->name) : dir + "/" + ev->name);
+                    if (files.count(file)) changed.insert(file);
+                }
+            }
+            return std::vector<std::string>(changed.begin(), changed.end());
+        }
+#endif
+
+        // Portable fallback - stat the files, but not more often than a few times a second
+        auto now = std::chrono::steady_clock::now();
+        if (now - last_poll < std::chrono::milliseconds(250)) return {};
+        last_poll = now;
+
+        for (auto& entry : files)
+        {
+            std::error_code ec;
+            auto time = std::filesystem::last_write_time(entry.first, ec);
+            if (!ec && time != entry.second)
+            {
+                entry.second = time;
+                changed.insert(entry.first);
+            }
+        }
+        return std::vector<std::string>(changed.begin(), changed.end());
+    }
+
+private:
+    static std::string normalize(const std::string& path)
+    {
+        return std::filesystem::path(path).lexically_normal().generic_string();
+    }
+
+    std::unordered_map<std::string, std::filesystem::file_time_type> files;
+    std::chrono::steady_clock::time_point last_poll;
+#ifdef __linux__
+    int inotify_fd = -1;
+    std::unordered_map<int, std::string> dir_watches;
+#endif
+};
+
+/////////////////////////////////////////////////////////////
+// Pipelines
+/////////////////////////////////////////////////////////////
+
+// Fragment shader permutation, expressed as specialization constants instead of separate GLSL copies.
+// Fields and map entries are generated from FRAG_SPEC_CONSTANTS in shader_interface.h, which frag.glsl
+// expands into its constant_id declarations - one list drives both sides.
+struct FragmentVariant
+{
+#define DECLARE_VARIANT_FIELD(name, id, glsl_type, glsl_default, cpp_type, cpp_default) cpp_type name = cpp_default;
+    FRAG_SPEC_CONSTANTS(DECLARE_VARIANT_FIELD)
+#undef DECLARE_VARIANT_FIELD
+
+    static std::vector<VkSpecializationMapEntry> mapEntries()
+    {
+#define VARIANT_MAP_ENTRY(name, id, glsl_type, glsl_default, cpp_type, cpp_default) \
+        { id, static_cast<uint32_t>(offsetof(FragmentVariant, name)), sizeof(cpp_type) },
+        return { FRAG_SPEC_CONSTANTS(VARIANT_MAP_ENTRY) };
+#undef VARIANT_MAP_ENTRY
+    }
+
+    // Compared and hashed as raw bytes, which is only sound without padding
+    bool operator==(const FragmentVariant& o) const { return 0 == memcmp(this, &o, sizeof(*this)); }
+    uint64_t hash() const { return fnv1a64(this, sizeof(*this)); }
+};
+
+#define VARIANT_FIELD_SIZE(name, id, glsl_type, glsl_default, cpp_type, cpp_default) + sizeof(cpp_type)
+static_assert(sizeof(FragmentVariant) == 0 FRAG_SPEC_CONSTANTS(VARIANT_FIELD_SIZE), "FragmentVariant must not contain padding");
+#undef VARIANT_FIELD_SIZE
+
+// Complete description of a graphics pipeline's state. Equal descriptions produce interchangeable pipelines,
+// so this doubles as the key for the PipelineLibrary. Viewport & scissor are always dynamic, so the swapchain
+// extent isn't part of it.
+struct PipelineDesc
+{
+    // Shaders (GLSL source, or precompiled .spv). No fragment shader gives a depth-only pipeline.
+    std::string vert_shader;
+    std::string frag_shader;
+    FragmentVariant frag_variant;
+
+    // Vertex layout
+    std::vector<VkVertexInputBindingDescription>    vertex_bindings;
+    std::vector<VkVertexInputAttributeDescription>  vertex_attribs;
+    VkPrimitiveTopology     topology        = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+
+    // Rasterizer
+    VkPolygonMode           polygon_mode    = VK_POLYGON_MODE_FILL;
+    VkCullModeFlags         cull_mode       = VK_CULL_MODE_BACK_BIT;
+    VkFrontFace             front_face      = VK_FRONT_FACE_CLOCKWISE;
+    VkSampleCountFlagBits   samples         = VK_SAMPLE_COUNT_1_BIT;
+
+    // Depth
+    VkBool32                depth_test      = VK_FALSE;
+    VkBool32                depth_write     = VK_FALSE;
+    VkCompareOp             depth_compare   = VK_COMPARE_OP_LESS;
+
+    // Blend (single color attachment)
+    VkBool32                blend_enable    = VK_FALSE;
+    VkBlendFactor           src_color_blend = VK_BLEND_FACTOR_ONE;
+    VkBlendFactor           dst_color_blend = VK_BLEND_FACTOR_ZERO;
+    VkColorComponentFlags   color_write_mask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT |
+                                               VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
+
+    // Compatibility. With no render pass, the pipeline is for dynamic rendering into attachments of these formats.
+    VkPipelineLayout        layout          = VK_NULL_HANDLE;
+    VkRenderPass            render_pass     = VK_NULL_HANDLE;
+    uint32_t                subpass         = 0;
+    VkFormat                color_format    = VK_FORMAT_UNDEFINED;
+    VkFormat                depth_format    = VK_FORMAT_UNDEFINED;
+
+    bool operator==(const PipelineDesc& o) const
+    {
+        if (vertex_bindings.size() != o.vertex_bindings.size() || vertex_attribs.size() != o.vertex_attribs.size()) return false;
+        for (size_t i = 0; i < vertex_bindings.size(); i++)
+        {
+            const auto& a = vertex_bindings[i];
+            const auto& b = o.vertex_bindings[i];
+            if (a.binding != b.binding || a.stride != b.stride || a.inputRate != b.inputRate) return false;
+        }
+        for (size_t i = 0; i < vertex_attribs.size(); i++)
+        {
+            const auto& a = vertex_attribs[i];
+            const auto& b = o.vertex_attribs[i];
+            if (a.binding != b.binding || a.location != b.location || a.format != b.format || a.offset != b.offset) return false;
+        }
+        return vert_shader == o.vert_shader && frag_shader == o.frag_shader && frag_variant == o.frag_variant && topology == o.topology &&
+               polygon_mode == o.polygon_mode && cull_mode == o.cull_mode && front_face == o.front_face &&
+               samples == o.samples && depth_test == o.depth_test && depth_write == o.depth_write &&
+               depth_compare == o.depth_compare && blend_enable == o.blend_enable &&
+               src_color_blend == o.src_color_blend && dst_color_blend == o.dst_color_blend &&
+               color_write_mask == o.color_write_mask && layout == o.layout && render_pass == o.render_pass &&
+               subpass == o.subpass && color_format == o.color_format && depth_format == o.depth_format;
+    }
+
+    size_t hash() const
+    {
+        size_t seed = 0;
+        hashCombine(seed, vert_shader);
+        hashCombine(seed, frag_shader);
+        hashCombine(seed, frag_variant.hash());
+        for (const auto& b : vertex_bindings)
+        {
+            hashCombine(seed, b.binding);
+            hashCombine(seed, b.stride);
+            hashCombine(seed, static_cast<uint32_t>(b.inputRate));
+        }
+        for (const auto& a : vertex_attribs)
+        {
+            hashCombine(seed, a.location);
+            hashCombine(seed, a.binding);
+            hashCombine(seed, static_cast<uint32_t>(a.format));
+            hashCombine(seed, a.offset);
+        }
+        hashCombine(seed, static_cast<uint32_t>(topology));
+        hashCombine(seed, static_cast<uint32_t>(polygon_mode));
+        hashCombine(seed, cull_mode);
+        hashCombine(seed, static_cast<uint32_t>(front_face));
+        hashCombine(seed, static_cast<uint32_t>(samples));
+        hashCombine(seed, depth_test);
+        hashCombine(seed, depth_write);
+        hashCombine(seed, static_cast<uint32_t>(depth_compare));
+        hashCombine(seed, blend_enable);
+        hashCombine(seed, static_cast<uint32_t>(src_color_blend));
+        hashCombine(seed, static_cast<uint32_t>(dst_color_blend));
+        hashCombine(seed, color_write_mask);
+        hashCombine(seed, (uint64_t)layout);
+        hashCombine(seed, (uint64_t)render_pass);
+        hashCombine(seed, subpass);
+        hashCombine(seed, static_cast<uint32_t>(color_format));
+        hashCombine(seed, static_cast<uint32_t>(depth_format));
+        return seed;
+    }
+};
+
+struct PipelineDescHash
+{
+    size_t operator()(const PipelineDesc& desc) const { return desc.hash(); }
+};
+
+// Hash-keyed store of graphics pipelines. get() builds a pipeline lazily on first use; precompile() builds a
+// manifest of pipelines on worker threads ahead of time, so the render thread normally only sees cache hits.
+// All compiles go through one VkPipelineCache, which is persisted to disk between runs. The few compute
+// pipelines are keyed by shader alone and built on first use by getCompute().
+class PipelineLibrary
+{
+public:
+    struct Stats
+    {
+        uint64_t hits = 0;              // get() found a finished pipeline
+        uint64_t misses = 0;            // get() had to compile on the calling thread
+        uint64_t stalls = 0;            // get() had to wait for a worker that was still compiling it
+        uint64_t compiles = 0;
+        double   total_compile_ms = 0.0;
+        double   max_compile_ms = 0.0;
+    };
+
+    void init(VkDevice dev, const std::string& cache_file = "pipeline_cache.bin")
+    {
+        device = dev;
+        cache_path = cache_file;
+        shader_compiler.init();
+
+        // Seed the driver cache from the previous run, if there was one
+        std::vector<char> initial_data;
+        std::ifstream file(cache_path, std::ios::ate | std::ios::binary);
+        if (file.is_open())
+        {
+            initial_data.resize((size_t)file.tellg());
+            file.seekg(0);
+            file.read(initial_data.data(), initial_data.size());
+        }
+
+        VkPipelineCacheCreateInfo ci = { VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO, nullptr };
+        ci.initialDataSize = initial_data.size();
+        ci.pInitialData = initial_data.empty() ? nullptr : initial_data.data();
+        if (VK_SUCCESS != vkCreatePipelineCache(device, &ci, nullptr, &pipeline_cache))
+        {
+            // Stale or incompatible data - start over with an empty cache
+            ci.initialDataSize = 0;
+            ci.pInitialData = nullptr;
+            if (VK_SUCCESS != vkCreatePipelineCache(device, &ci, nullptr, &pipeline_cache))
+            {
+                throw std::runtime_error("Failed to create pipeline cache");
+            }
+        }
+    }
+
+    void cleanup()
+    {
+        clear();
+        for (auto& entry : compute_pipelines) vkDestroyPipeline(device, entry.second, nullptr);
+        compute_pipelines.clear();
+
+        // Write the driver cache back out for next time
+        size_t size = 0;
+        vkGetPipelineCacheData(device, pipeline_cache, &size, nullptr);
+        if (size > 0)
+        {
+            std::vector<char> data(size);
+            vkGetPipelineCacheData(device, pipeline_cache, &size, data.data());
+            std::ofstream file(cache_path, std::ios::binary);
+            file.write(data.data(), size);
+        }
+        vkDestroyPipelineCache(device, pipeline_cache, nullptr);
+        pipeline_cache = VK_NULL_HANDLE;
+    }
+
+    // Destroy every graphics pipeline (e.g. when the render pass they were built against goes away). With a deletion
+    // queue, pipelines are only destroyed once the GPU passes retire_value; shader modules go immediately,
+    // since built pipelines don't need them.
+    void clear(DeletionQueue* deferred = nullptr, uint64_t retire_value = 0)
+    {
+        waitIdle();
+
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto& entry : pipelines)
+        {
+            if (VK_NULL_HANDLE != entry.second.pipeline) retire(entry.second.pipeline, deferred, retire_value);
+        }
+        pipelines.clear();
+        for (auto& module : shader_modules) vkDestroyShaderModule(device, module.second, nullptr);
+        shader_modules.clear();
+    }
+
+    VkPipeline get(const PipelineDesc& desc)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        auto it = pipelines.find(desc);
+        if (it != pipelines.end())
+        {
+            if (VK_NULL_HANDLE != it->second.pipeline)
+            {
+                stats.hits++;
+                return it->second.pipeline;
+            }
+
+            // A worker is on it - wait rather than compile twice
+            stats.stalls++;
+            ready.wait(lock, [&] { auto e = pipelines.find(desc); return e == pipelines.end() || !e->second.pending; });
+            auto done = pipelines.find(desc);
+            if (done != pipelines.end()) return done->second.pipeline;
+
+            // The worker failed; fall through and compile here so the error surfaces on this thread
+        }
+
+        stats.misses++;
+        pipelines[desc].pending = true;
+        lock.unlock();
+
+        return compileAndStore(desc);
+    }
+
+    // Each compute shader is used with a single layout, so the shader name is the whole key
+    VkPipeline getCompute(const std::string& shader, VkPipelineLayout layout)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = compute_pipelines.find(shader);
+            if (it != compute_pipelines.end())
+            {
+                stats.hits++;
+                return it->second;
+            }
+            stats.misses++;
+        }
+
+        PROFILE_ZONE("compile pipeline");
+        auto start = std::chrono::steady_clock::now();
+        VkComputePipelineCreateInfo ci = { VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO, nullptr };
+        ci.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+        ci.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+        ci.stage.module = getShaderModule(shader, VK_SHADER_STAGE_COMPUTE_BIT);
+        ci.stage.pName = "main";
+        ci.layout = layout;
+        VkPipeline pipeline;
+        if (VK_SUCCESS != vkCreateComputePipelines(device, pipeline_cache, 1, &ci, nullptr, &pipeline))
+        {
+            throw std::runtime_error("Failed to create compute pipeline for " + shader);
+        }
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        std::lock_guard<std::mutex> lock(mutex);
+        stats.compiles++;
+        stats.total_compile_ms += ms;
+        stats.max_compile_ms = std::max(stats.max_compile_ms, ms);
+        auto inserted = compute_pipelines.emplace(shader, pipeline);
+        if (!inserted.second) vkDestroyPipeline(device, pipeline, nullptr);    // another thread beat us to it
+        return inserted.first->second;
+    }
+
+    // Compile the manifest on worker threads. Returns immediately.
+    void precompile(const std::vector<PipelineDesc>& manifest, uint32_t thread_count = 0)
+    {
+        std::vector<PipelineDesc> todo;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (const auto& desc : manifest)
+            {
+                if (pipelines.count(desc)) continue;    // already built or in flight
+                pipelines[desc].pending = true;
+                todo.push_back(desc);
+            }
+        }
+        if (todo.empty()) return;
+
+        if (0 == thread_count) thread_count = std::max(1u, std::thread::hardware_concurrency() / 2);
+        thread_count = std::min(thread_count, static_cast<uint32_t>(todo.size()));
+
+        auto queue = std::make_shared<std::vector<PipelineDesc>>(std::move(todo));
+        auto next = std::make_shared<std::atomic<size_t>>(0);
+        for (uint32_t t = 0; t < thread_count; t++)
+        {
+            workers.emplace_back([this, queue, next]()
+            {
+                PROFILE_THREAD_NAME("pipeline worker");
+                for (size_t i = (*next)++; i < queue->size(); i = (*next)++)
+                {
+                    try
+                    {
+                        compileAndStore((*queue)[i]);
+                    }
+                    catch (const std::exception& e)
+                    {
+                        // Left uncached - a later get() retries and reports on the render thread
+                        std::cerr << "Pipeline precompile failed: " << e.what() << std::endl;
+                    }
+                }
+            });
+        }
+    }
+
+    // Block until all outstanding precompiles are done
+    void waitIdle()
+    {
+        for (auto& worker : workers) worker.join();
+        workers.clear();
+    }
+
+    // Drop a shader's module and every pipeline built from it. Returns the descriptions of the dropped
+    // pipelines so they can be rebuilt. Without a deletion queue, the caller must ensure the GPU is no
+    // longer using them.
+    std::vector<PipelineDesc> invalidateShader(const std::string& filename, DeletionQueue* deferred = nullptr, uint64_t retire_value = 0)
+    {
+        waitIdle();
+
+        std::lock_guard<std::mutex> lock(mutex);
+        auto module = shader_modules.find(filename);
+        if (module != shader_modules.end())
+        {
+            vkDestroyShaderModule(device, module->second, nullptr);
+            shader_modules.erase(module);
+        }
+
+        std::vector<PipelineDesc> dropped;
+        for (auto it = pipelines.begin(); it != pipelines.end(); )
+        {
+            if (it->first.vert_shader == filename || it->first.frag_shader == filename)
+            {
+                if (VK_NULL_HANDLE != it->second.pipeline) retire(it->second.pipeline, deferred, retire_value);
+                dropped.push_back(it->first);
+                it = pipelines.erase(it);
+            }
+            else ++it;
+        }
+
+        // Compute pipelines are simply rebuilt by the next getCompute()
+        auto compute = compute_pipelines.find(filename);
+        if (compute != compute_pipelines.end())
+        {
+            retire(compute->second, deferred, retire_value);
+            compute_pipelines.erase(compute);
+        }
+        return dropped;
+    }
+
+    ShaderCompiler& compiler() { return shader_compiler; }
+
+    Stats getStats()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return stats;
+    }
+
+    void printStats()
+    {
+        Stats s = getStats();
+        uint64_t lookups = s.hits + s.misses + s.stalls;
+        std::cout << std::endl << "Pipeline library: " << lookups << " lookups, "
+                  << (lookups ? (100.0 * s.hits / lookups) : 0.0) << "% hit rate ("
+                  << s.misses << " compiled on demand, " << s.stalls << " waited on precompile)" << std::endl;
+        std::cout << '\t' << s.compiles << " pipelines compiled, avg "
+                  << (s.compiles ? s.total_compile_ms / s.compiles : 0.0) << " ms, max " << s.max_compile_ms << " ms" << std::endl;
+
+        ShaderCompiler::Stats sc = shader_compiler.getStats();
+        std::cout << '\t' << sc.compiles << " shaders compiled (" << sc.total_compile_ms << " ms), "
+                  << sc.disk_hits << " loaded from the SPIR-V cache" << std::endl;
+    }
+
+private:
+    VkShaderModule getShaderModule(const std::string& filename, VkShaderStageFlagBits stage)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = shader_modules.find(filename);
+            if (it != shader_modules.end()) return it->second;
+        }
+
+        auto spirv = shader_compiler.load(filename, stage);
+        VkShaderModuleCreateInfo ci = { VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO, nullptr };
+        ci.codeSize = spirv.size() * sizeof(uint32_t);
+        ci.pCode = spirv.data();
+
+        VkShaderModule shader;
+        if (VK_SUCCESS != vkCreateShaderModule(device, &ci, nullptr, &shader)) throw std::runtime_error("Failed to create shader module");
+
+        std::lock_guard<std::mutex> lock(mutex);
+        auto inserted = shader_modules.emplace(filename, shader);
+        if (!inserted.second) vkDestroyShaderModule(device, shader, nullptr);   // another thread beat us to it
+        return inserted.first->second;
+    }
+
+    void retire(VkPipeline pipeline, DeletionQueue* deferred, uint64_t retire_value)
+    {
+        if (!deferred)
+        {
+            vkDestroyPipeline(device, pipeline, nullptr);
+            return;
+        }
+        VkDevice dev = device;
+        deferred->push(retire_value, [dev, pipeline]() { vkDestroyPipeline(dev, pipeline, nullptr); });
+    }
+
+    VkPipeline compileAndStore(const PipelineDesc& desc)
+    {
+        PROFILE_ZONE("compile pipeline");
+        auto start = std::chrono::steady_clock::now();
+        VkPipeline pipeline = VK_NULL_HANDLE;
+        try
+        {
+            pipeline = compile(desc);
+        }
+        catch (...)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            pipelines.erase(desc);
+            ready.notify_all();
+            throw;
+        }
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        std::lock_guard<std::mutex> lock(mutex);
+        auto& entry = pipelines[desc];
+        entry.pipeline = pipeline;
+        entry.pending = false;
+        stats.compiles++;
+        stats.total_compile_ms += ms;
+        stats.max_compile_ms = std::max(stats.max_compile_ms, ms);
+        ready.notify_all();
+        return pipeline;
+    }
+
+    VkPipeline compile(const PipelineDesc& desc)
+    {
+        /////////////////////////////////////////////////////////////
+        // Shaders
+        /////////////////////////////////////////////////////////////
+        VkPipelineShaderStageCreateInfo vert_ci = { VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO, nullptr };
+        vert_ci.stage = VK_SHADER_STAGE_VERTEX_BIT;
+        vert_ci.module = getShaderModule(desc.vert_shader, VK_SHADER_STAGE_VERTEX_BIT);
+        vert_ci.pName = "main";
+        vert_ci.pSpecializationInfo = nullptr;  // The vertex stage has no specialization constants
+
+        auto frag_map = FragmentVariant::mapEntries();
+        VkSpecializationInfo frag_spec{};
+        frag_spec.mapEntryCount = static_cast<uint32_t>(frag_map.size());
+        frag_spec.pMapEntries = frag_map.data();
+        frag_spec.dataSize = sizeof(desc.frag_variant);
+        frag_spec.pData = &desc.frag_variant;
+
+        VkPipelineShaderStageCreateInfo frag_ci = { VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO, nullptr };
+        frag_ci.stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+        frag_ci.module = desc.frag_shader.empty() ? VK_NULL_HANDLE : getShaderModule(desc.frag_shader, VK_SHADER_STAGE_FRAGMENT_BIT);
+        frag_ci.pName = "main";
+        frag_ci.pSpecializationInfo = &frag_spec;   // Selects the permutation
+
+        VkPipelineShaderStageCreateInfo pipe_stages[] = { vert_ci, frag_ci };
+        uint32_t stage_count = desc.frag_shader.empty() ? 1 : 2;
+
+        /////////////////////////////////////////////////////////////
+        // Vertex Input
+        /////////////////////////////////////////////////////////////
+        VkPipelineVertexInputStateCreateInfo vtx_in_ci = { VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO, nullptr };
+        vtx_in_ci.vertexBindingDescriptionCount = static_cast<uint32_t>(desc.vertex_bindings.size());
+        vtx_in_ci.pVertexBindingDescriptions = desc.vertex_bindings.data();
+        vtx_in_ci.vertexAttributeDescriptionCount = static_cast<uint32_t>(desc.vertex_attribs.size());
+        vtx_in_ci.pVertexAttributeDescriptions = desc.vertex_attribs.data();
+
+        /////////////////////////////////////////////////////////////
+        // Input Assembly
+        /////////////////////////////////////////////////////////////
+        VkPipelineInputAssemblyStateCreateInfo in_ass_ci = { VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO, nullptr };
+        in_ass_ci.topology = desc.topology;
+        in_ass_ci.primitiveRestartEnable = VK_FALSE;
+
+        /////////////////////////////////////////////////////////////
+        // Viewport (dynamic - set at record time)
+        /////////////////////////////////////////////////////////////
+        VkPipelineViewportStateCreateInfo view_ci = { VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO, nullptr };
+        view_ci.viewportCount = 1;
+        view_ci.pViewports = nullptr;
+        view_ci.scissorCount = 1;
+        view_ci.pScissors = nullptr;
+
+        /////////////////////////////////////////////////////////////
+        // Rasterizer
+        /////////////////////////////////////////////////////////////
+        VkPipelineRasterizationStateCreateInfo rast_ci = { VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO, nullptr };
+        rast_ci.depthClampEnable = VK_FALSE;        // kill outside depth range
+        rast_ci.rasterizerDiscardEnable = VK_FALSE; // pass geometry to rasterizer
+        rast_ci.polygonMode = desc.polygon_mode;
+        rast_ci.lineWidth = 1.0f;
+        rast_ci.cullMode = desc.cull_mode;
+        rast_ci.frontFace = desc.front_face;
+        rast_ci.depthBiasEnable = VK_FALSE;
+        rast_ci.depthBiasConstantFactor = 0.0f; // disabled
+        rast_ci.depthBiasClamp = 0.0f;          // disabled
+        rast_ci.depthBiasSlopeFactor = 0.0f;    // disabled
+
+        /////////////////////////////////////////////////////////////
+        // Multisampling
+        /////////////////////////////////////////////////////////////
+        VkPipelineMultisampleStateCreateInfo multi_ci = { VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO, nullptr };
+        multi_ci.sampleShadingEnable = VK_FALSE;
+        multi_ci.rasterizationSamples = desc.samples;
+        multi_ci.minSampleShading = 1.0f;           // disabled
+        multi_ci.pSampleMask = nullptr;             // disabled
+        multi_ci.alphaToCoverageEnable = VK_FALSE;  // disabled
+        multi_ci.alphaToOneEnable = VK_FALSE;       // disabled
+
+        /////////////////////////////////////////////////////////////
+        // Depth / Stencil
+        /////////////////////////////////////////////////////////////
+        VkPipelineDepthStencilStateCreateInfo ds_ci = { VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO, nullptr };
+        ds_ci.depthTestEnable = desc.depth_test;
+        ds_ci.depthWriteEnable = desc.depth_write;
+        ds_ci.depthCompareOp = desc.depth_compare;
+        ds_ci.depthBoundsTestEnable = VK_FALSE;
+        ds_ci.stencilTestEnable = VK_FALSE;
+
+        /////////////////////////////////////////////////////////////
+        // Color Blending
+        /////////////////////////////////////////////////////////////
+        VkPipelineColorBlendAttachmentState blend_attach{};
+        blend_attach.colorWriteMask         = desc.color_write_mask;
+        blend_attach.blendEnable            = desc.blend_enable;
+        blend_attach.srcColorBlendFactor    = desc.src_color_blend;
+        blend_attach.dstColorBlendFactor    = desc.dst_color_blend;
+        blend_attach.colorBlendOp           = VK_BLEND_OP_ADD;
+        blend_attach.srcAlphaBlendFactor    = VK_BLEND_FACTOR_ONE;
+        blend_attach.dstAlphaBlendFactor    = VK_BLEND_FACTOR_ZERO;
+        blend_attach.alphaBlendOp           = VK_BLEND_OP_ADD;
+
+        VkPipelineColorBlendStateCreateInfo blend_ci = { VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO, nullptr };
+        blend_ci.attachmentCount = 1;
+        blend_ci.pAttachments = &blend_attach;
+        blend_ci.logicOpEnable = VK_FALSE;
+        blend_ci.logicOp = VK_LOGIC_OP_COPY;    // disabled
+
+        /////////////////////////////////////////////////////////////
+        // Dynamic State - viewport & scissor, so pipelines survive swapchain resizes
+        /////////////////////////////////////////////////////////////
+        VkDynamicState dynamic_states[] = { VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR };
+
+        VkPipelineDynamicStateCreateInfo dyn_ci = { VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO, nullptr };
+        dyn_ci.dynamicStateCount = 2;
+        dyn_ci.pDynamicStates = dynamic_states;
+
+        /////////////////////////////////////////////////////////////
+        // Create pipeline
+        /////////////////////////////////////////////////////////////
+        VkPipelineRenderingCreateInfo rendering_ci = { VK_STRUCTURE_TYPE_PIPELINE_RENDERING_CREATE_INFO, nullptr };
+        rendering_ci.colorAttachmentCount = 1;
+        rendering_ci.pColorAttachmentFormats = &desc.color_format;
+        rendering_ci.depthAttachmentFormat = desc.depth_format;
+
+        VkGraphicsPipelineCreateInfo pipe_ci = { VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO, nullptr };
+        if (VK_NULL_HANDLE == desc.render_pass) pipe_ci.pNext = &rendering_ci;     // dynamic rendering
+        pipe_ci.stageCount = stage_count;
+        pipe_ci.pStages = pipe_stages;
+        pipe_ci.pVertexInputState = &vtx_in_ci;
+        pipe_ci.pInputAssemblyState = &in_ass_ci;
+        pipe_ci.pViewportState = &view_ci;
+        pipe_ci.pRasterizationState = &rast_ci;
+        pipe_ci.pMultisampleState = &multi_ci;
+        pipe_ci.pDepthStencilState = &ds_ci;
+        pipe_ci.pColorBlendState = &blend_ci;
+        pipe_ci.pDynamicState = &dyn_ci;
+        pipe_ci.layout = desc.layout;
+        pipe_ci.renderPass = desc.render_pass;
+        pipe_ci.subpass = desc.subpass;
+        pipe_ci.basePipelineHandle = VK_NULL_HANDLE;    // Not deriving from another pipeline
+        pipe_ci.basePipelineIndex = -1;                 // disabled
+
+        VkPipeline pipeline;
+        if (VK_SUCCESS != vkCreateGraphicsPipelines(device, pipeline_cache, 1, &pipe_ci, nullptr, &pipeline))
+        {
+            throw std::runtime_error("Failed to create graphics pipeline");
+        }
+        return pipeline;
+    }
+
+    struct Entry
+    {
+        VkPipeline  pipeline = VK_NULL_HANDLE;
+        bool        pending = false;    // being compiled by some thread
+    };
+
+    VkDevice                    device = VK_NULL_HANDLE;
+    VkPipelineCache             pipeline_cache = VK_NULL_HANDLE;
+    std::string                 cache_path;
+    std::mutex                  mutex;
+    std::condition_variable     ready;
+    std::unordered_map<PipelineDesc, Entry, PipelineDescHash> pipelines;
+    std::unordered_map<std::string, VkShaderModule>          shader_modules;
+    std::unordered_map<std::string, VkPipeline>              compute_pipelines;
+    std::vector<std::thread>    workers;
+    ShaderCompiler              shader_compiler;
+    Stats                       stats;
+};
+
+/////////////////////////////////////////////////////////////
+// Render graph
+/////////////////////////////////////////////////////////////
+
+// How a pass (or a one-off upload) uses an image. Barriers are derived from pairs of these rather than
+// written out by hand for each transition.
+enum class ResourceUsage
+{
+    Undefined,          // contents don't matter
+    Acquired,           // fresh from vkAcquireNextImageKHR - its semaphore wait is at color attachment output
+    TransferSrc,
+    TransferDst,
+    SampledFragment,
+    SampledCompute,
+    ColorAttachment,
+    DepthAttachment,
+    ComputeRead,        // storage image loads
+    ComputeWrite,       // storage image stores
+    Present,
+};
+
+struct UsageState
+{
+    VkPipelineStageFlags2   stages  = VK_PIPELINE_STAGE_2_NONE;
+    VkAccessFlags2          access  = VK_ACCESS_2_NONE;
+    VkImageLayout           layout  = VK_IMAGE_LAYOUT_UNDEFINED;
+    bool                    writes  = false;
+};
+
+inline UsageState usageState(ResourceUsage usage)
+{
+    switch (usage)
+    {
+    case ResourceUsage::Undefined:
+        return { VK_PIPELINE_STAGE_2_NONE, VK_ACCESS_2_NONE, VK_IMAGE_LAYOUT_UNDEFINED, false };
+    case ResourceUsage::Acquired:
+        return { VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT, VK_ACCESS_2_NONE, VK_IMAGE_LAYOUT_UNDEFINED, false };
+    case ResourceUsage::TransferSrc:
+        return { VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_READ_BIT, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, false };
+    case ResourceUsage::TransferDst:
+        return { VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, true };
+    case ResourceUsage::SampledFragment:
+        return { VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT, VK_ACCESS_2_SHADER_SAMPLED_READ_BIT, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, false };
+    case ResourceUsage::SampledCompute:
+        return { VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_SAMPLED_READ_BIT, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, false };
+    case ResourceUsage::ColorAttachment:
+        return { VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT,
+                 VK_ACCESS_2_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT,
+                 VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, true };
+    case ResourceUsage::DepthAttachment:
+        return { VK_PIPELINE_STAGE_2_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT,
+                 VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+                 VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL, true };
+    case ResourceUsage::ComputeRead:
+        return { VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_READ_BIT, VK_IMAGE_LAYOUT_GENERAL, false };
+    case ResourceUsage::ComputeWrite:
+        return { VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT, VK_IMAGE_LAYOUT_GENERAL, true };
+    case ResourceUsage::Present:
+        return { VK_PIPELINE_STAGE_2_NONE, VK_ACCESS_2_NONE, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR, false };   // the present semaphore covers the rest
+    }
+    return {};
+}
+
+// Only writes have to be made available - a barrier after reads just needs the execution dependency
+constexpr VkAccessFlags2 write_access_mask = VK_ACCESS_2_TRANSFER_WRITE_BIT | VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT |
+                                             VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT | VK_ACCESS_2_SHADER_WRITE_BIT |
+                                             VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT | VK_ACCESS_2_MEMORY_WRITE_BIT;
+
+inline VkImageMemoryBarrier2 imageBarrier(VkImage image, VkImageAspectFlags aspect, const UsageState& from, const UsageState& to)
+{
+    VkImageMemoryBarrier2 barrier = { VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2, nullptr };
+    barrier.srcStageMask = from.stages;
+    barrier.srcAccessMask = from.access & write_access_mask;
+    barrier.dstStageMask = to.stages;
+    barrier.dstAccessMask = to.access;
+    barrier.oldLayout = from.layout;
+    barrier.newLayout = to.layout;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.image = image;
+    barrier.subresourceRange.aspectMask = aspect;
+    barrier.subresourceRange.baseMipLevel = 0;
+    barrier.subresourceRange.levelCount = VK_REMAINING_MIP_LEVELS;
+    barrier.subresourceRange.baseArrayLayer = 0;
+    barrier.subresourceRange.layerCount = VK_REMAINING_ARRAY_LAYERS;
+    return barrier;
+}
+
+// Single transition outside the graph, e.g. in one-off upload command buffers
+inline void transitionImage(VkCommandBuffer cb, VkImage image, VkImageAspectFlags aspect, ResourceUsage from, ResourceUsage to)
+{
+    VkImageMemoryBarrier2 barrier = imageBarrier(image, aspect, usageState(from), usageState(to));
+    VkDependencyInfo dep = { VK_STRUCTURE_TYPE_DEPENDENCY_INFO, nullptr };
+    dep.imageMemoryBarrierCount = 1;
+    dep.pImageMemoryBarriers = &barrier;
+    vkCmdPipelineBarrier2(cb, &dep);
+}
+
+// Queue a pass is submitted to. Compute passes only go to a separate queue when the device has one.
+enum class PassQueue
+{
+    Graphics,
+    Compute,
+};
+
+// Passes declare how they use named images; compile() then
+//  - culls passes whose results nothing consumes (a pass is kept if it writes an imported image, or anything a
+//    kept pass uses),
+//  - places transient images with non-overlapping lifetimes in the same memory,
+//  - works out the barriers each pass needs, batched into one vkCmdPipelineBarrier2 ahead of it. Reads that
+//    follow reads in the same layout need none.
+//  - splits the live passes into segments of consecutive passes on the same queue. Each segment is recorded into
+//    its own command buffer and submitted after the one before it, waiting on it with a semaphore, so hand-offs
+//    between queues only need a layout transition on the receiving side.
+// Built once per swapchain configuration. Imported images (e.g. the swapchain image) are rebound each frame.
+class RenderGraph
+{
+public:
+    using ResourceId = uint32_t;
+    using RecordFn = std::function<void(VkCommandBuffer)>;
+
+    struct ImageDesc
+    {
+        VkFormat                format  = VK_FORMAT_UNDEFINED;
+        VkExtent2D              extent  = { 0, 0 };
+        VkImageUsageFlags       usage   = 0;
+        VkImageAspectFlags      aspect  = VK_IMAGE_ASPECT_COLOR_BIT;
+        VkSampleCountFlagBits   samples = VK_SAMPLE_COUNT_1_BIT;
+    };
+
+    struct Access
+    {
+        ResourceId      resource;
+        ResourceUsage   usage;
+    };
+
+    // The queue families are used to share images that both queues touch. Pass the same family twice when
+    // everything runs on one queue.
+    void init(VkDevice dev, VkPhysicalDevice phys, uint32_t graphics_family, uint32_t compute_family)
+    {
+        device = dev;
+        physical_device = phys;
+        families[0] = graphics_family;
+        families[1] = compute_family;
+    }
+
+    // An image owned elsewhere, in `initial` when the graph starts and left in `final_usage` when it ends
+    ResourceId importImage(const char* name, VkImageAspectFlags aspect, ResourceUsage initial, ResourceUsage final_usage)
+    {
+        Resource res;
+        res.name = name;
+        res.imported = true;
+        res.desc.aspect = aspect;
+        res.initial = initial;
+        res.final_usage = final_usage;
+        resources.push_back(res);
+        return static_cast<ResourceId>(resources.size() - 1);
+    }
+
+    // An image that lives only within the graph. Its contents don't survive from one frame to the next.
+    // Images with VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT go in lazily allocated memory where the device has it,
+    // so attachments that are never stored (MSAA color, depth) may never be backed by real memory on tilers.
+    ResourceId createTransient(const char* name, const ImageDesc& desc)
+    {
+        Resource res;
+        res.name = name;
+        res.desc = desc;
+        resources.push_back(res);
+        return static_cast<ResourceId>(resources.size() - 1);
+    }
+
+    // Passes run in the order they're added
+    void addPass(const char* name, std::vector<Access> accesses, RecordFn record, PassQueue queue = PassQueue::Graphics)
+    {
+        passes.push_back({ name, std::move(accesses), std::move(record), queue });
+    }
+
+    void compile()
+    {
+        cullPasses();
+        buildSegments();
+        allocateTransients();
+        planBarriers();
+    }
+
+    void bindImported(ResourceId id, VkImage image, VkImageView view)
+    {
+        resources[id].image = image;
+        resources[id].view = view;
+    }
+
+    VkImage image(ResourceId id) const { return resources[id].image; }
+    VkImageView view(ResourceId id) const { return resources[id].view; }
+
+    size_t segmentCount() const { return segments.size(); }
+    PassQueue segmentQueue(size_t segment) const { return segments[segment].queue; }
+
+    // The first segment that uses an image, e.g. the one that has to wait for the swapchain image to be acquired
+    size_t firstSegmentUsing(ResourceId id) const
+    {
+        for (size_t s = 0; s < segments.size(); s++)
+        {
+            for (uint32_t p : segments[s].passes)
+            {
+                for (const auto& access : passes[p].accesses)
+                {
+                    if (access.resource == id) return s;
+                }
+            }
+        }
+        return segments.size() - 1;
+    }
+
+    void executeSegment(VkCommandBuffer cb, size_t segment)
+    {
+        for (uint32_t p : segments[segment].passes)
+        {
+            emitBarriers(cb, passes[p].barriers);
+            passes[p].record(cb);
+        }
+        if (segment + 1 == segments.size()) emitBarriers(cb, final_barriers);
+    }
+
+    // Destroys transient images and memory - once the GPU passes retire_value if a deletion queue is given -
+    // and forgets all resources and passes, ready to be built again
+    void reset(DeletionQueue* deferred = nullptr, uint64_t retire_value = 0)
+    {
+        std::vector<VkImageView> views;
+        std::vector<VkImage> images;
+        std::vector<VkDeviceMemory> memory;
+        for (const auto& res : resources)
+        {
+            if (res.imported) continue;
+            if (VK_NULL_HANDLE != res.view) views.push_back(res.view);
+            if (VK_NULL_HANDLE != res.image) images.push_back(res.image);
+        }
+        for (const auto& block : blocks) memory.push_back(block.memory);
+
+        VkDevice dev = device;
+        auto destroy = [dev, views, images, memory]()
+        {
+            for (VkImageView view : views) vkDestroyImageView(dev, view, nullptr);
+            for (VkImage image : images) vkDestroyImage(dev, image, nullptr);
+            for (VkDeviceMemory mem : memory) vkFreeMemory(dev, mem, nullptr);
+        };
+        if (deferred) deferred->push(retire_value, destroy);
+        else destroy();
+
+        resources.clear();
+        passes.clear();
+        segments.clear();
+        blocks.clear();
+        final_barriers.clear();
+    }
+
+    void printStats() const
+    {
+        size_t culled = 0;
+        for (const auto& pass : passes) culled += pass.culled ? 1 : 0;
+        VkDeviceSize unaliased = 0, aliased = 0;
+        for (const auto& res : resources)
+        {
+            if (!res.imported && res.block >= 0) unaliased += res.mem_req.size;
+        }
+        VkDeviceSize lazy = 0, committed = 0;
+        for (const auto& block : blocks)
+        {
+            aliased += block.size;
+            if (!block.lazy_backed) continue;
+            VkDeviceSize bytes = 0;
+            vkGetDeviceMemoryCommitment(device, block.memory, &bytes);
+            lazy += block.size;
+            committed += bytes;
+        }
+
+        std::cout << "Render graph: " << passes.size() << " passes (" << culled << " culled) in " << segments.size() << " submits, "
+                  << (aliased + 1023) / 1024 << " KB transient memory in " << blocks.size() << " blocks ("
+                  << (unaliased + 1023) / 1024 << " KB unaliased";
+        if (lazy > 0) std::cout << ", " << (lazy + 1023) / 1024 << " KB lazily allocated, " << (committed + 1023) / 1024 << " KB committed";
+        std::cout << ")" << std::endl;
+    }
+
+private:
+    static constexpr uint32_t unused = UINT32_MAX;
+
+    struct Barrier
+    {
+        ResourceId  resource;
+        UsageState  from;
+        UsageState  to;
+    };
+
+    struct Resource
+    {
+        std::string             name;
+        bool                    imported    = false;
+        ImageDesc               desc;
+        ResourceUsage           initial     = ResourceUsage::Undefined;
+        ResourceUsage           final_usage = ResourceUsage::Undefined;
+        VkImage                 image       = VK_NULL_HANDLE;
+        VkImageView             view        = VK_NULL_HANDLE;
+        uint32_t                first_pass  = unused;   // lifetime over live passes (transients only)
+        uint32_t                last_pass   = 0;
+        int                     block       = -1;
+        uint32_t                queues      = 0;        // bit per PassQueue that uses it
+        VkMemoryRequirements    mem_req{};
+        UsageState              end_state;              // after the last pass that uses it
+        PassQueue               end_queue   = PassQueue::Graphics;
+    };
+
+    struct Pass
+    {
+        std::string             name;
+        std::vector<Access>     accesses;
+        RecordFn                record;
+        PassQueue               queue = PassQueue::Graphics;
+        bool                    culled = false;
+        std::vector<Barrier>    barriers;
+    };
+
+    struct Segment
+    {
+        PassQueue               queue;
+        std::vector<uint32_t>   passes;
+    };
+
+    // Transients sharing one allocation, all bound at offset 0
+    struct MemoryBlock
+    {
+        VkDeviceMemory          memory = VK_NULL_HANDLE;
+        VkDeviceSize            size = 0;
+        uint32_t                type_bits = ~0u;
+        bool                    lazy = false;       // all occupants are transient attachments
+        bool                    lazy_backed = false;    // ...and the device had lazily allocated memory for them
+        std::vector<ResourceId> occupants;
+    };
+
+    static bool isLazy(const Resource& res) { return 0 != (res.desc.usage & VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT); }
+    static uint32_t queueBit(PassQueue queue) { return 1u << static_cast<uint32_t>(queue); }
+
+    // Without a separate compute queue everything is one segment
+    bool asyncCompute() const { return families[0] != families[1]; }
+    PassQueue queueOf(const Pass& pass) const { return asyncCompute() ? pass.queue : PassQueue::Graphics; }
+
+    void cullPasses()
+    {
+        std::vector<bool> needed(resources.size(), false);
+        for (size_t p = passes.size(); p-- > 0; )
+        {
+            Pass& pass = passes[p];
+            bool live = false;
+            for (const auto& access : pass.accesses)
+            {
+                bool writes = usageState(access.usage).writes;
+                if (writes && (resources[access.resource].imported || needed[access.resource])) live = true;
+            }
+            pass.culled = !live;
+            if (!live) continue;
+
+            // Whatever a live pass touches, earlier writers of it must run (attachments may load or depth-test)
+            for (const auto& access : pass.accesses) needed[access.resource] = true;
+        }
+    }
+
+    void buildSegments()
+    {
+        segments.clear();
+        for (uint32_t p = 0; p < passes.size(); p++)
+        {
+            if (passes[p].culled) continue;
+            PassQueue queue = queueOf(passes[p]);
+            if (segments.empty() || segments.back().queue != queue) segments.push_back({ queue, {} });
+            segments.back().passes.push_back(p);
+        }
+        if (segments.empty()) segments.push_back({ PassQueue::Graphics, {} });   // final barriers still need a home
+    }
+
+    void allocateTransients()
+    {
+        // Lifetimes, in pass indices
+        for (uint32_t p = 0; p < passes.size(); p++)
+        {
+            if (passes[p].culled) continue;
+            for (const auto& access : passes[p].accesses)
+            {
+                Resource& res = resources[access.resource];
+                res.queues |= queueBit(queueOf(passes[p]));
+                if (res.imported) continue;
+                res.first_pass = std::min(res.first_pass, p);
+                res.last_pass = std::max(res.last_pass, p);
+            }
+        }
+
+        std::vector<ResourceId> transients;
+        for (ResourceId id = 0; id < resources.size(); id++)
+        {
+            Resource& res = resources[id];
+            if (res.imported || unused == res.first_pass) continue;
+
+            VkImageCreateInfo ici = { VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO, nullptr };
+            ici.imageType       = VK_IMAGE_TYPE_2D;
+            ici.format          = res.desc.format;
+            ici.extent          = { res.desc.extent.width, res.desc.extent.height, 1 };
+            ici.mipLevels       = 1;
+            ici.arrayLayers     = 1;
+            ici.samples         = res.desc.samples;
+            ici.tiling          = VK_IMAGE_TILING_OPTIMAL;
+            ici.usage           = res.desc.usage;
+            ici.sharingMode     = VK_SHARING_MODE_EXCLUSIVE;
+            ici.initialLayout   = VK_IMAGE_LAYOUT_UNDEFINED;
+            if (res.queues == (queueBit(PassQueue::Graphics) | queueBit(PassQueue::Compute)))
+            {
+                // Concurrent rather than ownership transfers: these images change hands twice a frame
+                ici.sharingMode = VK_SHARING_MODE_CONCURRENT;
+                ici.queueFamilyIndexCount = 2;
+                ici.pQueueFamilyIndices = families;
+            }
+            if (VK_SUCCESS != vkCreateImage(device, &ici, nullptr, &res.image))
+            {
+                throw std::runtime_error("Failed to create render graph image " + res.name);
+            }
+            vkGetImageMemoryRequirements(device, res.image, &res.mem_req);
+            transients.push_back(id);
+        }
+
+        // Largest first, each into the first block whose occupants' lifetimes it doesn't overlap
+        std::sort(transients.begin(), transients.end(), [this](ResourceId a, ResourceId b)
+        {
+            return resources[a].mem_req.size > resources[b].mem_req.size;
+        });
+        for (ResourceId id : transients)
+        {
+            Resource& res = resources[id];
+            for (size_t b = 0; b < blocks.size() && res.block < 0; b++)
+            {
+                MemoryBlock& block = blocks[b];
+                if (0 == (block.type_bits & res.mem_req.memoryTypeBits) || block.lazy != isLazy(res)) continue;
+                bool overlaps = false;
+                for (ResourceId other : block.occupants)
+                {
+                    const Resource& o = resources[other];
+                    overlaps |= res.first_pass <= o.last_pass && o.first_pass <= res.last_pass;
+                }
+                if (!overlaps) res.block = static_cast<int>(b);
+            }
+            if (res.block < 0)
+            {
+                res.block = static_cast<int>(blocks.size());
+                blocks.emplace_back();
+                blocks.back().lazy = isLazy(res);
+            }
+            MemoryBlock& block = blocks[res.block];
+            block.size = std::max(block.size, res.mem_req.size);     // offset 0, so alignment is always met
+            block.type_bits &= res.mem_req.memoryTypeBits;
+            block.occupants.push_back(id);
+        }
+
+        for (auto& block : blocks)
+        {
+            VkMemoryAllocateInfo ai = { VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO, nullptr };
+            ai.allocationSize = block.size;
+            ai.memoryTypeIndex = findMemoryType(block.type_bits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, block.lazy);
+            block.lazy_backed = block.lazy && isLazyType(ai.memoryTypeIndex);
+            runtime_counters.device_allocations++;
+            if (VK_SUCCESS != vkAllocateMemory(device, &ai, nullptr, &block.memory))
+            {
+                throw std::runtime_error("Failed to allocate render graph memory");
+            }
+            for (ResourceId id : block.occupants)
+            {
+                Resource& res = resources[id];
+                vkBindImageMemory(device, res.image, block.memory, 0);
+
+                VkImageViewCreateInfo ci = { VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO, nullptr };
+                ci.image = res.image;
+                ci.viewType = VK_IMAGE_VIEW_TYPE_2D;
+                ci.format = res.desc.format;
+                ci.subresourceRange.aspectMask = res.desc.aspect;
+                ci.subresourceRange.baseMipLevel = 0;
+                ci.subresourceRange.levelCount = 1;
+                ci.subresourceRange.baseArrayLayer = 0;
+                ci.subresourceRange.layerCount = 1;
+                if (VK_SUCCESS != vkCreateImageView(device, &ci, nullptr, &res.view))
+                {
+                    throw std::runtime_error("Failed to create render graph image view " + res.name);
+                }
+            }
+        }
+    }
+
+    void planBarriers()
+    {
+        // Walk the live passes tracking each image's state. Imported images start in their declared usage;
+        // transients start undefined, and their first barrier is completed once every block's final state is known.
+        // Images arriving from the other queue have already been waited for by the semaphore between the segments.
+        std::vector<UsageState> state(resources.size());
+        std::vector<PassQueue> queue(resources.size(), PassQueue::Graphics);
+        std::vector<bool> touched(resources.size(), false);
+        std::vector<std::pair<uint32_t, size_t>> first_uses;    // (pass, barrier index) of each transient's first use
+        for (ResourceId id = 0; id < resources.size(); id++)
+        {
+            if (resources[id].imported) state[id] = usageState(resources[id].initial);
+        }
+
+        for (uint32_t p = 0; p < passes.size(); p++)
+        {
+            Pass& pass = passes[p];
+            pass.barriers.clear();
+            if (pass.culled) continue;
+
+            for (const auto& access : pass.accesses)
+            {
+                ResourceId id = access.resource;
+                UsageState to = usageState(access.usage);
+                UsageState& cur = state[id];
+                bool handed_over = touched[id] && queue[id] != queueOf(pass);
+                queue[id] = queueOf(pass);
+                if (!resources[id].imported && !touched[id])
+                {
+                    first_uses.push_back({ p, pass.barriers.size() });
+                    pass.barriers.push_back({ id, UsageState{}, to });
+                    cur = to;
+                }
+                else if (handed_over)
+                {
+                    if (cur.layout != to.layout) pass.barriers.push_back({ id, fromOtherQueue(cur.layout), to });
+                    cur = to;
+                }
+                else if (cur.layout != to.layout || cur.writes || to.writes)
+                {
+                    pass.barriers.push_back({ id, cur, to });
+                    cur = to;
+                }
+                else
+                {
+                    // Read after read: no barrier, but a later writer must wait for both readers
+                    cur.stages |= to.stages;
+                    cur.access |= to.access;
+                }
+                touched[id] = true;
+            }
+        }
+
+        final_barriers.clear();
+        PassQueue last_queue = segments.back().queue;
+        for (ResourceId id = 0; id < resources.size(); id++)
+        {
+            Resource& res = resources[id];
+            res.end_state = state[id];
+            res.end_queue = queue[id];
+            if (!res.imported) continue;
+            UsageState final_state = usageState(res.final_usage);
+            if (queue[id] != last_queue)
+            {
+                if (state[id].layout != final_state.layout) final_barriers.push_back({ id, fromOtherQueue(state[id].layout), final_state });
+            }
+            else if (state[id].layout != final_state.layout || state[id].writes)
+            {
+                final_barriers.push_back({ id, state[id], final_state });
+            }
+        }
+
+        // A transient's first use discards its contents, but must wait for whatever last used its memory - the
+        // block's other occupants this frame, and every occupant in the previous frame. Occupants on the other
+        // queue were already waited for by a semaphore; only the execution dependency has to chain with it.
+        for (const auto& first : first_uses)
+        {
+            const Pass& pass = passes[first.first];
+            Barrier& barrier = passes[first.first].barriers[first.second];
+            for (ResourceId other : blocks[resources[barrier.resource].block].occupants)
+            {
+                const Resource& o = resources[other];
+                if (o.end_queue != queueOf(pass))
+                {
+                    barrier.from.stages |= VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT;
+                    continue;
+                }
+                barrier.from.stages |= o.end_state.stages;
+                barrier.from.access |= o.end_state.access;
+            }
+            barrier.from.layout = VK_IMAGE_LAYOUT_UNDEFINED;
+        }
+    }
+
+    // Source of a transition for an image the other queue used last
+    static UsageState fromOtherQueue(VkImageLayout layout)
+    {
+        return { VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, VK_ACCESS_2_NONE, layout, false };
+    }
+
+    void emitBarriers(VkCommandBuffer cb, const std::vector<Barrier>& barriers)
+    {
+        if (barriers.empty()) return;
+        image_barriers.clear();
+        for (const auto& b : barriers)
+        {
+            const Resource& res = resources[b.resource];
+            image_barriers.push_back(imageBarrier(res.image, res.desc.aspect, b.from, b.to));
+        }
+        VkDependencyInfo dep = { VK_STRUCTURE_TYPE_DEPENDENCY_INFO, nullptr };
+        dep.imageMemoryBarrierCount = static_cast<uint32_t>(image_barriers.size());
+        dep.pImageMemoryBarriers = image_barriers.data();
+        vkCmdPipelineBarrier2(cb, &dep);
+    }
+
+    uint32_t findMemoryType(uint32_t type_bits, VkMemoryPropertyFlags props, bool prefer_lazy = false)
+    {
+        VkPhysicalDeviceMemoryProperties mem_props;
+        vkGetPhysicalDeviceMemoryProperties(physical_device, &mem_props);
+        for (uint32_t i = 0; prefer_lazy && i < mem_props.memoryTypeCount; i++)
+        {
+            VkMemoryPropertyFlags lazy_props = props | VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT;
+            if ((type_bits & (1 << i)) && (mem_props.memoryTypes[i].propertyFlags & lazy_props) == lazy_props) return i;
+        }
+        for (uint32_t i = 0; i < mem_props.memoryTypeCount; i++)
+        {
+            if ((type_bits & (1 << i)) && (mem_props.memoryTypes[i].propertyFlags & props) == props) return i;
+        }
+        throw std::runtime_error("No suitable memory type for render graph image");
+    }
+
+    bool isLazyType(uint32_t type_index)
+    {
+        VkPhysicalDeviceMemoryProperties mem_props;
+        vkGetPhysicalDeviceMemoryProperties(physical_device, &mem_props);
+        return 0 != (mem_props.memoryTypes[type_index].propertyFlags & VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT);
+    }
+
+    VkDevice                            device = VK_NULL_HANDLE;
+    VkPhysicalDevice                    physical_device = VK_NULL_HANDLE;
+    uint32_t                            families[2] = { 0, 0 };     // indexed by PassQueue
+    std::vector<Resource>               resources;
+    std::vector<Pass>                   passes;
+    std::vector<Segment>                segments;
+    std::vector<MemoryBlock>            blocks;
+    std::vector<Barrier>                final_barriers;
+    std::vector<VkImageMemoryBarrier2>  image_barriers;     // scratch, reused each frame
+};
+
+/////////////////////////////////////////////////////////////
+// Sub-allocation
+/////////////////////////////////////////////////////////////
+
+// Sub-allocates ranges of `capacity` elements. The free ranges are indexed by size for best fit, and merged with
+// their neighbours when freed, so freeing everything always gives back the one range. It hands out offsets, not
+// memory, so one allocator can serve several buffers indexed alike.
+class FreeListAllocator
+{
+public:
+    static constexpr uint32_t invalid = UINT32_MAX;
+
+    void init(uint32_t capacity_elements)
+    {
+        capacity_ = capacity_elements;
+        used_ = 0;
+        allocations.clear();
+        free_by_offset.clear();
+        free_by_size.clear();
+        if (capacity_ > 0) addFree(0, capacity_);
+    }
+
+    // The offset of `size` elements, or invalid if no free range is big enough
+    uint32_t allocate(uint32_t size)
+    {
+        size = std::max(size, 1u);      // every allocation needs an offset of its own to be freed by
+        auto best = free_by_size.lower_bound(size);
+        if (best == free_by_size.end()) return invalid;
+
+        uint32_t offset = best->second;
+        uint32_t range = best->first;
+        removeFree(offset, range);
+        if (range > size) addFree(offset + size, range - size);
+        allocations[offset] = size;
+        used_ += size;
+        return offset;
+    }
+
+    void free(uint32_t offset)
+    {
+        auto alloc = allocations.find(offset);
+        if (alloc == allocations.end()) throw std::runtime_error("Freeing a range that isn't allocated");
+        uint32_t size = alloc->second;
+        allocations.erase(alloc);
+        used_ -= size;
+
+        auto next = free_by_offset.find(offset + size);
+        if (next != free_by_offset.end())
+        {
+            size += next->second;
+            removeFree(next->first, next->second);
+        }
+        auto prev = free_by_offset.lower_bound(offset);
+        if (prev != free_by_offset.begin())
+        {
+            --prev;
+            if (prev->first + prev->second == offset)
+            {
+                offset = prev->first;
+                size += prev->second;
+                removeFree(prev->first, prev->second);
+            }
+        }
+        addFree(offset, size);
+    }
+
+    uint32_t capacity() const { return capacity_; }
+    uint32_t used() const { return used_; }
+    uint32_t freeRanges() const { return static_cast<uint32_t>(free_by_offset.size()); }
+    uint32_t largestFree() const { return free_by_size.empty() ? 0 : free_by_size.rbegin()->first; }
+
+private:
+    void addFree(uint32_t offset, uint32_t size)
+    {
+        free_by_offset[offset] = size;
+        free_by_size.insert({ size, offset });
+    }
+
+    void removeFree(uint32_t offset, uint32_t size)
+    {
+        free_by_offset.erase(offset);
+        auto same_size = free_by_size.equal_range(size);
+        for (auto it = same_size.first; it != same_size.second; ++it)
+        {
+            if (it->second == offset)
+            {
+                free_by_size.erase(it);
+                break;
+            }
+        }
+    }
+
+    uint32_t                            capacity_ = 0;
+    uint32_t                            used_ = 0;
+    std::map<uint32_t, uint32_t>        allocations;        // offset -> size
+    std::map<uint32_t, uint32_t>        free_by_offset;     // offset -> size
+    std::multimap<uint32_t, uint32_t>   free_by_size;       // size -> offset
+};
+
+/////////////////////////////////////////////////////////////
+// Texture streaming
+/////////////////////////////////////////////////////////////
+
+// Keeps textures' mips resident on the GPU within a memory budget. Each texture's full mip chain stays decoded in
+// system memory; the GPU holds a tail of it, from `resident` (the most detailed level present) down to 1x1.
+// Textures start with just their small mips, then each frame
+//  - callers report the most detailed mip each texture needs on screen (request()),
+//  - update() moves the textures furthest from what they need one level closer, within a per-frame upload limit,
+//    evicting levels from the least recently used textures while that would exceed the budget.
+// Changing a texture's resident range makes a new image: the levels it keeps are copied across on the GPU and the
+// old image is retired once the frame that last used it completes. Images are carved out of a few large device-local
+// blocks, and uploads go through a persistently mapped staging ring, so streaming doesn't allocate device memory.
+// Views change with the images, so retire() evicts the old views' descriptor sets from the content cache.
+class TextureStreamer
+{
+public:
+    using TextureId = uint32_t;
+
+    struct Stats
+    {
+        uint64_t requests = 0;
+        uint64_t hits = 0;              // requests already met by the resident mips
+        uint64_t level_uploads = 0;
+        uint64_t bytes_uploaded = 0;
+        uint64_t level_evictions = 0;
+    };
+
+    // The budget is the smaller of budget_bytes and, with VK_EXT_memory_budget, what the device-local heap has
+    // left for us after everything else's usage. The staging ring has a region per frame in flight; a region is
+    // reused once the timeline passes the frame that last wrote it.
+    void init(VkDevice dev, VkPhysicalDevice phys, VkDeviceSize budget_bytes, VkDeviceSize upload_bytes_per_frame, bool has_memory_budget,
+              GpuTimeline& gpu_timeline, uint32_t frames_in_flight)
+    {
+        device = dev;
+        physical_device = phys;
+        budget = budget_bytes;
+        upload_limit = upload_bytes_per_frame;
+        use_budget_ext = has_memory_budget;
+        timeline = &gpu_timeline;
+        staging.region_retire.assign(frames_in_flight, 0);
+        start_time = std::chrono::steady_clock::now();
+    }
+
+    void cleanup()
+    {
+        for (auto& tex : textures) destroyImage(tex.image, tex.memory, tex.view);
+        for (auto& destroy : retired) destroy();
+        textures.clear();
+        retired.clear();
+        retired_views.clear();
+        destroyStaging(staging.buffer, staging.memory);
+        staging = StagingRing{};
+        for (auto& block : blocks) vkFreeMemory(device, block.memory, nullptr);
+        blocks.clear();
+    }
+
+    // Builds the mip chain from RGBA8 pixels. Nothing is resident until the next update().
+    TextureId add(const std::string& name, const uint8_t* rgba, uint32_t width, uint32_t height)
+    {
+        PROFILE_FUNCTION();
+        Texture tex;
+        tex.name = name;
+        tex.width = width;
+        tex.height = height;
+        tex.mip_count = static_cast<uint32_t>(std::floor(std::log2(std::max(width, height)))) + 1;
+        tex.mips.resize(tex.mip_count);
+        tex.mips[0].assign(rgba, rgba + size_t(width) * height * 4);
+
+        // 2x2 box filter. Applied to the sRGB values directly - slightly dark, but cheap.
+        for (uint32_t level = 1; level < tex.mip_count; level++)
+        {
+            uint32_t src_w = mipWidth(tex, level - 1), src_h = mipHeight(tex, level - 1);
+            uint32_t w = mipWidth(tex, level), h = mipHeight(tex, level);
+            const std::vector<uint8_t>& src = tex.mips[level - 1];
+            std::vector<uint8_t>& dst = tex.mips[level];
+            dst.resize(size_t(w) * h * 4);
+            for (uint32_t y = 0; y < h; y++)
+            {
+                uint32_t y0 = std::min(y * 2, src_h - 1), y1 = std::min(y * 2 + 1, src_h - 1);
+                for (uint32_t x = 0; x < w; x++)
+                {
+                    uint32_t x0 = std::min(x * 2, src_w - 1), x1 = std::min(x * 2 + 1, src_w - 1);
+                    for (uint32_t c = 0; c < 4; c++)
+                    {
+                        uint32_t sum = src[(size_t(y0) * src_w + x0) * 4 + c] + src[(size_t(y0) * src_w + x1) * 4 + c] +
+                                       src[(size_t(y1) * src_w + x0) * 4 + c] + src[(size_t(y1) * src_w + x1) * 4 + c];
+                        dst[(size_t(y) * w + x) * 4 + c] = static_cast<uint8_t>((sum + 2) / 4);
+                    }
+                }
+            }
+        }
+
+        // Always resident: every level no bigger than the tail size
+        tex.tail_mip = tex.mip_count - 1;
+        while (tex.tail_mip > 0 && std::max(mipWidth(tex, tex.tail_mip - 1), mipHeight(tex, tex.tail_mip - 1)) <= tail_size) tex.tail_mip--;
+        tex.resident = tex.mip_count;
+        tex.wanted = tex.tail_mip;
+        largest_upload = std::max({ largest_upload, VkDeviceSize(tex.mips[0].size()), levelBytes(tex, tex.tail_mip, tex.mip_count) });
+        textures.push_back(std::move(tex));
+        return static_cast<TextureId>(textures.size() - 1);
+    }
+
+    // The most detailed level the texture needs this frame. Multiple requests keep the most detailed.
+    void request(TextureId id, uint32_t mip, uint64_t frame)
+    {
+        Texture& tex = textures[id];
+        mip = std::min(mip, tex.mip_count - 1);
+        if (tex.last_used != frame) tex.wanted = tex.mip_count - 1;
+        tex.wanted = std::min(tex.wanted, mip);
+        tex.last_used = frame;
+        stats.requests++;
+        if (tex.resident <= mip) stats.hits++;
+    }
+
+    // Plans this frame's residency changes and records them into cb, which must be outside any rendering.
+    // Returns true if any texture's image changed.
+    bool update(VkCommandBuffer cb, uint64_t frame)
+    {
+        PROFILE_FUNCTION();
+        VkDeviceSize limit = currentBudget();
+        for (auto& tex : textures) tex.planned = tex.resident;
+
+        // Over budget (it shrank, or another process grew): shed detail until back under
+        VkDeviceSize planned_bytes = plannedBytes();
+        while (planned_bytes > limit && evictOne(frame, UINT32_MAX, true, planned_bytes)) {}
+
+        // Furthest from what they need first, then the most recently used. New textures get their tail.
+        std::vector<TextureId> loads;
+        for (TextureId id = 0; id < textures.size(); id++)
+        {
+            const Texture& tex = textures[id];
+            if (tex.resident == tex.mip_count || (tex.last_used == frame && tex.wanted < tex.planned)) loads.push_back(id);
+        }
+        std::sort(loads.begin(), loads.end(), [this](TextureId a, TextureId b)
+        {
+            const Texture& ta = textures[a];
+            const Texture& tb = textures[b];
+            uint32_t gap_a = ta.resident - std::min(ta.wanted, ta.resident), gap_b = tb.resident - std::min(tb.wanted, tb.resident);
+            return (gap_a != gap_b) ? gap_a > gap_b : ta.last_used > tb.last_used;
+        });
+
+        VkDeviceSize staged = 0;
+        uint32_t changes = 0;
+        for (TextureId id : loads)
+        {
+            Texture& tex = textures[id];
+            bool first = (tex.resident == tex.mip_count);
+            uint32_t target = first ? tex.tail_mip : tex.planned - 1;
+            VkDeviceSize upload = levelBytes(tex, target, tex.resident);
+            if (!first && (changes >= max_changes_per_frame || (staged > 0 && staged + upload > upload_limit))) break;
+
+            VkDeviceSize growth = chainBytes(tex, target) - chainBytes(tex, tex.planned);
+            while (!first && planned_bytes + growth > limit)
+            {
+                if (!evictOne(frame, id, false, planned_bytes)) break;
+            }
+            if (!first && planned_bytes + growth > limit) continue;     // nothing else can give way
+
+            tex.planned = target;
+            planned_bytes += growth;
+            staged += upload;
+            changes++;
+        }
+
+        return applyPlan(cb, staged);
+    }
+
+    // Hands the images replaced by the last update() to the deletion queue, to go once retire_value completes, and
+    // drops their views' sets from set_cache so a new view that happens to get a recycled handle can't hit them.
+    // The staging region the update wrote is free again from retire_value too.
+    void retire(DeletionQueue& deferred, uint64_t retire_value, DescriptorSetCache& set_cache)
+    {
+        for (VkImageView view : retired_views) set_cache.evict(view, deferred, retire_value);
+        for (auto& destroy : retired) deferred.push(retire_value, std::move(destroy));
+        retired_views.clear();
+        retired.clear();
+        if (staging.pending) staging.region_retire[staging.region] = retire_value;
+        staging.pending = false;
+    }
+
+    VkImage image(TextureId id) const { return textures[id].image; }
+    VkImageView view(TextureId id) const { return textures[id].view; }
+    uint32_t width(TextureId id) const { return textures[id].width; }
+    uint32_t height(TextureId id) const { return textures[id].height; }
+
+    void printStats() const
+    {
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+        VkDeviceSize resident_bytes = 0;
+        for (const auto& tex : textures) resident_bytes += tex.bytes;
+
+        std::cout << std::endl << "Texture streaming: " << (resident_bytes + 1023) / 1024 << " KB resident of "
+                  << (currentBudget() + 1023) / 1024 << " KB budget" << (use_budget_ext ? " (VK_EXT_memory_budget)" : "") << std::endl;
+        std::cout << '\t' << (blockBytes() + 1023) / 1024 << " KB in " << blocks.size() << " memory blocks, "
+                  << staging.region_retire.size() << " staging regions of " << (staging.region_size + 1023) / 1024 << " KB" << std::endl;
+        for (const auto& tex : textures)
+        {
+            std::cout << '\t' << tex.name << ": " << mipWidth(tex, tex.resident) << "x" << mipHeight(tex, tex.resident)
+                      << " (mip " << tex.resident << " of " << tex.mip_count << ", wants " << tex.wanted << "), "
+                      << (tex.bytes + 1023) / 1024 << " KB" << std::endl;
+        }
+        std::cout << '\t' << (stats.requests ? 100.0 * stats.hits / stats.requests : 100.0) << "% of requests resident, "
+                  << stats.level_uploads << " levels uploaded, " << stats.level_evictions << " evicted" << std::endl;
+        std::cout << '\t' << stats.bytes_uploaded / 1024 << " KB uploaded, "
+                  << (seconds > 0.0 ? stats.bytes_uploaded / (1024.0 * 1024.0) / seconds : 0.0) << " MB/s average" << std::endl;
+    }
+
+private:
+    static constexpr uint32_t tail_size = 64;              // levels this size or smaller are never evicted
+    static constexpr uint32_t max_changes_per_frame = 4;
+    static constexpr VkDeviceSize memory_unit = 4096;          // granule image memory is sub-allocated in
+    static constexpr VkDeviceSize block_size = 64ull << 20;    // device memory allocated at a time, within the budget
+
+    // Where an image's memory came from: a range of memory_unit granules in one of the blocks
+    struct ImageMemory
+    {
+        uint32_t    block = 0;
+        uint32_t    offset = FreeListAllocator::invalid;
+    };
+
+    struct MemoryBlock
+    {
+        VkDeviceMemory      memory = VK_NULL_HANDLE;
+        VkDeviceSize        size = 0;
+        uint32_t            type = 0;
+        FreeListAllocator   ranges;
+    };
+
+    // One buffer, persistently mapped, split into a region per frame in flight. Each region fits the per-frame upload
+    // limit or the largest single level, whichever is bigger, so it only grows for a burst of new textures.
+    struct StagingRing
+    {
+        VkBuffer                buffer = VK_NULL_HANDLE;
+        VkDeviceMemory          memory = VK_NULL_HANDLE;
+        uint8_t*                mapped = nullptr;
+        VkDeviceSize            region_size = 0;
+        std::vector<uint64_t>   region_retire;      // timeline value each region was last used up to
+        uint32_t                region = 0;         // the region the last update() wrote
+        bool                    pending = false;    // ...which retire() has yet to stamp
+    };
+
+    struct Texture
+    {
+        std::string                         name;
+        uint32_t                            width = 0;
+        uint32_t                            height = 0;
+        uint32_t                            mip_count = 0;
+        uint32_t                            tail_mip = 0;
+        std::vector<std::vector<uint8_t>>   mips;           // RGBA8, every level
+        uint32_t                            resident = 0;   // most detailed level on the GPU; mip_count for none
+        uint32_t                            planned = 0;    // the same, after this update
+        uint32_t                            wanted = 0;     // most detailed level requested in last_used's frame
+        uint64_t                            last_used = 0;
+        VkImage                             image = VK_NULL_HANDLE;
+        ImageMemory                         memory;
+        VkImageView                         view = VK_NULL_HANDLE;
+        VkDeviceSize                        bytes = 0;
+    };
+
+    static uint32_t mipWidth(const Texture& tex, uint32_t level) { return std::max(1u, tex.width >> std::min(level, tex.mip_count - 1)); }
+    static uint32_t mipHeight(const Texture& tex, uint32_t level) { return std::max(1u, tex.height >> std::min(level, tex.mip_count - 1)); }
+
+    // Bytes of levels [first, end) in system memory
+    static VkDeviceSize levelBytes(const Texture& tex, uint32_t first, uint32_t end)
+    {
+        VkDeviceSize bytes = 0;
+        for (uint32_t level = first; level < std::min(end, tex.mip_count); level++) bytes += tex.mips[level].size();
+        return bytes;
+    }
+
+    // Estimated GPU size with `resident` and every smaller level resident
+    static VkDeviceSize chainBytes(const Texture& tex, uint32_t resident) { return levelBytes(tex, resident, tex.mip_count); }
+
+    VkDeviceSize plannedBytes() const
+    {
+        VkDeviceSize bytes = 0;
+        for (const auto& tex : textures) bytes += chainBytes(tex, tex.planned);
+        return bytes;
+    }
+
+    // Drops the most detailed planned level of the least recently used texture that can spare one: anything
+    // not used this frame, or holding more detail than it asked for. `anything` also allows textures in use.
+    bool evictOne(uint64_t frame, TextureId keep, bool anything, VkDeviceSize& planned_bytes)
+    {
+        int victim = -1;
+        for (TextureId id = 0; id < textures.size(); id++)
+        {
+            const Texture& tex = textures[id];
+            if (id == keep || tex.planned >= tex.tail_mip) continue;
+            bool spare = (tex.last_used != frame) || (tex.planned < tex.wanted);
+            if (!spare && !anything) continue;
+            if (victim < 0 || tex.last_used < textures[victim].last_used) victim = static_cast<int>(id);
+        }
+        if (victim < 0) return false;
+
+        Texture& tex = textures[victim];
+        planned_bytes -= tex.mips[tex.planned].size();
+        tex.planned++;
+        stats.level_evictions++;
+        return true;
+    }
+
+    // Rebuilds every texture whose planned range differs from what's resident
+    bool applyPlan(VkCommandBuffer cb, VkDeviceSize staging_bytes)
+    {
+        bool changed = false;
+        for (const auto& tex : textures) changed |= (tex.planned != tex.resident);
+        if (!changed) return false;
+
+        // Next staging region round, once the GPU is done with its last frame - normally it already is, since
+        // the caller waited for this frame slot
+        VkDeviceSize offset = 0;
+        if (staging_bytes > 0)
+        {
+            reserveStaging(staging_bytes);
+            staging.region = (staging.region + 1) % static_cast<uint32_t>(staging.region_retire.size());
+            timeline->wait(staging.region_retire[staging.region]);
+            staging.pending = true;
+            offset = staging.region * staging.region_size;
+        }
+        uint8_t* mapped = staging.mapped;
+
+        for (auto& tex : textures)
+        {
+            if (tex.planned == tex.resident) continue;
+            uint32_t first = tex.planned;
+            uint32_t levels = tex.mip_count - first;
+
+            VkImage image;
+            ImageMemory memory;
+            VkImageView view;
+            VkDeviceSize bytes = createImage(mipWidth(tex, first), mipHeight(tex, first), levels, image, memory, view);
+            transitionImage(cb, image, VK_IMAGE_ASPECT_COLOR_BIT, ResourceUsage::Undefined, ResourceUsage::TransferDst);
+
+            // Levels both images have come from the old one; the rest from system memory
+            uint32_t kept_from = std::max(first, tex.resident);
+            if (VK_NULL_HANDLE != tex.image && kept_from < tex.mip_count)
+            {
+                transitionImage(cb, tex.image, VK_IMAGE_ASPECT_COLOR_BIT, ResourceUsage::SampledFragment, ResourceUsage::TransferSrc);
+                std::vector<VkImageCopy> copies;
+                for (uint32_t level = kept_from; level < tex.mip_count; level++)
+                {
+                    VkImageCopy copy{};
+                    copy.srcSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, level - tex.resident, 0, 1 };
+                    copy.dstSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, level - first, 0, 1 };
+                    copy.extent = { mipWidth(tex, level), mipHeight(tex, level), 1 };
+                    copies.push_back(copy);
+                }
+                vkCmdCopyImage(cb, tex.image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                               static_cast<uint32_t>(copies.size()), copies.data());
+            }
+
+            std::vector<VkBufferImageCopy> uploads;
+            for (uint32_t level = first; level < std::min(tex.resident, tex.mip_count); level++)
+            {
+                memcpy(mapped + offset, tex.mips[level].data(), tex.mips[level].size());
+                VkBufferImageCopy bic{};
+                bic.bufferOffset = offset;
+                bic.imageSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, level - first, 0, 1 };
+                bic.imageExtent = { mipWidth(tex, level), mipHeight(tex, level), 1 };
+                uploads.push_back(bic);
+                offset += tex.mips[level].size();     // RGBA8, so always 4-byte aligned
+                stats.level_uploads++;
+                stats.bytes_uploaded += tex.mips[level].size();
+            }
+            if (!uploads.empty())
+            {
+                vkCmdCopyBufferToImage(cb, staging.buffer, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                                       static_cast<uint32_t>(uploads.size()), uploads.data());
+            }
+            transitionImage(cb, image, VK_IMAGE_ASPECT_COLOR_BIT, ResourceUsage::TransferDst, ResourceUsage::SampledFragment);
+
+            if (VK_NULL_HANDLE != tex.image)
+            {
+                VkImage old_image = tex.image;
+                ImageMemory old_memory = tex.memory;
+                VkImageView old_view = tex.view;
+                retired.push_back([this, old_image, old_memory, old_view]() { destroyImage(old_image, old_memory, old_view); });
+                retired_views.push_back(old_view);
+            }
+            tex.image = image;
+            tex.memory = memory;
+            tex.view = view;
+            tex.bytes = bytes;
+            tex.resident = first;
+        }
+        return true;
+    }
+
+    VkDeviceSize currentBudget() const
+    {
+        if (!use_budget_ext) return budget;
+
+        VkPhysicalDeviceMemoryBudgetPropertiesEXT heap_budget = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_BUDGET_PROPERTIES_EXT, nullptr };
+        VkPhysicalDeviceMemoryProperties2 props = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_PROPERTIES_2, &heap_budget };
+        vkGetPhysicalDeviceMemoryProperties2(physical_device, &props);
+        uint32_t heap = props.memoryProperties.memoryTypes[deviceLocalType(props.memoryProperties, ~0u)].heapIndex;
+
+        // Keep 10% of the heap's budget spare, and leave everyone else's usage where it is
+        VkDeviceSize ours = blockBytes();
+        VkDeviceSize others = (heap_budget.heapUsage[heap] > ours) ? heap_budget.heapUsage[heap] - ours : 0;
+        VkDeviceSize usable = heap_budget.heapBudget[heap] / 10 * 9;
+        return std::min(budget, (usable > others) ? usable - others : 0);
+    }
+
+    static uint32_t deviceLocalType(const VkPhysicalDeviceMemoryProperties& props, uint32_t type_bits)
+    {
+        for (uint32_t i = 0; i < props.memoryTypeCount; i++)
+        {
+            if ((type_bits & (1 << i)) && (props.memoryTypes[i].propertyFlags & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT)) return i;
+        }
+        throw std::runtime_error("No device-local memory type for streamed texture");
+    }
+
+    VkDeviceSize createImage(uint32_t width, uint32_t height, uint32_t levels, VkImage& image, ImageMemory& memory, VkImageView& view)
+    {
+        VkImageCreateInfo ici = { VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO, nullptr };
+        ici.imageType       = VK_IMAGE_TYPE_2D;
+        ici.format          = VK_FORMAT_R8G8B8A8_SRGB;
+        ici.extent          = { width, height, 1 };
+        ici.mipLevels       = levels;
+        ici.arrayLayers     = 1;
+        ici.samples         = VK_SAMPLE_COUNT_1_BIT;
+        ici.tiling          = VK_IMAGE_TILING_OPTIMAL;
+        ici.usage           = VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+        ici.sharingMode     = VK_SHARING_MODE_EXCLUSIVE;
+        ici.initialLayout   = VK_IMAGE_LAYOUT_UNDEFINED;
+        if (VK_SUCCESS != vkCreateImage(device, &ici, nullptr, &image)) throw std::runtime_error("Failed to create streamed texture image");
+
+        VkMemoryRequirements mem_req;
+        vkGetImageMemoryRequirements(device, image, &mem_req);
+        VkDeviceSize memory_offset = allocateImageMemory(mem_req, memory);
+        vkBindImageMemory(device, image, blocks[memory.block].memory, memory_offset);
+
+        VkImageViewCreateInfo ci = { VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO, nullptr };
+        ci.image = image;
+        ci.viewType = VK_IMAGE_VIEW_TYPE_2D;
+        ci.format = VK_FORMAT_R8G8B8A8_SRGB;
+        ci.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, levels, 0, 1 };
+        if (VK_SUCCESS != vkCreateImageView(device, &ci, nullptr, &view)) throw std::runtime_error("Failed to create streamed texture view");
+        return mem_req.size;
+    }
+
+    // Best fit among the blocks of the right memory type, or a new block. Returns the byte offset to bind at.
+    VkDeviceSize allocateImageMemory(const VkMemoryRequirements& mem_req, ImageMemory& memory)
+    {
+        VkPhysicalDeviceMemoryProperties mem_props;
+        vkGetPhysicalDeviceMemoryProperties(physical_device, &mem_props);
+        uint32_t type = deviceLocalType(mem_props, mem_req.memoryTypeBits);
+
+        // Alignments past a granule are met by over-allocating and aligning the start up within the range
+        VkDeviceSize padded = mem_req.size + ((mem_req.alignment > memory_unit) ? mem_req.alignment - memory_unit : 0);
+        uint32_t units = static_cast<uint32_t>((padded + memory_unit - 1) / memory_unit);
+
+        memory.offset = FreeListAllocator::invalid;
+        for (uint32_t b = 0; b < blocks.size() && FreeListAllocator::invalid == memory.offset; b++)
+        {
+            if (blocks[b].type != type) continue;
+            memory.block = b;
+            memory.offset = blocks[b].ranges.allocate(units);
+        }
+        if (FreeListAllocator::invalid == memory.offset)
+        {
+            // No bigger than the budget, so a small budget doesn't hold much more memory than it allows for
+            MemoryBlock block;
+            VkDeviceSize budget_units = (budget + memory_unit - 1) / memory_unit;
+            block.size = std::max(std::min(block_size / memory_unit, budget_units), VkDeviceSize(units)) * memory_unit;
+            block.type = type;
+            block.ranges.init(static_cast<uint32_t>(block.size / memory_unit));
+            VkMemoryAllocateInfo ai = { VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO, nullptr };
+            ai.allocationSize = block.size;
+            ai.memoryTypeIndex = type;
+            runtime_counters.device_allocations++;
+            if (VK_SUCCESS != vkAllocateMemory(device, &ai, nullptr, &block.memory)) throw std::runtime_error("Failed to allocate streamed texture memory");
+            memory.block = static_cast<uint32_t>(blocks.size());
+            memory.offset = block.ranges.allocate(units);
+            blocks.push_back(std::move(block));
+        }
+
+        VkDeviceSize alignment = std::max(mem_req.alignment, VkDeviceSize(1));
+        return (VkDeviceSize(memory.offset) * memory_unit + alignment - 1) / alignment * alignment;
+    }
+
+    VkDeviceSize blockBytes() const
+    {
+        VkDeviceSize bytes = 0;
+        for (const auto& block : blocks) bytes += block.size;
+        return bytes;
+    }
+
+    // Makes sure a region holds `bytes`. Growing replaces the ring, and the old one goes with this update's retirees.
+    void reserveStaging(VkDeviceSize bytes)
+    {
+        VkDeviceSize region_size = std::max({ bytes, upload_limit, largest_upload });
+        if (region_size <= staging.region_size) return;
+
+        if (VK_NULL_HANDLE != staging.buffer)
+        {
+            VkBuffer old_buffer = staging.buffer;
+            VkDeviceMemory old_memory = staging.memory;
+            retired.push_back([this, old_buffer, old_memory]() { destroyStaging(old_buffer, old_memory); });
+        }
+
+        uint32_t regions = static_cast<uint32_t>(staging.region_retire.size());
+        VkBufferCreateInfo bci = { VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO, nullptr };
+        bci.size = region_size * regions;
+        bci.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+        bci.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+        if (VK_SUCCESS != vkCreateBuffer(device, &bci, nullptr, &staging.buffer)) throw std::runtime_error("Failed to create texture staging buffer");
+
+        VkMemoryRequirements mem_req;
+        vkGetBufferMemoryRequirements(device, staging.buffer, &mem_req);
+        VkPhysicalDeviceMemoryProperties mem_props;
+        vkGetPhysicalDeviceMemoryProperties(physical_device, &mem_props);
+        VkMemoryPropertyFlags wanted = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+        VkMemoryAllocateInfo ai = { VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO, nullptr };
+        ai.allocationSize = mem_req.size;
+        ai.memoryTypeIndex = UINT32_MAX;
+        for (uint32_t i = 0; i < mem_props.memoryTypeCount && UINT32_MAX == ai.memoryTypeIndex; i++)
+        {
+            if ((mem_req.memoryTypeBits & (1 << i)) && (mem_props.memoryTypes[i].propertyFlags & wanted) == wanted) ai.memoryTypeIndex = i;
+        }
+        runtime_counters.device_allocations++;
+        if (UINT32_MAX == ai.memoryTypeIndex || VK_SUCCESS != vkAllocateMemory(device, &ai, nullptr, &staging.memory))
+        {
+            throw std::runtime_error("Failed to allocate texture staging memory");
+        }
+        vkBindBufferMemory(device, staging.buffer, staging.memory, 0);
+        vkMapMemory(device, staging.memory, 0, VK_WHOLE_SIZE, 0, reinterpret_cast<void**>(&staging.mapped));
+
+        // The new ring has never been used, so every region is free
+        staging.region_size = region_size;
+        staging.region_retire.assign(regions, 0);
+    }
+
+    void destroyStaging(VkBuffer buffer, VkDeviceMemory memory)
+    {
+        if (VK_NULL_HANDLE == buffer) return;
+        vkDestroyBuffer(device, buffer, nullptr);
+        vkFreeMemory(device, memory, nullptr);     // implicitly unmapped
+    }
+
+    void destroyImage(VkImage image, const ImageMemory& memory, VkImageView view)
+    {
+        vkDestroyImageView(device, view, nullptr);
+        vkDestroyImage(device, image, nullptr);
+        if (FreeListAllocator::invalid != memory.offset) blocks[memory.block].ranges.free(memory.offset);    // none if never loaded
+    }
+
+    VkDevice                            device = VK_NULL_HANDLE;
+    VkPhysicalDevice                    physical_device = VK_NULL_HANDLE;
+    VkDeviceSize                        budget = 0;
+    VkDeviceSize                        upload_limit = 0;
+    bool                                use_budget_ext = false;
+    GpuTimeline*                        timeline = nullptr;
+    std::vector<Texture>                textures;
+    std::vector<MemoryBlock>            blocks;
+    StagingRing                         staging;
+    VkDeviceSize                        largest_upload = 0;     // biggest level, or tail chain, any texture uploads at once
+    std::vector<std::function<void()>>  retired;        // replaced by the last update(), waiting for retire()
+    std::vector<VkImageView>            retired_views;  // ...and the views among them, for retire() to evict
+    Stats                               stats;
+    std::chrono::steady_clock::time_point start_time;
+};
+
+/////////////////////////////////////////////////////////////
+// Meshlets
+/////////////////////////////////////////////////////////////
+
+// A cluster of up to MESHLET_MAX_TRIANGLES triangles over at most MESHLET_MAX_VERTICES vertices, drawn as one
+// contiguous index range. Culled as a unit in compute (matches Meshlet in cluster_cull.glsl).
+struct Meshlet
+{
+    glm::vec4   sphere;             // object space bounding sphere: center, radius
+    glm::vec4   cone;               // normal cone: axis, and the cutoff the cull test uses (1 - never backfacing)
+    uint32_t    first_index = 0;
+    uint32_t    index_count = 0;
+    int32_t     vertex_offset = 0;
+    uint32_t    pad = 0;
+};
+
+// Splits a triangle list into meshlets, reordering `tri_indices` so each meshlet's triangles are contiguous.
+// Meshlets grow across shared vertices, taking whichever neighbouring triangle adds fewest new vertices, which keeps
+// them compact so their bounds and normal cones are tight. first_index is relative to the start of tri_indices.
+inline void buildMeshlets(const std::vector<Vertex>& mesh_vertices, std::vector<uint16_t>& tri_indices, std::vector<Meshlet>& meshlets)
+{
+    PROFILE_FUNCTION();
+    uint32_t tri_count = static_cast<uint32_t>(tri_indices.size() / 3);
+    std::vector<std::vector<uint32_t>> vertex_tris(mesh_vertices.size());
+    for (uint32_t t = 0; t < tri_count; t++)
+    {
+        for (uint32_t k = 0; k < 3; k++) vertex_tris[tri_indices[t * 3 + k]].push_back(t);
+    }
+
+    std::vector<uint16_t> ordered;
+    ordered.reserve(tri_indices.size());
+    std::vector<bool> emitted(tri_count, false);
+    std::vector<uint32_t> vertex_meshlet(mesh_vertices.size(), UINT32_MAX);    // meshlet a vertex was last added to
+    uint32_t seed = 0;
+    while (ordered.size() < tri_indices.size())
+    {
+        while (emitted[seed]) seed++;
+        uint32_t id = static_cast<uint32_t>(meshlets.size());
+        std::vector<uint32_t> verts, tris, candidates = { seed };
+
+        for (;;)
+        {
+            // Cheapest candidate that still fits
+            uint32_t best = UINT32_MAX, best_new = UINT32_MAX;
+            for (uint32_t t : candidates)
+            {
+                if (emitted[t]) continue;
+                uint32_t added = 0;
+                for (uint32_t k = 0; k < 3; k++) added += (vertex_meshlet[tri_indices[t * 3 + k]] != id) ? 1 : 0;
+                if (verts.size() + added <= MESHLET_MAX_VERTICES && added < best_new)
+                {
+                    best = t;
+                    best_new = added;
+                }
+            }
+            if (UINT32_MAX == best) break;
+
+            emitted[best] = true;
+            tris.push_back(best);
+            for (uint32_t k = 0; k < 3; k++)
+            {
+                uint32_t v = tri_indices[best * 3 + k];
+                if (vertex_meshlet[v] == id) continue;
+                vertex_meshlet[v] = id;
+                verts.push_back(v);
+                candidates.insert(candidates.end(), vertex_tris[v].begin(), vertex_tris[v].end());
+            }
+            if (tris.size() == MESHLET_MAX_TRIANGLES) break;
+            candidates.erase(std::remove_if(candidates.begin(), candidates.end(), [&](uint32_t t) { return emitted[t]; }), candidates.end());
+        }
+
+        // Bounds: box center and the furthest vertex from it
+        glm::vec3 lo(FLT_MAX), hi(-FLT_MAX);
+        for (uint32_t v : verts)
+        {
+            lo = glm::min(lo, mesh_vertices[v].pos);
+            hi = glm::max(hi, mesh_vertices[v].pos);
+        }
+        glm::vec3 center = (lo + hi) * 0.5f;
+        float radius = 0.0f;
+        for (uint32_t v : verts) radius = std::max(radius, glm::length(mesh_vertices[v].pos - center));
+
+        // Normal cone: the mean facing, and how far the triangles stray from it. The cutoff is the sine of that
+        // spread - a view direction within 90 degrees minus the spread of the axis sees only back faces.
+        std::vector<glm::vec3> normals;
+        glm::vec3 axis(0.0f);
+        for (uint32_t t : tris)
+        {
+            const glm::vec3& p0 = mesh_vertices[tri_indices[t * 3]].pos;
+            glm::vec3 n = glm::cross(mesh_vertices[tri_indices[t * 3 + 1]].pos - p0, mesh_vertices[tri_indices[t * 3 + 2]].pos - p0);
+            if (glm::length(n) <= 0.0f) continue;
+            normals.push_back(glm::normalize(n));
+            axis += normals.back();
+        }
+        float cutoff = 1.0f;
+        if (glm::length(axis) > 0.0f)
+        {
+            axis = glm::normalize(axis);
+            float min_dot = 1.0f;
+            for (const auto& n : normals) min_dot = std::min(min_dot, glm::dot(axis, n));
+            if (min_dot > 0.1f) cutoff = std::sqrt(1.0f - min_dot * min_dot);   // near-hemisphere cones never cull
+        }
+
+        Meshlet m;
+        m.sphere = glm::vec4(center, radius);
+        m.cone = glm::vec4(axis, cutoff);
+        m.first_index = static_cast<uint32_t>(ordered.size());
+        m.index_count = static_cast<uint32_t>(tris.size() * 3);
+        for (uint32_t t : tris) ordered.insert(ordered.end(), &tri_indices[t * 3], &tri_indices[t * 3] + 3);
+        meshlets.push_back(m);
+    }
+    tri_indices.swap(ordered);
+}
+
+/////////////////////////////////////////////////////////////
+// Mesh LOD
+/////////////////////////////////////////////////////////////
+
+// One level of detail: a range of the shared index buffer, and how far (in object space) it strays from the full mesh.
+// The range is in meshlet order, so it's also the concatenation of the LOD's meshlets.
+struct MeshLod
+{
+    uint32_t first_index = 0;
+    uint32_t index_count = 0;
+    float    error = 0.0f;
+    uint32_t first_meshlet = 0;
+    uint32_t meshlet_count = 0;
+};
+
+// A mesh's place in the shared vertex and index arrays (or buffers, once in the GeometryPool). Its LODs all index the
+// same vertices, most detailed first.
+struct Mesh
+{
+    std::string             name;
+    int32_t                 vertex_offset = 0;
+    uint32_t                vertex_count = 0;
+    float                   radius = 0.0f;      // bounding sphere about the object space origin
+    std::vector<MeshLod>    lods;
+};
+
+// Quadric error metric simplification (Garland & Heckbert) by half-edge collapse: a vertex only ever moves onto one of
+// its neighbours, so every LOD can index the original vertex buffer. Quadrics accumulate across calls, so successive
+// simplify() calls give successively coarser LODs, each with its error measured against the original surface.
+class MeshSimplifier
+{
+public:
+    MeshSimplifier(const std::vector<Vertex>& vertices, const std::vector<uint16_t>& mesh_indices)
+        : positions(vertices.size()), quadrics(vertices.size()), locked(vertices.size(), false), indices(mesh_indices.begin(), mesh_indices.end())
+    {
+        for (size_t i = 0; i < vertices.size(); i++) positions[i] = vertices[i].pos;
+
+        // Vertices that share a position are attribute seams - moving one would tear the surface open
+        std::vector<uint32_t> order(vertices.size());
+        for (uint32_t i = 0; i < order.size(); i++) order[i] = i;
+        auto less = [this](uint32_t a, uint32_t b)
+        {
+            const glm::vec3& pa = positions[a];
+            const glm::vec3& pb = positions[b];
+            return (pa.x != pb.x) ? pa.x < pb.x : (pa.y != pb.y) ? pa.y < pb.y : pa.z < pb.z;
+        };
+        std::sort(order.begin(), order.end(), less);
+        for (size_t i = 1; i < order.size(); i++)
+        {
+            if (positions[order[i]] == positions[order[i - 1]]) locked[order[i]] = locked[order[i - 1]] = true;
+        }
+
+        // Each vertex starts with the planes of the triangles around it, weighted by area
+        std::unordered_map<uint64_t, uint32_t> edge_uses;
+        for (size_t t = 0; t < indices.size(); t += 3)
+        {
+            glm::dvec3 n = triangleNormal(indices[t], indices[t + 1], indices[t + 2]);
+            double area = glm::length(n) * 0.5;
+            if (area <= 0.0) continue;
+            n = glm::normalize(n);
+            Quadric q = Quadric::plane(n, -glm::dot(n, glm::dvec3(positions[indices[t]])), area);
+            for (uint32_t k = 0; k < 3; k++)
+            {
+                quadrics[indices[t + k]] += q;
+                edge_uses[edgeKey(indices[t + k], indices[t + (k + 1) % 3])]++;
+            }
+        }
+
+        // Open edges also get a plane through them, perpendicular to their triangle, so borders keep their shape
+        for (size_t t = 0; t < indices.size(); t += 3)
+        {
+            glm::dvec3 n = triangleNormal(indices[t], indices[t + 1], indices[t + 2]);
+            if (glm::length(n) <= 0.0) continue;
+            for (uint32_t k = 0; k < 3; k++)
+            {
+                uint32_t a = indices[t + k], b = indices[t + (k + 1) % 3];
+                if (edge_uses[edgeKey(a, b)] != 1) continue;
+                glm::dvec3 edge = glm::dvec3(positions[b]) - glm::dvec3(positions[a]);
+                glm::dvec3 side = glm::cross(edge, n);
+                if (glm::length(side) <= 0.0) continue;
+                side = glm::normalize(side);
+                Quadric q = Quadric::plane(side, -glm::dot(side, glm::dvec3(positions[a])), glm::dot(edge, edge) * border_weight);
+                quadrics[a] += q;
+                quadrics[b] += q;
+            }
+        }
+    }
+
+    // Collapses edges, cheapest first, until at most target_index_count indices remain or the next collapse would move
+    // the surface further than max_error. Returns the error of the result.
+    float simplify(size_t target_index_count, float max_error)
+    {
+        PROFILE_FUNCTION();
+        double max_cost = double(max_error) * max_error;
+        while (indices.size() > target_index_count)
+        {
+            std::vector<std::vector<uint32_t>> vertex_tris(positions.size());
+            for (uint32_t t = 0; t < indices.size() / 3; t++)
+            {
+                for (uint32_t k = 0; k < 3; k++) vertex_tris[indices[t * 3 + k]].push_back(t);
+            }
+
+            // Every edge once, in whichever direction is cheaper
+            std::vector<std::pair<uint32_t, uint32_t>> edges;
+            for (size_t t = 0; t < indices.size(); t += 3)
+            {
+                for (uint32_t k = 0; k < 3; k++)
+                {
+                    uint32_t a = indices[t + k], b = indices[t + (k + 1) % 3];
+                    edges.push_back({ std::min(a, b), std::max(a, b) });
+                }
+            }
+            std::sort(edges.begin(), edges.end());
+            edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+
+            std::vector<Collapse> collapses;
+            for (const auto& edge : edges)
+            {
+                double cost_ab = locked[edge.first] ? DBL_MAX : collapseCost(edge.first, edge.second);
+                double cost_ba = locked[edge.second] ? DBL_MAX : collapseCost(edge.second, edge.first);
+                if (DBL_MAX == std::min(cost_ab, cost_ba)) continue;
+                collapses.push_back((cost_ab <= cost_ba) ? Collapse{ edge.first, edge.second, cost_ab } : Collapse{ edge.second, edge.first, cost_ba });
+            }
+            if (collapses.empty()) break;
+            std::sort(collapses.begin(), collapses.end(), [](const Collapse& a, const Collapse& b) { return a.cost < b.cost; });
+
+            // Each collapse removes about two triangles. Nothing dearer than the one that would reach the target is
+            // taken this pass - locking neighbours leaves plenty of cheaper candidates for the next.
+            size_t tris_needed = (indices.size() - target_index_count + 2) / 3;
+            double pass_limit = collapses[std::min(collapses.size() - 1, tris_needed / 2)].cost;
+
+            std::vector<bool> touched(positions.size(), false);
+            std::vector<bool> dead(indices.size() / 3, false);
+            size_t removed = 0;
+            for (const Collapse& c : collapses)
+            {
+                if (removed >= tris_needed || c.cost > pass_limit || c.cost > max_cost) break;
+                if (touched[c.from] || touched[c.to] || !canCollapse(c.from, c.to, vertex_tris)) continue;
+
+                for (uint32_t t : vertex_tris[c.from])
+                {
+                    uint32_t* tri = &indices[t * 3];
+                    if (tri[0] == c.to || tri[1] == c.to || tri[2] == c.to)
+                    {
+                        dead[t] = true;
+                        removed++;
+                    }
+                    for (uint32_t k = 0; k < 3; k++) if (tri[k] == c.from) tri[k] = c.to;
+                }
+                quadrics[c.to] += quadrics[c.from];
+                error = std::max(error, c.cost);
+
+                // Triangles around either end have changed - anything else touching them waits for the next pass
+                for (uint32_t v : { c.from, c.to })
+                {
+                    for (uint32_t t : vertex_tris[v])
+                    {
+                        for (uint32_t k = 0; k < 3; k++) touched[indices[t * 3 + k]] = true;
+                    }
+                }
+            }
+            if (0 == removed) break;
+
+            std::vector<uint32_t> kept;
+            kept.reserve(indices.size());
+            for (uint32_t t = 0; t < dead.size(); t++)
+            {
+                if (!dead[t]) kept.insert(kept.end(), &indices[t * 3], &indices[t * 3] + 3);
+            }
+            indices.swap(kept);
+        }
+        return static_cast<float>(std::sqrt(error));
+    }
+
+    const std::vector<uint32_t>& result() const { return indices; }
+
+private:
+    static constexpr double border_weight = 10.0;
+
+    // Symmetric 4x4 matrix summing squared distances to a set of planes, plus their total weight
+    struct Quadric
+    {
+        double a2 = 0, ab = 0, ac = 0, ad = 0, b2 = 0, bc = 0, bd = 0, c2 = 0, cd = 0, d2 = 0, w = 0;
+
+        static Quadric plane(const glm::dvec3& n, double d, double weight)
+        {
+            Quadric q;
+            q.a2 = n.x * n.x * weight; q.ab = n.x * n.y * weight; q.ac = n.x * n.z * weight; q.ad = n.x * d * weight;
+            q.b2 = n.y * n.y * weight; q.bc = n.y * n.z * weight; q.bd = n.y * d * weight;
+            q.c2 = n.z * n.z * weight; q.cd = n.z * d * weight;
+            q.d2 = d * d * weight;
+            q.w = weight;
+            return q;
+        }
+
+        void operator+=(const Quadric& q)
+        {
+            a2 += q.a2; ab += q.ab; ac += q.ac; ad += q.ad; b2 += q.b2; bc += q.bc; bd += q.bd; c2 += q.c2; cd += q.cd; d2 += q.d2; w += q.w;
+        }
+
+        // Weighted mean squared distance from p to the planes
+        double evaluate(const glm::dvec3& p) const
+        {
+            double e = a2 * p.x * p.x + 2 * ab * p.x * p.y + 2 * ac * p.x * p.z + 2 * ad * p.x
+                     + b2 * p.y * p.y + 2 * bc * p.y * p.z + 2 * bd * p.y
+                     + c2 * p.z * p.z + 2 * cd * p.z + d2;
+            return (w > 0.0) ? std::max(e, 0.0) / w : 0.0;
+        }
+    };
+
+    struct Collapse
+    {
+        uint32_t from;
+        uint32_t to;
+        double   cost;
+    };
+
+    static uint64_t edgeKey(uint32_t a, uint32_t b) { return (uint64_t(std::min(a, b)) << 32) | std::max(a, b); }
+
+    glm::dvec3 triangleNormal(uint32_t a, uint32_t b, uint32_t c) const
+    {
+        glm::dvec3 pa(positions[a]), pb(positions[b]), pc(positions[c]);
+        return glm::cross(pb - pa, pc - pa);
+    }
+
+    double collapseCost(uint32_t from, uint32_t to) const
+    {
+        Quadric q = quadrics[from];
+        q += quadrics[to];
+        return q.evaluate(glm::dvec3(positions[to]));
+    }
+
+    // Rejects collapses that would make the surface non-manifold or turn a triangle over
+    bool canCollapse(uint32_t from, uint32_t to, const std::vector<std::vector<uint32_t>>& vertex_tris) const
+    {
+        // Link condition: the two ends may only share the neighbours opposite the edge
+        std::vector<uint32_t> from_ring, to_ring;
+        uint32_t shared_tris = 0;
+        for (uint32_t t : vertex_tris[from])
+        {
+            const uint32_t* tri = &indices[t * 3];
+            if (tri[0] == to || tri[1] == to || tri[2] == to) shared_tris++;
+            for (uint32_t k = 0; k < 3; k++) if (tri[k] != from && tri[k] != to) from_ring.push_back(tri[k]);
+        }
+        for (uint32_t t : vertex_tris[to])
+        {
+            const uint32_t* tri = &indices[t * 3];
+            for (uint32_t k = 0; k < 3; k++) if (tri[k] != from && tri[k] != to) to_ring.push_back(tri[k]);
+        }
+        std::sort(from_ring.begin(), from_ring.end());
+        from_ring.erase(std::unique(from_ring.begin(), from_ring.end()), from_ring.end());
+        std::sort(to_ring.begin(), to_ring.end());
+        to_ring.erase(std::unique(to_ring.begin(), to_ring.end()), to_ring.end());
+        std::vector<uint32_t> common;
+        std::set_intersection(from_ring.begin(), from_ring.end(), to_ring.begin(), to_ring.end(), std::back_inserter(common));
+        if (common.size() != shared_tris) return false;
+
+        // No remaining triangle may face the other way once `from` has moved
+        for (uint32_t t : vertex_tris[from])
+        {
+            const uint32_t* tri = &indices[t * 3];
+            if (tri[0] == to || tri[1] == to || tri[2] == to) continue;     // collapses away
+            glm::dvec3 before = triangleNormal(tri[0], tri[1], tri[2]);
+            glm::dvec3 after = triangleNormal(tri[0] == from ? to : tri[0], tri[1] == from ? to : tri[1], tri[2] == from ? to : tri[2]);
+            if (glm::dot(before, after) <= 0.0) return false;
+        }
+        return true;
+    }
+
+    std::vector<glm::vec3>  positions;
+    std::vector<Quadric>    quadrics;
+    std::vector<bool>       locked;
+    std::vector<uint32_t>   indices;        // current triangles, in original vertex numbering
+    double                  error = 0.0;    // largest collapse cost so far, as a mean squared distance
+};
+
+// Collects meshes into one vertex and one index array, building each mesh's LOD chain on the way. Each LOD aims for
+// half the triangles of the one before; the chain stops early once simplification stops paying. Every LOD is also
+// split into meshlets.
+class MeshLodBuilder
+{
+public:
+    uint32_t add(const std::string& name, const std::vector<Vertex>& mesh_vertices, const std::vector<uint16_t>& mesh_indices, uint32_t max_lods)
+    {
+        PROFILE_FUNCTION();
+        Mesh mesh;
+        mesh.name = name;
+        mesh.vertex_offset = static_cast<int32_t>(all_vertices.size());
+        mesh.vertex_count = static_cast<uint32_t>(mesh_vertices.size());
+        for (const auto& v : mesh_vertices) mesh.radius = std::max(mesh.radius, glm::length(v.pos));
+        all_vertices.insert(all_vertices.end(), mesh_vertices.begin(), mesh_vertices.end());
+        appendLod(mesh, mesh_vertices, mesh_indices, 0.0f);
+
+        MeshSimplifier simplifier(mesh_vertices, mesh_indices);
+        while (mesh.lods.size() < max_lods)
+        {
+            uint32_t prev_count = mesh.lods.back().index_count;
+            float error = simplifier.simplify(prev_count / 6 * 3, FLT_MAX);
+            const std::vector<uint32_t>& simplified = simplifier.result();
+            if (simplified.size() > prev_count * 8 / 10) break;     // under 20% fewer - not worth a level
+            appendLod(mesh, mesh_vertices, std::vector<uint16_t>(simplified.begin(), simplified.end()), error);
+        }
+
+        mesh_list.push_back(std::move(mesh));
+        return static_cast<uint32_t>(mesh_list.size() - 1);
+    }
+
+    const std::vector<Vertex>& vertices() const { return all_vertices; }
+    const std::vector<uint16_t>& indices() const { return all_indices; }
+    const std::vector<Mesh>& meshes() const { return mesh_list; }
+    const std::vector<Meshlet>& meshlets() const { return all_meshlets; }
+
+    void printReport() const
+    {
+        std::cout << std::endl << "Mesh LODs:" << std::endl;
+        for (const auto& mesh : mesh_list)
+        {
+            std::cout << '\t' << mesh.name << ":";
+            for (const auto& lod : mesh.lods) std::cout << " " << lod.index_count / 3 << " tris/" << lod.meshlet_count << " meshlets (" << lod.error << ")";
+            std::cout << std::endl;
+        }
+    }
+
+private:
+    void appendLod(Mesh& mesh, const std::vector<Vertex>& mesh_vertices, std::vector<uint16_t> lod_indices, float error)
+    {
+        MeshLod lod;
+        lod.first_index = static_cast<uint32_t>(all_indices.size());
+        lod.index_count = static_cast<uint32_t>(lod_indices.size());
+        lod.error = error;
+        lod.first_meshlet = static_cast<uint32_t>(all_meshlets.size());
+
+        buildMeshlets(mesh_vertices, lod_indices, all_meshlets);
+        lod.meshlet_count = static_cast<uint32_t>(all_meshlets.size()) - lod.first_meshlet;
+        for (uint32_t i = lod.first_meshlet; i < all_meshlets.size(); i++)
+        {
+            all_meshlets[i].first_index += lod.first_index;
+            all_meshlets[i].vertex_offset = mesh.vertex_offset;
+        }
+
+        all_indices.insert(all_indices.end(), lod_indices.begin(), lod_indices.end());
+        mesh.lods.push_back(lod);
+    }
+
+    std::vector<Vertex>     all_vertices;
+    std::vector<uint16_t>   all_indices;
+    std::vector<Meshlet>    all_meshlets;
+    std::vector<Mesh>       mesh_list;
+};
+
+// A square of rolling hills on the same footprint as the quad, flat at its edges so neighbouring tiles meet without
+// cracks whatever LOD each is drawn at
+inline void makeHillsMesh(uint32_t cells, std::vector<Vertex>& mesh_vertices, std::vector<uint16_t>& mesh_indices)
+{
+    const float pi = glm::pi<float>();
+    for (uint32_t j = 0; j <= cells; j++)
+    {
+        for (uint32_t i = 0; i <= cells; i++)
+        {
+            float u = i / float(cells), v = j / float(cells);
+            float height = std::sin(pi * u) * std::sin(pi * v) * (0.12f + 0.04f * std::sin(6.0f * pi * u) * std::sin(4.0f * pi * v));
+            Vertex vtx;
+            vtx.pos = glm::vec3(u - 0.5f, v - 0.5f, height);
+            vtx.color = glm::mix(glm::vec3(0.2f, 0.5f, 0.2f), glm::vec3(1.0f), height / 0.16f);
+            vtx.texcoord = glm::vec2(1.0f - u, v);      // same mapping as the quad
+            mesh_vertices.push_back(vtx);
+        }
+    }
+
+    // Same winding as the quad
+    for (uint32_t j = 0; j < cells; j++)
+    {
+        for (uint32_t i = 0; i < cells; i++)
+        {
+            uint16_t v00 = static_cast<uint16_t>(j * (cells + 1) + i);
+            uint16_t v10 = static_cast<uint16_t>(v00 + 1);
+            uint16_t v01 = static_cast<uint16_t>(v00 + cells + 1);
+            uint16_t v11 = static_cast<uint16_t>(v01 + 1);
+            mesh_indices.insert(mesh_indices.end(), { v00, v10, v11, v00, v11, v01 });
+        }
+    }
+}
+
+/////////////////////////////////////////////////////////////
+// Geometry pool
+/////////////////////////////////////////////////////////////
+
+// Every loaded mesh's vertices, indices and meshlets, sub-allocated from one device-local buffer of each (plus packed
+// vertices, for vertex pulling). Draws need one bind between them and pick out a mesh by vertexOffset and firstIndex,
+// which indirect draws carry too. Meshes are loaded from a MeshLodBuilder, which keeps their source data.
+//
+// load() and unload() only update the free lists; update() records the uploads and moves they imply. A load that
+// doesn't fit compacts the live meshes into new buffers - grown if compacting alone won't make room - so the device
+// memory never fragments, and the old buffers are retired once the copies out of them have run.
+class GeometryPool
+{
+public:
+    using MeshId = uint32_t;
+
+    struct Stats
+    {
+        uint64_t loads = 0;
+        uint64_t unloads = 0;
+        uint64_t relocations = 0;       // compactions, growing or not
+        uint64_t bytes_uploaded = 0;
+        uint64_t bytes_moved = 0;
+    };
+
+    // Capacities are in vertices, indices and meshlets. Packed vertices are only kept with device addresses.
+    void init(VkDevice dev, VkPhysicalDevice phys, const MeshLodBuilder& source_meshes, bool device_addresses,
+              uint32_t vertex_capacity, uint32_t index_capacity, uint32_t meshlet_capacity)
+    {
+        device = dev;
+        physical_device = phys;
+        source = &source_meshes;
+        packed_vertices = device_addresses;
+        vertex_ranges.init(vertex_capacity);
+        index_ranges.init(index_capacity);
+        meshlet_ranges.init(meshlet_capacity);
+        buffers = createBuffers();
+    }
+
+    void cleanup()
+    {
+        destroyBuffers(buffers);
+        for (auto& destroy : retired) destroy();
+        retired.clear();
+        entries.clear();
+    }
+
+    MeshId load(uint32_t source_mesh)
+    {
+        PROFILE_FUNCTION();
+        Ranges need = rangesOf(source->meshes()[source_mesh]);
+        Ranges placed;
+        if (!allocate(need, placed))
+        {
+            relocate(need);
+            if (!allocate(need, placed)) throw std::runtime_error("Geometry pool has no room for " + source->meshes()[source_mesh].name);
+        }
+
+        MeshId id = static_cast<MeshId>(std::find_if(entries.begin(), entries.end(), [](const Entry& e) { return !e.live; }) - entries.begin());
+        if (id == entries.size()) entries.emplace_back();
+        Entry& entry = entries[id];
+        entry = Entry{};
+        entry.source = source_mesh;
+        entry.live = true;
+        place(entry, placed);
+        stats.loads++;
+        return id;
+    }
+
+    // The mesh's ranges are free straight away: anything recorded later that reuses them waits on the reads of it
+    // already submitted. Draws recorded after this mustn't use it.
+    void unload(MeshId id)
+    {
+        Entry& entry = entries[id];
+        Ranges placed = rangesOf(entry.mesh);
+        vertex_ranges.free(placed.vertices);
+        index_ranges.free(placed.indices);
+        meshlet_ranges.free(placed.meshlets);
+        entry.live = false;
+        stats.unloads++;
+    }
+
+    // Packs the live meshes together, leaving all the free space in one range at the end
+    void compact()
+    {
+        relocate(Ranges{});
+    }
+
+    // Records everything since the last update() into cb, which must be on the graphics queue and ahead of anything
+    // that draws. Returns true if anything was recorded.
+    bool update(VkCommandBuffer cb)
+    {
+        PROFILE_FUNCTION();
+        bool uploads = std::any_of(entries.begin(), entries.end(), [](const Entry& e) { return e.live && (!e.resident || !e.meshlets_current); });
+        if (pending_moves.empty() && !uploads) return false;
+
+        // Reads of the ranges about to be written - this frame's or earlier submits' - must finish first
+        memoryBarrier(cb, VK_PIPELINE_STAGE_2_VERTEX_ATTRIBUTE_INPUT_BIT | VK_PIPELINE_STAGE_2_INDEX_INPUT_BIT |
+                          VK_PIPELINE_STAGE_2_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, 0,
+                      VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT);
+
+        // Oldest relocation first; a later one may copy out of an earlier one's buffers
+        for (size_t r = 0; r < pending_moves.size(); r++)
+        {
+            if (r > 0)
+            {
+                memoryBarrier(cb, VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT,
+                              VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_READ_BIT);
+            }
+            for (const auto& move : pending_moves[r])
+            {
+                vkCmdCopyBuffer(cb, move.src, move.dst, static_cast<uint32_t>(move.regions.size()), move.regions.data());
+                for (const auto& region : move.regions) stats.bytes_moved += region.size;
+            }
+        }
+        pending_moves.clear();
+
+        if (uploads) recordUploads(cb);
+
+        memoryBarrier(cb, VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT,
+                      VK_PIPELINE_STAGE_2_VERTEX_ATTRIBUTE_INPUT_BIT | VK_PIPELINE_STAGE_2_INDEX_INPUT_BIT |
+                      VK_PIPELINE_STAGE_2_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+                      VK_ACCESS_2_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_2_INDEX_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_READ_BIT);
+        return true;
+    }
+
+    // Hands the buffers replaced and the staging used since the last retire() to the deletion queue, to go once
+    // retire_value completes
+    void retire(DeletionQueue& deferred, uint64_t retire_value)
+    {
+        for (auto& destroy : retired) deferred.push(retire_value, std::move(destroy));
+        retired.clear();
+    }
+
+    // Placed in this pool's buffers: vertex_offset and each LOD's first_index and first_meshlet
+    const Mesh& mesh(MeshId id) const { return entries[id].mesh; }
+    uint32_t source(MeshId id) const { return entries[id].source; }
+
+    VkBuffer vertexBuffer() const { return buffers[VERTICES].buffer; }
+    VkBuffer indexBuffer() const { return buffers[INDICES].buffer; }
+    VkBuffer meshletBuffer() const { return buffers[MESHLETS].buffer; }
+    VkDeviceAddress packedVertexAddress() const { return packed_address; }
+
+    void printStats() const
+    {
+        size_t live = std::count_if(entries.begin(), entries.end(), [](const Entry& e) { return e.live; });
+        std::cout << std::endl << "Geometry pool: " << live << " meshes" << std::endl;
+        auto ranges = [](const char* name, const FreeListAllocator& a)
+        {
+            std::cout << '\t' << name << ": " << a.used() << " of " << a.capacity() << " used, " << a.freeRanges()
+                      << " free ranges, largest " << a.largestFree() << std::endl;
+        };
+        ranges("vertices", vertex_ranges);
+        ranges("indices", index_ranges);
+        ranges("meshlets", meshlet_ranges);
+        std::cout << '\t' << stats.loads << " loads, " << stats.unloads << " unloads, " << stats.relocations << " relocations, "
+                  << stats.bytes_uploaded / 1024 << " KB uploaded, " << stats.bytes_moved / 1024 << " KB moved" << std::endl;
+    }
+
+private:
+    enum Stream { VERTICES, PACKED_VERTICES, INDICES, MESHLETS, STREAM_COUNT };
+    static constexpr VkDeviceSize element_sizes[STREAM_COUNT] = { sizeof(Vertex), sizeof(PackedVertex), sizeof(uint16_t), sizeof(Meshlet) };
+
+    // Where a mesh's data starts in each allocator, and how much of it there is
+    struct Ranges
+    {
+        uint32_t vertices = 0, vertex_count = 0;
+        uint32_t indices = 0, index_count = 0;
+        uint32_t meshlets = 0, meshlet_count = 0;
+    };
+
+    struct Entry
+    {
+        uint32_t    source = 0;                 // mesh in the MeshLodBuilder
+        bool        live = false;
+        bool        resident = false;           // vertices and indices uploaded, or being moved into place
+        bool        meshlets_current = false;   // meshlets uploaded for where the mesh is now
+        Mesh        mesh;
+    };
+
+    struct PoolBuffer
+    {
+        VkBuffer        buffer = VK_NULL_HANDLE;
+        VkDeviceMemory  memory = VK_NULL_HANDLE;
+    };
+    using Buffers = std::array<PoolBuffer, STREAM_COUNT>;
+
+    struct Move
+    {
+        VkBuffer                    src;
+        VkBuffer                    dst;
+        std::vector<VkBufferCopy>   regions;
+    };
+
+    // LODs and meshlets are contiguous per mesh, so the first and last LOD bound them
+    static Ranges rangesOf(const Mesh& mesh)
+    {
+        const MeshLod& first = mesh.lods.front();
+        const MeshLod& last = mesh.lods.back();
+        Ranges r;
+        r.vertices = static_cast<uint32_t>(mesh.vertex_offset);
+        r.vertex_count = mesh.vertex_count;
+        r.indices = first.first_index;
+        r.index_count = last.first_index + last.index_count - first.first_index;
+        r.meshlets = first.first_meshlet;
+        r.meshlet_count = last.first_meshlet + last.meshlet_count - first.first_meshlet;
+        return r;
+    }
+
+    bool allocate(const Ranges& need, Ranges& placed)
+    {
+        placed = need;
+        placed.vertices = vertex_ranges.allocate(need.vertex_count);
+        placed.indices = index_ranges.allocate(need.index_count);
+        placed.meshlets = meshlet_ranges.allocate(need.meshlet_count);
+        if (FreeListAllocator::invalid != placed.vertices && FreeListAllocator::invalid != placed.indices &&
+            FreeListAllocator::invalid != placed.meshlets)
+        {
+            return true;
+        }
+        if (FreeListAllocator::invalid != placed.vertices) vertex_ranges.free(placed.vertices);
+        if (FreeListAllocator::invalid != placed.indices) index_ranges.free(placed.indices);
+        if (FreeListAllocator::invalid != placed.meshlets) meshlet_ranges.free(placed.meshlets);
+        return false;
+    }
+
+    // The source mesh, rebased onto the ranges allocated for it
+    void place(Entry& entry, const Ranges& placed)
+    {
+        const Mesh& src = source->meshes()[entry.source];
+        Ranges from = rangesOf(src);
+        entry.mesh = src;
+        entry.mesh.vertex_offset = static_cast<int32_t>(placed.vertices);
+        for (auto& lod : entry.mesh.lods)
+        {
+            lod.first_index = lod.first_index - from.indices + placed.indices;
+            lod.first_meshlet = lod.first_meshlet - from.meshlets + placed.meshlets;
+        }
+        entry.meshlets_current = false;
+    }
+
+    // Packs every live mesh from the start of new buffers, with room for `room` more. Each allocator keeps its
+    // capacity if that's enough, and otherwise doubles until it is.
+    void relocate(const Ranges& room)
+    {
+        PROFILE_FUNCTION();
+        auto grown = [](const FreeListAllocator& a, uint32_t more)
+        {
+            uint64_t capacity = std::max(a.capacity(), 1u);
+            while (capacity < uint64_t(a.used()) + more) capacity *= 2;
+            if (capacity > UINT32_MAX) throw std::runtime_error("Geometry pool is full");
+            return static_cast<uint32_t>(capacity);
+        };
+        vertex_ranges.init(grown(vertex_ranges, room.vertex_count));
+        index_ranges.init(grown(index_ranges, room.index_count));
+        meshlet_ranges.init(grown(meshlet_ranges, room.meshlet_count));
+
+        Buffers old = buffers;
+        buffers = createBuffers();
+
+        // Vertex and index data moves on the GPU. Meshlets hold absolute offsets, so they're uploaded again instead.
+        std::array<Move, STREAM_COUNT> moves;
+        for (uint32_t s = 0; s < STREAM_COUNT; s++) moves[s] = { old[s].buffer, buffers[s].buffer, {} };
+        for (auto& entry : entries)
+        {
+            if (!entry.live) continue;
+            Ranges from = rangesOf(entry.mesh);
+            Ranges to;
+            if (!allocate(from, to)) throw std::runtime_error("Geometry pool relocation lost room");
+            if (entry.resident)
+            {
+                for (uint32_t s : { VERTICES, PACKED_VERTICES })
+                {
+                    moves[s].regions.push_back({ from.vertices * element_sizes[s], to.vertices * element_sizes[s], from.vertex_count * element_sizes[s] });
+                }
+                moves[INDICES].regions.push_back({ from.indices * element_sizes[INDICES], to.indices * element_sizes[INDICES],
+                                                   from.index_count * element_sizes[INDICES] });
+            }
+            place(entry, to);
+        }
+
+        std::vector<Move> relocation;
+        for (uint32_t s : { VERTICES, PACKED_VERTICES, INDICES })
+        {
+            if (VK_NULL_HANDLE != moves[s].src && !moves[s].regions.empty()) relocation.push_back(std::move(moves[s]));
+        }
+        pending_moves.push_back(std::move(relocation));
+        retired.push_back([this, old]() { destroyBuffers(old); });
+        stats.relocations++;
+    }
+
+    // Stages every mesh that isn't resident yet, and the meshlets of every mesh that has moved since they were written
+    void recordUploads(VkCommandBuffer cb)
+    {
+        std::vector<uint8_t> data;
+        std::array<std::vector<VkBufferCopy>, STREAM_COUNT> copies;
+        auto stage = [&](Stream s, uint32_t element, const void* src, uint32_t count)
+        {
+            VkDeviceSize bytes = count * element_sizes[s];
+            copies[s].push_back({ data.size(), element * element_sizes[s], bytes });
+            const uint8_t* p = static_cast<const uint8_t*>(src);
+            data.insert(data.end(), p, p + bytes);
+        };
+
+        for (auto& entry : entries)
+        {
+            if (!entry.live) continue;
+            Ranges from = rangesOf(source->meshes()[entry.source]);
+            Ranges to = rangesOf(entry.mesh);
+            if (!entry.resident)
+            {
+                const Vertex* vertices = source->vertices().data() + from.vertices;
+                stage(VERTICES, to.vertices, vertices, from.vertex_count);
+                if (packed_vertices)
+                {
+                    std::vector<PackedVertex> packed;
+                    packed.reserve(from.vertex_count);
+                    for (uint32_t v = 0; v < from.vertex_count; v++) packed.push_back(PackedVertex::pack(vertices[v]));
+                    stage(PACKED_VERTICES, to.vertices, packed.data(), from.vertex_count);
+                }
+                stage(INDICES, to.indices, source->indices().data() + from.indices, from.index_count);
+                entry.resident = true;
+            }
+            if (!entry.meshlets_current)
+            {
+                std::vector<Meshlet> meshlets(source->meshlets().begin() + from.meshlets, source->meshlets().begin() + from.meshlets + from.meshlet_count);
+                for (auto& m : meshlets)
+                {
+                    m.first_index = m.first_index - from.indices + to.indices;
+                    m.vertex_offset = entry.mesh.vertex_offset;
+                }
+                stage(MESHLETS, to.meshlets, meshlets.data(), from.meshlet_count);
+                entry.meshlets_current = true;
+            }
+        }
+
+        PoolBuffer staging = createBuffer(data.size(), VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                                          VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+        void* mapped;
+        vkMapMemory(device, staging.memory, 0, VK_WHOLE_SIZE, 0, &mapped);
+        memcpy(mapped, data.data(), data.size());
+        vkUnmapMemory(device, staging.memory);
+        retired.push_back([this, staging]() { destroyBuffer(staging); });
+
+        for (uint32_t s = 0; s < STREAM_COUNT; s++)
+        {
+            if (copies[s].empty()) continue;
+            vkCmdCopyBuffer(cb, staging.buffer, buffers[s].buffer, static_cast<uint32_t>(copies[s].size()), copies[s].data());
+        }
+        stats.bytes_uploaded += data.size();
+    }
+
+    Buffers createBuffers()
+    {
+        const VkBufferUsageFlags copies = VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+        Buffers created;
+        created[VERTICES] = createBuffer(vertex_ranges.capacity() * element_sizes[VERTICES], VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | copies,
+                                         VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+        if (packed_vertices)
+        {
+            created[PACKED_VERTICES] = createBuffer(vertex_ranges.capacity() * element_sizes[PACKED_VERTICES],
+                                                    VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | copies,
+                                                    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+            VkBufferDeviceAddressInfo info = { VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO, nullptr };
+            info.buffer = created[PACKED_VERTICES].buffer;
+            packed_address = vkGetBufferDeviceAddress(device, &info);
+        }
+        created[INDICES] = createBuffer(index_ranges.capacity() * element_sizes[INDICES], VK_BUFFER_USAGE_INDEX_BUFFER_BIT | copies,
+                                        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+        created[MESHLETS] = createBuffer(meshlet_ranges.capacity() * element_sizes[MESHLETS], VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | copies,
+                                         VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+        return created;
+    }
+
+    PoolBuffer createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags props)
+    {
+        PoolBuffer result;
+        VkBufferCreateInfo bci = { VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO, nullptr };
+        bci.size = std::max<VkDeviceSize>(size, 4);
+        bci.usage = usage;
+        bci.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+        if (VK_SUCCESS != vkCreateBuffer(device, &bci, nullptr, &result.buffer)) throw std::runtime_error("Failed to create geometry pool buffer");
+
+        VkMemoryRequirements mem_req;
+        vkGetBufferMemoryRequirements(device, result.buffer, &mem_req);
+        VkPhysicalDeviceMemoryProperties mem_props;
+        vkGetPhysicalDeviceMemoryProperties(physical_device, &mem_props);
+        VkMemoryAllocateInfo ai = { VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO, nullptr };
+        ai.allocationSize = mem_req.size;
+        ai.memoryTypeIndex = UINT32_MAX;
+        for (uint32_t i = 0; i < mem_props.memoryTypeCount && UINT32_MAX == ai.memoryTypeIndex; i++)
+        {
+            if ((mem_req.memoryTypeBits & (1 << i)) && (mem_props.memoryTypes[i].propertyFlags & props) == props) ai.memoryTypeIndex = i;
+        }
+
+        VkMemoryAllocateFlagsInfo flags_info = { VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_FLAGS_INFO, nullptr };
+        if (usage & VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT)
+        {
+            flags_info.flags = VK_MEMORY_ALLOCATE_DEVICE_ADDRESS_BIT;
+            ai.pNext = &flags_info;
+        }
+
+        runtime_counters.device_allocations++;
+        if (UINT32_MAX == ai.memoryTypeIndex || VK_SUCCESS != vkAllocateMemory(device, &ai, nullptr, &result.memory))
+        {
+            throw std::runtime_error("Failed to allocate geometry pool memory");
+        }
+        vkBindBufferMemory(device, result.buffer, result.memory, 0);
+        return result;
+    }
+
+    void destroyBuffer(const PoolBuffer& b)
+    {
+        vkDestroyBuffer(device, b.buffer, nullptr);
+        vkFreeMemory(device, b.memory, nullptr);
+    }
+
+    void destroyBuffers(const Buffers& pool_buffers)
+    {
+        for (const auto& b : pool_buffers) destroyBuffer(b);
+    }
+
+    static void memoryBarrier(VkCommandBuffer cb, VkPipelineStageFlags2 src_stages, VkAccessFlags2 src_access,
+                              VkPipelineStageFlags2 dst_stages, VkAccessFlags2 dst_access)
+    {
+        VkMemoryBarrier2 barrier = { VK_STRUCTURE_TYPE_MEMORY_BARRIER_2, nullptr };
+        barrier.srcStageMask = src_stages;
+        barrier.srcAccessMask = src_access;
+        barrier.dstStageMask = dst_stages;
+        barrier.dstAccessMask = dst_access;
+        VkDependencyInfo dep = { VK_STRUCTURE_TYPE_DEPENDENCY_INFO, nullptr };
+        dep.memoryBarrierCount = 1;
+        dep.pMemoryBarriers = &barrier;
+        vkCmdPipelineBarrier2(cb, &dep);
+    }
+
+    VkDevice                            device = VK_NULL_HANDLE;
+    VkPhysicalDevice                    physical_device = VK_NULL_HANDLE;
+    const MeshLodBuilder*               source = nullptr;
+    bool                                packed_vertices = false;
+    FreeListAllocator                   vertex_ranges;      // shared by the vertex and packed vertex buffers
+    FreeListAllocator                   index_ranges;
+    FreeListAllocator                   meshlet_ranges;
+    Buffers                             buffers;
+    VkDeviceAddress                     packed_address = 0;
+    std::vector<Entry>                  entries;            // by MeshId; unloaded ones are reused
+    std::vector<std::vector<Move>>      pending_moves;      // per relocation since the last update()
+    std::vector<std::function<void()>>  retired;            // replaced buffers and used staging, waiting for retire()
+    Stats                               stats;
+};
+
+/////////////////////////////////////////////////////////////
+// Startup
+/////////////////////////////////////////////////////////////
+
+// Runs init stages as a dependency graph on a small thread pool - each stage starts as soon as the stages it
+// names have finished. Stages flagged main_thread only run on the thread that calls run(), for APIs (like most
+// of GLFW) that require it. The first exception stops any further stages from starting and is rethrown by run().
+class InitGraph
+{
+public:
+    void add(const char* name, std::vector<const char*> deps, std::function<void()> fn, bool main_thread = false)
+    {
+        Stage stage;
+        stage.name = name;
+        stage.dep_names = std::move(deps);
+        stage.fn = std::move(fn);
+        stage.main_thread = main_thread;
+        stages.push_back(std::move(stage));
+    }
+
+    void run(uint32_t thread_count = 0)
+    {
+        resolveDependencies();
+
+        if (0 == thread_count) thread_count = std::max(2u, std::thread::hardware_concurrency());
+        thread_count = std::min(thread_count, static_cast<uint32_t>(stages.size()));
+        used_threads = std::max(1u, thread_count);
+
+        run_start_us = traceNowUs();
+        remaining = stages.size();
+        for (size_t i = 0; i < stages.size(); i++)
+        {
+            if (stages[i].deps.empty()) pushReady(i);
+        }
+
+        // The calling thread is worker 0
+        std::vector<std::thread> workers;
+        for (uint32_t t = 1; t < used_threads; t++)
+        {
+            workers.emplace_back([this, t]()
+            {
+                PROFILE_THREAD_NAME("init worker");
+                workLoop(t);
+            });
+        }
+        workLoop(0);
+        for (auto& worker : workers) worker.join();
+        run_end_us = traceNowUs();
+
+        if (error) std::rethrow_exception(error);
+    }
+
+    // Per-stage start/duration/thread, and the chain of stages that bounded the total
+    void printReport() const
+    {
+        double busy_us = 0.0;
+        for (const auto& stage : stages) busy_us += stage.end_us - stage.start_us;
+
+        char line[128];
+        snprintf(line, sizeof(line), "Startup: %.2f ms wall, %.2f ms of stage work on %u threads",
+                 (run_end_us - run_start_us) / 1000.0, busy_us / 1000.0, used_threads);
+        std::cout << std::endl << line << std::endl;
+        std::cout << "\t   start(ms)  time(ms)  thread  stage" << std::endl;
+
+        std::vector<size_t> by_start(order);
+        std::sort(by_start.begin(), by_start.end(), [&](size_t a, size_t b) { return stages[a].start_us < stages[b].start_us; });
+        for (size_t i : by_start)
+        {
+            const Stage& stage = stages[i];
+            snprintf(line, sizeof(line), "\t%10.2f %9.2f %7u  %s", (stage.start_us - run_start_us) / 1000.0,
+                     (stage.end_us - stage.start_us) / 1000.0, stage.thread, stage.name);
+            std::cout << line << std::endl;
+        }
+
+        std::vector<size_t> path = criticalPath();
+        double path_us = 0.0;
+        for (size_t i : path) path_us += stages[i].end_us - stages[i].start_us;
+        snprintf(line, sizeof(line), "Critical path: %.2f ms", path_us / 1000.0);
+        std::cout << line << std::endl << "\t";
+        for (size_t i = 0; i < path.size(); i++) std::cout << (i ? " -> " : "") << stages[path[i]].name;
+        std::cout << std::endl;
+    }
+
+private:
+    struct Stage
+    {
+        const char*                 name = nullptr;
+        std::vector<const char*>    dep_names;
+        std::function<void()>       fn;
+        bool                        main_thread = false;
+
+        std::vector<size_t>         deps;
+        std::vector<size_t>         dependents;
+        size_t                      waiting = 0;    // unfinished deps
+        double                      start_us = 0.0;
+        double                      end_us = 0.0;
+        uint32_t                    thread = 0;
+    };
+
+    // Map names to indices, and check the graph is acyclic (a cycle would otherwise deadlock run())
+    void resolveDependencies()
+    {
+        std::unordered_map<std::string, size_t> index;
+        for (size_t i = 0; i < stages.size(); i++) index[stages[i].name] = i;
+
+        for (size_t i = 0; i < stages.size(); i++)
+        {
+            for (const char* dep : stages[i].dep_names)
+            {
+                auto it = index.find(dep);
+                if (it == index.end())
+                {
+                    throw std::runtime_error(std::string("Init stage '") + stages[i].name + "' depends on unknown stage '" + dep + "'");
+                }
+                stages[i].deps.push_back(it->second);
+                stages[it->second].dependents.push_back(i);
+            }
+            stages[i].waiting = stages[i].deps.size();
+        }
+
+        // Kahn's algorithm - also gives the order the critical path is computed in
+        order.clear();
+        std::vector<size_t> pending(stages.size());
+        for (size_t i = 0; i < stages.size(); i++)
+        {
+            pending[i] = stages[i].deps.size();
+            if (0 == pending[i]) order.push_back(i);
+        }
+        for (size_t n = 0; n < order.size(); n++)
+        {
+            for (size_t d : stages[order[n]].dependents)
+            {
+                if (0 == --pending[d]) order.push_back(d);
+            }
+        }
+        if (order.size() != stages.size()) throw std::runtime_error("Init stages have a dependency cycle");
+    }
+
+    // Caller holds the mutex (or no workers are running yet)
+    void pushReady(size_t idx)
+    {
+        (stages[idx].main_thread ? main_ready : any_ready).push_back(idx);
+    }
+
+    void workLoop(uint32_t thread)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;)
+        {
+            bool is_main = (0 == thread);
+            wake.wait(lock, [&] { return 0 == remaining || error || !any_ready.empty() || (is_main && !main_ready.empty()); });
+            if (0 == remaining || error) return;
+
+            // The main thread drains its own queue first, so the pool never waits on it longer than needed
+            std::deque<size_t>& queue = (is_main && !main_ready.empty()) ? main_ready : any_ready;
+            size_t idx = queue.front();
+            queue.pop_front();
+            lock.unlock();
+
+            Stage& stage = stages[idx];
+            stage.thread = thread;
+            stage.start_us = traceNowUs();
+            std::exception_ptr failure;
+            try
+            {
+                stage.fn();
+            }
+            catch (...)
+            {
+                failure = std::current_exception();
+            }
+            stage.end_us = traceNowUs();
+
+            lock.lock();
+            if (failure && !error) error = failure;
+            remaining--;
+            for (size_t d : stage.dependents)
+            {
+                if (0 == --stages[d].waiting) pushReady(d);
+            }
+            wake.notify_all();
+        }
+    }
+
+    // Longest chain through the graph, weighted by measured stage time
+    std::vector<size_t> criticalPath() const
+    {
+        std::vector<double> finish(stages.size(), 0.0);
+        std::vector<size_t> prev(stages.size(), SIZE_MAX);
+        size_t last = SIZE_MAX;
+        for (size_t i : order)
+        {
+            double start = 0.0;
+            for (size_t d : stages[i].deps)
+            {
+                if (finish[d] > start)
+                {
+                    start = finish[d];
+                    prev[i] = d;
+                }
+            }
+            finish[i] = start + (stages[i].end_us - stages[i].start_us);
+            if (SIZE_MAX == last || finish[i] > finish[last]) last = i;
+        }
+
+        std::vector<size_t> path;
+        for (size_t i = last; SIZE_MAX != i; i = prev[i]) path.push_back(i);
+        std::reverse(path.begin(), path.end());
+        return path;
+    }
+
+    std::vector<Stage>          stages;
+    std::vector<size_t>         order;
+    std::mutex                  mutex;
+    std::condition_variable     wake;
+    std::deque<size_t>          any_ready;
+    std::deque<size_t>          main_ready;
+    size_t                      remaining = 0;
+    std::exception_ptr          error;
+    uint32_t                    used_threads = 1;
+    double                      run_start_us = 0.0;
+    double                      run_end_us = 0.0;
+};
+
+/////////////////////////////////////////////////////////////
+// Frame pacing
+/////////////////////////////////////////////////////////////
+
+const std::array<std::pair<const char*, VkPresentModeKHR>, 4> present_mode_names = { {
+    { "fifo",           VK_PRESENT_MODE_FIFO_KHR },         // vsync, queues frames - lowest power, most latency
+    { "fifo_relaxed",   VK_PRESENT_MODE_FIFO_RELAXED_KHR }, // vsync, but tears rather than waits when a frame is late
+    { "mailbox",        VK_PRESENT_MODE_MAILBOX_KHR },      // vsync, newest frame replaces any queued one
+    { "immediate",      VK_PRESENT_MODE_IMMEDIATE_KHR },    // no vsync - tears, least latency
+} };
+
+inline const char* presentModeName(VkPresentModeKHR mode)
+{
+    for (const auto& entry : present_mode_names)
+    {
+        if (entry.second == mode) return entry.first;
+    }
+    return "unknown";
+}
+
+// Holds the loop to a fixed rate. Sleeps for most of each wait and spins the last stretch, as sleep
+// granularity (a millisecond or more) would otherwise show up as frame time jitter.
+class FrameLimiter
+{
+public:
+    void setRate(uint32_t fps)
+    {
+        period = fps ? std::chrono::nanoseconds(1000000000ll / fps) : std::chrono::nanoseconds(0);
+        next = std::chrono::steady_clock::now();
+    }
+
+    void wait()
+    {
+        if (0 == period.count()) return;
+
+        auto now = std::chrono::steady_clock::now();
+        if (now - next > period) next = now;    // fell well behind (a hitch, or a resize) - don't try to catch up
+        if (next - now > spin_margin) std::this_thread::sleep_for(next - now - spin_margin);
+        while (std::chrono::steady_clock::now() < next) std::this_thread::yield();
+        next += period;
+    }
+
+private:
+    std::chrono::nanoseconds                period{ 0 };
+    std::chrono::steady_clock::time_point   next;
+    const std::chrono::microseconds         spin_margin{ 1500 };
+};
+
+// Picks the render scale for the next frame from measured GPU frame time. The time is smoothed, and the scale only
+// moves once it has stayed outside a band around the target for a run of frames - dropping after a few frames over
+// budget, climbing back only after many well under it - and then holds while the change reaches the timings.
+// Pixel cost goes with scale squared, so steps are sized by the square root of the time ratio.
+class ResolutionController
+{
+public:
+    void configure(double target_frame_ms, float min_scale, float max_scale)
+    {
+        target_ms = target_frame_ms;
+        lo = min_scale;
+        hi = max_scale;
+        scale = max_scale;
+        smoothed_ms = 0.0;
+        over = under = cooldown = 0;
+    }
+
+    float update(double gpu_ms)
+    {
+        if (gpu_ms <= 0.0) return scale;    // no timing yet
+        smoothed_ms = (smoothed_ms <= 0.0) ? gpu_ms : smoothed_ms + smoothing * (gpu_ms - smoothed_ms);
+        if (cooldown > 0)
+        {
+            cooldown--;
+            return scale;
+        }
+
+        over = (smoothed_ms > target_ms * over_band) ? over + 1 : 0;
+        under = (smoothed_ms < target_ms * under_band) ? under + 1 : 0;
+
+        float next = scale;
+        if (over >= frames_to_drop) next = scale * std::max(0.75f, static_cast<float>(std::sqrt(target_ms / smoothed_ms)));
+        else if (under >= frames_to_raise) next = scale * std::min(1.1f, static_cast<float>(std::sqrt(target_ms * raise_to / smoothed_ms)));
+        next = std::clamp(next, lo, hi);
+        if (std::abs(next - scale) >= 0.01f)
+        {
+            scale = next;
+            over = under = 0;
+            cooldown = settle_frames;
+        }
+        return scale;
+    }
+
+    float current() const { return scale; }
+    double smoothedMs() const { return smoothed_ms; }
+    double targetMs() const { return target_ms; }
+
+private:
+    const double    smoothing = 0.1;
+    const double    over_band = 1.05;       // over budget above 105% of target
+    const double    under_band = 0.8;       // well under below 80%
+    const double    raise_to = 0.9;         // climbing aims below target, leaving headroom
+    const uint32_t  frames_to_drop = 4;
+    const uint32_t  frames_to_raise = 60;
+    const uint32_t  settle_frames = 8;      // results lag a couple of frames, and the smoothing longer still
+
+    double          target_ms = 16.0;
+    float           lo = 0.5f;
+    float           hi = 1.0f;
+    float           scale = 1.0f;
+    double          smoothed_ms = 0.0;
+    uint32_t        over = 0;
+    uint32_t        under = 0;
+    uint32_t        cooldown = 0;
+};
+
+// Launch options, from the command line. Some can also be toggled at runtime with the key noted.
+struct AppConfig
+{
+    bool depth_prepass      = false;    // --depth-prepass (Z)
+    bool sort_front_to_back = true;     // --no-sort (O)
+    VkPresentModeKHR present_mode = VK_PRESENT_MODE_MAILBOX_KHR;   // --present fifo|fifo_relaxed|mailbox|immediate (V)
+    uint32_t fps_limit      = 0;        // --fps N, 0 for unlimited
+    bool low_latency        = false;    // --low-latency (L)
+    bool dynamic_rendering  = false;    // --dynamic-rendering (R): vkCmdBeginRendering instead of render pass objects
+    uint32_t msaa_samples   = 1;        // --msaa 1|2|4|8 (M), clamped to what the device supports
+    bool dynamic_resolution = false;    // --dynamic-res (D): render at a scale that holds the target GPU time
+    float res_min           = 0.5f;     // --res-scale MIN,MAX - bounds, relative to the swapchain size
+    float res_max           = 1.0f;
+    double target_ms        = 16.0;     // --target-ms MS, GPU frame time the scale is adjusted to hold
+    bool post_process       = false;    // --post (H): render to an HDR target and bloom, tonemap and grade it in compute
+    bool async_compute      = true;     // --no-async-compute (A): post-processing on the compute queue, when there is one
+    uint32_t texture_budget_mb = 256;   // --texture-budget MB, device memory for streamed textures
+    uint32_t stream_kb_per_frame = 2048;    // --stream-rate KB, texture upload limit per frame
+    uint32_t lod_grid       = 0;        // --lod-scene N: an N x N field of hill tiles instead of the quad stack
+    bool mesh_lod           = true;     // --no-lod (G): always draw the full detail meshes
+    float lod_error_pixels  = 1.0f;     // --lod-error PX, screen space error a LOD may introduce
+    float lod_hysteresis    = 0.25f;    // --lod-hysteresis F, how far under the threshold a coarser LOD must be, 0 for none
+    bool clusters           = false;    // --clusters (C): cull meshlets in compute and draw the survivors indirectly
+    bool occlusion          = false;    // --occlusion (U): cluster culling also tests against last frame's depth pyramid
+    bool headless           = false;    // --headless: no window, present to a VK_EXT_headless_surface (needs --frames)
+    uint32_t frame_count    = 0;        // --frames N: exit after N measured frames and report them, 0 to run until closed
+    uint32_t warmup_frames  = 0;        // --warmup N, frames drawn before measuring starts
+    float fixed_step        = -1.0f;    // --fixed-step SEC: animate by frame number instead of wall time, negative for off
+    bool checksum           = false;    // --checksum: hash the last measured frame's image
+    std::string gpu;                    // --gpu NAME|0xVENDOR[:0xDEVICE]: that device rather than the best scoring one
+    bool vertex_pulling     = false;    // --vertex-pulling (X): fetch vertices in the shader through buffer device addresses
+
+    // The ID forms gpuMatches() parses: each present ID is 0x and 1-8 hex digits. Names are anything else.
+    static bool validGpuFilter(const std::string& filter)
+    {
+        if (0 != filter.rfind("0x", 0) && 0 != filter.rfind(":0x", 0)) return !filter.empty();
+        auto hex_id = [](const std::string& id)
+        {
+            return id.size() > 2 && id.size() <= 10 && 0 == id.rfind("0x", 0) &&
+                   std::all_of(id.begin() + 2, id.end(), [](unsigned char c) { return std::isxdigit(c); });
+        };
+        size_t colon = filter.find(':');
+        std::string vendor = filter.substr(0, colon);
+        if (!vendor.empty() && !hex_id(vendor)) return false;
+        return (std::string::npos == colon) || hex_id(filter.substr(colon + 1));
+    }
+
+    static AppConfig parse(int argc, char** argv)
+    {
+        AppConfig config;
+        for (int i = 1; i < argc; i++)
+        {
+            std::string arg = argv[i];
+            auto value = [&]() -> std::string
+            {
+                if (i + 1 >= argc) throw std::invalid_argument("Missing value for " + arg);
+                return argv[++i];
+            };
+
+            if ("--depth-prepass" == arg)   config.depth_prepass = true;
+            else if ("--no-sort" == arg)    config.sort_front_to_back = false;
+            else if ("--low-latency" == arg) config.low_latency = true;
+            else if ("--dynamic-rendering" == arg) config.dynamic_rendering = true;
+            else if ("--fps" == arg)        config.fps_limit = static_cast<uint32_t>(std::stoul(value()));
+            else if ("--dynamic-res" == arg) config.dynamic_resolution = true;
+            else if ("--post" == arg)       config.post_process = true;
+            else if ("--no-async-compute" == arg) config.async_compute = false;
+            else if ("--texture-budget" == arg) config.texture_budget_mb = static_cast<uint32_t>(std::stoul(value()));
+            else if ("--stream-rate" == arg) config.stream_kb_per_frame = static_cast<uint32_t>(std::stoul(value()));
+            else if ("--lod-scene" == arg)  config.lod_grid = static_cast<uint32_t>(std::stoul(value()));
+            else if ("--no-lod" == arg)     config.mesh_lod = false;
+            else if ("--clusters" == arg)   config.clusters = true;
+            else if ("--occlusion" == arg)  config.occlusion = true;
+            else if ("--headless" == arg)   config.headless = true;
+            else if ("--frames" == arg)     config.frame_count = static_cast<uint32_t>(std::stoul(value()));
+            else if ("--warmup" == arg)     config.warmup_frames = static_cast<uint32_t>(std::stoul(value()));
+            else if ("--fixed-step" == arg) config.fixed_step = std::stof(value());
+            else if ("--checksum" == arg)   config.checksum = true;
+            else if ("--gpu" == arg)
+            {
+                config.gpu = value();
+                if (!validGpuFilter(config.gpu)) throw std::invalid_argument("--gpu expects a name, 0xVENDOR, 0xVENDOR:0xDEVICE or :0xDEVICE, not " + config.gpu);
+            }
+            else if ("--vertex-pulling" == arg) config.vertex_pulling = true;
+            else if ("--lod-error" == arg)  config.lod_error_pixels = std::stof(value());
+            else if ("--lod-hysteresis" == arg)
+            {
+                config.lod_hysteresis = std::stof(value());
+                if (config.lod_hysteresis < 0.0f || config.lod_hysteresis >= 1.0f) throw std::invalid_argument("--lod-hysteresis must be in [0, 1)");
+            }
+            else if ("--target-ms" == arg)  config.target_ms = std::stod(value());
+            else if ("--res-scale" == arg)
+            {
+                std::string bounds = value();
+                size_t comma = bounds.find(',');
+                if (std::string::npos == comma) throw std::invalid_argument("--res-scale expects MIN,MAX");
+                config.res_min = std::stof(bounds.substr(0, comma));
+                config.res_max = std::stof(bounds.substr(comma + 1));
+                if (config.res_min <= 0.0f || config.res_min > config.res_max || config.res_max > 2.0f)
+                {
+                    throw std::invalid_argument("--res-scale bounds must satisfy 0 < MIN <= MAX <= 2");
+                }
+            }
+            else if ("--msaa" == arg)
+            {
+                config.msaa_samples = static_cast<uint32_t>(std::stoul(value()));
+                if (config.msaa_samples > 8 || 0 != (config.msaa_samples & (config.msaa_samples - 1)))
+                {
+                    throw std::invalid_argument("MSAA sample count must be 1, 2, 4 or 8");
+                }
+            }
+            else if ("--present" == arg)
+            {
+                std::string name = value();
+                auto it = std::find_if(present_mode_names.begin(), present_mode_names.end(),
+                                       [&](const auto& entry) { return name == entry.first; });
+                if (it == present_mode_names.end()) throw std::invalid_argument("Unknown present mode: " + name);
+                config.present_mode = it->second;
+            }
+            else throw std::invalid_argument("Unknown option: " + arg);
+        }
+        if (config.headless && 0 == config.frame_count) throw std::invalid_argument("--headless has no window to close, so needs --frames");
+        if (config.checksum && 0 == config.frame_count) throw std::invalid_argument("--checksum needs --frames");
+        return config;
+    }
+};
+
+// What a --frames run measured, from the end of the warm-up
+struct RunStats
 {
-    // Default C++ alignments don't match Vulkan spec: https://www.khronos.org/registry/vulkan/specs/1.3-extensions/html/chap15.html#interfaces-resources-layout
-    // i.e. without explicit alignments, the foo vec2 will break this struct
-    glm::vec2 foo;
-    alignas(16) glm::mat4 model;
-    alignas(16) glm::mat4 view;
-    alignas(16) glm::mat4 projection;
+    uint32_t        frames              = 0;
+    RollingStats    cpu_frame_ms;
+    uint64_t        submits             = 0;
+    uint64_t        device_allocations  = 0;
+    uint64_t        host_allocations    = 0;
+    std::optional<uint64_t> checksum;   // FNV-1a of the last frame's pixels, with --checksum
 };
 
-const std::vector<Vertex> vertices = { {{-0.5, -0.5}, {1.0, 0.0, 0.0}, {1.0f, 0.0f}},
-                                       {{ 0.5, -0.5}, {0.0, 1.0, 0.0}, {0.0f, 0.0f}},
-                                       {{ 0.5,  0.5}, {0.0, 0.0, 1.0}, {0.0f, 1.0f}},
-                                       {{-0.5,  0.5}, {1.0, 1.0, 1.0}, {1.0f, 1.0f}} };
-
-const std::vector<uint16_t> indices = { 0, 1, 2, 0, 2, 3 };
-
 class HelloTriangleApplication
 {
 public:
+    explicit HelloTriangleApplication(const AppConfig& app_config) : config(app_config) {}
+
+    const RunStats& runStats() const { return run_stats; }
+
     void run() 
     {
+        launch_us = traceNowUs();
         initWindow();
         initVulkan();
         mainLoop();
@@ -101,6 +5089,8 @@ public:
 private:
     void initWindow()
     {
+        if (config.headless) return;
+
         glfwSetErrorCallback(glfwErrorCallback);
 
         glfwInit();
@@ -111,9 +5101,115 @@ private:
 
         glfwSetWindowUserPointer(window, this);
         glfwSetFramebufferSizeCallback(window, onFramebufferResize);
+        glfwSetKeyCallback(window, onKey);
+    }
+
+    static void onKey(GLFWwindow* window, int key, int /*scancode*/, int action, int /*mods*/)
+    {
+        auto app = reinterpret_cast<HelloTriangleApplication*>(glfwGetWindowUserPointer(window));
+        if (GLFW_PRESS != action) return;
+
+        switch (key)
+        {
+        case GLFW_KEY_T:    // toggle between the textured and untextured shader variants
+            app->show_texture = !app->show_texture;
+            break;
+        case GLFW_KEY_Z:    // toggle the depth pre-pass
+            app->config.depth_prepass = !app->config.depth_prepass;
+            std::cout << std::endl << "Depth pre-pass " << (app->config.depth_prepass ? "on" : "off") << std::endl;
+            break;
+        case GLFW_KEY_V:    // cycle present modes
+        {
+            auto it = std::find_if(present_mode_names.begin(), present_mode_names.end(),
+                                   [&](const auto& entry) { return entry.second == app->config.present_mode; });
+            size_t next = (it == present_mode_names.end()) ? 0 : (it - present_mode_names.begin() + 1) % present_mode_names.size();
+            app->config.present_mode = present_mode_names[next].second;
+            app->frame_buffer_resized = true;   // recreates the swapchain after the next present
+            std::cout << std::endl << "Requested present mode " << present_mode_names[next].first << std::endl;
+            break;
+        }
+        case GLFW_KEY_L:    // toggle low latency mode
+            app->config.low_latency = !app->config.low_latency;
+            app->frame_buffer_resized = true;   // swapchain image count depends on it
+            std::cout << std::endl << "Low latency " << (app->config.low_latency ? "on" : "off") << std::endl;
+            break;
+        case GLFW_KEY_R:    // toggle between render pass objects and dynamic rendering
+            if (!app->device_caps.dynamic_rendering) break;
+            app->config.dynamic_rendering = !app->config.dynamic_rendering;
+            app->frame_buffer_resized = true;   // the swapchain's dependents are rebuilt for the new path
+            std::cout << std::endl << "Dynamic rendering " << (app->config.dynamic_rendering ? "on" : "off") << std::endl;
+            break;
+        case GLFW_KEY_M:    // cycle MSAA 1x, 2x, 4x, 8x
+            app->config.msaa_samples = (app->config.msaa_samples >= 8) ? 1 : app->config.msaa_samples * 2;
+            app->frame_buffer_resized = true;   // attachments, render pass and pipelines all depend on it
+            std::cout << std::endl << "Requested MSAA " << app->config.msaa_samples << "x" << std::endl;
+            break;
+        case GLFW_KEY_D:    // toggle dynamic resolution
+            app->config.dynamic_resolution = !app->config.dynamic_resolution;
+            app->frame_buffer_resized = true;   // adds or removes the internal target and upscale pass
+            std::cout << std::endl << "Dynamic resolution " << (app->config.dynamic_resolution ? "on" : "off") << std::endl;
+            break;
+        case GLFW_KEY_H:    // toggle compute post-processing
+            app->config.post_process = !app->config.post_process;
+            app->frame_buffer_resized = true;   // changes the scene format and the graph's passes
+            std::cout << std::endl << "Post-processing " << (app->config.post_process ? "on" : "off") << std::endl;
+            break;
+        case GLFW_KEY_A:    // toggle async compute
+            app->config.async_compute = !app->config.async_compute;
+            app->frame_buffer_resized = true;   // re-splits the graph into submits
+            std::cout << std::endl << "Async compute " << (app->config.async_compute ? "on" : "off") << std::endl;
+            break;
+        case GLFW_KEY_B:    // resize latency, render pass vs dynamic rendering
+            app->resize_benchmark_pending = true;
+            break;
+        case GLFW_KEY_G:    // toggle mesh LOD selection
+            app->config.mesh_lod = !app->config.mesh_lod;
+            std::cout << std::endl << "Mesh LOD " << (app->config.mesh_lod ? "on" : "off") << std::endl;
+            break;
+        case GLFW_KEY_C:    // toggle meshlet culling and indirect draws
+            app->config.clusters = !app->config.clusters;
+            std::cout << std::endl << "Cluster culling " << (app->config.clusters ? "on" : "off")
+                      << (app->device_caps.cluster_culling ? "" : " (not supported - drawing per object)") << std::endl;
+            break;
+        case GLFW_KEY_U:    // toggle occlusion culling against the depth pyramid
+            app->config.occlusion = !app->config.occlusion;
+            app->frame_buffer_resized = true;   // depth is kept for the pyramid pass, which is added or removed
+            std::cout << std::endl << "Occlusion culling " << (app->config.occlusion ? "on" : "off") << std::endl;
+            break;
+        case GLFW_KEY_X:    // toggle between fixed-function vertex input and vertex pulling
+            app->config.vertex_pulling = !app->config.vertex_pulling;
+            std::cout << std::endl << "Vertex pulling " << (app->config.vertex_pulling ? "on" : "off")
+                      << (app->device_caps.buffer_device_address ? "" : " (not supported - using vertex input)") << std::endl;
+            break;
+        case GLFW_KEY_K:    // reload every mesh and compact the geometry pool
+            app->reloadMeshes();
+            break;
+        case GLFW_KEY_O:    // toggle front-to-back sorting (off draws back to front)
+            app->config.sort_front_to_back = !app->config.sort_front_to_back;
+            std::cout << std::endl << "Front-to-back sort " << (app->config.sort_front_to_back ? "on" : "off") << std::endl;
+            break;
+#ifdef CPU_PROFILE_ON
+        case GLFW_KEY_F12:  // CPU + GPU trace of the recent past
+            CpuProfiler::writeChromeTrace("frame_trace.json", &app->gpu_profiler);
+            std::cout << std::endl << "Wrote frame_trace.json" << std::endl;
+            break;
+#endif
+        case GLFW_KEY_P:    // GPU timing report, plus a trace of the last few frames
+            app->printFramePacingReport();
+            app->printMsaaMemoryReport();
+            app->texture_streamer.printStats();
+            app->geometry_pool.printStats();
+            app->printLodReport();
+            app->printClusterReport();
+            app->gpu_profiler.printReport();
+            app->gpu_profiler.writeChromeTrace("gpu_trace.json");
+            break;
+        default:
+            break;
+        }
     }
 
-    static void onFramebufferResize(GLFWwindow* window, int width, int height)
+    static void onFramebufferResize(GLFWwindow* window, int /*width*/, int /*height*/)
     {
         auto app = reinterpret_cast<HelloTriangleApplication*>(glfwGetWindowUserPointer(window));
         app->frame_buffer_resized = true;
@@ -121,125 +5217,501 @@ private:
 
     void initVulkan() 
     {
-        createInstance();
-        setupDebugMessenger();
-        createSurface();
-        choosePhysicalDevice();
-        createLogicalDevice();
-        createSwapChain();
-        createSwapImageViews();
-        createRenderPass();
-        createDescriptorSetLayout();
-        createGraphicsPipeline();
-        createFrameBuffers();
-        createUniformBuffers();
-        createCommandPool();
-        createTextureImage();
-        createTexImageView();
-        createTextureSampler();
-        createDescriptorPool();
-        createDescriptorSets();
-        createVertexBuffers();
-        createIndexBuffers();
-        createSyncObjects();
+        PROFILE_FUNCTION();
+
+        // Stages run as soon as what they name has finished. Anything sharing an object that Vulkan requires
+        // to be externally synchronized must either depend on its peers or lock (see upload_mutex).
+        InitGraph init;
+        init.add("instance",            {},                                 [this] { createInstance(); });
+        init.add("debug messenger",     { "instance" },                     [this] { setupDebugMessenger(); });
+        init.add("surface",             { "instance" },                     [this] { createSurface(); });
+        init.add("physical device",     { "surface" },                      [this] { choosePhysicalDevice(); });
+        init.add("logical device",      { "physical device" },              [this] { createLogicalDevice(); });
+        init.add("profiler",            { "logical device" },               [this] { createProfiler(); });
+        init.add("swapchain",           { "logical device" },               [this] { createSwapChain(); }, true);  // queries the window size
+        init.add("swap image views",    { "swapchain" },                    [this] { createSwapImageViews(); });
+        init.add("render graph",        { "swapchain" },                    [this] { buildRenderGraph(); });
+        init.add("render pass",         { "swapchain", "render graph" },    [this] { createRenderPass(); });
+        init.add("set layouts",         { "logical device" },               [this] { createDescriptorSetLayout(); });
+        init.add("pipeline library",    { "logical device" },               [this] { createPipelineLibrary(); });
+        init.add("graphics pipeline",   { "render pass", "set layouts", "pipeline library" }, [this] { createGraphicsPipeline(); });
+        init.add("post pipelines",      { "set layouts", "pipeline library" }, [this] { createPostPipelines(); });
+        init.add("cull pipeline",       { "set layouts", "pipeline library" }, [this] { createCullPipeline(); });
+        init.add("framebuffers",        { "render pass", "swap image views", "render graph" }, [this] { createFrameBuffers(); });
+        init.add("uniform buffers",     { "logical device" },               [this] { createUniformBuffers(); });
+        init.add("command pool",        { "logical device" },               [this] { createCommandPool(); });
+        init.add("timeline",            { "logical device" },               [this] { createTimeline(); });
+        init.add("texture decode",      {},                                 [this] { loadTexturePixels(); });
+        init.add("texture image",       { "texture decode", "command pool", "profiler", "timeline" }, [this] { createTextureImage(); });
+        init.add("texture sampler",     { "logical device" },               [this] { createTextureSampler(); });
+        init.add("descriptor pools",    { "logical device" },               [this] { createDescriptorPool(); });
+        init.add("meshes",              {},                                 [this] { createMeshes(); });
+        init.add("geometry pool",       { "meshes", "command pool", "profiler", "timeline" }, [this] { createGeometryPool(); });
+        init.add("sync objects",        { "command pool" },                 [this] { createSyncObjects(); });
+        init.add("scene",               { "meshes" },                       [this] { createScene(); });
+        init.add("object buffers",      { "scene", "geometry pool" },       [this] { createObjectBuffers(); });
+        init.run();
+
+#ifdef VERBOSE_ON
+        init.printReport();
+        geometry.printReport();
+        printMsaaMemoryReport();
+#endif
     }
 
     void mainLoop() 
     {
-        while (!glfwWindowShouldClose(window))
+#ifdef HOT_RELOAD_ON
+        pipeline_library.waitIdle();    // precompiles record each shader's #includes
+        for (const auto& desc : buildPipelineManifest())
+        {
+            for (const auto& shader : { desc.vert_shader, desc.frag_shader })
+            {
+                if (shader.empty()) continue;   // depth-only
+                shader_watcher.watch(shader);
+                for (const auto& include : pipeline_library.compiler().includesOf(shader)) shader_watcher.watch(include);
+            }
+        }
+        for (const char* shader : { post_blur_shader, post_tonemap_shader, post_grade_shader, cluster_cull_shader, hiz_build_shader })
+        {
+            shader_watcher.watch(shader);
+            for (const auto& include : pipeline_library.compiler().includesOf(shader)) shader_watcher.watch(include);
+        }
+#endif
+
+        frame_limiter.setRate(config.fps_limit);
+        while (config.headless || !glfwWindowShouldClose(window))
+        {
+            if (config.frame_count > 0 && !run_measuring && frame_number == config.warmup_frames) beginRun();
+            if (run_measuring && frame_number == config.warmup_frames + config.frame_count) break;
+
+            if (resize_benchmark_pending)
+            {
+                resize_benchmark_pending = false;
+                runResizeBenchmark();
+            }
+
+            {
+                PROFILE_ZONE("frame limiter");
+                frame_limiter.wait();
+            }
+            double frame_start_us = traceNowUs();   // CPU frame time, excluding the limiter
+
+            // Normally input is sampled first and the frame then waits on the GPU and swapchain. In low latency
+            // mode all of that waiting happens before input is sampled, so nothing is queued behind the frame
+            // (queue depth 0) and the input is as fresh as possible when recording starts.
+            uint32_t image_idx = 0;
+            bool acquired = false;
+            if (config.low_latency) acquired = acquireFrame(image_idx);
+            pollInput();
+#ifdef HOT_RELOAD_ON
+            reloadChangedShaders();
+#endif
+            if (!config.low_latency) acquired = acquireFrame(image_idx);
+            if (acquired) drawFrame(image_idx);
+            if (acquired && run_measuring)
+            {
+                run_stats.frames++;
+                run_stats.cpu_frame_ms.add((traceNowUs() - frame_start_us) / 1000.0);
+            }
+
+#ifdef VERBOSE_ON
+            if (launch_us >= 0.0)
+            {
+                std::cout << std::endl << "Time to first frame: " << (traceNowUs() - launch_us) / 1000.0 << " ms" << std::endl;
+                launch_us = -1.0;
+            }
+#endif
+        }
+
+        // Shutdown is the one full wait left: presentation has no completion signal to wait on instead
+        vkDeviceWaitIdle(device);
+        if (run_measuring) endRun();
+    }
+
+    // A --frames run measures from here; counts start from what the warm-up (and init) left them at
+    void beginRun()
+    {
+        run_stats = RunStats{};
+        run_stats.cpu_frame_ms = RollingStats(config.frame_count);
+        if (config.checksum)
+        {
+            capture_size = static_cast<VkDeviceSize>(swapchain_extent.width) * swapchain_extent.height * 4;   // 32-bit swapchain formats
+            createBuffer(capture_size, VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                         VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, capture_buffer, capture_mem);
+        }
+        run_start_submits = runtime_counters.submits;
+        run_start_device_allocations = runtime_counters.device_allocations;
+        run_start_host_allocations = runtime_counters.host_allocations;
+        run_measuring = true;
+    }
+
+    // After the final wait idle, so the captured frame has landed
+    void endRun()
+    {
+        run_measuring = false;
+        run_stats.submits = runtime_counters.submits - run_start_submits;
+        run_stats.device_allocations = runtime_counters.device_allocations - run_start_device_allocations;
+        run_stats.host_allocations = runtime_counters.host_allocations - run_start_host_allocations;
+
+        if (VK_NULL_HANDLE != capture_buffer)
+        {
+            // FNV-1a over the pixels
+            void* data;
+            vkMapMemory(device, capture_mem, 0, capture_size, 0, &data);
+            uint64_t hash = 14695981039346656037ull;
+            for (VkDeviceSize i = 0; i < capture_size; i++)
+            {
+                hash = (hash ^ static_cast<const uint8_t*>(data)[i]) * 1099511628211ull;
+            }
+            vkUnmapMemory(device, capture_mem);
+            run_stats.checksum = hash;
+
+            vkDestroyBuffer(device, capture_buffer, nullptr);
+            vkFreeMemory(device, capture_mem, nullptr);
+            capture_buffer = VK_NULL_HANDLE;
+        }
+        printRunReport();
+    }
+
+    void printRunReport()
+    {
+        const RunStats& r = run_stats;
+        std::cout << std::endl << "Run of " << r.frames << " frames after " << config.warmup_frames << " warm-up" << std::endl;
+        std::cout << "\tCPU frame ms: avg " << r.cpu_frame_ms.avg() << ", min " << r.cpu_frame_ms.min()
+                  << ", p99 " << r.cpu_frame_ms.percentile(0.99) << std::endl;
+        std::cout << "\tSubmits: " << r.submits << ", device allocations: " << r.device_allocations
+                  << ", host allocations: " << r.host_allocations << std::endl;
+        if (r.checksum)
         {
-            glfwPollEvents();
-            drawFrame();
+            std::cout << "\tImage checksum: " << std::hex << *r.checksum << std::dec << std::endl;
         }
+    }
+
+    // Copy the finished frame out for the checksum, on the last measured frame. Whatever wrote the image last,
+    // the graph left it ready to present, so the barrier out has to cover every stage.
+    void recordCapture(VkCommandBuffer cb, VkImage image)
+    {
+        UsageState presented = { VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, VK_ACCESS_2_MEMORY_WRITE_BIT, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR, false };
+        VkImageMemoryBarrier2 barrier = imageBarrier(image, VK_IMAGE_ASPECT_COLOR_BIT, presented, usageState(ResourceUsage::TransferSrc));
+        VkDependencyInfo dep = { VK_STRUCTURE_TYPE_DEPENDENCY_INFO, nullptr };
+        dep.imageMemoryBarrierCount = 1;
+        dep.pImageMemoryBarriers = &barrier;
+        vkCmdPipelineBarrier2(cb, &dep);
+
+        VkBufferImageCopy region{};
+        region.imageSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
+        region.imageExtent = { swapchain_extent.width, swapchain_extent.height, 1 };
+        vkCmdCopyImageToBuffer(cb, image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, capture_buffer, 1, &region);
+
+        transitionImage(cb, image, VK_IMAGE_ASPECT_COLOR_BIT, ResourceUsage::TransferSrc, ResourceUsage::Present);
+        bufferBarrier(cb, VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_2_HOST_BIT, VK_ACCESS_2_HOST_READ_BIT);
+    }
+
+#ifdef HOT_RELOAD_ON
+    // Recompile edited shaders and rebuild only the pipelines built from them. A shader that fails to
+    // compile is reported and the previous version stays in use.
+    void reloadChangedShaders()
+    {
+        for (const auto& file : shader_watcher.pollChanges())
+        {
+            // An edited header affects every shader that includes it
+            for (const auto& shader : pipeline_library.compiler().dependents(file))
+            {
+                VkShaderStageFlagBits stage = VK_SHADER_STAGE_VERTEX_BIT;
+                for (const auto& desc : buildPipelineManifest())
+                {
+                    if (desc.frag_shader == shader) stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+                }
+                for (const char* compute_shader : { post_blur_shader, post_tonemap_shader, post_grade_shader, cluster_cull_shader, hiz_build_shader })
+                {
+                    if (shader == compute_shader) stage = VK_SHADER_STAGE_COMPUTE_BIT;
+                }
+
+                try
+                {
+                    pipeline_library.compiler().load(shader, stage);    // validate before tearing anything down
+                }
+                catch (const std::exception& e)
+                {
+                    std::cerr << std::endl << "Shader reload of " << shader << " failed: " << e.what() << std::endl;
+                    continue;
+                }
 
-        vkDeviceWaitIdle(device);   // wait for idle before cleaning up
+                // The pipelines being replaced may still be in flight, so they're retired rather than destroyed
+                auto dropped = pipeline_library.invalidateShader(shader, &deletion_queue, timeline.lastSubmitted());
+                pipeline_library.precompile(dropped);
+                std::cout << std::endl << "Reloaded " << shader << ", rebuilding " << dropped.size() << " pipeline(s)" << std::endl;
+            }
+        }
     }
+#endif
 
     void cleanup() 
     {
-        vkDestroyFence(device, fence_in_flight, nullptr);
-        vkDestroySemaphore(device, sem_image_available, nullptr);
-        vkDestroySemaphore(device, sem_render_complete, nullptr);
-        vkFreeCommandBuffers(device, command_pool, 1, &render_cmd_buf);
+#ifdef CPU_PROFILE_ON
+        CpuProfiler::writeChromeTrace("frame_trace.json", &gpu_profiler);
+#endif
+
+        for (auto& frame : frames)
+        {
+            vkDestroySemaphore(device, frame.image_available, nullptr);
+            vkDestroyBuffer(device, frame.object_buffer, nullptr);
+            vkFreeMemory(device, frame.object_mem, nullptr);
+            vkDestroyBuffer(device, frame.draw_buffer, nullptr);
+            vkFreeMemory(device, frame.draw_mem, nullptr);
+            vkDestroyBuffer(device, frame.count_buffer, nullptr);
+            vkFreeMemory(device, frame.count_mem, nullptr);
+            vkDestroyBuffer(device, frame.cull_params_buffer, nullptr);
+            vkFreeMemory(device, frame.cull_params_mem, nullptr);
+            vkFreeCommandBuffers(device, command_pool, MAX_GRAPH_SEGMENTS, frame.cmd_bufs.data());
+            if (VK_NULL_HANDLE != compute_command_pool)
+            {
+                vkFreeCommandBuffers(device, compute_command_pool, MAX_GRAPH_SEGMENTS, frame.compute_cmd_bufs.data());
+            }
+        }
         vkDestroyCommandPool(device, command_pool, nullptr);
+        if (VK_NULL_HANDLE != compute_command_pool) vkDestroyCommandPool(device, compute_command_pool, nullptr);
 
         cleanupSwapchain();
+        timeline.cleanup();
+
+#ifdef VERBOSE_ON
+        pipeline_library.printStats();
+#endif
+        pipeline_library.cleanup();
+        vkDestroyPipelineLayout(device, pipeline_layout, nullptr);
+        vkDestroyPipelineLayout(device, post_pipeline_layout, nullptr);
+        vkDestroyPipelineLayout(device, cull_pipeline_layout, nullptr);
+        vkDestroyPipelineLayout(device, hiz_pipeline_layout, nullptr);
+        vkDestroySampler(device, hiz_sampler, nullptr);
+
+#ifdef VERBOSE_ON
+        printFramePacingReport();
+        gpu_profiler.printReport();
+#endif
+        gpu_profiler.cleanup();
 
-        vkDestroyDescriptorPool(device, descriptor_pool, nullptr);
-        vkDestroyDescriptorSetLayout(device, ubo_desc_layout, nullptr);
+#ifdef VERBOSE_ON
+        texture_streamer.printStats();
+        std::cout << std::endl << "Material descriptor sets: " << material_set_cache.size() << " unique, "
+                  << material_set_cache.hitCount() << " cache hits, " << material_set_cache.missCount() << " misses, "
+                  << material_set_cache.evictionCount() << " evicted with their texture's view" << std::endl;
+        geometry_pool.printStats();
+        printLodReport();
+        printClusterReport();
+#endif
+        for (auto& frame_alloc : frame_descriptors) frame_alloc.cleanup();
+        material_descriptors.cleanup();
+        material_set_cache.clear();
+        layout_cache.cleanup();
         for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++)
         {
             vkDestroyBuffer(device, uniform_buffer[i], nullptr);
             vkFreeMemory(device, uniform_buffer_memory[i], nullptr);
         }
-        vkDestroyBuffer(device, vertex_buffer, nullptr);
-        vkDestroyBuffer(device, index_buffer, nullptr);
-        vkFreeMemory(device, vertex_buffer_mem, nullptr);
-        vkFreeMemory(device, index_buffer_mem, nullptr);
-        vkDestroyImageView(device, tex_image_view, nullptr);
-        vkDestroyImage(device, tex_image, nullptr);
-        vkFreeMemory(device, tex_image_mem, nullptr);
+        geometry_pool.cleanup();
+        vkDestroyBuffer(device, hiz_counter, nullptr);
+        vkFreeMemory(device, hiz_counter_mem, nullptr);
+        texture_streamer.cleanup();
         vkDestroySampler(device, tex_sampler, nullptr);
         vkDestroyDevice(device, nullptr);
         destroyDebugMessenger();
         vkDestroySurfaceKHR(instance, surface, nullptr);
         vkDestroyInstance(instance, nullptr);
 
-        glfwDestroyWindow(window);
-        glfwTerminate();
+        if (!config.headless)
+        {
+            glfwDestroyWindow(window);
+            glfwTerminate();
+        }
+    }
+
+    void printFramePacingReport()
+    {
+        char line[128];
+        std::cout << std::endl << "Frame pacing (ms)         min       avg       p99   [" << presentModeName(present_mode)
+                  << (config.low_latency ? ", low latency" : "") << "]" << std::endl;
+        snprintf(line, sizeof(line), "\t%-20s %8.3f  %8.3f  %8.3f", "frame interval",
+                 frame_interval_ms.min(), frame_interval_ms.avg(), frame_interval_ms.percentile(0.99));
+        std::cout << line << std::endl;
+        snprintf(line, sizeof(line), "\t%-20s %8.3f  %8.3f  %8.3f", "input to present",
+                 input_to_present_ms.min(), input_to_present_ms.avg(), input_to_present_ms.percentile(0.99));
+        std::cout << line << std::endl;
+        if (dynamic_resolution)
+        {
+            snprintf(line, sizeof(line), "Render scale %.2f (%ux%u), GPU frame %.2f ms smoothed, target %.2f ms",
+                     resolution_controller.current(), render_extent.width, render_extent.height,
+                     resolution_controller.smoothedMs(), resolution_controller.targetMs());
+            std::cout << line << std::endl;
+        }
+    }
+
+    // Time from swapchain recreation to the first frame finishing on it, for each rendering path. The render pass
+    // path also rebuilds its render pass, framebuffers and pipelines; dynamic rendering keeps its pipelines.
+    void runResizeBenchmark(uint32_t iterations = 50)
+    {
+        bool saved = config.dynamic_rendering;
+        std::cout << std::endl << "Resize latency (ms)       min       avg       p99" << std::endl;
+        for (bool dynamic : { false, true })
+        {
+            if (dynamic && !device_caps.dynamic_rendering) continue;
+            config.dynamic_rendering = dynamic;
+            RollingStats resize_ms(iterations);
+            for (uint32_t i = 0; i <= iterations; i++)
+            {
+                double start_us = traceNowUs();
+                recreateSwapChain();
+                uint32_t image_idx = 0;
+                if (acquireFrame(image_idx)) drawFrame(image_idx);
+                timeline.wait(timeline.lastSubmitted());
+                if (i > 0) resize_ms.add((traceNowUs() - start_us) / 1000.0);    // first one includes the switch
+            }
+
+            char line[128];
+            snprintf(line, sizeof(line), "\t%-20s %8.3f  %8.3f  %8.3f", dynamic ? "dynamic rendering" : "render pass",
+                     resize_ms.min(), resize_ms.avg(), resize_ms.percentile(0.99));
+            std::cout << line << std::endl;
+        }
+        config.dynamic_rendering = saved;
+        recreateSwapChain();
+    }
+
+    void pollInput()
+    {
+        PROFILE_ZONE("poll events");
+        if (!config.headless) glfwPollEvents();
+        input_sample_us = traceNowUs();     // carried through to present for the latency measurement
     }
 
-    void drawFrame()
+    // Everything in a frame that can block: the GPU finishing with this frame slot, then the next swapchain
+    // image. Returns false if the swapchain had to be recreated instead.
+    bool acquireFrame(uint32_t& image_idx)
     {
-        vkWaitForFences(device, 1, &fence_in_flight, VK_TRUE, UINT64_MAX);
+        PROFILE_FUNCTION();
+        FrameSlot& frame = frames[frame_number % MAX_FRAMES_IN_FLIGHT];
+        {
+            PROFILE_ZONE("wait frame slot");
+            // Low latency waits for everything, so nothing is queued ahead of the frame about to be recorded
+            timeline.wait(config.low_latency ? timeline.lastSubmitted() : frame.retire_value);
+        }
+        deletion_queue.collect(timeline.completed());
 
-        uint32_t image_idx;
-        VkResult res = vkAcquireNextImageKHR(device, swapchain, UINT64_MAX, sem_image_available, VK_NULL_HANDLE, &image_idx);
+        VkResult res;
+        {
+            PROFILE_ZONE("acquire");
+            res = vkAcquireNextImageKHR(device, swapchain, UINT64_MAX, frame.image_available, VK_NULL_HANDLE, &image_idx);
+        }
         if (VK_ERROR_OUT_OF_DATE_KHR == res)
         {
             recreateSwapChain();    // Something has changed that makes present impossible
-            return;
+            return false;
         }
         if (VK_SUCCESS != res && VK_SUBOPTIMAL_KHR != res)  // both are 'successful-ish' results
         {
             throw std::runtime_error("Error acquiring next swap chain image");
         }
+        return true;
+    }
 
-        // By here we've assured we'll be submitting work, so we should reset the fence
-        vkResetFences(device, 1, &fence_in_flight);
-
-        updateUniformBuffer(image_idx);
+    void drawFrame(uint32_t image_idx)
+    {
+        PROFILE_FUNCTION();
+        VkResult res;
+        uint32_t slot = frame_number % MAX_FRAMES_IN_FLIGHT;
+        FrameSlot& frame = frames[slot];
 
-        // Allocate on 1st pass
-        if (VK_NULL_HANDLE == render_cmd_buf) render_cmd_buf = createCommandBuffer();
+        // The timeline wait in acquireFrame guarantees the GPU is done with last use of this slot's descriptor sets
+        frame_descriptors[slot].reset();
 
-        vkResetCommandBuffer(render_cmd_buf, 0);
-        recordCommandBuffer(render_cmd_buf, image_idx);
+        {
+            PROFILE_ZONE("update ubo");
+            updateUniformBuffer(slot);
+        }
 
-        VkPipelineStageFlags wait_stages[] = { VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT };
-        VkSubmitInfo si = { VK_STRUCTURE_TYPE_SUBMIT_INFO, nullptr };
-        si.waitSemaphoreCount = 1;
-        si.pWaitSemaphores = &sem_image_available;
-        si.pWaitDstStageMask = wait_stages;
-        si.commandBufferCount = 1;
-        si.pCommandBuffers = &render_cmd_buf;
-        si.signalSemaphoreCount = 1;
-        si.pSignalSemaphores = &sem_render_complete;
+        {
+            PROFILE_ZONE("record");
+            recordCommandBuffers(frame, image_idx, slot);
+        }
 
-        if (VK_SUCCESS != vkQueueSubmit(gfx_queue, 1, &si, fence_in_flight))
+        // One submit per graph segment. Each waits for the segment before it on the timeline; the one that first
+        // touches the swapchain image waits for the image, and the last signals present (binary, as WSI requires).
+        // The last timeline value retires everything this frame used.
+        size_t segment_count = render_graph.segmentCount();
+        size_t acquire_segment = render_graph.firstSegmentUsing(graph_backbuffer);
+        uint64_t prev_value = 0;
+        for (size_t seg = 0; seg < segment_count; seg++)
         {
-            throw std::runtime_error("Error submitting draw command buffer");
+            bool last = (seg + 1 == segment_count);
+            bool compute = (PassQueue::Compute == render_graph.segmentQueue(seg));
+            VkCommandBuffer cb = compute ? frame.compute_cmd_bufs[seg] : frame.cmd_bufs[seg];
+
+            VkSemaphore wait_sems[2];
+            uint64_t wait_values[2];
+            VkPipelineStageFlags wait_stages[2];
+            uint32_t wait_count = 0;
+            if (seg == acquire_segment)
+            {
+                wait_sems[wait_count] = frame.image_available;
+                wait_values[wait_count] = 0;    // ignored for binary semaphores
+                wait_stages[wait_count++] = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+            }
+            if (seg > 0)
+            {
+                wait_sems[wait_count] = timeline.semaphore();
+                wait_values[wait_count] = prev_value;
+                wait_stages[wait_count++] = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+            }
+
+            uint64_t signal_values[] = { timeline.nextValue(), 0 };
+            VkSemaphore signal_sems[] = { timeline.semaphore(), sem_render_complete[image_idx] };
+
+            VkTimelineSemaphoreSubmitInfo timeline_si = { VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO, nullptr };
+            timeline_si.waitSemaphoreValueCount = wait_count;
+            timeline_si.pWaitSemaphoreValues = wait_values;
+            timeline_si.signalSemaphoreValueCount = last ? 2 : 1;
+            timeline_si.pSignalSemaphoreValues = signal_values;
+
+            VkSubmitInfo si = { VK_STRUCTURE_TYPE_SUBMIT_INFO, &timeline_si };
+            si.waitSemaphoreCount = wait_count;
+            si.pWaitSemaphores = wait_sems;
+            si.pWaitDstStageMask = wait_stages;
+            si.commandBufferCount = 1;
+            si.pCommandBuffers = &cb;
+            si.signalSemaphoreCount = last ? 2 : 1;
+            si.pSignalSemaphores = signal_sems;
+
+            PROFILE_ZONE("submit");
+            runtime_counters.submits++;
+            if (VK_SUCCESS != vkQueueSubmit(compute ? compute_queue : gfx_queue, 1, &si, VK_NULL_HANDLE))
+            {
+                throw std::runtime_error("Error submitting draw command buffer");
+            }
+            prev_value = signal_values[0];
         }
+        frame.retire_value = prev_value;
+        texture_streamer.retire(deletion_queue, prev_value, material_set_cache);    // images replaced while recording this frame
+        geometry_pool.retire(deletion_queue, prev_value);       // buffers replaced, and staging
+        frame_number++;
 
         VkPresentInfoKHR present = { VK_STRUCTURE_TYPE_PRESENT_INFO_KHR, nullptr };
         present.waitSemaphoreCount = 1;
-        present.pWaitSemaphores = &sem_render_complete;
+        present.pWaitSemaphores = &sem_render_complete[image_idx];
         present.swapchainCount = 1;
         present.pSwapchains = &swapchain;
         present.pImageIndices = &image_idx;
         present.pResults = nullptr;
 
-        res = vkQueuePresentKHR(present_queue, &present);
+        {
+            PROFILE_ZONE("present");
+            res = vkQueuePresentKHR(present_queue, &present);
+        }
+
+        double now_us = traceNowUs();
+        input_to_present_ms.add((now_us - input_sample_us) / 1000.0);
+        if (last_present_us > 0.0) frame_interval_ms.add((now_us - last_present_us) / 1000.0);
+        last_present_us = now_us;
+
         if (VK_ERROR_OUT_OF_DATE_KHR == res || VK_SUBOPTIMAL_KHR == res || frame_buffer_resized)
         {
             frame_buffer_resized = false;
@@ -253,6 +5725,7 @@ private:
 
     void createInstance() 
     {
+        PROFILE_FUNCTION();
         // Fetch list of available instance extensions
         uint32_t ext_count = 0;
         vkEnumerateInstanceExtensionProperties(nullptr, &ext_count, nullptr);
@@ -282,7 +5755,13 @@ private:
         appInfo.applicationVersion = VK_API_VERSION_1_0;    // App version, not API version, but format works so... 
         appInfo.pEngineName = "No Engine";
         appInfo.engineVersion = 0;
-        appInfo.apiVersion = VK_HEADER_VERSION_COMPLETE;    // Use latest installed version (1.3)
+        // The renderer's target, unless the loader is older (1.0 loaders can't be asked, and don't accept more).
+        // Devices are then checked against what this ends up as.
+        uint32_t loader_version = VK_API_VERSION_1_0;
+        auto pEIV_fxn = (PFN_vkEnumerateInstanceVersion)vkGetInstanceProcAddr(nullptr, "vkEnumerateInstanceVersion");
+        if (nullptr != pEIV_fxn) pEIV_fxn(&loader_version);
+        instance_api_version = std::min(loader_version, DeviceFeatures::target_api_version);
+        appInfo.apiVersion = instance_api_version;
 
         // Instance creation struct, which points at app info
         VkInstanceCreateInfo createInfo{ VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO, nullptr };
@@ -350,12 +5829,19 @@ private:
 
     std::vector<const char*> getRequiredInstanceExtensions()
     {
-        // glfw required extensions list
-        uint32_t     glfw_ext_count = 0;
-        const char** glfw_extensions;
-        glfw_extensions = glfwGetRequiredInstanceExtensions(&glfw_ext_count);
-
-        std::vector<const char*> required_extensions(glfw_extensions, glfw_extensions + glfw_ext_count);
+        std::vector<const char*> required_extensions;
+        if (config.headless)
+        {
+            required_extensions = { VK_KHR_SURFACE_EXTENSION_NAME, VK_EXT_HEADLESS_SURFACE_EXTENSION_NAME };
+        }
+        else
+        {
+            // glfw required extensions list
+            uint32_t     glfw_ext_count = 0;
+            const char** glfw_extensions;
+            glfw_extensions = glfwGetRequiredInstanceExtensions(&glfw_ext_count);
+            required_extensions.assign(glfw_extensions, glfw_extensions + glfw_ext_count);
+        }
 
         if (enable_validation)
         {
@@ -375,16 +5861,19 @@ private:
 
     void createSurface()
     {
-#if 0
-        // 'by-hand' version
-        VkWin32SurfaceCreateInfoKHR surf_ci = { VK_STRUCTURE_TYPE_WIN32_SURFACE_CREATE_INFO_KHR, nullptr };
-        surf_ci.hwnd = glfwGetWin32Window(window);
-        surf_ci.hinstance = GetModuleHandle(nullptr);   // HINSTANCE of current process
-        if (vkCreateWin32SurfaceKHR(instance, &surf_ci, nullptr, &surface) != VK_SUCCESS) 
+        PROFILE_FUNCTION();
+
+        // Headless presents go nowhere, but run the same swapchain path as a window (e.g. on lavapipe in CI)
+        if (config.headless)
         {
-            throw std::runtime_error("Failed to create window surface!");
+            auto pCHS_fxn = (PFN_vkCreateHeadlessSurfaceEXT)vkGetInstanceProcAddr(instance, "vkCreateHeadlessSurfaceEXT");
+            VkHeadlessSurfaceCreateInfoEXT surf_ci = { VK_STRUCTURE_TYPE_HEADLESS_SURFACE_CREATE_INFO_EXT, nullptr };
+            if (nullptr == pCHS_fxn || VK_SUCCESS != pCHS_fxn(instance, &surf_ci, nullptr, &surface))
+            {
+                throw std::runtime_error("Failed to create headless surface!");
+            }
+            return;
         }
-#endif
 
         // Use glfw to create surface for us
         if (VK_SUCCESS != glfwCreateWindowSurface(instance, window, nullptr, &surface))
@@ -393,8 +5882,10 @@ private:
         }
     }
 
+    // Ranks every device, best first, and takes the best acceptable one (or the best matching --gpu)
     void choosePhysicalDevice()
     {
+        PROFILE_FUNCTION();
         uint32_t dev_count = 0;
         vkEnumeratePhysicalDevices(instance, &dev_count, nullptr);
         if (0 == dev_count) throw std::runtime_error("No Vulkan-capable physical devices");
@@ -402,16 +5893,142 @@ private:
         std::vector<VkPhysicalDevice> devices(dev_count);
         vkEnumeratePhysicalDevices(instance, &dev_count, devices.data());
 
+        struct Candidate
+        {
+            VkPhysicalDevice            phys;
+            VkPhysicalDeviceProperties  props;
+            bool                        acceptable;
+            std::string                 reason;     // when it isn't
+            uint64_t                    score;
+        };
+        std::vector<Candidate> candidates;
         for (const VkPhysicalDevice& device : devices)
         {
-            if (physDeviceAcceptable(device))
+            Candidate c = { device, {}, false, {}, 0 };
+            c.acceptable = physDeviceAcceptable(device, c.reason);
+            vkGetPhysicalDeviceProperties(device, &c.props);
+            if (c.acceptable) c.score = scorePhysicalDevice(device);
+            candidates.push_back(c);
+        }
+        std::stable_sort(candidates.begin(), candidates.end(), [](const Candidate& a, const Candidate& b)
+        {
+            return (a.acceptable != b.acceptable) ? a.acceptable : a.score > b.score;
+        });
+
+        for (const auto& c : candidates)
+        {
+            if (c.acceptable && (config.gpu.empty() || gpuMatches(config.gpu, c.props)))
             {
-                physical_device = device;
+                physical_device = c.phys;
                 break;
             }
         }
 
-        if (VK_NULL_HANDLE == physical_device) throw std::runtime_error("No suitable physical device found");
+        std::cout << std::endl << "GPUs, best first" << (config.gpu.empty() ? "" : " (--gpu " + config.gpu + ")") << std::endl;
+        for (const auto& c : candidates)
+        {
+            std::cout << '\t' << (c.phys == physical_device ? "* " : "  ") << c.props.deviceName << " ("
+                      << deviceTypeName(c.props.deviceType) << std::hex << ", vendor 0x" << c.props.vendorID
+                      << ", device 0x" << c.props.deviceID << std::dec << "): ";
+            if (c.acceptable) std::cout << "score " << c.score << std::endl;
+            else std::cout << "unsuitable - " << c.reason << std::endl;
+        }
+
+        if (VK_NULL_HANDLE == physical_device)
+        {
+            throw std::runtime_error(config.gpu.empty() ? "No suitable physical device found" : "No suitable physical device matches --gpu " + config.gpu);
+        }
+    }
+
+    // Higher is faster. Device type dominates (a software rasterizer scores lowest), then the largest
+    // device-local heap, then queues and features the renderer makes use of.
+    uint64_t scorePhysicalDevice(VkPhysicalDevice phys)
+    {
+        VkPhysicalDeviceProperties props;
+        vkGetPhysicalDeviceProperties(phys, &props);
+        VkPhysicalDeviceVulkan12Features features_12 = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES, nullptr };
+        VkPhysicalDeviceFeatures2 features = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2, &features_12 };
+        vkGetPhysicalDeviceFeatures2(phys, &features);
+
+        uint64_t score = 0;
+        switch (props.deviceType)
+        {
+        case VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU:      score += 1000000;   break;
+        case VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU:    score += 300000;    break;
+        case VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU:       score += 200000;    break;
+        default:                                        break;
+        }
+
+        // A point per MB, capped well short of the gap between device types
+        VkPhysicalDeviceMemoryProperties mem_props;
+        vkGetPhysicalDeviceMemoryProperties(phys, &mem_props);
+        VkDeviceSize vram = 0;
+        for (uint32_t i = 0; i < mem_props.memoryHeapCount; i++)
+        {
+            if (mem_props.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) vram = std::max(vram, mem_props.memoryHeaps[i].size);
+        }
+        score += std::min<uint64_t>(vram >> 20, 65536);
+
+        // Families that can run alongside graphics: compute (async post-processing) and transfer-only (DMA engines)
+        uint32_t fam_count = 0;
+        vkGetPhysicalDeviceQueueFamilyProperties(phys, &fam_count, nullptr);
+        std::vector<VkQueueFamilyProperties> families(fam_count);
+        vkGetPhysicalDeviceQueueFamilyProperties(phys, &fam_count, families.data());
+        bool dedicated_compute = false, dedicated_transfer = false;
+        for (const auto& fam : families)
+        {
+            if ((fam.queueFlags & VK_QUEUE_COMPUTE_BIT) && !(fam.queueFlags & VK_QUEUE_GRAPHICS_BIT)) dedicated_compute = true;
+            if ((fam.queueFlags & VK_QUEUE_TRANSFER_BIT) && !(fam.queueFlags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT))) dedicated_transfer = true;
+        }
+        if (dedicated_compute) score += 2000;
+        if (dedicated_transfer) score += 1000;
+
+        // Optional features, and formats and sample counts, that there are paths for
+        for (VkBool32 feature : { features.features.multiDrawIndirect, features.features.drawIndirectFirstInstance,
+                                  features_12.drawIndirectCount, features.features.pipelineStatisticsQuery,
+                                  props.limits.timestampComputeAndGraphics })
+        {
+            if (VK_TRUE == feature) score += 500;
+        }
+        VkFormatProperties depth_props;
+        vkGetPhysicalDeviceFormatProperties(phys, VK_FORMAT_D32_SFLOAT, &depth_props);
+        if (depth_props.optimalTilingFeatures & VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT) score += 500;
+        if (props.limits.framebufferColorSampleCounts & VK_SAMPLE_COUNT_8_BIT) score += 250;
+        return score;
+    }
+
+    // --gpu: "0xVVVV" matches a vendor ID, "0xVVVV:0xDDDD" a vendor and device, ":0xDDDD" just a device.
+    // Anything else is a case-insensitive part of the device name. AppConfig::parse has checked the IDs.
+    static bool gpuMatches(const std::string& filter, const VkPhysicalDeviceProperties& props)
+    {
+        auto hex = [](const std::string& id) { return static_cast<uint32_t>(std::stoul(id, nullptr, 16)); };
+        if (0 == filter.rfind("0x", 0) || 0 == filter.rfind(":0x", 0))
+        {
+            size_t colon = filter.find(':');
+            std::string vendor = filter.substr(0, colon);
+            if (!vendor.empty() && hex(vendor) != props.vendorID) return false;
+            return (std::string::npos == colon) || (hex(filter.substr(colon + 1)) == props.deviceID);
+        }
+
+        std::string name = props.deviceName;
+        std::string wanted = filter;
+        for (std::string* str : { &name, &wanted })
+        {
+            std::transform(str->begin(), str->end(), str->begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+        }
+        return std::string::npos != name.find(wanted);
+    }
+
+    static const char* deviceTypeName(VkPhysicalDeviceType type)
+    {
+        switch (type)
+        {
+        case VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU:      return "discrete";
+        case VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU:    return "integrated";
+        case VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU:       return "virtual";
+        case VK_PHYSICAL_DEVICE_TYPE_CPU:               return "CPU";
+        default:                                        return "other";
+        }
     }
 
     struct QueueFamilies
@@ -430,46 +6047,34 @@ private:
         }
     };
 
-    bool physDeviceAcceptable(VkPhysicalDevice phys)
+    // Hard requirements only - choosePhysicalDevice ranks whatever passes. Sets reason when it fails.
+    bool physDeviceAcceptable(VkPhysicalDevice phys, std::string& reason)
     {
-        VkPhysicalDeviceProperties2 dev_props = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2_KHR, nullptr };
-        VkPhysicalDeviceFeatures2   dev_features = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2_KHR, nullptr };
-
-        vkGetPhysicalDeviceProperties2(phys, &dev_props);
-        vkGetPhysicalDeviceFeatures2(phys, &dev_features);
+        reason = DeviceFeatures::missingRequirements(phys, instance_api_version);
+        if (!reason.empty()) return false;
 
-        // for fun - force integrated GPU
-        //if (VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU != dev_props.properties.deviceType) return false;
-
-        // Filter on min properties & features here, e.g.
-        VkBool32 reqd_features = (dev_features.features.samplerAnisotropy);
-
-        // for example...
-        if (VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU == dev_props.properties.deviceType &&
-            dev_features.features.vertexPipelineStoresAndAtomics)
+        // Check for required device extensions
+        if (!checkDeviceExtensions(phys))
         {
-            bool gpu_ok = true; // ignore this for now, any Vulkan device is ok
+            reason = "missing device extensions";
+            return false;
         }
 
-        // Check for required device extensions
-        bool has_extensions = checkDeviceExtensions(phys);
-
         // Verify swap chain support
-        bool swap_chain_ok = false;
-        if (has_extensions)
+        SwapChainDetails swap_details = querySwapChainSupport(phys);
+        if (swap_details.formats.empty() || swap_details.modes.empty())    // anything goes
         {
-            SwapChainDetails swap_details = querySwapChainSupport(phys);
-            swap_chain_ok = !swap_details.formats.empty() && !swap_details.modes.empty();   // anything goes
+            reason = "can't present to the surface";
+            return false;
         }
 
         // Check for presence of required queues
-        QueueFamilies queue_fam_idx = findDeviceQueueFamilies(phys);
-        
-        bool found = (queue_fam_idx.isComplete() && swap_chain_ok && reqd_features);
-#ifdef VERBOSE_ON
-        if (found) std::cout << std::endl << "Physical GPU selected: " << dev_props.properties.deviceName << std::endl;
-#endif
-        return found;
+        if (!findDeviceQueueFamilies(phys).isComplete())
+        {
+            reason = "no graphics or present queue";
+            return false;
+        }
+        return true;
     }
 
     QueueFamilies findDeviceQueueFamilies(VkPhysicalDevice phys)
@@ -500,6 +6105,19 @@ private:
 
                 idx++;
             }
+
+            // Prefer a compute-only family, whose queue can run alongside graphics (async compute). It needs
+            // timestamps, so the work sent to it can still be profiled.
+            if (family_indices.graphics_family.has_value()) family_indices.compute_family = family_indices.graphics_family;
+            for (uint32_t i = 0; i < fam_count; i++)
+            {
+                const VkQueueFamilyProperties& props = fam_props[i].queueFamilyProperties;
+                if ((props.queueFlags & VK_QUEUE_COMPUTE_BIT) && !(props.queueFlags & VK_QUEUE_GRAPHICS_BIT) && props.timestampValidBits > 0)
+                {
+                    family_indices.compute_family = i;
+                    break;
+                }
+            }
         }
 
         return family_indices;
@@ -532,12 +6150,14 @@ private:
 
     void createLogicalDevice()
     {
+        PROFILE_FUNCTION();
         QueueFamilies queue_idx = findDeviceQueueFamilies(physical_device);
         float queue_priority = 1.0f;
 
-        // Queues (gfx & present - which may be the same family - so creating either 1 or 2 queues)
+        // Queues (gfx, present & compute - which may all be the same family - so creating 1 to 3 queues)
         std::vector<VkDeviceQueueCreateInfo> dev_q_ci;// = { VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO, nullptr };
-        std::set<uint32_t> unique_q_families = { queue_idx.graphics_family.value(), queue_idx.present_family.value() };
+        std::set<uint32_t> unique_q_families = { queue_idx.graphics_family.value(), queue_idx.present_family.value(),
+                                                 queue_idx.compute_family.value() };
         for (uint32_t q_fam : unique_q_families)
         {
             VkDeviceQueueCreateInfo ci = { VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO, nullptr };
@@ -547,17 +6167,34 @@ private:
             dev_q_ci.push_back(ci);
         }
 
-        // Features
-        VkPhysicalDeviceFeatures2 dev_features = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2, nullptr };
-        dev_features.features.samplerAnisotropy = VK_TRUE;
+        // Features: the required ones plus every optional one the device has
+        DeviceFeatures features;
+        features.negotiate(physical_device, instance_api_version);
+        features.report();
+        device_caps = features.caps();
+
+        std::vector<const char*> enabled_extensions = device_extensions;
+        enabled_extensions.insert(enabled_extensions.end(), features.extensions().begin(), features.extensions().end());
+
+        if (config.dynamic_rendering && !device_caps.dynamic_rendering)
+        {
+            std::cout << "Dynamic rendering not supported - using render pass objects" << std::endl;
+            config.dynamic_rendering = false;
+        }
+        if (config.vertex_pulling && !device_caps.buffer_device_address)
+        {
+            std::cout << "Buffer device address not supported - vertex pulling off" << std::endl;
+            config.vertex_pulling = false;
+        }
 
         // Logical Device
         VkDeviceCreateInfo dev_ci = { VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO, nullptr };
         dev_ci.pQueueCreateInfos = dev_q_ci.data();
         dev_ci.queueCreateInfoCount = static_cast<uint32_t>(dev_q_ci.size());
-        dev_ci.pEnabledFeatures = &dev_features.features;
-        dev_ci.enabledExtensionCount = static_cast<uint32_t>(device_extensions.size());
-        dev_ci.ppEnabledExtensionNames = device_extensions.data();
+        dev_ci.pNext = features.chain();   // features2 chain, so pEnabledFeatures must stay null
+        dev_ci.pEnabledFeatures = nullptr;
+        dev_ci.enabledExtensionCount = static_cast<uint32_t>(enabled_extensions.size());
+        dev_ci.ppEnabledExtensionNames = enabled_extensions.data();
         
 #if 0
         // these are obsoleted and ignored after 1.0, but may be set for backwards compatibility
@@ -589,6 +6226,17 @@ private:
 
         q_info.queueFamilyIndex = queue_idx.present_family.value();
         vkGetDeviceQueue2(device, &q_info, &present_queue);
+
+        graphics_family = queue_idx.graphics_family.value();
+        compute_family = queue_idx.compute_family.value();
+        if (compute_family != graphics_family)
+        {
+            q_info.queueFamilyIndex = compute_family;
+            vkGetDeviceQueue2(device, &q_info, &compute_queue);
+        }
+#ifdef VERBOSE_ON
+        std::cout << "Async compute: " << ((compute_family != graphics_family) ? "queue family " + std::to_string(compute_family) : "not available") << std::endl;
+#endif
     }
 
     struct SwapChainDetails
@@ -639,12 +6287,16 @@ private:
         return formats[0];
     }
 
+    // The configured mode if the surface has it, else the nearest that doesn't tear more than asked for:
+    // IMMEDIATE falls back to MAILBOX, and everything ends at FIFO
     VkPresentModeKHR choosePresentMode(const std::vector<VkPresentModeKHR>& modes)
     {
-        // Use mailbox if available for least possible latency. If not, use FIFO
-        for (const auto& mode : modes)
+        std::vector<VkPresentModeKHR> preference = { config.present_mode };
+        if (VK_PRESENT_MODE_IMMEDIATE_KHR == config.present_mode) preference.push_back(VK_PRESENT_MODE_MAILBOX_KHR);
+
+        for (VkPresentModeKHR wanted : preference)
         {
-            if (VK_PRESENT_MODE_MAILBOX_KHR == mode) return mode;
+            if (std::find(modes.begin(), modes.end(), wanted) != modes.end()) return wanted;
         }
         
         return VK_PRESENT_MODE_FIFO_KHR;    // guaranteed available by spec
@@ -655,25 +6307,28 @@ private:
         const uint32_t swap_controlled = 0xffffffff;
         if (swap_controlled != caps.currentExtent.width) return caps.currentExtent; // Not controllable by swapchain
 
-        int w, h;
-        glfwGetFramebufferSize(window, &w, &h);
+        int w = window_width, h = window_height;
+        if (!config.headless) glfwGetFramebufferSize(window, &w, &h);
         VkExtent2D ext;
         ext.width = std::clamp(static_cast<uint32_t>(w), caps.minImageExtent.width, caps.maxImageExtent.width);
         ext.height = std::clamp(static_cast<uint32_t>(h), caps.minImageExtent.height, caps.maxImageExtent.height);
         return ext;
     }
 
-    void createSwapChain()
+    void createSwapChain(VkSwapchainKHR old_swapchain = VK_NULL_HANDLE)
     {
+        PROFILE_FUNCTION();
         SwapChainDetails swap_details = querySwapChainSupport(physical_device);
         VkPresentModeKHR swap_mode = choosePresentMode(swap_details.modes);
 
         swapchain_format = chooseSwapFormat(swap_details.formats);
         swapchain_extent = chooseSwapExtent(swap_details.caps);
 
-        uint32_t image_count = swap_details.caps.maxImageCount;
-        if (0 == image_count) image_count = swap_details.caps.minImageCount + 1;    // max == 0 is flag for 'no limit'
-        image_count = std::min(image_count, MAX_FRAMES_IN_FLIGHT);                  // discourage overly-large swap chains.
+        // Each extra image is another frame the presentation engine can queue, i.e. more latency under FIFO.
+        // One spare lets us render while an image is held for display; low latency mode goes without.
+        // Per-image resources are sized from the count the driver actually returns below.
+        uint32_t image_count = swap_details.caps.minImageCount + (config.low_latency ? 0 : 1);
+        if (0 != swap_details.caps.maxImageCount) image_count = std::min(image_count, swap_details.caps.maxImageCount);  // max == 0 is flag for 'no limit'
 
         // Build up the swapchain CI
         VkSwapchainCreateInfoKHR swap_ci = { VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR, nullptr };
@@ -683,12 +6338,19 @@ private:
         swap_ci.imageColorSpace = swapchain_format.colorSpace;
         swap_ci.imageExtent = swapchain_extent;
         swap_ci.imageArrayLayers = 1;
-        swap_ci.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;   // rendering directly to swap images
+        swapchain_usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT |                                 // rendering directly to swap images
+                          (swap_details.caps.supportedUsageFlags & VK_IMAGE_USAGE_TRANSFER_DST_BIT);   // or upscaling into them
+        if (config.checksum) swapchain_usage |= VK_IMAGE_USAGE_TRANSFER_SRC_BIT;                // copied out for the checksum
+        swap_ci.imageUsage = swapchain_usage;
         swap_ci.presentMode = swap_mode;
+        present_mode = swap_mode;
+#ifdef VERBOSE_ON
+        std::cout << std::endl << "Present mode " << presentModeName(swap_mode) << ", " << image_count << " swapchain images" << std::endl;
+#endif
         swap_ci.clipped = VK_TRUE;  // Don't render pixels that are obscured or clipped
         swap_ci.preTransform = swap_details.caps.currentTransform;  // No image transform
         swap_ci.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR; // Don't blend over other windows
-        swap_ci.oldSwapchain = VK_NULL_HANDLE;  // This is not a replacement swapchain
+        swap_ci.oldSwapchain = old_swapchain;   // Lets the driver hand over resources when this is a replacement
 
         QueueFamilies q_idx = findDeviceQueueFamilies(physical_device);
         uint32_t qfi[] = { q_idx.graphics_family.value(), q_idx.present_family.value() };
@@ -715,47 +6377,113 @@ private:
         vkGetSwapchainImagesKHR(device, swapchain, &image_count, nullptr);
         swapchain_images.resize(image_count);
         vkGetSwapchainImagesKHR(device, swapchain, &image_count, swapchain_images.data());
+
+        // Present waits on a per-image semaphore: re-acquiring an image guarantees its last present is done with it
+        VkSemaphoreCreateInfo sem_ci = { VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO, nullptr };
+        sem_render_complete.resize(image_count);
+        for (auto& sem : sem_render_complete)
+        {
+            if (VK_SUCCESS != vkCreateSemaphore(device, &sem_ci, nullptr, &sem))
+            {
+                throw std::runtime_error("Error creating present semaphore");
+            }
+        }
     }
 
     void recreateSwapChain() // Works on Intel, validation error "vkCreateSwapchainKHR: internal drawable creation failed" on nvidia
     {
-        int w = 0, h = 0;
-        glfwGetFramebufferSize(window, &w, &h);
+        int w = 1, h = 1;
+        if (!config.headless) glfwGetFramebufferSize(window, &w, &h);
         while (0 == w || 0 == h)
         {
             glfwWaitEvents();   // We've been minimized, so just wait for an event that says otherwise
             glfwGetFramebufferSize(window, &w, &h);
         }
 
-        vkDeviceWaitIdle(device);   // Big hammer synchronization
-
-        cleanupSwapchain();         // Destroy all existing swapchain resources
+        // No GPU wait: everything in-flight frames may still use is handed to the deletion queue. The old
+        // swapchain is passed to its replacement, then retired along with its present semaphores.
+        VkSwapchainKHR old_swapchain = swapchain;
+        std::vector<VkSemaphore> old_render_complete = std::move(sem_render_complete);
+        retireSwapchainResources(timeline.lastSubmitted());
+
+        createSwapChain(old_swapchain);
+        retireSwapchain(old_swapchain, old_render_complete);
+        createSwapImageViews();
+        buildRenderGraph();
+        createRenderPass();
+        createGraphicsPipeline();   // Viewport & scissor are dynamic; only render pass pipelines need rebuilding
+        createFrameBuffers();
+    }
+
+    // Destroy everything built on the swapchain (but not the swapchain itself) once the GPU passes retire_value.
+    // Dynamic rendering has no render pass or framebuffers, and its pipelines only depend on formats, so they're kept.
+    void retireSwapchainResources(uint64_t retire_value)
+    {
+        VkDevice dev = device;
+        for (VkFramebuffer fb : swapchain_framebuffers)
+        {
+            deletion_queue.push(retire_value, [dev, fb]() { vkDestroyFramebuffer(dev, fb, nullptr); });
+        }
+        swapchain_framebuffers.clear();
+        if (VK_NULL_HANDLE != render_pass)
+        {
+            pipeline_library.clear(&deletion_queue, retire_value);    // Pipelines reference the render pass
+            VkRenderPass pass = render_pass;
+            deletion_queue.push(retire_value, [dev, pass]() { vkDestroyRenderPass(dev, pass, nullptr); });
+            render_pass = VK_NULL_HANDLE;
+        }
+        render_graph.reset(&deletion_queue, retire_value);
+        if (VK_NULL_HANDLE != hiz_image)
+        {
+            VkImage image = hiz_image;
+            VkImageView view = hiz_view;
+            VkDeviceMemory mem = hiz_mem;
+            deletion_queue.push(retire_value, [dev, image, view, mem]()
+            {
+                vkDestroyImageView(dev, view, nullptr);
+                vkDestroyImage(dev, image, nullptr);
+                vkFreeMemory(dev, mem, nullptr);
+            });
+            hiz_image = VK_NULL_HANDLE;
+            hiz_view = VK_NULL_HANDLE;
+            hiz_mem = VK_NULL_HANDLE;
+        }
+
+        std::vector<VkImageView> views = std::move(swapchain_image_views);
+        deletion_queue.push(retire_value, [dev, views]()
+        {
+            for (VkImageView view : views) vkDestroyImageView(dev, view, nullptr);
+        });
+        swapchain_image_views.clear();
+    }
 
-        createSwapChain();
-        createSwapImageViews();
-        createRenderPass();
-        createGraphicsPipeline();   // Can avoid re-creation by making viewport & scissor dynamic
-        createFrameBuffers();
+    // Presentation signals nothing we can wait on, so a swapchain and the semaphores its presents wait on are
+    // kept until a full set of later frames has completed, by which point its last present is long done.
+    // Every one of its images may have been queued for display, so wait out whichever is more frames.
+    void retireSwapchain(VkSwapchainKHR old_swapchain, const std::vector<VkSemaphore>& old_render_complete)
+    {
+        VkDevice dev = device;
+        uint64_t frames = std::max<uint64_t>(MAX_FRAMES_IN_FLIGHT, old_render_complete.size());
+        deletion_queue.push(timeline.lastSubmitted() + frames, [dev, old_swapchain, old_render_complete]()
+        {
+            for (VkSemaphore sem : old_render_complete) vkDestroySemaphore(dev, sem, nullptr);
+            vkDestroySwapchainKHR(dev, old_swapchain, nullptr);
+        });
     }
 
+    // Shutdown only - the device must be idle
     void cleanupSwapchain()
     {
-        for (auto& fb : swapchain_framebuffers) vkDestroyFramebuffer(device, fb, nullptr);
-        swapchain_framebuffers.clear();
-        vkDestroyPipeline(device, pipeline, nullptr); 
-        pipeline = VK_NULL_HANDLE;
-        vkDestroyPipelineLayout(device, pipeline_layout, nullptr);
-        pipeline_layout = VK_NULL_HANDLE;
-        vkDestroyRenderPass(device, render_pass, nullptr);
-        render_pass = VK_NULL_HANDLE;
-        for (auto& imageview : swapchain_image_views) vkDestroyImageView(device, imageview, nullptr);
-        swapchain_image_views.clear();
-        vkDestroySwapchainKHR(device, swapchain, nullptr);
+        retireSwapchainResources(timeline.lastSubmitted());
+        retireSwapchain(swapchain, sem_render_complete);
         swapchain = VK_NULL_HANDLE;
+        sem_render_complete.clear();
+        deletion_queue.flush();
     }
 
     void createSwapImageViews()
     {
+        PROFILE_FUNCTION();
         swapchain_image_views.resize(swapchain_images.size());
 
         for (size_t i = 0; i < swapchain_image_views.size(); i++)
@@ -781,93 +6509,342 @@ private:
         }
     }
 
-    void createTexImageView()
+    // First format in the list usable as an optimally-tiled depth attachment
+    VkFormat findDepthFormat()
     {
-        VkImageViewCreateInfo ci = { VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO, nullptr };
-        ci.image = tex_image;
-        ci.viewType = VK_IMAGE_VIEW_TYPE_2D;
-        ci.format = VK_FORMAT_R8G8B8A8_SRGB;
-        ci.components.r = VK_COMPONENT_SWIZZLE_IDENTITY;
-        ci.components.g = VK_COMPONENT_SWIZZLE_IDENTITY;
-        ci.components.b = VK_COMPONENT_SWIZZLE_IDENTITY;
-        ci.components.a = VK_COMPONENT_SWIZZLE_IDENTITY;
-        ci.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-        ci.subresourceRange.baseMipLevel = 0;
-        ci.subresourceRange.levelCount = 1;
-        ci.subresourceRange.baseArrayLayer = 0;
-        ci.subresourceRange.layerCount = 1;
-
-        if (VK_SUCCESS != vkCreateImageView(device, &ci, nullptr, &tex_image_view))
+        const VkFormat candidates[] = { VK_FORMAT_D32_SFLOAT, VK_FORMAT_D32_SFLOAT_S8_UINT, VK_FORMAT_D24_UNORM_S8_UINT, VK_FORMAT_D16_UNORM };
+        for (VkFormat format : candidates)
         {
-            throw std::runtime_error("Failure while creating texture image view");
+            VkFormatProperties props;
+            vkGetPhysicalDeviceFormatProperties(physical_device, format, &props);
+            if (props.optimalTilingFeatures & VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT) return format;
         }
+        throw std::runtime_error("No supported depth attachment format");
     }
 
-    static std::vector<char> readSPIRV(const std::string& filename)
+    // Passes and attachments for the current swapchain, rebuilt with it. The depth buffer is a graph transient:
+    // the graph places it, and orders each frame's depth writes after the previous frame's.
+    void buildRenderGraph()
     {
-        std::ifstream file(filename, std::ios::ate | std::ios::binary);
-        if (!file.is_open()) throw std::runtime_error(std::string("Failed to open shader file: " + filename));
+        PROFILE_FUNCTION();
+        depth_format = findDepthFormat();
+        VkImageAspectFlags depth_aspect = VK_IMAGE_ASPECT_DEPTH_BIT;
+        if (VK_FORMAT_D32_SFLOAT_S8_UINT == depth_format || VK_FORMAT_D24_UNORM_S8_UINT == depth_format)
+        {
+            depth_aspect |= VK_IMAGE_ASPECT_STENCIL_BIT;    // layout transitions must cover both aspects
+        }
 
-        size_t file_size = (size_t)file.tellg();
-        std::vector<char> buffer(file_size);
-        file.seekg(0);
-        file.read(buffer.data(), file_size);
+        render_graph.init(device, physical_device, graphics_family, config.async_compute ? compute_family : graphics_family);
+        graph_backbuffer = render_graph.importImage("backbuffer", VK_IMAGE_ASPECT_COLOR_BIT, ResourceUsage::Acquired, ResourceUsage::Present);
+        graph_texture = render_graph.importImage("texture", VK_IMAGE_ASPECT_COLOR_BIT, ResourceUsage::SampledFragment, ResourceUsage::SampledFragment);
+
+        // With dynamic resolution the scene renders into an internal target allocated once at the largest scale
+        // (so scale changes only move the viewport), and is then upscaled into the swapchain image. Post-processing
+        // also renders into an internal target, in HDR, and its output is copied into the swapchain image the same way.
+        bool can_blit = (0 != (swapchain_usage & VK_IMAGE_USAGE_TRANSFER_DST_BIT));
+        dynamic_resolution = config.dynamic_resolution && can_blit;
+        post_process = config.post_process && can_blit;
+        scene_format = post_process ? post_format : swapchain_format.format;
+        target_extent = swapchain_extent;
+        render_extent = swapchain_extent;
+        if (dynamic_resolution)
+        {
+            target_extent.width = static_cast<uint32_t>(std::ceil(swapchain_extent.width * config.res_max));
+            target_extent.height = static_cast<uint32_t>(std::ceil(swapchain_extent.height * config.res_max));
+            resolution_controller.configure(config.target_ms, config.res_min, config.res_max);
+        }
+        if (dynamic_resolution || post_process)
+        {
+            RenderGraph::ImageDesc scene_desc;
+            scene_desc.format = scene_format;
+            scene_desc.extent = target_extent;
+            scene_desc.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | (post_process ? VK_IMAGE_USAGE_STORAGE_BIT : VK_IMAGE_USAGE_TRANSFER_SRC_BIT);
+            graph_scene_color = render_graph.createTransient("scene color", scene_desc);
+
+            VkFormatProperties props;
+            vkGetPhysicalDeviceFormatProperties(physical_device, scene_format, &props);
+            bool linear = 0 != (props.optimalTilingFeatures & VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT);
+            upscale_filter = linear ? VK_FILTER_LINEAR : VK_FILTER_NEAREST;
+        }
+
+        // Depth, and the multisampled color when MSAA is on, are never stored - so they're transient attachments.
+        // The exception is depth for occlusion culling, which is stored and reduced into the next frame's pyramid.
+        // That's single sampled depth only, without stencil, so it can be read through a depth-only view.
+        msaa_samples = chooseSampleCount(config.msaa_samples);
+        hiz_active = config.occlusion && device_caps.cluster_culling && (VK_SAMPLE_COUNT_1_BIT == msaa_samples) &&
+                     (VK_IMAGE_ASPECT_DEPTH_BIT == depth_aspect);
+        if (config.occlusion && !hiz_active)
+        {
+            std::cout << "Occlusion culling needs cluster culling, no MSAA and a depth-only format - disabled" << std::endl;
+        }
+        RenderGraph::ImageDesc depth_desc;
+        depth_desc.format = depth_format;
+        depth_desc.extent = target_extent;
+        depth_desc.usage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT |
+                           (hiz_active ? VK_IMAGE_USAGE_SAMPLED_BIT : VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT);
+        depth_desc.aspect = depth_aspect;
+        depth_desc.samples = msaa_samples;
+        graph_depth = render_graph.createTransient("depth", depth_desc);
+
+        RenderGraph::ResourceId scene_target = (dynamic_resolution || post_process) ? graph_scene_color : graph_backbuffer;
+        std::vector<RenderGraph::Access> main_accesses = { { scene_target, ResourceUsage::ColorAttachment },   // or resolve target
+                                                           { graph_depth, ResourceUsage::DepthAttachment },
+                                                           { graph_texture, ResourceUsage::SampledFragment } };
+        if (VK_SAMPLE_COUNT_1_BIT != msaa_samples)
+        {
+            RenderGraph::ImageDesc color_desc;
+            color_desc.format = scene_format;
+            color_desc.extent = target_extent;
+            color_desc.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT;
+            color_desc.samples = msaa_samples;
+            graph_msaa_color = render_graph.createTransient("msaa color", color_desc);
+            main_accesses.push_back({ graph_msaa_color, ResourceUsage::ColorAttachment });
+        }
 
+        // Culling always binds a pyramid, so there's a single texel stand-in when occlusion is off. The real one
+        // persists across frames: each frame's main pass tests against the one the frame before built.
+        createHizPyramid(hiz_active ? target_extent : VkExtent2D{ 1, 1 });
+        if (hiz_active)
+        {
+            graph_hiz = render_graph.importImage("depth pyramid", VK_IMAGE_ASPECT_COLOR_BIT, ResourceUsage::ComputeWrite, ResourceUsage::ComputeWrite);
+            render_graph.bindImported(graph_hiz, hiz_image, hiz_view);
+            main_accesses.push_back({ graph_hiz, ResourceUsage::ComputeRead });
+        }
+
+        render_graph.addPass("main", main_accesses, [this](VkCommandBuffer cb) { recordMainPass(cb); });
+        if (hiz_active)
+        {
+            // On the graphics queue, so the pyramid is never shared between queues
+            render_graph.addPass("depth pyramid", { { graph_depth, ResourceUsage::SampledCompute },
+                                                    { graph_hiz, ResourceUsage::ComputeWrite } },
+                                 [this](VkCommandBuffer cb) { recordHizBuild(cb); });
+        }
+        graph_blit_source = graph_scene_color;
+        if (post_process) addPostPasses();
+        if (dynamic_resolution || post_process)
+        {
+            render_graph.addPass("upscale", { { graph_blit_source, ResourceUsage::TransferSrc },
+                                              { graph_backbuffer, ResourceUsage::TransferDst } },
+                                 [this](VkCommandBuffer cb) { recordUpscale(cb); });
+        }
+        render_graph.compile();
+        if (render_graph.segmentCount() > MAX_GRAPH_SEGMENTS)
+        {
+            throw std::runtime_error("Render graph needs more submits than a frame has command buffers for");
+        }
 #ifdef VERBOSE_ON
-        std::cout << std::endl << "Read SPIR-V shader file " << filename << ", size  = " << file_size << " bytes." << std::endl;
+        render_graph.printStats();
 #endif
+    }
 
-        file.close();
-        return buffer;
+    // Bloom (a separable blur of the scene), tonemap and color grade, each a compute pass over the rendered part
+    // of the HDR scene color. They go to the compute queue when it's separate. The blur scratch and tonemapped
+    // images have disjoint lifetimes, as do the bloom and output, so the graph puts each pair in the same memory.
+    void addPostPasses()
+    {
+        RenderGraph::ImageDesc desc;
+        desc.format = post_format;
+        desc.extent = target_extent;
+        desc.usage = VK_IMAGE_USAGE_STORAGE_BIT;
+        RenderGraph::ResourceId blur_temp = render_graph.createTransient("blur temp", desc);
+        RenderGraph::ResourceId bloom = render_graph.createTransient("bloom", desc);
+        RenderGraph::ResourceId tonemapped = render_graph.createTransient("tonemapped", desc);
+        desc.usage |= VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+        RenderGraph::ResourceId output = render_graph.createTransient("post output", desc);
+
+        auto add = [this](const char* name, const char* shader, RenderGraph::ResourceId src, RenderGraph::ResourceId src2,
+                          RenderGraph::ResourceId dst, int32_t direction, float strength)
+        {
+            std::vector<RenderGraph::Access> accesses = { { src, ResourceUsage::ComputeRead }, { dst, ResourceUsage::ComputeWrite } };
+            if (src2 != src) accesses.push_back({ src2, ResourceUsage::ComputeRead });
+            render_graph.addPass(name, accesses, [this, name, shader, src, src2, dst, direction, strength](VkCommandBuffer cb)
+            {
+                recordPostStage(cb, name, shader, { src, src2, dst }, direction, strength);
+            }, PassQueue::Compute);
+        };
+        add("blur h",  post_blur_shader,    graph_scene_color, graph_scene_color, blur_temp,  0, 0.0f);
+        add("blur v",  post_blur_shader,    blur_temp,         blur_temp,         bloom,      1, 0.0f);
+        add("tonemap", post_tonemap_shader, graph_scene_color, bloom,             tonemapped, 0, 0.6f);
+        add("grade",   post_grade_shader,   tonemapped,        tonemapped,        output,     0, 1.0f);
+        graph_blit_source = output;
     }
 
-    VkShaderModule createShaderModule(const std::vector<char>& spirv)
+    // One post-processing dispatch. Bindings are 0 and 1 for the inputs (the same image twice for single-input
+    // stages) and 2 for the output; they're written fresh into the frame's descriptor pool each time.
+    void recordPostStage(VkCommandBuffer cb, const char* name, const char* shader, std::array<RenderGraph::ResourceId, 3> images,
+                         int32_t direction, float strength)
     {
-        VkShaderModuleCreateInfo ci = { VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO, nullptr };
-        ci.codeSize = spirv.size();
-        ci.pCode = reinterpret_cast<const uint32_t*>(spirv.data());
+        uint32_t region = gpu_profiler.beginRegion(cb, record_slot, name);
 
-        VkShaderModule shader;
-        if (VK_SUCCESS != vkCreateShaderModule(device, &ci, nullptr, &shader)) throw std::runtime_error("Failed to create shader module");
-        return shader;
+        DescriptorBuilder builder(layout_cache, frame_descriptors[record_slot]);
+        std::array<VkDescriptorImageInfo, 3> infos{};
+        for (uint32_t b = 0; b < infos.size(); b++)
+        {
+            infos[b].imageView = render_graph.view(images[b]);
+            infos[b].imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+            builder.bindImage(b, infos[b], VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_SHADER_STAGE_COMPUTE_BIT);
+        }
+        VkDescriptorSet set = builder.build();
+
+        PostConstants pc{};
+        pc.extent[0] = static_cast<int32_t>(render_extent.width);
+        pc.extent[1] = static_cast<int32_t>(render_extent.height);
+        pc.direction = direction;
+        pc.strength = strength;
+
+        vkCmdBindPipeline(cb, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline_library.getCompute(shader, post_pipeline_layout));
+        vkCmdBindDescriptorSets(cb, VK_PIPELINE_BIND_POINT_COMPUTE, post_pipeline_layout, 0, 1, &set, 0, nullptr);
+        vkCmdPushConstants(cb, post_pipeline_layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(PostConstants), &pc);
+
+        // Blur groups each cover a run along one row or column; the rest cover square tiles
+        if (0 == strcmp(post_blur_shader, shader))
+        {
+            uint32_t along = direction ? render_extent.height : render_extent.width;
+            uint32_t across = direction ? render_extent.width : render_extent.height;
+            vkCmdDispatch(cb, (along + POST_BLUR_TILE - 1) / POST_BLUR_TILE, across, 1);
+        }
+        else
+        {
+            vkCmdDispatch(cb, (render_extent.width + POST_GROUP_SIZE - 1) / POST_GROUP_SIZE,
+                          (render_extent.height + POST_GROUP_SIZE - 1) / POST_GROUP_SIZE, 1);
+        }
+
+        gpu_profiler.endRegion(cb, record_slot, region);
+    }
+
+    // Highest count no greater than requested that both color and depth attachments support
+    VkSampleCountFlagBits chooseSampleCount(uint32_t requested)
+    {
+        VkPhysicalDeviceProperties props;
+        vkGetPhysicalDeviceProperties(physical_device, &props);
+        VkSampleCountFlags supported = props.limits.framebufferColorSampleCounts & props.limits.framebufferDepthSampleCounts;
+        for (uint32_t count = requested; count > 1; count /= 2)
+        {
+            if (supported & count) return static_cast<VkSampleCountFlagBits>(count);
+        }
+        return VK_SAMPLE_COUNT_1_BIT;
+    }
+
+    // Attachment memory at the current size for each supported sample count. At 1x only depth is needed - color
+    // goes straight to the swapchain; above that the multisampled color is resolved into it.
+    void printMsaaMemoryReport()
+    {
+        VkPhysicalDeviceProperties props;
+        vkGetPhysicalDeviceProperties(physical_device, &props);
+        VkSampleCountFlags supported = props.limits.framebufferColorSampleCounts & props.limits.framebufferDepthSampleCounts;
+
+        VkPhysicalDeviceMemoryProperties mem_props;
+        vkGetPhysicalDeviceMemoryProperties(physical_device, &mem_props);
+        bool has_lazy = false;
+        for (uint32_t i = 0; i < mem_props.memoryTypeCount; i++)
+        {
+            has_lazy |= 0 != (mem_props.memoryTypes[i].propertyFlags & VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT);
+        }
+
+        auto image_bytes = [this](VkFormat format, VkImageUsageFlags usage, VkSampleCountFlagBits samples)
+        {
+            VkImageCreateInfo ici = { VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO, nullptr };
+            ici.imageType = VK_IMAGE_TYPE_2D;
+            ici.format = format;
+            ici.extent = { swapchain_extent.width, swapchain_extent.height, 1 };
+            ici.mipLevels = 1;
+            ici.arrayLayers = 1;
+            ici.samples = samples;
+            ici.tiling = VK_IMAGE_TILING_OPTIMAL;
+            ici.usage = usage | VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT;
+            ici.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+            ici.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+            VkDeviceImageMemoryRequirements info = { VK_STRUCTURE_TYPE_DEVICE_IMAGE_MEMORY_REQUIREMENTS, nullptr };
+            info.pCreateInfo = &ici;
+            VkMemoryRequirements2 req = { VK_STRUCTURE_TYPE_MEMORY_REQUIREMENTS_2, nullptr };
+            vkGetDeviceImageMemoryRequirements(device, &info, &req);
+            return req.memoryRequirements.size;
+        };
+
+        std::cout << std::endl << "MSAA attachment memory at " << swapchain_extent.width << "x" << swapchain_extent.height
+                  << (has_lazy ? " (lazily allocated - may never be committed)" : "") << std::endl;
+        char line[128];
+        for (uint32_t count = 1; count <= 8; count *= 2)
+        {
+            VkSampleCountFlagBits samples = static_cast<VkSampleCountFlagBits>(count);
+            if (!(supported & samples)) continue;
+            VkDeviceSize color = (1 == count) ? 0 : image_bytes(scene_format, VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT, samples);
+            VkDeviceSize depth = image_bytes(depth_format, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT, samples);
+            snprintf(line, sizeof(line), "\t%ux  %8llu KB color  %8llu KB depth  %8llu KB total%s", count,
+                     (unsigned long long)(color / 1024), (unsigned long long)(depth / 1024),
+                     (unsigned long long)((color + depth) / 1024), samples == msaa_samples ? "   <- in use" : "");
+            std::cout << line << std::endl;
+        }
     }
 
     void createRenderPass()
     {
+        PROFILE_FUNCTION();
+        if (config.dynamic_rendering) return;   // rendering begins directly on the image views instead
+        // With MSAA, color renders to a multisampled attachment that's resolved into the swapchain image at the end
+        // of the subpass, and never stored itself
+        bool msaa = (VK_SAMPLE_COUNT_1_BIT != msaa_samples);
         VkAttachmentDescription2 attachment = { VK_STRUCTURE_TYPE_ATTACHMENT_DESCRIPTION_2, nullptr };
-        attachment.format = swapchain_format.format;
-        attachment.samples = VK_SAMPLE_COUNT_1_BIT;         // Match the swapchain image views
+        attachment.format = scene_format;
+        attachment.samples = msaa_samples;
         attachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;    // Clear before rendering
-        attachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;  // Save render contents for display
+        attachment.storeOp = msaa ? VK_ATTACHMENT_STORE_OP_DONT_CARE : VK_ATTACHMENT_STORE_OP_STORE;  // Save render contents for display
         attachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
         attachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-        attachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-        attachment.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;   // We'll be presenting the result via swapchain
+        attachment.initialLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;   // The render graph does all transitions
+        attachment.finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;     // (including the one to present)
+
+        // Depth is only needed within the pass, so it's never stored - unless the depth pyramid is built from it
+        VkAttachmentDescription2 depth_attachment = { VK_STRUCTURE_TYPE_ATTACHMENT_DESCRIPTION_2, nullptr };
+        depth_attachment.format = depth_format;
+        depth_attachment.samples = msaa_samples;
+        depth_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+        depth_attachment.storeOp = hiz_active ? VK_ATTACHMENT_STORE_OP_STORE : VK_ATTACHMENT_STORE_OP_DONT_CARE;
+        depth_attachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+        depth_attachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+        depth_attachment.initialLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+        depth_attachment.finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
 
         VkAttachmentReference2 attach_ref = { VK_STRUCTURE_TYPE_ATTACHMENT_REFERENCE_2, nullptr };
-        attach_ref.attachment = 0;  // Index of the attachment - 0 since we have only 1
+        attach_ref.attachment = 0;  // Index of the color attachment
         attach_ref.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;   // layout to transition to when this subpass is active
 
+        VkAttachmentReference2 depth_ref = { VK_STRUCTURE_TYPE_ATTACHMENT_REFERENCE_2, nullptr };
+        depth_ref.attachment = 1;
+        depth_ref.layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+
+        VkAttachmentDescription2 resolve_attachment = { VK_STRUCTURE_TYPE_ATTACHMENT_DESCRIPTION_2, nullptr };
+        resolve_attachment.format = scene_format;
+        resolve_attachment.samples = VK_SAMPLE_COUNT_1_BIT;     // Match the swapchain image views
+        resolve_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+        resolve_attachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+        resolve_attachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+        resolve_attachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+        resolve_attachment.initialLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+        resolve_attachment.finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+
+        VkAttachmentReference2 resolve_ref = { VK_STRUCTURE_TYPE_ATTACHMENT_REFERENCE_2, nullptr };
+        resolve_ref.attachment = 2;
+        resolve_ref.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+
         VkSubpassDescription2 subpass = { VK_STRUCTURE_TYPE_SUBPASS_DESCRIPTION_2, nullptr };
         subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
         subpass.colorAttachmentCount = 1;
         subpass.pColorAttachments = &attach_ref;    // shader layout directive indexes into this array, e.g. layout(location=0)
+        subpass.pResolveAttachments = msaa ? &resolve_ref : nullptr;
+        subpass.pDepthStencilAttachment = &depth_ref;
 
-        VkSubpassDependency2 dep = { VK_STRUCTURE_TYPE_SUBPASS_DEPENDENCY_2, nullptr };
-        dep.srcSubpass = VK_SUBPASS_EXTERNAL;   // Before render pass
-        dep.dstSubpass = 0; // Index 0 is our sole subpass
-        dep.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;   // swap chain finished with color attachment
-        dep.srcAccessMask = 0;
-        dep.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;   // we will modify color attachment
-        dep.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
-
+        // No subpass dependencies: the render graph's barriers order this pass against everything around it
+        std::vector<VkAttachmentDescription2> attachments = { attachment, depth_attachment };
+        if (msaa) attachments.push_back(resolve_attachment);
         VkRenderPassCreateInfo2 render_pass_ci = { VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO_2, nullptr };
-        render_pass_ci.attachmentCount = 1;
-        render_pass_ci.pAttachments = &attachment;
+        render_pass_ci.attachmentCount = static_cast<uint32_t>(attachments.size());
+        render_pass_ci.pAttachments = attachments.data();
         render_pass_ci.subpassCount = 1;
         render_pass_ci.pSubpasses = &subpass;
-        render_pass_ci.dependencyCount = 1;
-        render_pass_ci.pDependencies = &dep;
+        render_pass_ci.dependencyCount = 0;
+        render_pass_ci.pDependencies = nullptr;
 
         if (VK_SUCCESS != vkCreateRenderPass2(device, &render_pass_ci, nullptr, &render_pass))
         {
@@ -877,223 +6854,262 @@ private:
 
     void createDescriptorSetLayout()
     {
+        PROFILE_FUNCTION();
+        layout_cache.init(device);
+
+        // Set 0 - per-frame data, allocated and written fresh each frame
         VkDescriptorSetLayoutBinding ubo_layout{};
         ubo_layout.binding = 0;    // Matches vertex shader binding layout
         ubo_layout.stageFlags = VK_SHADER_STAGE_VERTEX_BIT; // Consumed only in vtx shader
         ubo_layout.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
         ubo_layout.descriptorCount = 1;
         ubo_layout.pImmutableSamplers = nullptr;
-
+        VkDescriptorSetLayoutBinding object_layout{};
+        object_layout.binding = 1;
+        object_layout.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+        object_layout.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        object_layout.descriptorCount = 1;
+        object_layout.pImmutableSamplers = nullptr;
+        frame_set_layout = layout_cache.getLayout({ ubo_layout, object_layout });
+
+        // Set 1 - material data, long-lived and deduplicated by content (evicted when a streamed texture's view goes)
         VkDescriptorSetLayoutBinding tex_layout{};
-        tex_layout.binding = 1;    // Matches vertex shader binding layout
+        tex_layout.binding = 0;    // Matches fragment shader binding layout
         tex_layout.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT; // Consumed only in frag shader
         tex_layout.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
         tex_layout.descriptorCount = 1;
         tex_layout.pImmutableSamplers = nullptr;
+        material_set_layout = layout_cache.getLayout({ tex_layout });
 
-        std::array<VkDescriptorSetLayoutBinding, 2> bindings = { ubo_layout, tex_layout };
-
-        VkDescriptorSetLayoutCreateInfo ds_ci = { VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO, nullptr };
-        ds_ci.bindingCount = static_cast<uint32_t>(bindings.size());
-        ds_ci.pBindings = bindings.data();
+        // Post-processing - two storage image inputs and one output, written per dispatch
+        std::vector<VkDescriptorSetLayoutBinding> post_bindings(3);
+        for (uint32_t b = 0; b < post_bindings.size(); b++)
+        {
+            post_bindings[b].binding = b;
+            post_bindings[b].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+            post_bindings[b].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+            post_bindings[b].descriptorCount = 1;
+            post_bindings[b].pImmutableSamplers = nullptr;
+        }
+        post_set_layout = layout_cache.getLayout(post_bindings);
 
-        if (VK_SUCCESS != vkCreateDescriptorSetLayout(device, &ds_ci, nullptr, &ubo_desc_layout))
+        // Cluster culling - objects, meshlets, draws and counts, then the parameters and depth pyramid, written per frame
+        std::vector<VkDescriptorSetLayoutBinding> cull_bindings(6);
+        for (uint32_t b = 0; b < cull_bindings.size(); b++)
         {
-            throw std::runtime_error("Failed to create descriptor set layout");
+            cull_bindings[b].binding = b;
+            cull_bindings[b].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+            cull_bindings[b].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+            cull_bindings[b].descriptorCount = 1;
+            cull_bindings[b].pImmutableSamplers = nullptr;
         }
+        cull_bindings[4].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+        cull_bindings[5].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+        cull_set_layout = layout_cache.getLayout(cull_bindings);
 
+        // Depth pyramid build - depth in, the pyramid, and the count of workgroups done
+        std::vector<VkDescriptorSetLayoutBinding> hiz_bindings(3);
+        for (uint32_t b = 0; b < hiz_bindings.size(); b++)
+        {
+            hiz_bindings[b].binding = b;
+            hiz_bindings[b].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+            hiz_bindings[b].descriptorCount = 1;
+            hiz_bindings[b].pImmutableSamplers = nullptr;
+        }
+        hiz_bindings[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+        hiz_bindings[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+        hiz_bindings[2].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        hiz_set_layout = layout_cache.getLayout(hiz_bindings);
     }
 
-    void createGraphicsPipeline()
+    void createPipelineLibrary()
     {
-        /////////////////////////////////////////////////////////////
-        // Shaders
-        /////////////////////////////////////////////////////////////
-        auto vert_shader = readSPIRV("vert.spv");
-        auto frag_shader = readSPIRV("frag.spv");
-
-        VkShaderModule vert_shader_module = createShaderModule(vert_shader);
-        VkShaderModule frag_shader_module = createShaderModule(frag_shader);
-
-        VkPipelineShaderStageCreateInfo vert_ci = { VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO, nullptr };
-        vert_ci.stage = VK_SHADER_STAGE_VERTEX_BIT;
-        vert_ci.module = vert_shader_module;
-        vert_ci.pName = "main";
-        vert_ci.pSpecializationInfo = nullptr;  // Specialization constants go here
-
-        VkPipelineShaderStageCreateInfo frag_ci = { VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO, nullptr };
-        frag_ci.stage = VK_SHADER_STAGE_FRAGMENT_BIT;
-        frag_ci.module = frag_shader_module;
-        frag_ci.pName = "main";
-        frag_ci.pSpecializationInfo = nullptr;  // Specialization constants go here
-
-        VkPipelineShaderStageCreateInfo pipe_stages[] = { vert_ci, frag_ci };
-
-        /////////////////////////////////////////////////////////////
-        // Vertex Input (none, for the moment - vertices are hard-coded in the shader)
-        /////////////////////////////////////////////////////////////
-        auto bind_desc = Vertex::getBindingDesc();
-        auto attrib_desc = Vertex::getAttribDesc();
-
-        VkPipelineVertexInputStateCreateInfo vtx_in_ci = { VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO, nullptr };
-        vtx_in_ci.vertexBindingDescriptionCount = 1;
-        vtx_in_ci.pVertexBindingDescriptions = &bind_desc;
-        vtx_in_ci.vertexAttributeDescriptionCount = static_cast<uint32_t>(attrib_desc.size());
-        vtx_in_ci.pVertexAttributeDescriptions = attrib_desc.data();
-
-        /////////////////////////////////////////////////////////////
-        // Input Assembly
-        /////////////////////////////////////////////////////////////
-        VkPipelineInputAssemblyStateCreateInfo in_ass_ci = { VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO, nullptr };
-        in_ass_ci.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
-        in_ass_ci.primitiveRestartEnable = VK_FALSE;
+        PROFILE_FUNCTION();
+        pipeline_library.init(device);
+    }
 
-        /////////////////////////////////////////////////////////////
-        // Viewport
-        /////////////////////////////////////////////////////////////
-        VkViewport viewport{};
-        viewport.x = 0.0f; 
-        viewport.y = 0.0f;
-        viewport.width = (float)swapchain_extent.width;
-        viewport.height = (float)swapchain_extent.height;
-        viewport.minDepth = 0.0f;
-        viewport.maxDepth = 1.0f;
+    // The post-processing layout, plus its pipelines if post-processing starts on
+    void createPostPipelines()
+    {
+        PROFILE_FUNCTION();
+        VkPipelineLayoutCreateInfo layout_ci = { VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO, nullptr };
+        layout_ci.setLayoutCount = 1;
+        layout_ci.pSetLayouts = &post_set_layout;
+        VkPushConstantRange range{};
+        range.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+        range.offset = 0;
+        range.size = sizeof(PostConstants);
+        layout_ci.pushConstantRangeCount = 1;
+        layout_ci.pPushConstantRanges = &range;
+        if (VK_SUCCESS != vkCreatePipelineLayout(device, &layout_ci, nullptr, &post_pipeline_layout))
+        {
+            throw std::runtime_error("Failed to create post-processing pipeline layout");
+        }
 
-        VkRect2D scissor{};
-        scissor.offset = { 0, 0 };
-        scissor.extent = swapchain_extent;
+        if (!config.post_process) return;
+        for (const char* shader : { post_blur_shader, post_tonemap_shader, post_grade_shader })
+        {
+            pipeline_library.getCompute(shader, post_pipeline_layout);
+        }
+    }
 
-        VkPipelineViewportStateCreateInfo view_ci = { VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO, nullptr };
-        view_ci.viewportCount = 1;
-        view_ci.pViewports = &viewport;
-        view_ci.scissorCount = 1;
-        view_ci.pScissors = &scissor;
+    // The cluster culling and depth pyramid layouts, plus their pipelines if culling starts on. Culling parameters
+    // outgrew the guaranteed push constant space, so they're in a uniform buffer.
+    void createCullPipeline()
+    {
+        PROFILE_FUNCTION();
+        VkPipelineLayoutCreateInfo layout_ci = { VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO, nullptr };
+        layout_ci.setLayoutCount = 1;
+        layout_ci.pSetLayouts = &cull_set_layout;
+        layout_ci.pushConstantRangeCount = 0;
+        if (VK_SUCCESS != vkCreatePipelineLayout(device, &layout_ci, nullptr, &cull_pipeline_layout))
+        {
+            throw std::runtime_error("Failed to create cluster culling pipeline layout");
+        }
 
-        /////////////////////////////////////////////////////////////
-        // Rasterizer
-        /////////////////////////////////////////////////////////////
-        VkPipelineRasterizationStateCreateInfo rast_ci = { VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO, nullptr };
-        rast_ci.depthClampEnable = VK_FALSE;        // kill outside depth range
-        rast_ci.rasterizerDiscardEnable = VK_FALSE; // pass geometry to rasterizer
-        rast_ci.polygonMode = VK_POLYGON_MODE_FILL;
-        rast_ci.lineWidth = 1.0f;
-        rast_ci.cullMode = VK_CULL_MODE_BACK_BIT;   // enable back face culling
-        rast_ci.frontFace = VK_FRONT_FACE_CLOCKWISE;
-        rast_ci.depthBiasEnable = VK_FALSE;
-        rast_ci.depthBiasConstantFactor = 0.0f; // disabled
-        rast_ci.depthBiasClamp = 0.0f;          // disabled
-        rast_ci.depthBiasSlopeFactor = 0.0f;    // disabled
+        VkPushConstantRange range{};
+        range.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+        range.offset = 0;
+        range.size = sizeof(HizConstants);
+        layout_ci.pSetLayouts = &hiz_set_layout;
+        layout_ci.pushConstantRangeCount = 1;
+        layout_ci.pPushConstantRanges = &range;
+        if (VK_SUCCESS != vkCreatePipelineLayout(device, &layout_ci, nullptr, &hiz_pipeline_layout))
+        {
+            throw std::runtime_error("Failed to create depth pyramid pipeline layout");
+        }
 
-        /////////////////////////////////////////////////////////////
-        // Multisampling
-        /////////////////////////////////////////////////////////////
-        VkPipelineMultisampleStateCreateInfo multi_ci = { VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO, nullptr };
-        multi_ci.sampleShadingEnable = VK_FALSE;
-        multi_ci.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;  
-        multi_ci.minSampleShading = 1.0f;           // disabled
-        multi_ci.pSampleMask = nullptr;             // disabled
-        multi_ci.alphaToCoverageEnable = VK_FALSE;  // disabled
-        multi_ci.alphaToOneEnable = VK_FALSE;       // disabled
+        // Depth is read with texelFetch, so filtering doesn't matter - it's only here because the binding needs one
+        VkSamplerCreateInfo ci = { VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO, nullptr };
+        ci.minFilter = VK_FILTER_NEAREST;
+        ci.magFilter = VK_FILTER_NEAREST;
+        ci.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+        ci.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+        ci.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+        ci.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+        ci.maxLod = 0.f;
+        if (VK_SUCCESS != vkCreateSampler(device, &ci, nullptr, &hiz_sampler))
+        {
+            throw std::runtime_error("Failed to create depth pyramid sampler");
+        }
 
-        /////////////////////////////////////////////////////////////
-        // Depth / Stencil (unused for now)
-        /////////////////////////////////////////////////////////////
-        VkPipelineDepthStencilStateCreateInfo ds_ci = { VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO, nullptr };
-        ds_ci.depthTestEnable = VK_FALSE;
-        ds_ci.depthWriteEnable = VK_FALSE;
-        ds_ci.depthBoundsTestEnable = VK_FALSE;
-        ds_ci.stencilTestEnable = VK_FALSE;
+        if (config.clusters) pipeline_library.getCompute(cluster_cull_shader, cull_pipeline_layout);
+        if (config.clusters && config.occlusion) pipeline_library.getCompute(hiz_build_shader, hiz_pipeline_layout);
+    }
 
+    void createGraphicsPipeline()
+    {
+        PROFILE_FUNCTION();
         /////////////////////////////////////////////////////////////
-        // Color Blending (none)
+        // Pipeline Layout (independent of the swapchain, so only built once)
         /////////////////////////////////////////////////////////////
-        VkPipelineColorBlendAttachmentState blend_attach{};
-        blend_attach.colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_B_BIT |
-                                      VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_A_BIT;
-        blend_attach.blendEnable            = VK_FALSE;
-        blend_attach.srcColorBlendFactor    = VK_BLEND_FACTOR_ONE;  // disabled
-        blend_attach.dstColorBlendFactor    = VK_BLEND_FACTOR_ZERO; // disabled
-        blend_attach.colorBlendOp           = VK_BLEND_OP_ADD;      // disabled
-        blend_attach.srcAlphaBlendFactor    = VK_BLEND_FACTOR_ONE;  // disabled
-        blend_attach.dstAlphaBlendFactor    = VK_BLEND_FACTOR_ZERO; // disabled
-        blend_attach.alphaBlendOp           = VK_BLEND_OP_ADD;      // disabled
-
-        VkPipelineColorBlendStateCreateInfo blend_ci = { VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO, nullptr };
-        blend_ci.attachmentCount = 1;
-        blend_ci.pAttachments = &blend_attach;
-        blend_ci.logicOpEnable = VK_FALSE;
-        blend_ci.logicOp = VK_LOGIC_OP_COPY;    // disabled
-        // blend_ci.blendConstants[0] = ...
+        if (VK_NULL_HANDLE == pipeline_layout)
+        {
+            VkPipelineLayoutCreateInfo layout_ci = { VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO, nullptr };
+            std::array<VkDescriptorSetLayout, 2> set_layouts = { frame_set_layout, material_set_layout };
+            layout_ci.setLayoutCount = static_cast<uint32_t>(set_layouts.size());
+            layout_ci.pSetLayouts = set_layouts.data();
+            // Per-object data comes from the frame set's object buffer, or with vertex pulling, from its address
+            VkPushConstantRange pull_range = { VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(PullConstants) };
+            layout_ci.pushConstantRangeCount = 1;
+            layout_ci.pPushConstantRanges = &pull_range;
+
+            if (VK_SUCCESS != vkCreatePipelineLayout(device, &layout_ci, nullptr, &pipeline_layout))
+            {
+                throw std::runtime_error("Failed to create pipeline layout");
+            }
+        }
 
         /////////////////////////////////////////////////////////////
-        // Dynamic State (example - unused)
+        // Describe the pipelines, and kick off background compiles. They're fetched lazily at record time.
         /////////////////////////////////////////////////////////////
-        VkDynamicState dynamic_states[] = { VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_LINE_WIDTH };
-
-        VkPipelineDynamicStateCreateInfo dyn_ci = { VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO, nullptr };
-        dyn_ci.dynamicStateCount = 2;
-        dyn_ci.pDynamicStates = dynamic_states;
+        auto bind_desc = Vertex::getBindingDesc();
+        auto attrib_desc = Vertex::getAttribDesc();
 
-        /////////////////////////////////////////////////////////////
-        // Pipeline Layout
-        /////////////////////////////////////////////////////////////
-        VkPipelineLayoutCreateInfo layout_ci = { VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO, nullptr };
-        layout_ci.setLayoutCount = 1;
-        layout_ci.pSetLayouts = &ubo_desc_layout;
-        layout_ci.pushConstantRangeCount = 0;
-        layout_ci.pPushConstantRanges = nullptr;
+        PipelineDesc& main_desc = input_pipelines.main;
+        main_desc = PipelineDesc{};
+        main_desc.vert_shader = "vert.glsl";
+        main_desc.frag_shader = "frag.glsl";
+        main_desc.vertex_bindings = { bind_desc };
+        main_desc.vertex_attribs.assign(attrib_desc.begin(), attrib_desc.end());
+        main_desc.cull_mode = VK_CULL_MODE_BACK_BIT;   // enable back face culling
+        main_desc.front_face = VK_FRONT_FACE_CLOCKWISE;
+        main_desc.depth_test = VK_TRUE;
+        main_desc.depth_write = VK_TRUE;
+        main_desc.depth_compare = VK_COMPARE_OP_LESS;
+        main_desc.samples = msaa_samples;
+        main_desc.layout = pipeline_layout;
+        main_desc.render_pass = render_pass;  // null with dynamic rendering, which uses the formats below
+        main_desc.subpass = 0;    // Index of the render_pass subpass that uses this pipeline
+        if (VK_NULL_HANDLE == render_pass)
+        {
+            main_desc.color_format = scene_format;
+            main_desc.depth_format = depth_format;
+        }
 
-        if (VK_SUCCESS != vkCreatePipelineLayout(device, &layout_ci, nullptr, &pipeline_layout))
+        // Same pipeline with the texture fetch specialized out
+        input_pipelines.untextured = main_desc;
+        input_pipelines.untextured.frag_variant.textured = VK_FALSE;
+
+        // Depth pre-pass: lay down depth with no fragment shader or color writes, then shade only the
+        // fragments that match it exactly
+        input_pipelines.depth_prepass = main_desc;
+        input_pipelines.depth_prepass.frag_shader.clear();
+        input_pipelines.depth_prepass.frag_variant = FragmentVariant{};
+        input_pipelines.depth_prepass.color_write_mask = 0;
+
+        input_pipelines.main_after_prepass = main_desc;
+        input_pipelines.main_after_prepass.depth_write = VK_FALSE;
+        input_pipelines.main_after_prepass.depth_compare = VK_COMPARE_OP_EQUAL;
+        input_pipelines.untextured_after_prepass = input_pipelines.untextured;
+        input_pipelines.untextured_after_prepass.depth_write = VK_FALSE;
+        input_pipelines.untextured_after_prepass.depth_compare = VK_COMPARE_OP_EQUAL;
+
+        // The same again with no vertex input, for vert_pull.glsl to fetch its own
+        pulling_pipelines = input_pipelines;
+        for (PipelineDesc* desc : pulling_pipelines.all())
         {
-            throw std::runtime_error("Failed to create pipeline layout");
+            desc->vert_shader = "vert_pull.glsl";
+            desc->vertex_bindings.clear();
+            desc->vertex_attribs.clear();
         }
 
-        /////////////////////////////////////////////////////////////
-        // Create pipeline
-        /////////////////////////////////////////////////////////////
-        VkGraphicsPipelineCreateInfo pipe_ci = { VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO, nullptr };
-        pipe_ci.stageCount = 2;
-        pipe_ci.pStages = pipe_stages;
-        pipe_ci.pVertexInputState = &vtx_in_ci;
-        pipe_ci.pInputAssemblyState = &in_ass_ci;
-        pipe_ci.pViewportState = &view_ci;
-        pipe_ci.pRasterizationState = &rast_ci;
-        pipe_ci.pMultisampleState = &multi_ci;
-        pipe_ci.pDepthStencilState = &ds_ci;
-        pipe_ci.pColorBlendState = &blend_ci;
-        pipe_ci.pDynamicState = nullptr;    // &dyn_ci;
-        pipe_ci.layout = pipeline_layout;
-        pipe_ci.renderPass = render_pass;
-        pipe_ci.subpass = 0;    // Index of the render_pass subpass that uses this pipeline
-        pipe_ci.basePipelineHandle = VK_NULL_HANDLE;    // Not deriving from another pipeline
-        pipe_ci.basePipelineIndex = -1;                 // disabled
+        pipeline_library.precompile(buildPipelineManifest());
+    }
 
-        if (VK_SUCCESS != vkCreateGraphicsPipelines(device, VK_NULL_HANDLE, 1, &pipe_ci, nullptr, &pipeline))
+    // Every pipeline the renderer may ask for, so they can all be compiled off the render thread
+    std::vector<PipelineDesc> buildPipelineManifest()
+    {
+        std::vector<PipelineDesc> manifest;
+        for (const PipelineDesc* desc : input_pipelines.all()) manifest.push_back(*desc);
+        if (device_caps.buffer_device_address)
         {
-            throw std::runtime_error("Failed to create graphics pipeline");
+            for (const PipelineDesc* desc : pulling_pipelines.all()) manifest.push_back(*desc);
         }
-
-        /////////////////////////////////////////////////////////////
-        // Cleanup
-        /////////////////////////////////////////////////////////////
-        vkDestroyShaderModule(device, vert_shader_module, nullptr);
-        vkDestroyShaderModule(device, frag_shader_module, nullptr);
+        return manifest;
     }
 
     void createFrameBuffers()
     {
+        PROFILE_FUNCTION();
+        if (config.dynamic_rendering) return;
         swapchain_framebuffers.resize(swapchain_image_views.size());
 
         for (size_t i = 0; i < swapchain_image_views.size(); i++)
         {
-            VkImageView image_attachments[] = { swapchain_image_views[i] };
+            // Same order as the render pass attachments
+            std::vector<VkImageView> image_attachments = { sceneTargetView(i), render_graph.view(graph_depth) };
+            if (VK_SAMPLE_COUNT_1_BIT != msaa_samples)
+            {
+                image_attachments = { render_graph.view(graph_msaa_color), render_graph.view(graph_depth), sceneTargetView(i) };
+            }
 
             VkFramebufferCreateInfo fb_ci = { VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO, nullptr };
             fb_ci.renderPass = render_pass;
-            fb_ci.attachmentCount = 1;
-            fb_ci.pAttachments = image_attachments;
-            fb_ci.width = swapchain_extent.width;
-            fb_ci.height = swapchain_extent.height;
+            fb_ci.attachmentCount = static_cast<uint32_t>(image_attachments.size());
+            fb_ci.pAttachments = image_attachments.data();
+            fb_ci.width = target_extent.width;
+            fb_ci.height = target_extent.height;
             fb_ci.layers = 1;
 
             if (VK_SUCCESS != vkCreateFramebuffer(device, &fb_ci, nullptr, &swapchain_framebuffers[i]))
@@ -1105,6 +7121,7 @@ private:
 
     void createTextureSampler()
     {
+        PROFILE_FUNCTION();
         VkPhysicalDeviceProperties props;
         vkGetPhysicalDeviceProperties(physical_device, &props);
 
@@ -1123,7 +7140,7 @@ private:
         ci.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
         ci.mipLodBias = 0.f;
         ci.minLod = 0.f;
-        ci.maxLod = 0.f;
+        ci.maxLod = VK_LOD_CLAMP_NONE;     // streamed textures' views start at their most detailed resident mip
 
         if (VK_SUCCESS != vkCreateSampler(device, &ci, nullptr, &tex_sampler))
         {
@@ -1131,145 +7148,52 @@ private:
         }
     }
 
-    void createTextureImage()
+    // Decode only - needs no Vulkan objects, so it runs alongside device creation
+    void loadTexturePixels()
     {
-        // Load image
-        int width, height, channels;
-        stbi_uc* pixels = stbi_load("textures/statue.jpg", &width, &height, &channels, STBI_rgb_alpha);
-        VkDeviceSize image_size = width * height * (uint64_t)STBI_rgb_alpha;    // RGB in, RGBA out
-        if (!pixels) throw std::runtime_error("Failed to to load texture");
-
-        // Copy to a staging buffer
-        VkBuffer staging_buffer;
-        VkDeviceMemory sb_mem;
-        createBuffer(image_size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-            staging_buffer, sb_mem);
-        void* data;
-        vkMapMemory(device, sb_mem, 0, image_size, 0, &data);
-        memcpy(data, pixels, image_size);
-        vkUnmapMemory(device, sb_mem);
-        stbi_image_free(pixels);
-
-        // Create the device-local tex image
-        createImage(width, height, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_TILING_OPTIMAL,
-                    VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,      // Dest for staging copy, will be sampled by shaders
-                    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,        
-                    tex_image, tex_image_mem);
-
-        // Copy buffer data to image
-        transitionImageLayout(tex_image, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
-        copyBufferToImage(staging_buffer, tex_image, width, height);
-
-        // Prepare image for use as texture source
-        transitionImageLayout(tex_image, VK_FORMAT_R8G8B8A8_SRGB, 
-                              VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
-
-        // Clean up
-        vkDestroyBuffer(device, staging_buffer, nullptr);
-        vkFreeMemory(device, sb_mem, nullptr);
+        PROFILE_FUNCTION();
+        int channels;
+        tex_pixels = stbi_load("textures/statue.jpg", &tex_width, &tex_height, &channels, STBI_rgb_alpha);
+        if (!tex_pixels) throw std::runtime_error("Failed to to load texture");
     }
 
-    void createImage(uint32_t width, uint32_t height, VkFormat format, VkImageTiling tiling, 
-                     VkImageUsageFlags usage, VkMemoryPropertyFlags properties, 
-                     VkImage& image, VkDeviceMemory& image_mem)
+    // Hands the decoded pixels to the streamer, and uploads just the small mips so the first frame has something
+    // to sample. The rest stream in as the frames show they're needed.
+    void createTextureImage()
     {
-        // Create the tex image
-        VkImageCreateInfo ici = { VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO, nullptr };
-        ici.format          = format;
-        ici.tiling          = tiling;
-        ici.usage           = usage;
-        ici.extent.width    = width;
-        ici.extent.height   = height;
-        ici.imageType       = VK_IMAGE_TYPE_2D;
-        ici.initialLayout   = VK_IMAGE_LAYOUT_UNDEFINED;
-        ici.sharingMode     = VK_SHARING_MODE_EXCLUSIVE;
-        ici.extent.depth    = 1;
-        ici.mipLevels       = 1;
-        ici.arrayLayers     = 1;
-        ici.samples         = VK_SAMPLE_COUNT_1_BIT;
-        ici.flags           = 0;
-        if (VK_SUCCESS != vkCreateImage(device, &ici, nullptr, &image)) throw std::runtime_error("Failed to to create image");
-
-        // Alloc and bind image memory
-        VkMemoryRequirements mem_req;
-        vkGetImageMemoryRequirements(device, image, &mem_req);
-        VkMemoryAllocateInfo ai = { VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO, nullptr };
-        ai.allocationSize = mem_req.size;
-        ai.memoryTypeIndex = findMemoryTypeIdx(mem_req.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-        if (VK_SUCCESS != vkAllocateMemory(device, &ai, nullptr, &image_mem)) throw std::runtime_error("Failed to to allocate image memory");
-        vkBindImageMemory(device, image, image_mem, 0);
-    }
-
-    void transitionImageLayout(VkImage image, VkFormat format, VkImageLayout in_layout, VkImageLayout out_layout)
-    {
-        VkImageMemoryBarrier barrier = { VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER, nullptr };
-        barrier.oldLayout = in_layout;
-        barrier.newLayout = out_layout;
-        barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;  // for transfering queue family ownership only
-        barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-        barrier.image = image;
-        barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-        barrier.subresourceRange.baseMipLevel = 0;
-        barrier.subresourceRange.levelCount = 1;
-        barrier.subresourceRange.baseArrayLayer = 0;
-        barrier.subresourceRange.layerCount = 1;
-
-        barrier.srcAccessMask = 0;  // TBD - which ops must precede
-        barrier.dstAccessMask = 0;  // TBD - which ops must follow
-        VkPipelineStageFlags src_stage = VK_PIPELINE_STAGE_NONE;                // Not produced or modified in pipeline
-        VkPipelineStageFlags dst_stage = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT; // Texture image is consumed in fragment shader
-
-        // We only have 2 transitions to worry about, but this approach wouldn't scale well...
-        if (VK_IMAGE_LAYOUT_UNDEFINED == in_layout && VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL == out_layout)
-        {
-            barrier.srcAccessMask = VK_ACCESS_NONE;                 // 
-            barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;   // transfer dest access must follow
-            src_stage = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;          // 
-            dst_stage = VK_PIPELINE_STAGE_TRANSFER_BIT;             // transfer stage
-        } 
-        else if (VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL == in_layout && VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL == out_layout)
-        {
-            barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;   // transfer complete 
-            barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;      // shader read access
-            src_stage = VK_PIPELINE_STAGE_TRANSFER_BIT;             // transfer complete
-            dst_stage = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;      // fragment shader consumes the image
-        }
-        else
+        PROFILE_FUNCTION();
+        texture_streamer.init(device, physical_device, VkDeviceSize(config.texture_budget_mb) * 1024 * 1024,
+                              VkDeviceSize(config.stream_kb_per_frame) * 1024, device_caps.memory_budget, timeline, MAX_FRAMES_IN_FLIGHT);
+
+        // Pixels were decoded by loadTexturePixels()
+        stbi_uc* pixels = tex_pixels;
+        tex_pixels = nullptr;
+        texture_id = texture_streamer.add("statue", pixels, tex_width, tex_height);
+        stbi_image_free(pixels);
+
+        DeletionQueue staging;
         {
-            throw std::invalid_argument("unsupported layout transition!");
+            std::lock_guard<std::mutex> lock(upload_mutex);
+            VkCommandBuffer cb = beginOneOffCommandBuffer();
+            uint32_t region = gpu_profiler.beginRegion(cb, gpu_profiler.uploadSlot(), "texture upload");
+            texture_streamer.update(cb, frame_number);
+            gpu_profiler.endRegion(cb, gpu_profiler.uploadSlot(), region);
+            finishOneOffCommandBuffer(cb);
         }
-
-        // Submit barrier
-        VkCommandBuffer cb = beginOneOffCommandBuffer();
-        vkCmdPipelineBarrier(cb, src_stage, dst_stage, 0, 0, nullptr, 0, nullptr, 1, &barrier);
-        finishOneOffCommandBuffer(cb);
+        texture_streamer.retire(staging, 0, material_set_cache);
+        staging.flush();    // the upload has finished
     }
 
-    void copyBufferToImage(VkBuffer buffer, VkImage image, uint32_t width, uint32_t height)
+    void createProfiler()
     {
-        VkCommandBuffer cb = beginOneOffCommandBuffer();
-
-        VkBufferImageCopy bic{};
-        bic.bufferOffset = 0;
-        bic.bufferRowLength = 0;    // Buffer is tightly packed, ie no row alignment padding
-        bic.bufferImageHeight = 0;  // Single image in buffer
-
-        bic.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-        bic.imageSubresource.layerCount = 1;
-        bic.imageSubresource.baseArrayLayer = 0;
-        bic.imageSubresource.mipLevel = 0;
-
-        bic.imageOffset = { 0, 0, 0 };
-        bic.imageExtent = { width, height, 1 };
-
-        vkCmdCopyBufferToImage(cb, buffer, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &bic);
-
-        finishOneOffCommandBuffer(cb);
+        PROFILE_FUNCTION();
+        QueueFamilies queue_indices = findDeviceQueueFamilies(physical_device);
+        gpu_profiler.init(device, physical_device, queue_indices.graphics_family.value(), MAX_FRAMES_IN_FLIGHT, device_caps.pipeline_statistics);
     }
 
     void createCommandPool()
     {
+        PROFILE_FUNCTION();
         QueueFamilies queue_indices = findDeviceQueueFamilies(physical_device);
 
         VkCommandPoolCreateInfo pool_ci = { VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO, nullptr };
@@ -1280,13 +7204,22 @@ private:
         {
             throw std::runtime_error("Failed to create command pool");
         }
+
+        if (VK_NULL_HANDLE != compute_queue)
+        {
+            pool_ci.queueFamilyIndex = compute_family;
+            if (VK_SUCCESS != vkCreateCommandPool(device, &pool_ci, nullptr, &compute_command_pool))
+            {
+                throw std::runtime_error("Failed to create compute command pool");
+            }
+        }
     }
 
-    VkCommandBuffer createCommandBuffer()
+    VkCommandBuffer createCommandBuffer(VkCommandPool pool = VK_NULL_HANDLE)
     {
         VkCommandBuffer cb;
         VkCommandBufferAllocateInfo cb_ai = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO, nullptr };
-        cb_ai.commandPool = command_pool;
+        cb_ai.commandPool = (VK_NULL_HANDLE != pool) ? pool : command_pool;
         cb_ai.commandBufferCount = 1;
         cb_ai.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;  // Submit to queue directly
 
@@ -1297,7 +7230,8 @@ private:
         return cb;
     }
 
-    // Create a one-time-use gfx command buffer and begin recording
+    // Create a one-time-use gfx command buffer and begin recording. Callers hold upload_mutex until finishOneOffCommandBuffer,
+    // since uploads may run on several init threads at once.
     VkCommandBuffer beginOneOffCommandBuffer()
     {
         VkCommandBuffer cb = createCommandBuffer();
@@ -1309,87 +7243,708 @@ private:
         {
             throw std::runtime_error("Failure on begin one-off command buffer");
         }
+        gpu_profiler.beginSlot(cb, gpu_profiler.uploadSlot());
         return cb;
     }
 
-    // Finalize one-time-use gfx command buffer and submit to gfx queue. (Very heavy-weight synchronization via QueueWaitIdle)
+    // Finalize one-time-use gfx command buffer, submit to gfx queue and block until it's done (init-time only)
     void finishOneOffCommandBuffer(VkCommandBuffer cb)
     {
         vkEndCommandBuffer(cb);
-        
-        VkSubmitInfo si = { VK_STRUCTURE_TYPE_SUBMIT_INFO, nullptr };
+
+        uint64_t signal_value = timeline.nextValue();
+        VkTimelineSemaphoreSubmitInfo timeline_si = { VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO, nullptr };
+        timeline_si.signalSemaphoreValueCount = 1;
+        timeline_si.pSignalSemaphoreValues = &signal_value;
+
+        VkSemaphore timeline_sem = timeline.semaphore();
+        VkSubmitInfo si = { VK_STRUCTURE_TYPE_SUBMIT_INFO, &timeline_si };
         si.commandBufferCount = 1;
         si.pCommandBuffers = &cb;
-        si.signalSemaphoreCount = 0;
+        si.signalSemaphoreCount = 1;
+        si.pSignalSemaphores = &timeline_sem;
         si.waitSemaphoreCount = 0;
 
+        runtime_counters.submits++;
         vkQueueSubmit(gfx_queue, 1, &si, VK_NULL_HANDLE);
-        vkQueueWaitIdle(gfx_queue);
+        timeline.wait(signal_value);
         vkFreeCommandBuffers(device, command_pool, 1, &cb);
+
+        gpu_profiler.resolveSlot(gpu_profiler.uploadSlot());    // already complete, so this never stalls
     }
 
-    void recordCommandBuffer(VkCommandBuffer buf, uint32_t image_idx)
+    // Records each render graph segment into the slot's command buffer for it
+    void recordCommandBuffers(FrameSlot& frame, uint32_t image_idx, uint32_t slot)
     {
-        // Init buffer
-        VkCommandBufferBeginInfo begin_info = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO, nullptr };
-        begin_info.flags = 0;
-        begin_info.pInheritanceInfo = nullptr;
-        if (VK_SUCCESS != vkBeginCommandBuffer(render_cmd_buf, &begin_info))
+        // Scale for this frame, from the latest GPU timing
+        if (dynamic_resolution)
         {
-            throw std::runtime_error("Failure on begin command buffer recording");
+            float scale = resolution_controller.update(gpu_profiler.latestMs("frame"));
+            render_extent.width = std::clamp(static_cast<uint32_t>(swapchain_extent.width * scale + 0.5f), 1u, target_extent.width);
+            render_extent.height = std::clamp(static_cast<uint32_t>(swapchain_extent.height * scale + 0.5f), 1u, target_extent.height);
         }
 
-        // Init render pass
-        VkClearValue clear = { {{0.0f, 0.0f, 0.0f, 1.0f}} };
-        VkRenderPassBeginInfo rp = { VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO, nullptr };
-        rp.renderPass = render_pass;
-        rp.framebuffer = swapchain_framebuffers[image_idx];
-        rp.renderArea.offset = { 0, 0 };
-        rp.renderArea.extent = swapchain_extent;
-        rp.clearValueCount = 1;
-        rp.pClearValues = &clear;
-        
-        vkCmdBeginRenderPass(render_cmd_buf, &rp, VK_SUBPASS_CONTENTS_INLINE);
+        // Passes record through the graph, which puts the barriers between them
+        record_image_idx = image_idx;
+        record_slot = slot;
+        render_graph.bindImported(graph_backbuffer, swapchain_images[image_idx], swapchain_image_views[image_idx]);
+        requestTextureMips();
+
+        uint32_t frame_region = UINT32_MAX;
+        size_t segment_count = render_graph.segmentCount();
+        for (size_t seg = 0; seg < segment_count; seg++)
+        {
+            bool compute = (PassQueue::Compute == render_graph.segmentQueue(seg));
+            VkCommandBuffer cb = compute ? frame.compute_cmd_bufs[seg] : frame.cmd_bufs[seg];
+            vkResetCommandBuffer(cb, 0);
+
+            // Init buffer
+            VkCommandBufferBeginInfo begin_info = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO, nullptr };
+            begin_info.flags = 0;
+            begin_info.pInheritanceInfo = nullptr;
+            if (VK_SUCCESS != vkBeginCommandBuffer(cb, &begin_info))
+            {
+                throw std::runtime_error("Failure on begin command buffer recording");
+            }
+
+            // Harvest this slot's timings from its previous use, and start timing this frame. The first and last
+            // segments are both on the graphics queue, so the frame region's timestamps are comparable.
+            if (0 == seg)
+            {
+                gpu_profiler.beginSlot(cb, slot);
+                frame_region = gpu_profiler.beginRegion(cb, slot, "frame");
+
+                // A new pyramid starts undefined; put it in the state the graph expects it in between frames
+                if (hiz_needs_init)
+                {
+                    transitionImage(cb, hiz_image, VK_IMAGE_ASPECT_COLOR_BIT, ResourceUsage::Undefined, ResourceUsage::ComputeWrite);
+                    hiz_needs_init = false;
+                }
+
+                // Residency changes go ahead of every pass, and may replace the image the graph samples
+                uint32_t stream_region = gpu_profiler.beginRegion(cb, slot, "texture streaming");
+                texture_streamer.update(cb, frame_number);
+                gpu_profiler.endRegion(cb, slot, stream_region);
+                render_graph.bindImported(graph_texture, texture_streamer.image(texture_id), texture_streamer.view(texture_id));
+
+                // Mesh loads and moves since the last frame, ahead of anything that draws
+                uint32_t geometry_region = gpu_profiler.beginRegion(cb, slot, "geometry uploads");
+                geometry_pool.update(cb);
+                gpu_profiler.endRegion(cb, slot, geometry_region);
+            }
+
+            render_graph.executeSegment(cb, seg);
+
+            bool last_run_frame = run_measuring && (frame_number + 1 == config.warmup_frames + config.frame_count);
+            if (seg + 1 == segment_count && last_run_frame && VK_NULL_HANDLE != capture_buffer)
+            {
+                recordCapture(cb, swapchain_images[image_idx]);
+            }
+            if (seg + 1 == segment_count) gpu_profiler.endRegion(cb, slot, frame_region);
+            if (VK_SUCCESS != vkEndCommandBuffer(cb))
+            {
+                throw std::runtime_error("Error ending command buffer recording");
+            }
+        }
+    }
+
+    void recordMainPass(VkCommandBuffer cb)
+    {
+        uint32_t image_idx = record_image_idx;
+        uint32_t slot = record_slot;
+        prepareDraws(cb, slot);     // may record the culling dispatch, so must come before rendering begins
+        uint32_t pass_region = gpu_profiler.beginRegion(cb, slot, "main pass");
+
+        std::array<VkClearValue, 2> clear{};
+        clear[0].color = { {0.0f, 0.0f, 0.0f, 1.0f} };
+        clear[1].depthStencil = { 1.0f, 0 };   // far plane
+
+        // The path in use is the one the swapchain was last built for - config may have been toggled since
+        bool dynamic_rendering = (VK_NULL_HANDLE == render_pass);
+        if (dynamic_rendering)
+        {
+            // Same load/store ops as the render pass; the graph has already put both images in these layouts
+            VkRenderingAttachmentInfo color = { VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO, nullptr };
+            color.imageView = sceneTargetView(image_idx);
+            color.imageLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+            color.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+            color.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+            color.clearValue = clear[0];
+            if (VK_SAMPLE_COUNT_1_BIT != msaa_samples)
+            {
+                color.imageView = render_graph.view(graph_msaa_color);
+                color.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+                color.resolveMode = VK_RESOLVE_MODE_AVERAGE_BIT;
+                color.resolveImageView = sceneTargetView(image_idx);
+                color.resolveImageLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+            }
+
+            VkRenderingAttachmentInfo depth = { VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO, nullptr };
+            depth.imageView = render_graph.view(graph_depth);
+            depth.imageLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+            depth.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+            depth.storeOp = hiz_active ? VK_ATTACHMENT_STORE_OP_STORE : VK_ATTACHMENT_STORE_OP_DONT_CARE;
+            depth.clearValue = clear[1];
+
+            VkRenderingInfo ri = { VK_STRUCTURE_TYPE_RENDERING_INFO, nullptr };
+            ri.renderArea.offset = { 0, 0 };
+            ri.renderArea.extent = render_extent;
+            ri.layerCount = 1;
+            ri.colorAttachmentCount = 1;
+            ri.pColorAttachments = &color;
+            ri.pDepthAttachment = &depth;
+            vkCmdBeginRendering(cb, &ri);
+        }
+        else
+        {
+            VkRenderPassBeginInfo rp = { VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO, nullptr };
+            rp.renderPass = render_pass;
+            rp.framebuffer = swapchain_framebuffers[image_idx];
+            rp.renderArea.offset = { 0, 0 };
+            rp.renderArea.extent = render_extent;
+            rp.clearValueCount = static_cast<uint32_t>(clear.size());
+            rp.pClearValues = clear.data();
+            vkCmdBeginRenderPass(cb, &rp, VK_SUBPASS_CONTENTS_INLINE);
+        }
+
+        // Viewport & scissor are dynamic state
+        VkViewport viewport{};
+        viewport.x = 0.0f;
+        viewport.y = 0.0f;
+        viewport.width = (float)render_extent.width;     // the swapchain size, or less with dynamic resolution
+        viewport.height = (float)render_extent.height;
+        viewport.minDepth = 0.0f;
+        viewport.maxDepth = 1.0f;
+        vkCmdSetViewport(cb, 0, 1, &viewport);
+
+        VkRect2D scissor{};
+        scissor.offset = { 0, 0 };
+        scissor.extent = render_extent;
+        vkCmdSetScissor(cb, 0, 1, &scissor);
+
+        // Bind the vertex buffer, or with vertex pulling, hand the shader the vertex and object addresses instead
+        bool pulling = config.vertex_pulling && device_caps.buffer_device_address;
+        if (pulling)
+        {
+            PullConstants pull = { geometry_pool.packedVertexAddress(), frames[slot].object_address };
+            vkCmdPushConstants(cb, pipeline_layout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(pull), &pull);
+        }
+        else
+        {
+            VkBuffer vtx_buffers[] = { geometry_pool.vertexBuffer() };
+            VkDeviceSize vb_offsets[] = { 0 };
+            vkCmdBindVertexBuffers(cb, 0, 1, vtx_buffers, vb_offsets);
+        }
+
+        // Bind the index buffer - vertex pulling still indexes through it, keeping post-transform vertex reuse
+        vkCmdBindIndexBuffer(cb, geometry_pool.indexBuffer(), 0, VK_INDEX_TYPE_UINT16);
+
+        // Bind the per-frame ubo set and the material set
+        std::array<VkDescriptorSet, 2> sets = { getFrameDescriptorSet(slot), 
+                                                getMaterialDescriptorSet(texture_streamer.view(texture_id), tex_sampler) };
+        vkCmdBindDescriptorSets(cb, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline_layout, 
+                                0, static_cast<uint32_t>(sets.size()), sets.data(), 0, nullptr);
+
+        gpu_profiler.beginStatistics(cb, slot);
+
+        // Pipelines are normally precompiled - first use only blocks if the worker hasn't finished them
+        const MainPassPipelines& pipelines = pulling ? pulling_pipelines : input_pipelines;
+        if (config.depth_prepass)
+        {
+            vkCmdBindPipeline(cb, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline_library.get(pipelines.depth_prepass));
+            drawScene(cb, slot);
+        }
+
+        const PipelineDesc& pipe_desc = config.depth_prepass ? (show_texture ? pipelines.main_after_prepass : pipelines.untextured_after_prepass)
+                                                             : (show_texture ? pipelines.main : pipelines.untextured);
+        vkCmdBindPipeline(cb, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline_library.get(pipe_desc));
+        drawScene(cb, slot);
+
+        gpu_profiler.endStatistics(cb, slot);
+
+        if (dynamic_rendering) vkCmdEndRendering(cb);
+        else vkCmdEndRenderPass(cb);
+        gpu_profiler.endRegion(cb, slot, pass_region);
+    }
+
+    // Where the main pass renders (or resolves) color: the swapchain image, or the internal target
+    VkImageView sceneTargetView(size_t image_idx)
+    {
+        return (dynamic_resolution || post_process) ? render_graph.view(graph_scene_color) : swapchain_image_views[image_idx];
+    }
+
+    // Stretch the rendered part of the internal target (or the post-processed copy of it) over the whole
+    // swapchain image. The blit also converts to the swapchain format.
+    void recordUpscale(VkCommandBuffer cb)
+    {
+        uint32_t region = gpu_profiler.beginRegion(cb, record_slot, "upscale");
+
+        VkImageBlit2 blit = { VK_STRUCTURE_TYPE_IMAGE_BLIT_2, nullptr };
+        blit.srcSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
+        blit.srcOffsets[1] = { static_cast<int32_t>(render_extent.width), static_cast<int32_t>(render_extent.height), 1 };
+        blit.dstSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
+        blit.dstOffsets[1] = { static_cast<int32_t>(swapchain_extent.width), static_cast<int32_t>(swapchain_extent.height), 1 };
+
+        VkBlitImageInfo2 info = { VK_STRUCTURE_TYPE_BLIT_IMAGE_INFO_2, nullptr };
+        info.srcImage = render_graph.image(graph_blit_source);
+        info.srcImageLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+        info.dstImage = render_graph.image(graph_backbuffer);
+        info.dstImageLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+        info.regionCount = 1;
+        info.pRegions = &blit;
+        info.filter = upscale_filter;
+        vkCmdBlitImage2(cb, &info);
+
+        gpu_profiler.endRegion(cb, record_slot, region);
+    }
+
+    // The quad, and a tile of hills with its LOD chain. Both share one vertex and one index buffer.
+    void createMeshes()
+    {
+        PROFILE_FUNCTION();
+        quad_mesh = geometry.add("quad", vertices, indices, 1);
+
+        std::vector<Vertex> hill_vertices;
+        std::vector<uint16_t> hill_indices;
+        makeHillsMesh(32, hill_vertices, hill_indices);
+        hills_mesh = geometry.add("hills", hill_vertices, hill_indices, 6);
+    }
+
+    // A stack of overlapping quads, listed back to front (the worst case for early-Z) so the sort has work to do.
+    // With --lod-scene, a field of hill tiles instead, spread from under the camera to near the far plane.
+    void createScene()
+    {
+        PROFILE_FUNCTION();
+        if (config.lod_grid > 0)
+        {
+            const float extent = 6.0f;
+            float tile = extent / config.lod_grid;
+            for (uint32_t j = 0; j < config.lod_grid; j++)
+            {
+                for (uint32_t i = 0; i < config.lod_grid; i++)
+                {
+                    SceneObject obj;
+                    glm::vec3 center((i + 0.5f) * tile - 0.5f * extent, (j + 0.5f) * tile - 0.5f * extent, 0.0f);
+                    obj.model = glm::scale(glm::translate(glm::mat4(1.0f), center), glm::vec3(tile));
+                    scene_objects.push_back(obj);
+                    scene_instances.push_back({ hills_mesh, 0 });
+                }
+            }
+            return;
+        }
+
+        const int layers = 8;
+        for (int i = 0; i < layers; i++)
+        {
+            float t = i / float(layers - 1);
+            SceneObject obj;
+            obj.model = glm::translate(glm::mat4(1.0f), glm::vec3(0.4f * (t - 0.5f), 0.2f * (t - 0.5f), -0.6f + 0.8f * t));
+            scene_objects.push_back(obj);
+            scene_instances.push_back({ quad_mesh, 0 });
+        }
+    }
+
+    // Unloads and reloads each mesh the scene draws, one at a time, then compacts the pool. All of it is free list
+    // bookkeeping here; the uploads and moves are recorded into the next frame.
+    void reloadMeshes()
+    {
+        std::set<GeometryPool::MeshId> in_use;
+        for (const auto& inst : scene_instances) in_use.insert(inst.mesh);
+        for (GeometryPool::MeshId id : in_use)
+        {
+            uint32_t source = geometry_pool.source(id);
+            geometry_pool.unload(id);
+            GeometryPool::MeshId reloaded = geometry_pool.load(source);
+            for (auto& inst : scene_instances)
+            {
+                if (inst.mesh == id) inst.mesh = reloaded;
+            }
+        }
+        geometry_pool.compact();
+        geometry_pool.printStats();
+    }
+
+    // Picks each object's LOD: the coarsest whose error projects to no more than lod_error_pixels, measured at the
+    // nearest point of its bounds. Going coarser also needs the error a hysteresis margin under the threshold, so
+    // objects sitting near it don't switch back and forth every frame.
+    void selectLods()
+    {
+        glm::mat4 view_model = frame_ubo.view * frame_ubo.model;
+        float pixels_per_unit = frame_ubo.projection[1][1] * 0.5f * render_extent.height;    // at unit distance
+        float coarser_threshold = config.lod_error_pixels * (1.0f - config.lod_hysteresis);
+
+        uint64_t drawn = 0, full = 0;
+        for (size_t i = 0; i < scene_objects.size(); i++)
+        {
+            SceneInstance& inst = scene_instances[i];
+            const Mesh& mesh = geometry_pool.mesh(inst.mesh);
+            uint32_t lod = 0;
+            if (config.mesh_lod)
+            {
+                glm::mat4 mv = view_model * scene_objects[i].model;
+                float scale = std::max({ glm::length(glm::vec3(mv[0])), glm::length(glm::vec3(mv[1])), glm::length(glm::vec3(mv[2])) });
+                float distance = std::max(-mv[3].z - mesh.radius * scale, 1e-3f);     // view space looks down -Z
+                float error_to_pixels = scale * pixels_per_unit / distance;
+
+                lod = std::min(inst.lod, static_cast<uint32_t>(mesh.lods.size() - 1));
+                while (lod > 0 && mesh.lods[lod].error * error_to_pixels > config.lod_error_pixels) lod--;
+                while (lod + 1 < mesh.lods.size() && mesh.lods[lod + 1].error * error_to_pixels <= coarser_threshold) lod++;
+            }
+            inst.lod = lod;
+
+            drawn += mesh.lods[lod].index_count / 3;
+            full += mesh.lods[0].index_count / 3;
+            if (lod_stats.per_lod.size() <= lod) lod_stats.per_lod.resize(lod + 1, 0);
+            lod_stats.per_lod[lod]++;
+        }
+        lod_stats.frames++;
+        lod_stats.drawn += drawn;
+        lod_stats.full += full;
+    }
+
+    void printLodReport()
+    {
+        if (0 == lod_stats.frames) return;
+        uint64_t instances = 0;
+        for (uint64_t count : lod_stats.per_lod) instances += count;
+
+        std::cout << std::endl << "Mesh LOD: " << scene_objects.size() << " objects, " << lod_stats.drawn / lod_stats.frames
+                  << " triangles per pass of " << lod_stats.full / lod_stats.frames << " at full detail ("
+                  << 100.0 * (1.0 - double(lod_stats.drawn) / double(lod_stats.full)) << "% saved)" << std::endl;
+        std::cout << '\t' << "objects per LOD:";
+        for (size_t lod = 0; lod < lod_stats.per_lod.size(); lod++)
+        {
+            std::cout << " " << lod << ": " << 100.0 * lod_stats.per_lod[lod] / instances << "%";
+        }
+        std::cout << std::endl;
+    }
+
+    // Texel to pixel ratio of each object's quad on screen picks the mip it needs. One level more detailed than
+    // that, so magnification near the threshold doesn't blur while the next level streams in.
+    void requestTextureMips()
+    {
+        glm::mat4 view_proj_model = frame_ubo.projection * frame_ubo.view * frame_ubo.model;
+        float tex_w = static_cast<float>(texture_streamer.width(texture_id));
+        float tex_h = static_cast<float>(texture_streamer.height(texture_id));
+        for (const auto& obj : scene_objects)
+        {
+            // Corners of the quad (every mesh's footprint) in pixels; vertices 0-1 run along u and 1-2 along v
+            glm::vec2 px[3];
+            for (uint32_t i = 0; i < 3; i++)
+            {
+                glm::vec4 clip = view_proj_model * obj.model * glm::vec4(vertices[i].pos, 1.0f);
+                if (clip.w <= 0.0f) clip.w = 1e-4f;     // behind the eye - treat as very close
+                px[i] = glm::vec2(clip.x / clip.w * 0.5f * render_extent.width, clip.y / clip.w * 0.5f * render_extent.height);
+            }
+            float pixels_u = std::max(glm::length(px[1] - px[0]), 1.0f);
+            float pixels_v = std::max(glm::length(px[2] - px[1]), 1.0f);
+            float ratio = std::min(tex_w / pixels_u, tex_h / pixels_v);
+            int mip = static_cast<int>(std::floor(std::log2(std::max(ratio, 1.0f)))) - 1;
+            texture_streamer.request(texture_id, static_cast<uint32_t>(std::max(mip, 0)), frame_number);
+        }
+    }
+
+    // Order by view space depth of each object's origin, using the matrices last written to the UBO
+    void sortDrawOrder()
+    {
+        glm::mat4 view_model = frame_ubo.view * frame_ubo.model;
+        draw_order.clear();
+        for (uint32_t i = 0; i < scene_objects.size(); i++)
+        {
+            glm::vec4 center = view_model * scene_objects[i].model * glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+            draw_order.push_back({ -center.z, i });     // right-handed view space looks down -Z
+        }
+        if (config.sort_front_to_back) std::sort(draw_order.begin(), draw_order.end());
+    }
+
+    // Opaque draws, nearest first so early-Z rejects as much of what follows as possible. Objects were uploaded in
+    // that order, so the first instance of each draw is its object's place in it.
+    void prepareDraws(VkCommandBuffer cb, uint32_t slot)
+    {
+        sortDrawOrder();
+        selectLods();
+
+        FrameSlot& frame = frames[slot];
+        readClusterCounts(frame);   // from this slot's last use, which has completed
+
+        ObjectData* objects = nullptr;
+        uint32_t meshlets = 0;
+        vkMapMemory(device, frame.object_mem, 0, VK_WHOLE_SIZE, 0, reinterpret_cast<void**>(&objects));
+        for (uint32_t i = 0; i < draw_order.size(); i++)
+        {
+            uint32_t object = draw_order[i].second;
+            const Mesh& mesh = geometry_pool.mesh(scene_instances[object].mesh);
+            const MeshLod& lod = mesh.lods[scene_instances[object].lod];
+            objects[i].model = scene_objects[object].model;
+            objects[i].first_meshlet = lod.first_meshlet;
+            objects[i].meshlet_count = lod.meshlet_count;
+            objects[i].radius = mesh.radius;
+            meshlets += lod.meshlet_count;
+        }
+        vkUnmapMemory(device, frame.object_mem);
 
-        // Bind the pipeline
-        vkCmdBindPipeline(render_cmd_buf, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+        draw_clusters = config.clusters && device_caps.cluster_culling;
+        if (draw_clusters) recordClusterCull(cb, slot, meshlets);
+    }
 
-        // Bind the vertex buffer
-        VkBuffer vtx_buffers[] = { vertex_buffer };
-        VkDeviceSize vb_offsets[] = { 0 };
-        vkCmdBindVertexBuffers(render_cmd_buf, 0, 1, vtx_buffers, vb_offsets);
+    void drawScene(VkCommandBuffer cb, uint32_t slot)
+    {
+        if (!draw_clusters)
+        {
+            for (uint32_t i = 0; i < draw_order.size(); i++)
+            {
+                const SceneInstance& inst = scene_instances[draw_order[i].second];
+                const Mesh& mesh = geometry_pool.mesh(inst.mesh);
+                const MeshLod& lod = mesh.lods[inst.lod];
+                vkCmdDrawIndexed(cb, lod.index_count, 1, lod.first_index, mesh.vertex_offset, i);
+            }
+            return;
+        }
 
-        // Bind the index buffer
-        vkCmdBindIndexBuffer(render_cmd_buf, index_buffer, 0, VK_INDEX_TYPE_UINT16);
+        // The meshlets that survived culling. Without an indirect count, the unused tail are zero-instance draws.
+        const FrameSlot& frame = frames[slot];
+        if (device_caps.draw_indirect_count)
+        {
+            vkCmdDrawIndexedIndirectCount(cb, frame.draw_buffer, 0, frame.count_buffer, offsetof(ClusterCounts, draw_count),
+                                          max_cluster_draws, sizeof(VkDrawIndexedIndirectCommand));
+        }
+        else
+        {
+            vkCmdDrawIndexedIndirect(cb, frame.draw_buffer, 0, max_cluster_draws, sizeof(VkDrawIndexedIndirectCommand));
+        }
+    }
 
-        // Bind the ubo descriptor
-        vkCmdBindDescriptorSets(render_cmd_buf, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline_layout, 
-                                0, 1, &descriptor_sets[image_idx], 0, nullptr);
+    // Tests every meshlet of every object's LOD against the frustum, its normal cone and - once there is one - the
+    // previous frame's depth pyramid, writing an indirect draw for each that passes. Recorded ahead of the main pass
+    // on the same queue.
+    void recordClusterCull(VkCommandBuffer cb, uint32_t slot, uint32_t meshlets)
+    {
+        FrameSlot& frame = frames[slot];
+        uint32_t region = gpu_profiler.beginRegion(cb, slot, "cluster cull");
+
+        vkCmdFillBuffer(cb, frame.count_buffer, 0, VK_WHOLE_SIZE, 0);
+        if (!device_caps.draw_indirect_count) vkCmdFillBuffer(cb, frame.draw_buffer, 0, VK_WHOLE_SIZE, 0);
+        bufferBarrier(cb, VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT,
+                      VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT);
+
+        VkDescriptorBufferInfo infos[5] = { { frame.object_buffer, 0, VK_WHOLE_SIZE }, { geometry_pool.meshletBuffer(), 0, VK_WHOLE_SIZE },
+                                            { frame.draw_buffer, 0, VK_WHOLE_SIZE }, { frame.count_buffer, 0, VK_WHOLE_SIZE },
+                                            { frame.cull_params_buffer, 0, VK_WHOLE_SIZE } };
+        VkDescriptorImageInfo pyramid = { VK_NULL_HANDLE, hiz_view, VK_IMAGE_LAYOUT_GENERAL };
+        DescriptorBuilder builder(layout_cache, frame_descriptors[slot]);
+        for (uint32_t b = 0; b < 4; b++) builder.bindBuffer(b, infos[b], VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT);
+        builder.bindBuffer(4, infos[4], VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT);
+        builder.bindImage(5, pyramid, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_SHADER_STAGE_COMPUTE_BIT);
+        VkDescriptorSet set = builder.build();
+
+        // Frustum planes (Gribb & Hartmann, for 0..1 depth) and camera, in the space object models map into
+        glm::mat4 scene_to_view = frame_ubo.view * frame_ubo.model;
+        glm::mat4 m = frame_ubo.projection * scene_to_view;
+        auto row = [&m](int r) { return glm::vec4(m[0][r], m[1][r], m[2][r], m[3][r]); };
+        CullParams cp{};
+        cp.planes[0] = row(3) + row(0);
+        cp.planes[1] = row(3) - row(0);
+        cp.planes[2] = row(3) + row(1);
+        cp.planes[3] = row(3) - row(1);
+        cp.planes[4] = row(2);
+        cp.planes[5] = row(3) - row(2);
+        for (auto& plane : cp.planes) plane /= glm::length(glm::vec3(plane));
+        cp.camera = glm::inverse(scene_to_view) * glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+        cp.object_count = static_cast<uint32_t>(draw_order.size());
+        cp.max_draws = max_cluster_draws;
+        cp.flags = CLUSTER_CULL_FRUSTUM | CLUSTER_CULL_BACKFACE;
+        if (hiz_active && hiz_valid)
+        {
+            cp.flags |= CLUSTER_CULL_OCCLUSION;
+            cp.hiz_view_proj = hiz_view_proj;
+            cp.hiz_extent[0] = static_cast<int32_t>(hiz_extent.width);
+            cp.hiz_extent[1] = static_cast<int32_t>(hiz_extent.height);
+            cp.hiz_size = static_cast<int32_t>(hiz_size);
+            cp.hiz_levels = static_cast<int32_t>(hiz_levels);
+        }
+        void* data;
+        vkMapMemory(device, frame.cull_params_mem, 0, sizeof(cp), 0, &data);
+        memcpy(data, &cp, sizeof(cp));
+        vkUnmapMemory(device, frame.cull_params_mem);
+
+        vkCmdBindPipeline(cb, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline_library.getCompute(cluster_cull_shader, cull_pipeline_layout));
+        vkCmdBindDescriptorSets(cb, VK_PIPELINE_BIND_POINT_COMPUTE, cull_pipeline_layout, 0, 1, &set, 0, nullptr);
+        vkCmdDispatch(cb, cp.object_count, 1, 1);   // a workgroup per object
+
+        // Draws consume the commands; the host reads the counts back once the frame completes
+        bufferBarrier(cb, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+                      VK_PIPELINE_STAGE_2_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_2_HOST_BIT,
+                      VK_ACCESS_2_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_2_HOST_READ_BIT);
+
+        gpu_profiler.endRegion(cb, slot, region);
+        frame.clusters_tested = meshlets;
+        frame.objects_tested = cp.object_count;
+    }
 
-        // Submit a draw call
-        vkCmdDrawIndexed(render_cmd_buf, static_cast<uint32_t>(indices.size()), 1, 0, 0, 0);
+    // Power-of-two level 0 square (level k texels cover 2^(k+1) depth pixels a side, so it holds the reduced
+    // depth of any render extent up to `extent`), with the smaller levels stacked in a column to its right
+    void createHizPyramid(VkExtent2D extent)
+    {
+        hiz_size = 1;
+        while (hiz_size < (extent.width + 1) / 2 || hiz_size < (extent.height + 1) / 2) hiz_size *= 2;
+        hiz_levels = 1;
+        while ((hiz_size >> (hiz_levels - 1)) > 1) hiz_levels++;
+
+        VkImageCreateInfo ci = { VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO, nullptr };
+        ci.imageType = VK_IMAGE_TYPE_2D;
+        ci.format = VK_FORMAT_R32_SFLOAT;
+        ci.extent = { hiz_size + hiz_size / 2, hiz_size, 1 };
+        ci.mipLevels = 1;
+        ci.arrayLayers = 1;
+        ci.samples = VK_SAMPLE_COUNT_1_BIT;
+        ci.tiling = VK_IMAGE_TILING_OPTIMAL;
+        ci.usage = VK_IMAGE_USAGE_STORAGE_BIT;
+        ci.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+        ci.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+        if (VK_SUCCESS != vkCreateImage(device, &ci, nullptr, &hiz_image))
+        {
+            throw std::runtime_error("Failed to create depth pyramid");
+        }
 
-        // End the render pass and finish recording
-        vkCmdEndRenderPass(render_cmd_buf);
-        if (VK_SUCCESS != vkEndCommandBuffer(render_cmd_buf))
+        VkMemoryRequirements mem_req;
+        vkGetImageMemoryRequirements(device, hiz_image, &mem_req);
+        VkMemoryAllocateInfo ai = { VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO, nullptr };
+        ai.allocationSize = mem_req.size;
+        ai.memoryTypeIndex = findMemoryTypeIdx(mem_req.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+        runtime_counters.device_allocations++;
+        if (VK_SUCCESS != vkAllocateMemory(device, &ai, nullptr, &hiz_mem))
+        {
+            throw std::runtime_error("Failed to allocate depth pyramid memory");
+        }
+        vkBindImageMemory(device, hiz_image, hiz_mem, 0);
+        hiz_bytes = mem_req.size;
+
+        VkImageViewCreateInfo vci = { VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO, nullptr };
+        vci.image = hiz_image;
+        vci.viewType = VK_IMAGE_VIEW_TYPE_2D;
+        vci.format = ci.format;
+        vci.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+        if (VK_SUCCESS != vkCreateImageView(device, &vci, nullptr, &hiz_view))
         {
-            throw std::runtime_error("Error ending command buffer recording");
+            throw std::runtime_error("Failed to create depth pyramid view");
         }
+        hiz_needs_init = true;
+        hiz_valid = false;
+    }
+
+    // Reduces this frame's depth into the pyramid the next frame's culling tests against, along with the view it
+    // was rendered from. Objects are static in scene space, so reprojecting them with that view finds exactly
+    // where they were drawn.
+    void recordHizBuild(VkCommandBuffer cb)
+    {
+        uint32_t slot = record_slot;
+        uint32_t region = gpu_profiler.beginRegion(cb, slot, "depth pyramid");
+
+        // The workgroup counter was last written by the previous build
+        bufferBarrier(cb, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+                      VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT);
+
+        VkDescriptorImageInfo depth = { hiz_sampler, render_graph.view(graph_depth), VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL };
+        VkDescriptorImageInfo pyramid = { VK_NULL_HANDLE, hiz_view, VK_IMAGE_LAYOUT_GENERAL };
+        VkDescriptorBufferInfo counter = { hiz_counter, 0, VK_WHOLE_SIZE };
+        VkDescriptorSet set = DescriptorBuilder(layout_cache, frame_descriptors[slot])
+            .bindImage(0, depth, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_COMPUTE_BIT)
+            .bindImage(1, pyramid, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_SHADER_STAGE_COMPUTE_BIT)
+            .bindBuffer(2, counter, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT)
+            .build();
+
+        HizConstants hc{};
+        hc.extent[0] = static_cast<int32_t>(render_extent.width);
+        hc.extent[1] = static_cast<int32_t>(render_extent.height);
+        hc.size = static_cast<int32_t>(hiz_size);
+        hc.levels = static_cast<int32_t>(hiz_levels);
+
+        vkCmdBindPipeline(cb, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline_library.getCompute(hiz_build_shader, hiz_pipeline_layout));
+        vkCmdBindDescriptorSets(cb, VK_PIPELINE_BIND_POINT_COMPUTE, hiz_pipeline_layout, 0, 1, &set, 0, nullptr);
+        vkCmdPushConstants(cb, hiz_pipeline_layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(HizConstants), &hc);
+        const uint32_t tile = 4 * HIZ_GROUP_SIZE;     // depth pixels a side per workgroup
+        vkCmdDispatch(cb, (render_extent.width + tile - 1) / tile, (render_extent.height + tile - 1) / tile, 1);
+
+        gpu_profiler.endRegion(cb, slot, region);
+        hiz_view_proj = frame_ubo.projection * frame_ubo.view * frame_ubo.model;
+        hiz_extent = render_extent;
+        hiz_valid = true;
+    }
+
+    // Global memory dependency - the cull buffers are per frame and few, so there's nothing to gain from narrowing it
+    void bufferBarrier(VkCommandBuffer cb, VkPipelineStageFlags2 src_stages, VkAccessFlags2 src_access,
+                       VkPipelineStageFlags2 dst_stages, VkAccessFlags2 dst_access)
+    {
+        VkMemoryBarrier2 barrier = { VK_STRUCTURE_TYPE_MEMORY_BARRIER_2, nullptr };
+        barrier.srcStageMask = src_stages;
+        barrier.srcAccessMask = src_access;
+        barrier.dstStageMask = dst_stages;
+        barrier.dstAccessMask = dst_access;
+        VkDependencyInfo dep = { VK_STRUCTURE_TYPE_DEPENDENCY_INFO, nullptr };
+        dep.memoryBarrierCount = 1;
+        dep.pMemoryBarriers = &barrier;
+        vkCmdPipelineBarrier2(cb, &dep);
+    }
+
+    void readClusterCounts(FrameSlot& frame)
+    {
+        if (0 == frame.clusters_tested) return;
+        ClusterCounts* counts = nullptr;
+        vkMapMemory(device, frame.count_mem, 0, VK_WHOLE_SIZE, 0, reinterpret_cast<void**>(&counts));
+        cluster_stats.frames++;
+        cluster_stats.tested += frame.clusters_tested;
+        cluster_stats.drawn += std::min(counts->draw_count, max_cluster_draws);
+        cluster_stats.frustum_culled += counts->frustum_culled;
+        cluster_stats.backface_culled += counts->backface_culled;
+        cluster_stats.occluded += counts->occluded;
+        cluster_stats.occluded_objects += counts->occluded_objects;
+        cluster_stats.objects += frame.objects_tested;
+        vkUnmapMemory(device, frame.count_mem);
+        frame.clusters_tested = 0;
+    }
+
+    void printClusterReport()
+    {
+        if (0 == cluster_stats.frames) return;
+        uint64_t frames = cluster_stats.frames;
+        double tested = double(std::max<uint64_t>(cluster_stats.tested, 1));
+        std::cout << std::endl << "Cluster culling: " << cluster_stats.tested / frames << " meshlets tested per frame, "
+                  << cluster_stats.drawn / frames << " drawn (" << 100.0 * cluster_stats.drawn / tested << "%)" << std::endl;
+        std::cout << '\t' << 100.0 * cluster_stats.frustum_culled / tested << "% outside the frustum, "
+                  << 100.0 * cluster_stats.backface_culled / tested << "% back facing"
+                  << (device_caps.draw_indirect_count ? "" : " (no indirect count - culled draws are zero-instance)") << std::endl;
+        if (!hiz_active) return;
+        std::cout << '\t' << 100.0 * cluster_stats.occluded / tested << "% occluded, including "
+                  << cluster_stats.occluded_objects / frames << " of " << cluster_stats.objects / frames << " objects whole" << std::endl;
+        std::cout << "\tDepth pyramid: " << hiz_size + hiz_size / 2 << "x" << hiz_size << " atlas, " << hiz_levels << " levels, "
+                  << (hiz_bytes + 1023) / 1024 << " KB, " << gpu_profiler.averageMs("depth pyramid") << " ms to build" << std::endl;
     }
 
     void createSyncObjects()
     {
+        PROFILE_FUNCTION();
+        // Frame slots start retired (value 0), so the first MAX_FRAMES_IN_FLIGHT frames never wait
         VkSemaphoreCreateInfo sem_ci = { VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO, nullptr };
-        VkFenceCreateInfo fence_ci = { VK_STRUCTURE_TYPE_FENCE_CREATE_INFO, nullptr };
-        fence_ci.flags = VK_FENCE_CREATE_SIGNALED_BIT;  // Create as already signaled
-
-        if (VK_SUCCESS != vkCreateSemaphore(device, &sem_ci, nullptr, &sem_image_available) ||
-            VK_SUCCESS != vkCreateSemaphore(device, &sem_ci, nullptr, &sem_render_complete) ||
-            VK_SUCCESS != vkCreateFence(device, &fence_ci, nullptr, &fence_in_flight))
+        for (auto& frame : frames)
         {
-            throw std::runtime_error("Error creating sync objects");
+            if (VK_SUCCESS != vkCreateSemaphore(device, &sem_ci, nullptr, &frame.image_available))
+            {
+                throw std::runtime_error("Error creating sync objects");
+            }
+            for (auto& cb : frame.cmd_bufs) cb = createCommandBuffer();
+            if (VK_NULL_HANDLE != compute_command_pool)
+            {
+                for (auto& cb : frame.compute_cmd_bufs) cb = createCommandBuffer(compute_command_pool);
+            }
+            frame.retire_value = 0;
         }
     }
+
+    void createTimeline()
+    {
+        PROFILE_FUNCTION();
+        timeline.init(device);
+    }
     
     uint32_t findMemoryTypeIdx(uint32_t type, VkMemoryPropertyFlags props)
     {
@@ -1440,6 +7995,16 @@ private:
         VkMemoryAllocateInfo alloc_info = { VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO, nullptr };
         alloc_info.allocationSize = mem_req.memoryRequirements.size;
         alloc_info.memoryTypeIndex = findMemoryTypeIdx(mem_req.memoryRequirements.memoryTypeBits, props);
+
+        // A buffer whose address shaders use needs memory that can be addressed
+        VkMemoryAllocateFlagsInfo flags_info = { VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_FLAGS_INFO, nullptr };
+        if (usage & VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT)
+        {
+            flags_info.flags = VK_MEMORY_ALLOCATE_DEVICE_ADDRESS_BIT;
+            alloc_info.pNext = &flags_info;
+        }
+
+        runtime_counters.device_allocations++;
         if (VK_SUCCESS != vkAllocateMemory(device, &alloc_info, nullptr, &buffer_mem))
         {
             throw std::runtime_error("Error allocating memory for buffer");
@@ -1449,161 +8014,143 @@ private:
         vkBindBufferMemory(device, buffer, buffer_mem, 0);
     }
 
-    void copyBuffer(VkBuffer src, VkBuffer dst, VkDeviceSize size)
+    // Every mesh into the pool, with as much room again for meshes loaded later. Loaded in order, so pool IDs start
+    // out the same as the builder's.
+    void createGeometryPool()
     {
-        VkCommandBuffer cb = beginOneOffCommandBuffer();
-
-        // Copy staging to vtx
-        VkBufferCopy2 copy_rgn = { VK_STRUCTURE_TYPE_BUFFER_COPY_2, nullptr };
-        copy_rgn.srcOffset = 0;
-        copy_rgn.dstOffset = 0;
-        copy_rgn.size = size;
-
-        VkCopyBufferInfo2 copy_info = { VK_STRUCTURE_TYPE_COPY_BUFFER_INFO_2, nullptr };
-        copy_info.srcBuffer = src;
-        copy_info.dstBuffer = dst;
-        copy_info.regionCount = 1;
-        copy_info.pRegions = &copy_rgn;
-
-        vkCmdCopyBuffer2(cb, &copy_info);
+        PROFILE_FUNCTION();
+        uint32_t vertex_count = static_cast<uint32_t>(geometry.vertices().size());
+        uint32_t index_count = static_cast<uint32_t>(geometry.indices().size());
+        uint32_t meshlet_count = static_cast<uint32_t>(geometry.meshlets().size());
+        geometry_pool.init(device, physical_device, geometry, device_caps.buffer_device_address,
+                           vertex_count * 2, index_count * 2, meshlet_count * 2);
+        for (uint32_t i = 0; i < geometry.meshes().size(); i++) geometry_pool.load(i);
+
+        DeletionQueue staging;
+        {
+            std::lock_guard<std::mutex> lock(upload_mutex);
+            VkCommandBuffer cb = beginOneOffCommandBuffer();
+            uint32_t region = gpu_profiler.beginRegion(cb, gpu_profiler.uploadSlot(), "geometry upload");
+            geometry_pool.update(cb);
+            gpu_profiler.endRegion(cb, gpu_profiler.uploadSlot(), region);
+            finishOneOffCommandBuffer(cb);
+        }
+        geometry_pool.retire(staging, 0);
+        staging.flush();    // the upload has finished
 
-        finishOneOffCommandBuffer(cb);
+#ifdef VERBOSE_ON
+        std::cout << meshlet_count << " meshlets in " << geometry.meshes().size() << " meshes" << std::endl;
+#endif
     }
 
-    void createVertexBuffers()
+    VkDeviceAddress bufferAddress(VkBuffer buffer)
     {
-        VkDeviceSize vb_size = sizeof(vertices[0]) * vertices.size(); // vb size in bytes
-
-        VkBuffer staging = VK_NULL_HANDLE;
-        VkDeviceMemory staging_mem = VK_NULL_HANDLE;
-        createBuffer(vb_size,
-                     VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                     staging, 
-                     staging_mem);
-
-        // Map & fill staging buffer
-        void* data;
-        vkMapMemory(device, staging_mem, 0, VK_WHOLE_SIZE, 0, &data);
-        memcpy(data, vertices.data(), (size_t) vb_size);
-        vkUnmapMemory(device, staging_mem);
-
-        // Create the on-device vertex buffer & copy data from staging
-        createBuffer(vb_size,
-            VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
-            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-            vertex_buffer,
-            vertex_buffer_mem);
-
-        copyBuffer(staging, vertex_buffer, vb_size);
-
-        // Clean up
-        vkDestroyBuffer(device, staging, nullptr);
-        vkFreeMemory(device, staging_mem, nullptr);
+        VkBufferDeviceAddressInfo info = { VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO, nullptr };
+        info.buffer = buffer;
+        return vkGetBufferDeviceAddress(device, &info);
     }
-    
-    void createIndexBuffers()
-    {
-        VkDeviceSize ib_size = sizeof(indices[0]) * indices.size(); // ib size in bytes
 
-        VkBuffer staging = VK_NULL_HANDLE;
-        VkDeviceMemory staging_mem = VK_NULL_HANDLE;
-        createBuffer( ib_size,
-                      VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-                      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                      staging,
-                      staging_mem );
+    // Per-frame object data, which every draw reads its model from, and the cull outputs
+    void createObjectBuffers()
+    {
+        PROFILE_FUNCTION();
+        max_cluster_draws = 0;
+        for (const auto& inst : scene_instances)
+        {
+            uint32_t most = 0;
+            for (const auto& lod : geometry_pool.mesh(inst.mesh).lods) most = std::max(most, lod.meshlet_count);
+            max_cluster_draws += most;
+        }
 
-        // Map & fill staging buffer
-        void* data;
-        vkMapMemory(device, staging_mem, 0, VK_WHOLE_SIZE, 0, &data);
-        memcpy(data, indices.data(), (size_t)ib_size);
-        vkUnmapMemory(device, staging_mem);
+        VkPhysicalDeviceProperties props;
+        vkGetPhysicalDeviceProperties(physical_device, &props);
+        if (device_caps.cluster_culling && max_cluster_draws > props.limits.maxDrawIndirectCount)
+        {
+            std::cout << "Scene needs " << max_cluster_draws << " indirect draws, device allows "
+                      << props.limits.maxDrawIndirectCount << " - cluster culling disabled" << std::endl;
+            device_caps.cluster_culling = false;
+        }
 
-        // Create the on-device index buffer & copy data from staging
-        createBuffer(ib_size,
-            VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
-            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-            index_buffer,
-            index_buffer_mem);
+        VkDeviceSize object_size = sizeof(ObjectData) * std::max<size_t>(scene_objects.size(), 1);
+        VkDeviceSize draw_size = sizeof(VkDrawIndexedIndirectCommand) * std::max(max_cluster_draws, 1u);
+        VkBufferUsageFlags object_usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+        if (device_caps.buffer_device_address) object_usage |= VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT;   // vertex pulling
+        for (auto& frame : frames)
+        {
+            createBuffer(object_size, object_usage,
+                VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                frame.object_buffer, frame.object_mem);
+            if (device_caps.buffer_device_address) frame.object_address = bufferAddress(frame.object_buffer);
+            createBuffer(draw_size, VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                frame.draw_buffer, frame.draw_mem);
+            // Host visible so the stats can be read back without a copy
+            createBuffer(sizeof(ClusterCounts), VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                frame.count_buffer, frame.count_mem);
+            createBuffer(sizeof(CullParams), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+                VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                frame.cull_params_buffer, frame.cull_params_mem);
+        }
 
-        copyBuffer(staging, index_buffer, ib_size);
+        // The pyramid build leaves its counter at zero for the next one, so it only needs clearing here
+        createBuffer(sizeof(uint32_t), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+            hiz_counter, hiz_counter_mem);
+        void* counter;
+        vkMapMemory(device, hiz_counter_mem, 0, VK_WHOLE_SIZE, 0, &counter);
+        memset(counter, 0, sizeof(uint32_t));
+        vkUnmapMemory(device, hiz_counter_mem);
 
-        // Clean up
-        vkDestroyBuffer(device, staging, nullptr);
-        vkFreeMemory(device, staging_mem, nullptr);
+#ifdef VERBOSE_ON
+        std::cout << "Up to " << max_cluster_draws << " cluster draws per frame" << std::endl;
+#endif
     }
 
     void createDescriptorPool()
     {
-        std::array<VkDescriptorPoolSize, 2> pool_sizes{};
-        pool_sizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-        pool_sizes[0].descriptorCount = MAX_FRAMES_IN_FLIGHT;
-        pool_sizes[1].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-        pool_sizes[1].descriptorCount = MAX_FRAMES_IN_FLIGHT;
-
-        VkDescriptorPoolCreateInfo dp_ci = { VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO, nullptr };
-        dp_ci.poolSizeCount = static_cast<uint32_t>(pool_sizes.size());
-        dp_ci.pPoolSizes = pool_sizes.data();
-        dp_ci.maxSets = MAX_FRAMES_IN_FLIGHT;
-
-        if (VK_SUCCESS != vkCreateDescriptorPool(device, &dp_ci, nullptr, &descriptor_pool))
-        {
-            throw std::runtime_error("Error creating descriptor pool");
-        }
+        PROFILE_FUNCTION();
+        // One allocator per frame for transient sets (reset wholesale once that frame's work has retired),
+        // plus a long-lived one for sets served through the content cache
+        for (auto& frame_alloc : frame_descriptors) frame_alloc.init(device, 16);
+        material_descriptors.init(device, 64);
     }
 
-    void createDescriptorSets()
+    VkDescriptorSet getFrameDescriptorSet(uint32_t idx)
     {
-        std::vector<VkDescriptorSetLayout> ds_layouts(MAX_FRAMES_IN_FLIGHT, ubo_desc_layout);
-        VkDescriptorSetAllocateInfo ds_ai = { VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO, nullptr };
-        ds_ai.descriptorPool = descriptor_pool;
-        ds_ai.descriptorSetCount = MAX_FRAMES_IN_FLIGHT;
-        ds_ai.pSetLayouts = ds_layouts.data();
-
-        descriptor_sets.resize(MAX_FRAMES_IN_FLIGHT);
-        if (VK_SUCCESS != vkAllocateDescriptorSets(device, &ds_ai, descriptor_sets.data()))
-        {
-            throw std::runtime_error("Error allocating descriptor sets");
-        }
-        // cleaned up implicitly when pool is destroyed
-
-        // Populate the descriptor sets with the uniform buffers
-        for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++)
-        {
-            VkDescriptorBufferInfo bi{};
-            bi.buffer = uniform_buffer[i];
-            bi.offset = 0;
-            bi.range = sizeof(mvp_ubo);
-            
-            VkDescriptorImageInfo ti{};
-            ti.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-            ti.imageView = tex_image_view;
-            ti.sampler = tex_sampler;
-
-            std::array<VkWriteDescriptorSet, 2> write_info{};
-            for (auto& wi : write_info)
-            {
-                wi.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-                wi.pNext = nullptr;
-                wi.dstSet = descriptor_sets[i];
-                wi.dstArrayElement = 0;
-                wi.descriptorCount = 1;
-            }
-            write_info[0].dstBinding = 0;
-            write_info[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-            write_info[0].pBufferInfo = &bi;
-
-            write_info[1].dstBinding = 1;
-            write_info[1].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-            write_info[1].pImageInfo = &ti;        // 
+        VkDescriptorBufferInfo bi{};
+        bi.buffer = uniform_buffer[idx];
+        bi.offset = 0;
+        bi.range = sizeof(mvp_ubo);
+
+        VkDescriptorBufferInfo objects{};
+        objects.buffer = frames[idx].object_buffer;
+        objects.offset = 0;
+        objects.range = VK_WHOLE_SIZE;
+
+        return DescriptorBuilder(layout_cache, frame_descriptors[idx])
+            .bindBuffer(0, bi, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_VERTEX_BIT)
+            .bindBuffer(1, objects, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_VERTEX_BIT)
+            .build();
+    }
 
-            vkUpdateDescriptorSets(device, static_cast<uint32_t>(write_info.size()), write_info.data(), 0, nullptr);
-        }
+    VkDescriptorSet getMaterialDescriptorSet(VkImageView view, VkSampler sampler)
+    {
+        VkDescriptorImageInfo ti{};
+        ti.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+        ti.imageView = view;
+        ti.sampler = sampler;
+
+        // Identical content hits the cache - no allocation or descriptor writes. A streamed texture's new view is
+        // a new key; the streamer evicts the old one's set when it retires the view.
+        return DescriptorBuilder(layout_cache, material_descriptors)
+            .bindImage(0, ti, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT)
+            .build(&material_set_cache);
     }
 
     void createUniformBuffers()
     {
+        PROFILE_FUNCTION();
         VkDeviceSize ubo_size = sizeof(mvp_ubo);
         uniform_buffer.resize(MAX_FRAMES_IN_FLIGHT);
         uniform_buffer_memory.resize(MAX_FRAMES_IN_FLIGHT);
@@ -1623,6 +8170,7 @@ private:
 
         auto cur_time = std::chrono::high_resolution_clock::now();
         auto elapsed_time = std::chrono::duration<float, std::chrono::seconds::period>(cur_time - start_time).count();
+        if (config.fixed_step >= 0.0f) elapsed_time = frame_number * config.fixed_step;    // repeatable frames
 
         mvp_ubo ubo{};
         // rotate around Z at 90 deg/sec
@@ -1634,6 +8182,8 @@ private:
         // 45-deg FOV, z range 0.1 .. 10.0
         ubo.projection = glm::perspectiveRH(glm::radians(45.f), swapchain_extent.width / (float)swapchain_extent.height, 0.1f, 10.f);
 
+        frame_ubo = ubo;    // draw sorting needs the same view
+
         // copy (optimization would be to use push constants instead of map/copy/unmap)
         void* data;
         vkMapMemory(device, uniform_buffer_memory[idx], 0, sizeof(ubo), 0, &data);
@@ -1661,6 +8211,7 @@ private:
 
     void setupDebugMessenger()
     {
+        PROFILE_FUNCTION();
         if (!enable_validation) return;
 
         VkDebugUtilsMessengerCreateInfoEXT info;
@@ -1683,10 +8234,10 @@ private:
         if (pDDUM_fxn != nullptr) pDDUM_fxn(instance, debug_messenger, nullptr);
     }
 
-    static VKAPI_ATTR VkBool32 VKAPI_CALL debugCallback( VkDebugUtilsMessageSeverityFlagBitsEXT         messageSeverity,
-                                                         VkDebugUtilsMessageTypeFlagsEXT                messageType,
+    static VKAPI_ATTR VkBool32 VKAPI_CALL debugCallback( VkDebugUtilsMessageSeverityFlagBitsEXT         /*messageSeverity*/,
+                                                         VkDebugUtilsMessageTypeFlagsEXT                /*messageType*/,
                                                          const VkDebugUtilsMessengerCallbackDataEXT*    pCallbackData,
-                                                         void*                                          pUserData) 
+                                                         void*                                          /*pUserData*/)
     {
         std::cerr << "Validation: " << pCallbackData->pMessage << std::endl;
         return VK_FALSE;
@@ -1700,9 +8251,25 @@ private:
 private:
     const uint32_t  window_width = 1200;
     const uint32_t  window_height = 900;
-    GLFWwindow*     window;
+    GLFWwindow*     window = nullptr;     // none when headless
 
     bool            frame_buffer_resized = false;
+    bool            resize_benchmark_pending = false;
+    FrameLimiter    frame_limiter;
+    double          input_sample_us = 0.0;
+    double          last_present_us = 0.0;
+    RollingStats    input_to_present_ms;
+    RollingStats    frame_interval_ms;
+    double          launch_us = 0.0;    // for the time-to-first-frame report
+
+    RunStats        run_stats;
+    bool            run_measuring = false;
+    uint64_t        run_start_submits = 0;
+    uint64_t        run_start_device_allocations = 0;
+    uint64_t        run_start_host_allocations = 0;
+    VkBuffer        capture_buffer = VK_NULL_HANDLE;    // the last run frame's pixels, with --checksum
+    VkDeviceMemory  capture_mem = VK_NULL_HANDLE;
+    VkDeviceSize    capture_size = 0;
 
     VkInstance                  instance            = VK_NULL_HANDLE;
     VkSurfaceKHR                surface             = VK_NULL_HANDLE;
@@ -1710,35 +8277,159 @@ private:
     VkDevice                    device              = VK_NULL_HANDLE;    // logical device
     VkQueue                     gfx_queue           = VK_NULL_HANDLE;
     VkQueue                     present_queue       = VK_NULL_HANDLE;
+    VkQueue                     compute_queue       = VK_NULL_HANDLE;   // only when there's a separate compute family
+    uint32_t                    graphics_family     = 0;
+    uint32_t                    compute_family      = 0;
     VkDebugUtilsMessengerEXT    debug_messenger     = VK_NULL_HANDLE;
     VkSwapchainKHR              swapchain           = VK_NULL_HANDLE;
     VkSurfaceFormatKHR          swapchain_format;
+    VkPresentModeKHR            present_mode        = VK_PRESENT_MODE_FIFO_KHR;  // as chosen, which may differ from config
     VkExtent2D                  swapchain_extent;
     std::vector<VkImage>        swapchain_images;
     std::vector<VkImageView>    swapchain_image_views;
     std::vector<VkFramebuffer>  swapchain_framebuffers;
-    VkDescriptorSetLayout       ubo_desc_layout     = VK_NULL_HANDLE;
-    VkDescriptorPool            descriptor_pool     = VK_NULL_HANDLE;
-    std::vector<VkDescriptorSet> descriptor_sets;
+    VkFormat                    depth_format        = VK_FORMAT_UNDEFINED;
+    RenderGraph                 render_graph;
+    RenderGraph::ResourceId     graph_backbuffer    = 0;
+    RenderGraph::ResourceId     graph_texture       = 0;
+    RenderGraph::ResourceId     graph_depth         = 0;
+    RenderGraph::ResourceId     graph_msaa_color    = 0;    // only with MSAA
+    VkSampleCountFlagBits       msaa_samples        = VK_SAMPLE_COUNT_1_BIT;    // as chosen, which may differ from config
+    VkImageUsageFlags           swapchain_usage     = 0;
+    bool                        dynamic_resolution  = false;    // as built - needs a transfer-capable swapchain
+    RenderGraph::ResourceId     graph_scene_color   = 0;        // internal target, only with dynamic resolution or post-processing
+    RenderGraph::ResourceId     graph_blit_source   = 0;        // what's copied to the swapchain image from the internal target
+    bool                        post_process        = false;    // as built - also needs a transfer-capable swapchain
+    static constexpr VkFormat   post_format         = VK_FORMAT_R16G16B16A16_SFLOAT;   // storage support is required for it
+    VkFormat                    scene_format        = VK_FORMAT_UNDEFINED;  // main pass color: swapchain format, or HDR
+    VkDescriptorSetLayout       post_set_layout     = VK_NULL_HANDLE;
+    VkPipelineLayout            post_pipeline_layout = VK_NULL_HANDLE;
+    VkExtent2D                  target_extent       = { 0, 0 }; // allocated size of the attachments
+    VkExtent2D                  render_extent       = { 0, 0 }; // part of them rendered this frame
+    ResolutionController        resolution_controller;
+    VkFilter                    upscale_filter      = VK_FILTER_LINEAR;
+    uint32_t                    record_image_idx    = 0;    // for pass callbacks, set while recording a frame
+    uint32_t                    record_slot         = 0;
+    DescriptorLayoutCache       layout_cache;
+    VkDescriptorSetLayout       frame_set_layout    = VK_NULL_HANDLE;
+    VkDescriptorSetLayout       material_set_layout = VK_NULL_HANDLE;
+    VkDescriptorSetLayout       cull_set_layout     = VK_NULL_HANDLE;
+    VkPipelineLayout            cull_pipeline_layout = VK_NULL_HANDLE;
+    uint32_t                    max_cluster_draws   = 0;    // every object at its LOD with most meshlets
+    bool                        draw_clusters       = false;    // this frame, set while recording
+    VkDescriptorSetLayout       hiz_set_layout      = VK_NULL_HANDLE;
+    VkPipelineLayout            hiz_pipeline_layout = VK_NULL_HANDLE;
+    VkSampler                   hiz_sampler         = VK_NULL_HANDLE;
+    VkBuffer                    hiz_counter         = VK_NULL_HANDLE;   // workgroups through the build's first levels
+    VkDeviceMemory              hiz_counter_mem     = VK_NULL_HANDLE;
+    bool                        hiz_active          = false;    // as built - occlusion culling's pyramid pass is in the graph
+    VkImage                     hiz_image           = VK_NULL_HANDLE;   // level atlas, rebuilt with the swapchain
+    VkImageView                 hiz_view            = VK_NULL_HANDLE;
+    VkDeviceMemory              hiz_mem             = VK_NULL_HANDLE;
+    VkDeviceSize                hiz_bytes           = 0;
+    uint32_t                    hiz_size            = 1;        // level 0 square
+    uint32_t                    hiz_levels          = 1;
+    bool                        hiz_needs_init      = false;    // not yet transitioned out of undefined
+    bool                        hiz_valid           = false;    // holds a built frame's depth
+    glm::mat4                   hiz_view_proj       = glm::mat4(1.0f);  // scene to clip, for the frame it holds
+    VkExtent2D                  hiz_extent          = { 0, 0 };
+    RenderGraph::ResourceId     graph_hiz           = 0;        // only with occlusion culling
+    std::array<DescriptorAllocator, MAX_FRAMES_IN_FLIGHT> frame_descriptors;
+    DescriptorAllocator         material_descriptors;
+    DescriptorSetCache          material_set_cache;
     VkPipelineLayout            pipeline_layout     = VK_NULL_HANDLE;
     VkRenderPass                render_pass         = VK_NULL_HANDLE;
-    VkPipeline                  pipeline            = VK_NULL_HANDLE;
+    PipelineLibrary             pipeline_library;
+
+    // The main pass's pipelines, for one way of fetching vertices
+    struct MainPassPipelines
+    {
+        PipelineDesc main;
+        PipelineDesc untextured;
+        PipelineDesc depth_prepass;
+        PipelineDesc main_after_prepass;
+        PipelineDesc untextured_after_prepass;
+
+        std::array<PipelineDesc*, 5> all() { return { &main, &untextured, &depth_prepass, &main_after_prepass, &untextured_after_prepass }; }
+    };
+    MainPassPipelines           input_pipelines;        // fixed-function vertex input
+    MainPassPipelines           pulling_pipelines;      // vertex pulling, used only with buffer device address
+
+    bool                        show_texture        = true;
+    AppConfig                   config;
+    std::vector<SceneObject>    scene_objects;
+    std::vector<SceneInstance>  scene_instances;        // per scene object: what it draws
+    MeshLodBuilder              geometry;               // every mesh, LODs included, as built - the pool loads from it
+    GeometryPool                geometry_pool;          // the meshes loaded, all in one set of buffers
+    uint32_t                    quad_mesh           = 0;
+    uint32_t                    hills_mesh          = 0;
+    struct LodStats
+    {
+        uint64_t                frames = 0;
+        uint64_t                drawn = 0;              // triangles per pass, summed over frames
+        uint64_t                full = 0;               // the same at LOD 0
+        std::vector<uint64_t>   per_lod;                // objects drawn at each LOD, summed over frames
+    };
+    LodStats                    lod_stats;
+    struct ClusterStats
+    {
+        uint64_t                frames = 0;
+        uint64_t                tested = 0;             // meshlets of the selected LODs, summed over frames
+        uint64_t                drawn = 0;
+        uint64_t                frustum_culled = 0;
+        uint64_t                backface_culled = 0;
+        uint64_t                occluded = 0;
+        uint64_t                objects = 0;
+        uint64_t                occluded_objects = 0;
+    };
+    ClusterStats                cluster_stats;
+    std::vector<std::pair<float, uint32_t>> draw_order;     // (view depth, object index)
+    mvp_ubo                     frame_ubo{};            // last values written by updateUniformBuffer
+#ifdef HOT_RELOAD_ON
+    FileWatcher                 shader_watcher;
+#endif
     VkCommandPool               command_pool        = VK_NULL_HANDLE;
-    VkCommandBuffer             render_cmd_buf      = VK_NULL_HANDLE;
-    VkBuffer                    vertex_buffer       = VK_NULL_HANDLE;
-    VkDeviceMemory              vertex_buffer_mem   = VK_NULL_HANDLE;
-    VkBuffer                    index_buffer        = VK_NULL_HANDLE;
-    VkDeviceMemory              index_buffer_mem    = VK_NULL_HANDLE;
+    VkCommandPool               compute_command_pool = VK_NULL_HANDLE;
+    std::mutex                  upload_mutex;       // one-off submits: the pool, gfx queue and upload query slot
     std::vector<VkBuffer>       uniform_buffer;
     std::vector<VkDeviceMemory> uniform_buffer_memory;
-    VkImage                     tex_image           = VK_NULL_HANDLE;
-    VkDeviceMemory              tex_image_mem       = VK_NULL_HANDLE;
-    VkImageView                 tex_image_view      = VK_NULL_HANDLE;
+    stbi_uc*                    tex_pixels          = nullptr;
+    int                         tex_width           = 0;
+    int                         tex_height          = 0;
+    TextureStreamer             texture_streamer;
+    TextureStreamer::TextureId  texture_id          = 0;
     VkSampler                   tex_sampler         = VK_NULL_HANDLE;
 
-    VkSemaphore                 sem_image_available;
-    VkSemaphore                 sem_render_complete;
-    VkFence                     fence_in_flight;
+    GpuProfiler                 gpu_profiler;
+    uint32_t                    instance_api_version = VK_API_VERSION_1_0;
+    DeviceCapabilities          device_caps;        // what the device was created with
+
+    // Per frame in flight. A slot is reused once the timeline passes the value its last submit signaled.
+    // One command buffer per render graph segment, with compute-pool ones for segments on the compute queue
+    static constexpr size_t MAX_GRAPH_SEGMENTS = 3;
+    struct FrameSlot
+    {
+        std::array<VkCommandBuffer, MAX_GRAPH_SEGMENTS> cmd_bufs{};
+        std::array<VkCommandBuffer, MAX_GRAPH_SEGMENTS> compute_cmd_bufs{};
+        VkSemaphore             image_available = VK_NULL_HANDLE;
+        uint64_t                retire_value = 0;
+        VkBuffer                object_buffer = VK_NULL_HANDLE;     // ObjectData, host written
+        VkDeviceMemory          object_mem = VK_NULL_HANDLE;
+        VkDeviceAddress         object_address = 0;                 // for vertex pulling
+        VkBuffer                draw_buffer = VK_NULL_HANDLE;       // cluster culling's indirect draws
+        VkDeviceMemory          draw_mem = VK_NULL_HANDLE;
+        VkBuffer                count_buffer = VK_NULL_HANDLE;      // ClusterCounts, host readable for stats
+        VkDeviceMemory          count_mem = VK_NULL_HANDLE;
+        VkBuffer                cull_params_buffer = VK_NULL_HANDLE;    // CullParams
+        VkDeviceMemory          cull_params_mem = VK_NULL_HANDLE;
+        uint32_t                clusters_tested = 0;                // by the cull recorded in this slot, 0 for none
+        uint32_t                objects_tested = 0;
+    };
+    std::array<FrameSlot, MAX_FRAMES_IN_FLIGHT> frames;
+    uint64_t                    frame_number = 0;
+    std::vector<VkSemaphore>    sem_render_complete;    // per swapchain image
+    GpuTimeline                 timeline;
+    DeletionQueue               deletion_queue;
 
     // conditional use of validation layers
     const std::vector<const char*> validation_layers = {"VK_LAYER_KHRONOS_validation"};
@@ -1753,12 +8444,12 @@ private:
 #endif
 };
 
-int main() 
+#ifndef GAMELOOP_NO_MAIN    // the benchmark includes this file and brings its own
+int main(int argc, char** argv) 
 {
-    HelloTriangleApplication app;
-
     try 
     {
+        HelloTriangleApplication app(AppConfig::parse(argc, argv));
         app.run();
     }
     catch (const std::exception& e) 
@@ -1768,4 +8459,5 @@ int main()
     }
 
     return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
+#endif
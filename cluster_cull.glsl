@@ -0,0 +1,167 @@
+#version 450
+#extension GL_GOOGLE_include_directive : require
+
+#include "shader_interface.h"
+
+// Tests each meshlet of each object against the frustum, its normal cone and the depth pyramid, and appends a draw
+// for each survivor
+layout(local_size_x = CLUSTER_CULL_GROUP_SIZE) in;
+
+struct ObjectData
+{
+    mat4 model;
+    uint first_meshlet;     // of the LOD being drawn
+    uint meshlet_count;
+    float radius;           // object space bounding sphere about the origin
+    uint pad;
+};
+
+struct Meshlet
+{
+    vec4 sphere;            // object space center, radius
+    vec4 cone;              // axis, cutoff - 1 where the triangles face too many ways to ever cull
+    uint first_index;
+    uint index_count;
+    int vertex_offset;
+    uint pad;
+};
+
+// VkDrawIndexedIndirectCommand
+struct DrawCommand
+{
+    uint index_count;
+    uint instance_count;
+    uint first_index;
+    int vertex_offset;
+    uint first_instance;
+};
+
+// Buffers
+layout(std430, set = 0, binding = 0) readonly buffer Objects { ObjectData objects[]; };
+layout(std430, set = 0, binding = 1) readonly buffer Meshlets { Meshlet meshlets[]; };
+layout(std430, set = 0, binding = 2) writeonly buffer Draws { DrawCommand draws[]; };
+layout(std430, set = 0, binding = 3) buffer Counts
+{
+    uint draw_count;
+    uint frustum_culled;
+    uint backface_culled;
+    uint occluded;          // meshlets, including those of whole objects culled
+    uint occluded_objects;
+    uint pad[3];
+} counts;
+
+// Planes, camera and the pyramid's view are in the space object models map into, so only the object model is
+// applied here
+layout(std140, set = 0, binding = 4) uniform CullParams
+{
+    vec4 planes[6];         // normalized, pointing inwards
+    vec4 camera;
+    mat4 hiz_view_proj;     // of the frame the pyramid was built from
+    uint object_count;
+    uint max_draws;
+    uint flags;
+    uint pad;
+    ivec2 hiz_extent;       // depth pixels the pyramid was built over
+    int hiz_size;           // of its level 0 square in the atlas
+    int hiz_levels;
+} cull;
+
+layout(set = 0, binding = 5, r32f) uniform readonly image2D pyramid;
+
+// Matches the layout hiz_build.glsl writes: level 0 in the atlas's left square, later levels stacked to its right
+ivec2 levelOffset(int level)
+{
+	return (0 == level) ? ivec2(0) : ivec2(cull.hiz_size, cull.hiz_size - (cull.hiz_size >> (level - 1)));
+}
+
+// Whether a sphere was behind everything in the pyramid's frame. Tests the screen rectangle of its bounding box at
+// the level where that covers at most 2x2 texels, each the farthest depth under it.
+bool occluded(vec3 center, float radius)
+{
+	vec2 lo = vec2(1.0e30);
+	vec2 hi = vec2(-1.0e30);
+	float nearest = 1.0;
+	for (int i = 0; i < 8; i++)
+	{
+		vec3 corner = center + radius * vec3((i & 1) != 0 ? 1.0 : -1.0, (i & 2) != 0 ? 1.0 : -1.0, (i & 4) != 0 ? 1.0 : -1.0);
+		vec4 clip = cull.hiz_view_proj * vec4(corner, 1.0);
+		if (clip.w <= 0.0 || clip.z < 0.0) return false;   // reaches in front of the near plane
+		vec3 ndc = clip.xyz / clip.w;
+		lo = min(lo, ndc.xy);
+		hi = max(hi, ndc.xy);
+		nearest = min(nearest, ndc.z);
+	}
+	if (any(greaterThan(lo, vec2(1.0))) || any(lessThan(hi, vec2(-1.0)))) return false;  // was off screen
+
+	ivec2 last = cull.hiz_extent - 1;
+	ivec2 p0 = clamp(ivec2((lo * 0.5 + 0.5) * vec2(cull.hiz_extent)), ivec2(0), last);
+	ivec2 p1 = clamp(ivec2((hi * 0.5 + 0.5) * vec2(cull.hiz_extent)), ivec2(0), last);
+	ivec2 span = p1 - p0;
+	int level = clamp(findMSB(max(span.x, span.y)), 0, cull.hiz_levels - 1);
+	ivec2 t0 = p0 >> (level + 1);
+	ivec2 t1 = p1 >> (level + 1);
+	ivec2 offset = levelOffset(level);
+	float farthest = max(max(imageLoad(pyramid, offset + t0).r, imageLoad(pyramid, offset + ivec2(t1.x, t0.y)).r),
+	                     max(imageLoad(pyramid, offset + ivec2(t0.x, t1.y)).r, imageLoad(pyramid, offset + t1).r));
+	return nearest > farthest;
+}
+
+void main()
+{
+	uint object = gl_WorkGroupID.x;
+	if (object >= cull.object_count) return;
+
+	ObjectData obj = objects[object];
+	float scale = max(length(obj.model[0].xyz), max(length(obj.model[1].xyz), length(obj.model[2].xyz)));
+	bool occlusion = (cull.flags & CLUSTER_CULL_OCCLUSION) != 0;
+
+	// Whole objects first - the result is the same for every thread
+	if (occlusion && occluded(obj.model[3].xyz, obj.radius * scale))
+	{
+		if (0 == gl_LocalInvocationID.x)
+		{
+			atomicAdd(counts.occluded_objects, 1);
+			atomicAdd(counts.occluded, obj.meshlet_count);
+		}
+		return;
+	}
+
+	for (uint i = gl_LocalInvocationID.x; i < obj.meshlet_count; i += CLUSTER_CULL_GROUP_SIZE)
+	{
+		Meshlet m = meshlets[obj.first_meshlet + i];
+		vec3 center = (obj.model * vec4(m.sphere.xyz, 1.0)).xyz;
+		float radius = m.sphere.w * scale;
+
+		if ((cull.flags & CLUSTER_CULL_FRUSTUM) != 0)
+		{
+			bool inside = true;
+			for (int p = 0; p < 6; p++) inside = inside && (dot(cull.planes[p].xyz, center) + cull.planes[p].w >= -radius);
+			if (!inside)
+			{
+				atomicAdd(counts.frustum_culled, 1);
+				continue;
+			}
+		}
+
+		// Every triangle faces away from every point the camera could see the sphere from
+		if ((cull.flags & CLUSTER_CULL_BACKFACE) != 0 && m.cone.w < 1.0)
+		{
+			vec3 axis = normalize(mat3(obj.model) * m.cone.xyz);
+			vec3 view = center - cull.camera.xyz;
+			if (dot(view, axis) >= m.cone.w * length(view) + radius)
+			{
+				atomicAdd(counts.backface_culled, 1);
+				continue;
+			}
+		}
+
+		if (occlusion && occluded(center, radius))
+		{
+			atomicAdd(counts.occluded, 1);
+			continue;
+		}
+
+		uint slot = atomicAdd(counts.draw_count, 1);
+		if (slot < cull.max_draws) draws[slot] = DrawCommand(m.index_count, 1, m.first_index, m.vertex_offset, object);
+	}
+}
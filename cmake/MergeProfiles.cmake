@@ -0,0 +1,11 @@
+# Merges the raw profiles a clang PGO=GENERATE run wrote into the default.profdata a PGO=USE build reads.
+#   cmake -DPROFDATA=<llvm-profdata> -DPGO_DIR=<dir> -P MergeProfiles.cmake
+file(GLOB raw_profiles ${PGO_DIR}/*.profraw)
+if(NOT raw_profiles)
+    message(FATAL_ERROR "No .profraw files in ${PGO_DIR} - did the training run use a PGO=GENERATE build?")
+endif()
+execute_process(COMMAND ${PROFDATA} merge -output=${PGO_DIR}/default.profdata ${raw_profiles}
+                RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+    message(FATAL_ERROR "llvm-profdata merge failed")
+endif()
@@ -1,4 +1,7 @@
 #version 450
+#extension GL_GOOGLE_include_directive : require
+
+#include "shader_interface.h"
 
 // Data in
 layout(location = 0) in vec3 frag_color;
@@ -8,10 +11,20 @@ layout(location = 1) in vec2 texcoord;
 layout(location = 0) out vec4 color;
 
 // Uniforms
-layout(binding = 1) uniform sampler2D tex;
+layout(set = 1, binding = 0) uniform sampler2D tex;
+
+// Specialization constants - resolved at pipeline creation, so untaken branches compile away
+#define DECLARE_SPEC_CONSTANT(name, id, glsl_type, glsl_default, cpp_type, cpp_default) \
+    layout(constant_id = id) const glsl_type name = glsl_default;
+FRAG_SPEC_CONSTANTS(DECLARE_SPEC_CONSTANT)
 
 void main()
 {
-	vec4 tcolor = texture(tex, texcoord);
-	color = vec4(((frag_color * 0.25f) + (tcolor.rgb * 0.75)), 1.0);
-}
\ No newline at end of file
+	vec3 rgb = frag_color;
+	if (textured)
+	{
+		vec4 tcolor = texture(tex, texcoord);
+		rgb = (frag_color * vertex_color_weight) + (tcolor.rgb * texture_weight);
+	}
+	color = vec4(rgb, 1.0);
+}
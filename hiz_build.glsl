@@ -0,0 +1,125 @@
+#version 450
+#extension GL_GOOGLE_include_directive : require
+
+#include "shader_interface.h"
+
+// Builds the whole depth pyramid in one dispatch. Each workgroup reduces a tile of depth through the first
+// HIZ_GROUP_LEVELS levels; the last workgroup to finish then reduces what they all produced down to one texel.
+// Each texel holds the farthest depth under it.
+layout(local_size_x = HIZ_GROUP_SIZE, local_size_y = HIZ_GROUP_SIZE) in;
+
+layout(set = 0, binding = 0) uniform sampler2D depth;
+layout(set = 0, binding = 1, r32f) uniform coherent image2D pyramid;
+layout(std430, set = 0, binding = 2) coherent buffer Counter
+{
+    uint groups_done;   // back to 0 once the last group is through
+} counter;
+
+layout(push_constant) uniform HizConstants
+{
+    ivec2 extent;       // depth pixels rendered
+    int size;           // of level 0's square in the atlas, a power of two
+    int levels;
+} hiz;
+
+shared float tile[HIZ_GROUP_SIZE][HIZ_GROUP_SIZE];
+shared bool last_group;
+
+// Level 0 fills the atlas's left square; later levels stack down the column to its right
+ivec2 levelOffset(int level)
+{
+	return (0 == level) ? ivec2(0) : ivec2(hiz.size, hiz.size - (hiz.size >> (level - 1)));
+}
+
+// Texels of a level that cover rendered pixels - a level k texel covers 2^(k+1) pixels a side
+ivec2 levelExtent(int level)
+{
+	return (hiz.extent + (2 << level) - 1) >> (level + 1);
+}
+
+void storeLevel(int level, ivec2 p, float d)
+{
+	if (all(lessThan(p, levelExtent(level)))) imageStore(pyramid, levelOffset(level) + p, vec4(d));
+}
+
+float loadLevel(int level, ivec2 p)
+{
+	return imageLoad(pyramid, levelOffset(level) + min(p, levelExtent(level) - 1)).r;
+}
+
+float loadDepth(ivec2 p)
+{
+	return texelFetch(depth, min(p, hiz.extent - 1), 0).r;
+}
+
+void main()
+{
+	ivec2 local = ivec2(gl_LocalInvocationID.xy);
+	ivec2 group = ivec2(gl_WorkGroupID.xy);
+
+	// Levels 0 and 1: each thread reduces a 4x4 block of depth to 2x2 level 0 texels, and those to one of level 1
+	float level1 = 0.0;
+	for (int j = 0; j < 2; j++)
+	{
+		for (int i = 0; i < 2; i++)
+		{
+			ivec2 texel = (group * HIZ_GROUP_SIZE + local) * 2 + ivec2(i, j);
+			ivec2 px = texel * 2;
+			float d = max(max(loadDepth(px), loadDepth(px + ivec2(1, 0))), max(loadDepth(px + ivec2(0, 1)), loadDepth(px + ivec2(1, 1))));
+			storeLevel(0, texel, d);
+			level1 = max(level1, d);
+		}
+	}
+	if (hiz.levels > 1) storeLevel(1, group * HIZ_GROUP_SIZE + local, level1);
+	tile[local.y][local.x] = level1;
+	barrier();
+
+	// The rest of the tile's levels in shared memory, halving the active threads each time
+	for (int level = 2; level < min(HIZ_GROUP_LEVELS, hiz.levels); level++)
+	{
+		int n = HIZ_GROUP_SIZE >> (level - 1);
+		bool active = all(lessThan(local, ivec2(n)));
+		float d = 0.0;
+		if (active)
+		{
+			ivec2 src = local * 2;
+			d = max(max(tile[src.y][src.x], tile[src.y][src.x + 1]), max(tile[src.y + 1][src.x], tile[src.y + 1][src.x + 1]));
+		}
+		barrier();
+		if (active)
+		{
+			tile[local.y][local.x] = d;
+			storeLevel(level, group * n + local, d);
+		}
+		barrier();
+	}
+	if (hiz.levels <= HIZ_GROUP_LEVELS) return;
+
+	// Only the last group to get here sees every tile's output
+	memoryBarrierImage();
+	barrier();
+	if (all(equal(local, ivec2(0))))
+	{
+		last_group = (atomicAdd(counter.groups_done, 1) == gl_NumWorkGroups.x * gl_NumWorkGroups.y - 1);
+	}
+	barrier();
+	if (!last_group) return;
+	memoryBarrierImage();
+
+	int thread = local.y * HIZ_GROUP_SIZE + local.x;
+	for (int level = HIZ_GROUP_LEVELS; level < hiz.levels; level++)
+	{
+		ivec2 n = levelExtent(level);
+		for (int i = thread; i < n.x * n.y; i += HIZ_GROUP_SIZE * HIZ_GROUP_SIZE)
+		{
+			ivec2 p = ivec2(i % n.x, i / n.x);
+			ivec2 src = p * 2;
+			float d = max(max(loadLevel(level - 1, src), loadLevel(level - 1, src + ivec2(1, 0))),
+			              max(loadLevel(level - 1, src + ivec2(0, 1)), loadLevel(level - 1, src + ivec2(1, 1))));
+			storeLevel(level, p, d);
+		}
+		memoryBarrierImage();
+		barrier();
+	}
+	if (0 == thread) counter.groups_done = 0;
+}
@@ -0,0 +1,55 @@
+#version 450
+#extension GL_GOOGLE_include_directive : require
+
+#include "shader_interface.h"
+
+// One direction of a separable Gaussian blur. The group's run of pixels plus the apron either side is loaded
+// into shared memory once, so each texel is read from the image once per group rather than once per tap.
+layout(local_size_x = POST_BLUR_TILE) in;
+
+// Images
+layout(set = 0, binding = 0, rgba16f) uniform readonly image2D src;
+layout(set = 0, binding = 2, rgba16f) uniform writeonly image2D dst;
+
+layout(push_constant) uniform PostConstants
+{
+    ivec2 extent;
+    int direction;      // 0 horizontal, 1 vertical
+    float strength;
+} pc;
+
+const int tile_size = POST_BLUR_TILE + 2 * POST_BLUR_RADIUS;
+shared vec4 tile[tile_size];
+
+ivec2 texel(int along, int across)
+{
+	return (0 == pc.direction) ? ivec2(along, across) : ivec2(across, along);
+}
+
+void main()
+{
+	int length = (0 == pc.direction) ? pc.extent.x : pc.extent.y;
+	int across = int(gl_WorkGroupID.y);
+	int base = int(gl_WorkGroupID.x) * POST_BLUR_TILE - POST_BLUR_RADIUS;
+	int local = int(gl_LocalInvocationID.x);
+
+	for (int i = local; i < tile_size; i += POST_BLUR_TILE)
+	{
+		tile[i] = imageLoad(src, texel(clamp(base + i, 0, length - 1), across));
+	}
+	barrier();
+
+	int along = int(gl_GlobalInvocationID.x);
+	if (along >= length) return;
+
+	const float sigma = POST_BLUR_RADIUS * 0.5;
+	vec4 sum = vec4(0.0);
+	float total = 0.0;
+	for (int t = -POST_BLUR_RADIUS; t <= POST_BLUR_RADIUS; t++)
+	{
+		float w = exp(-float(t * t) / (2.0 * sigma * sigma));
+		sum += w * tile[local + POST_BLUR_RADIUS + t];
+		total += w;
+	}
+	imageStore(dst, texel(along, across), sum / total);
+}
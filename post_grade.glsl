@@ -0,0 +1,31 @@
+#version 450
+#extension GL_GOOGLE_include_directive : require
+
+#include "shader_interface.h"
+
+// Simple color grade of the tonemapped image: saturation, contrast and a slight warm tint
+layout(local_size_x = POST_GROUP_SIZE, local_size_y = POST_GROUP_SIZE) in;
+
+// Images
+layout(set = 0, binding = 0, rgba16f) uniform readonly image2D src;
+layout(set = 0, binding = 2, rgba16f) uniform writeonly image2D dst;
+
+layout(push_constant) uniform PostConstants
+{
+    ivec2 extent;
+    int direction;
+    float strength;     // blend from ungraded (0) to fully graded (1)
+} pc;
+
+void main()
+{
+	ivec2 pos = ivec2(gl_GlobalInvocationID.xy);
+	if (any(greaterThanEqual(pos, pc.extent))) return;
+
+	vec3 rgb = imageLoad(src, pos).rgb;
+	float luma = dot(rgb, vec3(0.2126, 0.7152, 0.0722));
+	vec3 graded = mix(vec3(luma), rgb, 1.15);
+	graded = (graded - 0.5) * 1.1 + 0.5;
+	graded *= vec3(1.04, 1.0, 0.96);
+	imageStore(dst, pos, vec4(clamp(mix(rgb, graded, pc.strength), 0.0, 1.0), 1.0));
+}
@@ -0,0 +1,34 @@
+#version 450
+#extension GL_GOOGLE_include_directive : require
+
+#include "shader_interface.h"
+
+// Adds the blurred scene as bloom and maps the HDR result into [0, 1]
+layout(local_size_x = POST_GROUP_SIZE, local_size_y = POST_GROUP_SIZE) in;
+
+// Images
+layout(set = 0, binding = 0, rgba16f) uniform readonly image2D hdr;
+layout(set = 0, binding = 1, rgba16f) uniform readonly image2D bloom;
+layout(set = 0, binding = 2, rgba16f) uniform writeonly image2D dst;
+
+layout(push_constant) uniform PostConstants
+{
+    ivec2 extent;
+    int direction;
+    float strength;     // bloom
+} pc;
+
+// Narkowicz's fit of the ACES filmic curve
+vec3 aces(vec3 x)
+{
+	return clamp((x * (2.51 * x + 0.03)) / (x * (2.43 * x + 0.59) + 0.14), 0.0, 1.0);
+}
+
+void main()
+{
+	ivec2 pos = ivec2(gl_GlobalInvocationID.xy);
+	if (any(greaterThanEqual(pos, pc.extent))) return;
+
+	vec3 rgb = imageLoad(hdr, pos).rgb + pc.strength * imageLoad(bloom, pos).rgb;
+	imageStore(dst, pos, vec4(aces(rgb), 1.0));
+}
@@ -0,0 +1,37 @@
+// Shared between GameLoop.cpp and the GLSL shaders (via GL_GOOGLE_include_directive).
+// Only preprocessor definitions belong here, so that both compilers accept it.
+#ifndef SHADER_INTERFACE_H
+#define SHADER_INTERFACE_H
+
+// Fragment shader specialization constants. Each row expands to a `layout(constant_id = ...)` declaration
+// in GLSL, and to a field plus VkSpecializationMapEntry on the host, so IDs can't drift out of sync.
+//
+//  X(name,                constant_id, glsl_type, glsl_default, cpp_type, cpp_default)
+#define FRAG_SPEC_CONSTANTS(X)                                                  \
+    X(textured,            0,           bool,      true,         VkBool32, VK_TRUE) \
+    X(vertex_color_weight, 1,           float,     0.25,         float,    0.25f)   \
+    X(texture_weight,      2,           float,     0.75,         float,    0.75f)
+
+// Compute post-processing. Blur workgroups cover a run of POST_BLUR_TILE pixels along one row or column and
+// read POST_BLUR_RADIUS more on either side; the other passes use square POST_GROUP_SIZE groups.
+#define POST_GROUP_SIZE     8
+#define POST_BLUR_TILE      64
+#define POST_BLUR_RADIUS    8
+
+// Meshlets (clusters) and their culling. Each cull workgroup walks one object's meshlets; the flags select the tests.
+#define MESHLET_MAX_VERTICES    64
+#define MESHLET_MAX_TRIANGLES   124
+#define CLUSTER_CULL_GROUP_SIZE 64
+#define CLUSTER_CULL_FRUSTUM    1
+#define CLUSTER_CULL_BACKFACE   2
+#define CLUSTER_CULL_OCCLUSION  4
+
+// Depth pyramid for occlusion culling, built in one dispatch. Each HIZ_GROUP_SIZE square workgroup reduces its tile
+// of depth through HIZ_GROUP_LEVELS levels, and the last to finish reduces the rest.
+#define HIZ_GROUP_SIZE          16
+#define HIZ_GROUP_LEVELS        6
+
+// Vertex pulling reads PackedVertex as this many 32-bit words
+#define PACKED_VERTEX_WORDS     5
+
+#endif // SHADER_INTERFACE_H
@@ -1,7 +1,7 @@
 #version 450
 
 // Data in
-layout(location = 0) in vec2 in_position;
+layout(location = 0) in vec3 in_position;
 layout(location = 1) in vec3 in_color;
 layout(location = 2) in vec2 in_texcoord;
 
@@ -10,7 +10,7 @@ layout(location = 0) out vec3 frag_color;
 layout(location = 1) out vec2 out_texcoord;
 
 // Uniforms
-layout(binding = 0) uniform UniformBufferObject
+layout(set = 0, binding = 0) uniform UniformBufferObject
 {
     vec2 foo;
     mat4 model;
@@ -18,9 +18,24 @@ layout(binding = 0) uniform UniformBufferObject
     mat4 proj;
 } ubo;
 
+// Per-object, indexed by the draw's first instance - set per draw, or by the cluster culling pass for indirect draws
+struct ObjectData
+{
+    mat4 model;
+    uint first_meshlet;
+    uint meshlet_count;
+    float radius;
+    uint pad;
+};
+
+layout(std430, set = 0, binding = 1) readonly buffer Objects
+{
+    ObjectData objects[];
+};
+
 void main()
 {
-    gl_Position = ubo.proj * ubo.view * ubo.model * vec4(in_position, 0.0, 1.0);
+    gl_Position = ubo.proj * ubo.view * ubo.model * objects[gl_InstanceIndex].model * vec4(in_position, 1.0);
     out_texcoord = in_texcoord;
     frag_color = in_color;
 }
\ No newline at end of file
@@ -0,0 +1,60 @@
+#version 450
+#extension GL_GOOGLE_include_directive : require
+#extension GL_EXT_buffer_reference : require
+
+#include "shader_interface.h"
+
+// vert.glsl with no vertex input: vertices and per-object data are read through buffer device addresses. The
+// index buffer is still bound, so gl_VertexIndex arrives already remapped and offset to the mesh's vertices.
+
+// Data out
+layout(location = 0) out vec3 frag_color;
+layout(location = 1) out vec2 out_texcoord;
+
+// Uniforms
+layout(set = 0, binding = 0) uniform UniformBufferObject
+{
+    vec2 foo;
+    mat4 model;
+    mat4 view;
+    mat4 proj;
+} ubo;
+
+struct ObjectData
+{
+    mat4 model;
+    uint first_meshlet;
+    uint meshlet_count;
+    float radius;
+    uint pad;
+};
+
+// PackedVertex: position as 3 floats, color as unorm8 RGBA, texcoord as 2 halfs. Read as words, so the layout
+// is whatever this shader says it is.
+layout(buffer_reference, std430, buffer_reference_align = 4) readonly buffer PackedVertices
+{
+    uint words[];
+};
+
+layout(buffer_reference, std430, buffer_reference_align = 16) readonly buffer Objects
+{
+    ObjectData objects[];
+};
+
+layout(push_constant) uniform PullConstants
+{
+    PackedVertices vertices;
+    Objects objects;
+} pull;
+
+void main()
+{
+    uint base = uint(gl_VertexIndex) * PACKED_VERTEX_WORDS;
+    vec3 position = uintBitsToFloat(uvec3(pull.vertices.words[base], pull.vertices.words[base + 1], pull.vertices.words[base + 2]));
+    vec4 color = unpackUnorm4x8(pull.vertices.words[base + 3]);
+    vec2 texcoord = unpackHalf2x16(pull.vertices.words[base + 4]);
+
+    gl_Position = ubo.proj * ubo.view * ubo.model * pull.objects.objects[gl_InstanceIndex].model * vec4(position, 1.0);
+    out_texcoord = texcoord;
+    frag_color = color.rgb;
+}